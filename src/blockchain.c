@@ -3,6 +3,7 @@
 #include "base64.h"
 #include "inttypes.h"
 #include "log.h"
+#include "miner.h"
 
 #ifdef _WIN32
     #include <windows.h>
@@ -57,13 +58,8 @@ void block_free(struct block *block) {
 }
 
 int block_mine_with_copy(struct block *newblock, int zero_bits, unsigned char *previous_hash, int *loop_condition) {
-    sha3_context ctx;
     static unsigned char ref_hash[32];
-    const unsigned char *hash;
     char proof_of_work[0x100];
-    char in[16];
-    char out[32];
-    int len;
 
     if (!newblock)
         return 0;
@@ -80,6 +76,19 @@ int block_mine_with_copy(struct block *newblock, int zero_bits, unsigned char *p
     if (proof_len >= 0x100 - 10)
         return 0;
 
+#ifndef BLOCKCHAIN_HASHCASH_ASCII_STRING
+    struct miner_stats stats;
+    if (miner_search((const unsigned char *)proof_of_work, proof_len, previous_hash, 32, zero_bits, loop_condition, &newblock->nonce, newblock->hash, &stats)) {
+        log_info("mined block %" PRIu64 " in %.2fs, %i threads, %.2f kH/s", newblock->index, (double)stats.elapsed_us / 1000000.0, stats.threads, miner_hash_rate(&stats) / 1000.0);
+        return 1;
+    }
+    if ((loop_condition) && (!*loop_condition))
+        log_info("mining of block %" PRIu64 " cancelled after %.2fs (%.2f kH/s)", newblock->index, (double)stats.elapsed_us / 1000000.0, miner_hash_rate(&stats) / 1000.0);
+    return 0;
+#else
+    sha3_context ctx;
+    const unsigned char *hash;
+    int len;
     uint64_t counter = 0;
     unsigned char *ptr = (unsigned char *)proof_of_work + proof_len;
 
@@ -94,7 +103,6 @@ int block_mine_with_copy(struct block *newblock, int zero_bits, unsigned char *p
         sha3_Init256(&ctx);
 
         uint64_t counter_be = htonll(counter);
-#ifdef BLOCKCHAIN_HASHCASH_ASCII_STRING
         const unsigned char *counter_ptr = (const unsigned char *)&counter_be;
         int offset = 0;
         do {
@@ -105,11 +113,6 @@ int block_mine_with_copy(struct block *newblock, int zero_bits, unsigned char *p
 
         len = base64_decode(8 - offset, (const char *)counter_ptr + offset, sizeof(proof_of_work) - proof_len, (char *)ptr);
         sha3_Update(&ctx, proof_of_work, proof_len + len);
-#else
-        len = 8;
-        sha3_Update(&ctx, proof_of_work, proof_len);
-        sha3_Update(&ctx, (unsigned char *)&counter_be, 8);
-#endif
         sha3_Update(&ctx, previous_hash, 32);
 
         hash = (const unsigned char *)sha3_Finalize(&ctx);
@@ -128,6 +131,7 @@ int block_mine_with_copy(struct block *newblock, int zero_bits, unsigned char *p
             return 0;
     }
     return 0;
+#endif
 }
 
 int block_mine(struct block *newblock, int zero_bits) {
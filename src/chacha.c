@@ -6,6 +6,19 @@ Public domain.
 
 #include "chacha.h"
 
+#if !defined(CHACHA_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define CHACHA_SSE2
+#define CHACHA_AVX2
+#include <immintrin.h>
+#elif !defined(CHACHA_NO_SIMD) && defined(__GNUC__) && defined(__aarch64__)
+#define CHACHA_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(CHACHA_SSE2) || defined(CHACHA_NEON)
+#define CHACHA_SIMD
+#endif
+
 #define U8C(v) (v##U)
 #define U32C(v) (v##U)
 
@@ -86,8 +99,8 @@ chacha_ivsetup(struct chacha_ctx *x, const unsigned char *iv, const unsigned cha
   x->input[15] = U8TO32_LITTLE(iv + 8);
 }
 
-void
-chacha_encrypt_bytes(struct chacha_ctx *x,const unsigned char *m,unsigned char *c,uint32_t bytes)
+static void
+chacha_encrypt_bytes_scalar(struct chacha_ctx *x,const unsigned char *m,unsigned char *c,uint32_t bytes)
 {
   uint32_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
   uint32_t j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
@@ -225,3 +238,290 @@ chacha_encrypt_bytes(struct chacha_ctx *x,const unsigned char *m,unsigned char *
     m += 64;
   }
 }
+
+#ifdef CHACHA_SIMD
+#define CHACHA_KERNEL_UNKNOWN -1
+#define CHACHA_KERNEL_SCALAR  0
+#define CHACHA_KERNEL_SSE2    1
+#define CHACHA_KERNEL_AVX2    2
+#define CHACHA_KERNEL_NEON    3
+
+/* multi-block kernels keep word i of every block in lane i of a vector
+   and process 4 (SSE2, NEON) or 8 (AVX2) consecutive counters at once */
+
+#define VQUARTERROUND(a,b,c,d,ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+  a = ADD(a,b); d = ROT16(XORV(d,a)); \
+  c = ADD(c,d); b = ROT12(XORV(b,c)); \
+  a = ADD(a,b); d = ROT8(XORV(d,a)); \
+  c = ADD(c,d); b = ROT7(XORV(b,c));
+
+#define VDOUBLEROUNDS(v,ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+  for (i = 20;i > 0;i -= 2) { \
+    VQUARTERROUND(v[0], v[4], v[8],v[12],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+    VQUARTERROUND(v[1], v[5], v[9],v[13],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+    VQUARTERROUND(v[2], v[6],v[10],v[14],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+    VQUARTERROUND(v[3], v[7],v[11],v[15],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+    VQUARTERROUND(v[0], v[5],v[10],v[15],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+    VQUARTERROUND(v[1], v[6],v[11],v[12],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+    VQUARTERROUND(v[2], v[7], v[8],v[13],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+    VQUARTERROUND(v[3], v[4], v[9],v[14],ADD,XORV,ROT16,ROT12,ROT8,ROT7) \
+  }
+
+#ifdef CHACHA_SSE2
+#define SSE2_ROTL(v,n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define SSE2_ROT16(v) SSE2_ROTL(v,16)
+#define SSE2_ROT12(v) SSE2_ROTL(v,12)
+#define SSE2_ROT8(v) SSE2_ROTL(v,8)
+#define SSE2_ROT7(v) SSE2_ROTL(v,7)
+
+static void
+chacha_blocks_sse2(const uint32_t *input,const unsigned char *m,unsigned char *c)
+{
+  __m128i v[16], j[16];
+  __m128i t0, t1, t2, t3;
+  int i, k;
+
+  for (k = 0;k < 16;++k)
+    j[k] = _mm_set1_epi32((int)input[k]);
+  j[12] = _mm_add_epi32(j[12], _mm_set_epi32(3, 2, 1, 0));
+  for (k = 0;k < 16;++k)
+    v[k] = j[k];
+
+  VDOUBLEROUNDS(v, _mm_add_epi32, _mm_xor_si128, SSE2_ROT16, SSE2_ROT12, SSE2_ROT8, SSE2_ROT7)
+
+  for (k = 0;k < 16;++k)
+    v[k] = _mm_add_epi32(v[k], j[k]);
+
+  /* transpose 4 words of 4 blocks at a time */
+  for (k = 0;k < 16;k += 4) {
+    t0 = _mm_unpacklo_epi32(v[k], v[k + 1]);
+    t1 = _mm_unpacklo_epi32(v[k + 2], v[k + 3]);
+    t2 = _mm_unpackhi_epi32(v[k], v[k + 1]);
+    t3 = _mm_unpackhi_epi32(v[k + 2], v[k + 3]);
+    _mm_storeu_si128((__m128i *)(c + k * 4), _mm_xor_si128(_mm_unpacklo_epi64(t0, t1), _mm_loadu_si128((const __m128i *)(m + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 64 + k * 4), _mm_xor_si128(_mm_unpackhi_epi64(t0, t1), _mm_loadu_si128((const __m128i *)(m + 64 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 128 + k * 4), _mm_xor_si128(_mm_unpacklo_epi64(t2, t3), _mm_loadu_si128((const __m128i *)(m + 128 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 192 + k * 4), _mm_xor_si128(_mm_unpackhi_epi64(t2, t3), _mm_loadu_si128((const __m128i *)(m + 192 + k * 4))));
+  }
+}
+#endif
+
+#ifdef CHACHA_AVX2
+#define AVX2_ROTL(v,n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define AVX2_ROT16(v) _mm256_shuffle_epi8(v, rot16)
+#define AVX2_ROT12(v) AVX2_ROTL(v,12)
+#define AVX2_ROT8(v) _mm256_shuffle_epi8(v, rot8)
+#define AVX2_ROT7(v) AVX2_ROTL(v,7)
+
+__attribute__((target("avx2"))) static void
+chacha_blocks_avx2(const uint32_t *input,const unsigned char *m,unsigned char *c)
+{
+  __m256i v[16], j[16];
+  __m256i t0, t1, t2, t3, b0, b1, b2, b3;
+  const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, 13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+  const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3, 14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+  int i, k;
+
+  for (k = 0;k < 16;++k)
+    j[k] = _mm256_set1_epi32((int)input[k]);
+  j[12] = _mm256_add_epi32(j[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+  for (k = 0;k < 16;++k)
+    v[k] = j[k];
+
+  VDOUBLEROUNDS(v, _mm256_add_epi32, _mm256_xor_si256, AVX2_ROT16, AVX2_ROT12, AVX2_ROT8, AVX2_ROT7)
+
+  for (k = 0;k < 16;++k)
+    v[k] = _mm256_add_epi32(v[k], j[k]);
+
+  /* low 128 bits hold blocks 0-3, high 128 bits blocks 4-7 */
+  for (k = 0;k < 16;k += 4) {
+    t0 = _mm256_unpacklo_epi32(v[k], v[k + 1]);
+    t1 = _mm256_unpacklo_epi32(v[k + 2], v[k + 3]);
+    t2 = _mm256_unpackhi_epi32(v[k], v[k + 1]);
+    t3 = _mm256_unpackhi_epi32(v[k + 2], v[k + 3]);
+    b0 = _mm256_unpacklo_epi64(t0, t1);
+    b1 = _mm256_unpackhi_epi64(t0, t1);
+    b2 = _mm256_unpacklo_epi64(t2, t3);
+    b3 = _mm256_unpackhi_epi64(t2, t3);
+    _mm_storeu_si128((__m128i *)(c + k * 4), _mm_xor_si128(_mm256_castsi256_si128(b0), _mm_loadu_si128((const __m128i *)(m + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 64 + k * 4), _mm_xor_si128(_mm256_castsi256_si128(b1), _mm_loadu_si128((const __m128i *)(m + 64 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 128 + k * 4), _mm_xor_si128(_mm256_castsi256_si128(b2), _mm_loadu_si128((const __m128i *)(m + 128 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 192 + k * 4), _mm_xor_si128(_mm256_castsi256_si128(b3), _mm_loadu_si128((const __m128i *)(m + 192 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 256 + k * 4), _mm_xor_si128(_mm256_extracti128_si256(b0, 1), _mm_loadu_si128((const __m128i *)(m + 256 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 320 + k * 4), _mm_xor_si128(_mm256_extracti128_si256(b1, 1), _mm_loadu_si128((const __m128i *)(m + 320 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 384 + k * 4), _mm_xor_si128(_mm256_extracti128_si256(b2, 1), _mm_loadu_si128((const __m128i *)(m + 384 + k * 4))));
+    _mm_storeu_si128((__m128i *)(c + 448 + k * 4), _mm_xor_si128(_mm256_extracti128_si256(b3, 1), _mm_loadu_si128((const __m128i *)(m + 448 + k * 4))));
+  }
+}
+#endif
+
+#ifdef CHACHA_NEON
+#define NEON_ROTL(v,n) vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - (n))
+#define NEON_ROT16(v) vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v)))
+#define NEON_ROT12(v) NEON_ROTL(v,12)
+#define NEON_ROT8(v) NEON_ROTL(v,8)
+#define NEON_ROT7(v) NEON_ROTL(v,7)
+
+static void
+chacha_blocks_neon(const uint32_t *input,const unsigned char *m,unsigned char *c)
+{
+  static const uint32_t lanes[4] = { 0, 1, 2, 3 };
+  uint32x4_t v[16], j[16];
+  uint32x4x2_t ab, cd;
+  int i, k;
+
+  for (k = 0;k < 16;++k)
+    j[k] = vdupq_n_u32(input[k]);
+  j[12] = vaddq_u32(j[12], vld1q_u32(lanes));
+  for (k = 0;k < 16;++k)
+    v[k] = j[k];
+
+  VDOUBLEROUNDS(v, vaddq_u32, veorq_u32, NEON_ROT16, NEON_ROT12, NEON_ROT8, NEON_ROT7)
+
+  for (k = 0;k < 16;++k)
+    v[k] = vaddq_u32(v[k], j[k]);
+
+  for (k = 0;k < 16;k += 4) {
+    ab = vtrnq_u32(v[k], v[k + 1]);
+    cd = vtrnq_u32(v[k + 2], v[k + 3]);
+    vst1q_u8(c + k * 4, veorq_u8(vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(ab.val[0]), vget_low_u32(cd.val[0]))), vld1q_u8(m + k * 4)));
+    vst1q_u8(c + 64 + k * 4, veorq_u8(vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(ab.val[1]), vget_low_u32(cd.val[1]))), vld1q_u8(m + 64 + k * 4)));
+    vst1q_u8(c + 128 + k * 4, veorq_u8(vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(ab.val[0]), vget_high_u32(cd.val[0]))), vld1q_u8(m + 128 + k * 4)));
+    vst1q_u8(c + 192 + k * 4, veorq_u8(vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(ab.val[1]), vget_high_u32(cd.val[1]))), vld1q_u8(m + 192 + k * 4)));
+  }
+}
+#endif
+
+static volatile int chacha_kernel = CHACHA_KERNEL_UNKNOWN;
+
+static void
+chacha_run_kernel(int kernel,const uint32_t *input,const unsigned char *m,unsigned char *c)
+{
+  switch (kernel) {
+#ifdef CHACHA_SSE2
+    case CHACHA_KERNEL_SSE2:
+      chacha_blocks_sse2(input, m, c);
+      break;
+#endif
+#ifdef CHACHA_AVX2
+    case CHACHA_KERNEL_AVX2:
+      chacha_blocks_avx2(input, m, c);
+      break;
+#endif
+#ifdef CHACHA_NEON
+    case CHACHA_KERNEL_NEON:
+      chacha_blocks_neon(input, m, c);
+      break;
+#endif
+  }
+}
+
+static uint32_t
+chacha_kernel_blocks(int kernel)
+{
+  return kernel == CHACHA_KERNEL_AVX2 ? 8 : 4;
+}
+
+/* known answer: all zero key and iv, first keystream block */
+static const unsigned char chacha_kat[64] = {
+  0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+  0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+  0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+  0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86
+};
+
+/* a kernel is used only if it produces the same bytes as the scalar implementation */
+static int
+chacha_kernel_check(int kernel)
+{
+  static const unsigned char zero[32] = { 0 };
+  unsigned char in[512], ref[512], out[512], key[32], iv[12], ctr[4] = { 0xF0, 0xFF, 0xFF, 0x7F };
+  struct chacha_ctx ctx;
+  uint32_t blocks = chacha_kernel_blocks(kernel);
+  uint32_t i;
+
+  for (i = 0;i < sizeof(in);++i)
+    in[i] = (unsigned char)(i * 7 + 3);
+  for (i = 0;i < sizeof(key);++i)
+    key[i] = (unsigned char)(i * 13 + 1);
+  for (i = 0;i < sizeof(iv);++i)
+    iv[i] = (unsigned char)(i * 29 + 5);
+
+  memset(out, 0, sizeof(out));
+  chacha_keysetup(&ctx, zero, 256);
+  chacha_ivsetup(&ctx, zero, NULL);
+  chacha_run_kernel(kernel, ctx.input, out, out);
+  if (memcmp(out, chacha_kat, sizeof(chacha_kat)))
+    return 0;
+
+  chacha_keysetup(&ctx, key, 256);
+  chacha_ivsetup(&ctx, iv, ctr);
+  chacha_encrypt_bytes_scalar(&ctx, in, ref, blocks * CHACHA_BLOCKLEN);
+  chacha_ivsetup(&ctx, iv, ctr);
+  chacha_run_kernel(kernel, ctx.input, in, out);
+  return !memcmp(ref, out, blocks * CHACHA_BLOCKLEN);
+}
+
+static int
+chacha_select_kernel(void)
+{
+  int kernel = CHACHA_KERNEL_SCALAR;
+#ifdef CHACHA_NEON
+  kernel = CHACHA_KERNEL_NEON;
+#endif
+#ifdef CHACHA_SSE2
+  kernel = CHACHA_KERNEL_SSE2;
+#endif
+#ifdef CHACHA_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    if (chacha_kernel_check(CHACHA_KERNEL_AVX2))
+      return CHACHA_KERNEL_AVX2;
+  }
+#endif
+  if ((kernel != CHACHA_KERNEL_SCALAR) && (!chacha_kernel_check(kernel)))
+    kernel = CHACHA_KERNEL_SCALAR;
+  return kernel;
+}
+
+/* encrypts whole groups of blocks, returns the number of bytes processed */
+static uint32_t
+chacha_encrypt_blocks(struct chacha_ctx *x,const unsigned char *m,unsigned char *c,uint32_t bytes)
+{
+  int kernel = chacha_kernel;
+  uint32_t processed = 0;
+  uint32_t blocks;
+
+  if (kernel == CHACHA_KERNEL_UNKNOWN) {
+    kernel = chacha_select_kernel();
+    chacha_kernel = kernel;
+  }
+  if (kernel == CHACHA_KERNEL_SCALAR)
+    return 0;
+
+  blocks = chacha_kernel_blocks(kernel);
+  /* counter carry into input[13] is left to the scalar code */
+  while ((bytes - processed >= blocks * CHACHA_BLOCKLEN) && (x->input[12] <= 0xFFFFFFFFU - blocks)) {
+    chacha_run_kernel(kernel, x->input, m + processed, c + processed);
+    x->input[12] += blocks;
+    processed += blocks * CHACHA_BLOCKLEN;
+  }
+  return processed;
+}
+#endif
+
+void
+chacha_encrypt_bytes(struct chacha_ctx *x,const unsigned char *m,unsigned char *c,uint32_t bytes)
+{
+#ifdef CHACHA_SIMD
+  if (bytes >= CHACHA_BLOCKLEN * 4) {
+    uint32_t processed = chacha_encrypt_blocks(x, m, c, bytes);
+    if (processed == bytes)
+      return;
+    m += processed;
+    c += processed;
+    bytes -= processed;
+  }
+#endif
+  chacha_encrypt_bytes_scalar(x, m, c, bytes);
+}
@@ -22,6 +22,7 @@ Public domain.
 #define USE_MEMCPY          1
 /* use unaligned little-endian load/store (can be faster) */
 #define USE_UNALIGNED       0
+/* define CHACHA_NO_SIMD to disable the multi-block SSE2/AVX2/NEON kernels */
 
 struct chacha_ctx {
 	uint32_t input[16];
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chain_index.h"
+#include "thread.h"
+#include "log.h"
+
+#define CHAIN_INDEX_INITIAL_BUCKETS 1024
+
+struct chain_index_entry {
+    uint64_t key;
+    struct chain_index_record record;
+    struct chain_index_entry *next;
+};
+
+struct chain_index_table {
+    struct chain_index_entry **buckets;
+    unsigned int size;
+    unsigned int count;
+};
+
+struct chain_index {
+    // inode => latest record
+    struct chain_index_table inodes;
+    // block hash => height
+    struct chain_index_table hashes;
+    // height => block
+    struct block **blocks;
+    uint64_t count;
+    uint64_t allocated;
+
+    thread_mutex_t lock;
+};
+
+static uint64_t chain_index_uint64(const unsigned char *ptr) {
+    uint64_t val = 0;
+    int i;
+    // records are big endian
+    for (i = 0; i < 8; i++)
+        val = (val << 8) | ptr[i];
+    return val;
+}
+
+static unsigned int chain_index_bucket(struct chain_index_table *table, uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(key >> 32) & (table->size - 1);
+}
+
+static int chain_index_table_init(struct chain_index_table *table) {
+    table->buckets = (struct chain_index_entry **)calloc(CHAIN_INDEX_INITIAL_BUCKETS, sizeof(struct chain_index_entry *));
+    if (!table->buckets)
+        return -1;
+    table->size = CHAIN_INDEX_INITIAL_BUCKETS;
+    table->count = 0;
+    return 0;
+}
+
+static void chain_index_table_clear(struct chain_index_table *table) {
+    unsigned int i;
+    for (i = 0; i < table->size; i++) {
+        struct chain_index_entry *entry = table->buckets[i];
+        while (entry) {
+            struct chain_index_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        table->buckets[i] = NULL;
+    }
+    table->count = 0;
+}
+
+static void chain_index_table_grow(struct chain_index_table *table) {
+    unsigned int size = table->size * 2;
+    struct chain_index_entry **buckets = (struct chain_index_entry **)calloc(size, sizeof(struct chain_index_entry *));
+    if (!buckets)
+        return;
+
+    struct chain_index_entry **old_buckets = table->buckets;
+    unsigned int old_size = table->size;
+    unsigned int i;
+    table->buckets = buckets;
+    table->size = size;
+    for (i = 0; i < old_size; i++) {
+        struct chain_index_entry *entry = old_buckets[i];
+        while (entry) {
+            struct chain_index_entry *next = entry->next;
+            unsigned int bucket = chain_index_bucket(table, entry->key);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+}
+
+static struct chain_index_entry *chain_index_table_add(struct chain_index_table *table, uint64_t key) {
+    if (table->count >= table->size * 2)
+        chain_index_table_grow(table);
+
+    struct chain_index_entry *entry = (struct chain_index_entry *)malloc(sizeof(struct chain_index_entry));
+    if (!entry)
+        return NULL;
+    memset(entry, 0, sizeof(struct chain_index_entry));
+    entry->key = key;
+
+    unsigned int bucket = chain_index_bucket(table, key);
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    table->count ++;
+    return entry;
+}
+
+static struct chain_index_entry *chain_index_find_inode(struct chain_index *index, uint64_t inode) {
+    struct chain_index_entry *entry = index->inodes.buckets[chain_index_bucket(&index->inodes, inode)];
+    while (entry) {
+        if (entry->key == inode)
+            return entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static struct chain_index_entry *chain_index_find_block_hash(struct chain_index *index, const unsigned char *hash) {
+    uint64_t key = chain_index_uint64(hash);
+    struct chain_index_entry *entry = index->hashes.buckets[chain_index_bucket(&index->hashes, key)];
+    while (entry) {
+        if ((entry->key == key) && (!memcmp(entry->record.hash, hash, 32)))
+            return entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+static void chain_index_clear(struct chain_index *index) {
+    chain_index_table_clear(&index->inodes);
+    chain_index_table_clear(&index->hashes);
+    index->count = 0;
+}
+
+static int chain_index_add_block(struct chain_index *index, struct block *block) {
+    if (index->count >= index->allocated) {
+        uint64_t allocated = index->allocated ? index->allocated * 2 : 1024;
+        struct block **blocks = (struct block **)realloc(index->blocks, allocated * sizeof(struct block *));
+        if (!blocks)
+            return -1;
+        index->blocks = blocks;
+        index->allocated = allocated;
+    }
+    uint64_t height = index->count;
+    index->blocks[index->count ++] = block;
+
+    struct chain_index_entry *entry = chain_index_table_add(&index->hashes, chain_index_uint64(block->hash));
+    if (entry) {
+        memcpy(entry->record.hash, block->hash, 32);
+        entry->record.height = height;
+        entry->record.block_timestamp = block->timestamp;
+    }
+
+    int len = (int)block->data_len - CHAIN_INDEX_BLOCK_TRAILER;
+    const unsigned char *ptr = block->data;
+    int i;
+    for (i = 0; i + CHAIN_INDEX_RECORD_SIZE <= len; i += CHAIN_INDEX_RECORD_SIZE) {
+        uint64_t inode = chain_index_uint64(ptr);
+        entry = chain_index_find_inode(index, inode);
+        if (!entry)
+            entry = chain_index_table_add(&index->inodes, inode);
+        else
+        if (entry->record.height == height) {
+            // first record in a block wins
+            ptr += CHAIN_INDEX_RECORD_SIZE;
+            continue;
+        }
+        if (entry) {
+            entry->record.inode = inode;
+            entry->record.generation = chain_index_uint64(ptr + 8);
+            entry->record.timestamp = chain_index_uint64(ptr + 16);
+            memcpy(entry->record.hash, ptr + 24, 32);
+            entry->record.height = height;
+            entry->record.block_timestamp = block->timestamp;
+        }
+        ptr += CHAIN_INDEX_RECORD_SIZE;
+    }
+    return 0;
+}
+
+// adds the blocks newer than base (NULL for all the chain), oldest first
+static void chain_index_add_blocks(struct chain_index *index, struct block *top, struct block *base) {
+    uint64_t count = 0;
+    struct block *block = top;
+    while ((block) && (block != base)) {
+        count ++;
+        block = (struct block *)block->previous_block;
+    }
+    if (!count)
+        return;
+
+    struct block **blocks = (struct block **)malloc(count * sizeof(struct block *));
+    if (!blocks) {
+        log_error("error allocating memory for chain index");
+        return;
+    }
+    uint64_t i = count;
+    block = top;
+    while (i > 0) {
+        blocks[--i] = block;
+        block = (struct block *)block->previous_block;
+    }
+    for (i = 0; i < count; i++) {
+        if (chain_index_add_block(index, blocks[i])) {
+            log_error("error adding block to chain index");
+            break;
+        }
+    }
+    free(blocks);
+}
+
+struct chain_index *chain_index_create() {
+    struct chain_index *index = (struct chain_index *)malloc(sizeof(struct chain_index));
+    if (!index)
+        return NULL;
+
+    memset(index, 0, sizeof(struct chain_index));
+    if ((chain_index_table_init(&index->inodes)) || (chain_index_table_init(&index->hashes))) {
+        free(index->inodes.buckets);
+        free(index);
+        return NULL;
+    }
+    thread_mutex_init(&index->lock);
+    return index;
+}
+
+void chain_index_destroy(struct chain_index *index) {
+    if (!index)
+        return;
+
+    chain_index_clear(index);
+    free(index->inodes.buckets);
+    free(index->hashes.buckets);
+    free(index->blocks);
+    thread_mutex_term(&index->lock);
+    free(index);
+}
+
+// must be called every time the chain top changes; appended blocks are indexed incrementally, any other change (pop, mediated top, new chain) rebuilds the index
+void chain_index_update(struct chain_index *index, struct block *top) {
+    if (!index)
+        return;
+
+    thread_mutex_lock(&index->lock);
+    struct block *base = top;
+    while (base) {
+        // only pointers are compared, removed blocks may be already freed
+        if ((base->index < index->count) && (index->blocks[base->index] == base))
+            break;
+        base = (struct block *)base->previous_block;
+    }
+    if ((!base) || (base->index + 1 != index->count)) {
+        if (index->count)
+            log_debug("rebuilding chain index");
+        chain_index_clear(index);
+        base = NULL;
+    }
+    chain_index_add_blocks(index, top, base);
+    thread_mutex_unlock(&index->lock);
+}
+
+int chain_index_lookup(struct chain_index *index, uint64_t inode, struct chain_index_record *record) {
+    if (!index)
+        return 0;
+
+    thread_mutex_lock(&index->lock);
+    struct chain_index_entry *entry = chain_index_find_inode(index, inode);
+    if ((entry) && (record))
+        memcpy(record, &entry->record, sizeof(struct chain_index_record));
+    thread_mutex_unlock(&index->lock);
+    return entry ? 1 : 0;
+}
+
+int chain_index_find_hash(struct chain_index *index, const unsigned char *hash, uint64_t *height) {
+    if ((!index) || (!hash))
+        return 0;
+
+    thread_mutex_lock(&index->lock);
+    struct chain_index_entry *entry = chain_index_find_block_hash(index, hash);
+    if ((entry) && (height))
+        *height = entry->record.height;
+    thread_mutex_unlock(&index->lock);
+    return entry ? 1 : 0;
+}
+
+// the hash is copied under the lock, the block may be freed when the chain is replaced
+int chain_index_block_hash(struct chain_index *index, uint64_t height, unsigned char *hash) {
+    int found = 0;
+    if ((!index) || (!hash))
+        return 0;
+
+    thread_mutex_lock(&index->lock);
+    if ((height < index->count) && (index->blocks[height])) {
+        memcpy(hash, index->blocks[height]->hash, 32);
+        found = 1;
+    }
+    thread_mutex_unlock(&index->lock);
+    return found;
+}
+
+uint64_t chain_index_size(struct chain_index *index) {
+    uint64_t count;
+    if (!index)
+        return 0;
+
+    thread_mutex_lock(&index->lock);
+    count = index->count;
+    thread_mutex_unlock(&index->lock);
+    return count;
+}
@@ -0,0 +1,31 @@
+#ifndef __CHAIN_INDEX_H
+#define __CHAIN_INDEX_H
+
+#include <inttypes.h>
+#include "blockchain.h"
+
+// block data is a list of (inode, generation, timestamp, hash[32]) records, followed by who_am_i[32] and proof_of_time[40]
+#define CHAIN_INDEX_RECORD_SIZE     56
+#define CHAIN_INDEX_BLOCK_TRAILER   72
+
+struct chain_index;
+
+struct chain_index_record {
+    uint64_t inode;
+    uint64_t generation;
+    uint64_t timestamp;
+    unsigned char hash[32];
+    // block holding the latest record for inode
+    uint64_t height;
+    uint64_t block_timestamp;
+};
+
+struct chain_index *chain_index_create();
+void chain_index_destroy(struct chain_index *index);
+void chain_index_update(struct chain_index *index, struct block *top);
+int chain_index_lookup(struct chain_index *index, uint64_t inode, struct chain_index_record *record);
+int chain_index_find_hash(struct chain_index *index, const unsigned char *hash, uint64_t *height);
+int chain_index_block_hash(struct chain_index *index, uint64_t height, unsigned char *hash);
+uint64_t chain_index_size(struct chain_index *index);
+
+#endif
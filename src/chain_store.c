@@ -0,0 +1,453 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+#include "chain_store.h"
+#include "thread.h"
+#include "xxhash.h"
+#include "log.h"
+
+#define CHAIN_STORE_DATA_MAGIC      0x45444344
+#define CHAIN_STORE_INDEX_MAGIC     0x45444349
+#define CHAIN_STORE_CHECK_MAGIC     0x4544434B
+#define CHAIN_STORE_HEADER_SIZE     16
+// offset (8), size (4), checksum (4)
+#define CHAIN_STORE_ENTRY_SIZE      16
+#define CHAIN_STORE_CHECK_SIZE      48
+
+struct chain_store_file {
+    FILE *f;
+    uint64_t size;
+    unsigned char *map;
+    uint64_t map_size;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+};
+
+struct chain_store {
+    char *path;
+    // append-only blocks
+    struct chain_store_file data;
+    // fixed size entries, one per height
+    struct chain_store_file index;
+    uint64_t count;
+
+    thread_mutex_t lock;
+};
+
+static void chain_store_put32(unsigned char *buf, uint32_t val) {
+    buf[0] = (unsigned char)(val >> 24);
+    buf[1] = (unsigned char)(val >> 16);
+    buf[2] = (unsigned char)(val >> 8);
+    buf[3] = (unsigned char)val;
+}
+
+static uint32_t chain_store_get32(const unsigned char *buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+static void chain_store_put64(unsigned char *buf, uint64_t val) {
+    chain_store_put32(buf, (uint32_t)(val >> 32));
+    chain_store_put32(buf + 4, (uint32_t)val);
+}
+
+static uint64_t chain_store_get64(const unsigned char *buf) {
+    return ((uint64_t)chain_store_get32(buf) << 32) | chain_store_get32(buf + 4);
+}
+
+static char *chain_store_path(struct chain_store *store, const char *name, char *path, int len) {
+    snprintf(path, len, "%s/%s", store->path, name);
+    return path;
+}
+
+static void chain_store_unmap(struct chain_store_file *file) {
+    if (!file->map)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(file->map);
+    CloseHandle(file->mapping);
+    file->mapping = NULL;
+#else
+    munmap(file->map, (size_t)file->map_size);
+#endif
+    file->map = NULL;
+    file->map_size = 0;
+}
+
+static int chain_store_remap(struct chain_store_file *file) {
+    chain_store_unmap(file);
+    if (!file->size)
+        return -1;
+
+    fflush(file->f);
+#ifdef _WIN32
+    file->mapping = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(file->f)), NULL, PAGE_READONLY, (DWORD)(file->size >> 32), (DWORD)file->size, NULL);
+    if (!file->mapping)
+        return -1;
+    file->map = (unsigned char *)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, (SIZE_T)file->size);
+    if (!file->map) {
+        CloseHandle(file->mapping);
+        file->mapping = NULL;
+        return -1;
+    }
+#else
+    void *map = mmap(NULL, (size_t)file->size, PROT_READ, MAP_SHARED, fileno(file->f), 0);
+    if (map == MAP_FAILED)
+        return -1;
+    file->map = (unsigned char *)map;
+#endif
+    file->map_size = file->size;
+    return 0;
+}
+
+// maps the file again, if it grew since the last mapping
+static const unsigned char *chain_store_ptr(struct chain_store_file *file, uint64_t offset, uint64_t size) {
+    if (offset + size > file->size)
+        return NULL;
+
+    if ((offset + size > file->map_size) && (chain_store_remap(file))) {
+        log_error("error mapping chain store file (errno: %i)", errno);
+        return NULL;
+    }
+    return file->map + offset;
+}
+
+static int chain_store_truncate_file(struct chain_store_file *file, uint64_t size) {
+    chain_store_unmap(file);
+    fflush(file->f);
+#ifdef _WIN32
+    if (_chsize_s(_fileno(file->f), (__int64)size))
+        return -1;
+#else
+    if (ftruncate(fileno(file->f), (off_t)size))
+        return -1;
+#endif
+    file->size = size;
+    return 0;
+}
+
+// long is 32-bit on Win32, chain.dat may be larger than 2GB
+static int chain_store_seek(FILE *f, uint64_t offset, int whence) {
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)offset, whence);
+#else
+    return fseeko(f, (off_t)offset, whence);
+#endif
+}
+
+static int64_t chain_store_tell(FILE *f) {
+#ifdef _WIN32
+    return (int64_t)_ftelli64(f);
+#else
+    return (int64_t)ftello(f);
+#endif
+}
+
+static int chain_store_write_at(struct chain_store_file *file, uint64_t offset, const void *data, int size) {
+    if (chain_store_seek(file->f, offset, SEEK_SET))
+        return -1;
+    if (fwrite(data, 1, size, file->f) != size)
+        return -1;
+    fflush(file->f);
+    if (offset + size > file->size)
+        file->size = offset + size;
+    return 0;
+}
+
+static int chain_store_open_file(struct chain_store_file *file, const char *path, uint32_t magic) {
+    unsigned char header[CHAIN_STORE_HEADER_SIZE];
+
+    file->f = fopen(path, "r+b");
+    if (!file->f)
+        file->f = fopen(path, "w+b");
+    if (!file->f)
+        return -1;
+
+    chain_store_seek(file->f, 0, SEEK_END);
+    int64_t size = chain_store_tell(file->f);
+    file->size = (size > 0) ? (uint64_t)size : 0;
+
+    if (file->size >= CHAIN_STORE_HEADER_SIZE) {
+        chain_store_seek(file->f, 0, SEEK_SET);
+        if ((fread(header, 1, CHAIN_STORE_HEADER_SIZE, file->f) == CHAIN_STORE_HEADER_SIZE) && (chain_store_get32(header) == magic))
+            return 0;
+        log_warn("invalid chain store file %s, resetting", path);
+    }
+
+    memset(header, 0, sizeof(header));
+    chain_store_put32(header, magic);
+    // version
+    chain_store_put32(header + 4, 1);
+    if ((chain_store_truncate_file(file, 0)) || (chain_store_write_at(file, 0, header, CHAIN_STORE_HEADER_SIZE)))
+        return -1;
+    return 0;
+}
+
+static void chain_store_close_file(struct chain_store_file *file) {
+    chain_store_unmap(file);
+    if (file->f)
+        fclose(file->f);
+    file->f = NULL;
+}
+
+static const unsigned char *chain_store_entry(struct chain_store *store, uint64_t height, uint64_t *offset, int *size) {
+    const unsigned char *entry = chain_store_ptr(&store->index, CHAIN_STORE_HEADER_SIZE + height * CHAIN_STORE_ENTRY_SIZE, CHAIN_STORE_ENTRY_SIZE);
+    if (!entry)
+        return NULL;
+
+    *offset = chain_store_get64(entry);
+    *size = (int)chain_store_get32(entry + 8);
+    if ((*offset < CHAIN_STORE_HEADER_SIZE) || (*size < 0) || (*size > CHAIN_STORE_MAX_RECORD_SIZE))
+        return NULL;
+
+    const unsigned char *data = chain_store_ptr(&store->data, *offset, *size);
+    if ((!data) || (XXH32(data, *size, 0) != chain_store_get32(entry + 12)))
+        return NULL;
+    return data;
+}
+
+// keeps the first count blocks (already validated)
+static int chain_store_truncate_locked(struct chain_store *store, uint64_t count) {
+    uint64_t data_size = CHAIN_STORE_HEADER_SIZE;
+    if (count) {
+        const unsigned char *entry = chain_store_ptr(&store->index, CHAIN_STORE_HEADER_SIZE + (count - 1) * CHAIN_STORE_ENTRY_SIZE, CHAIN_STORE_ENTRY_SIZE);
+        if (!entry)
+            return -1;
+        data_size = chain_store_get64(entry) + chain_store_get32(entry + 8);
+    }
+    if (data_size > store->data.size)
+        data_size = store->data.size;
+
+    store->count = count;
+    if ((chain_store_truncate_file(&store->index, CHAIN_STORE_HEADER_SIZE + count * CHAIN_STORE_ENTRY_SIZE)) || (chain_store_truncate_file(&store->data, data_size))) {
+        log_error("error truncating chain store (errno: %i)", errno);
+        return -1;
+    }
+    return 0;
+}
+
+struct chain_store *chain_store_open(const char *path) {
+    char fullpath[4096];
+
+    if (!path)
+        return NULL;
+
+    struct chain_store *store = (struct chain_store *)malloc(sizeof(struct chain_store));
+    if (!store)
+        return NULL;
+
+    memset(store, 0, sizeof(struct chain_store));
+    store->path = strdup(path);
+    if ((chain_store_open_file(&store->data, chain_store_path(store, "chain.dat", fullpath, sizeof(fullpath)), CHAIN_STORE_DATA_MAGIC)) || (chain_store_open_file(&store->index, chain_store_path(store, "chain.idx", fullpath, sizeof(fullpath)), CHAIN_STORE_INDEX_MAGIC))) {
+        log_error("error opening chain store in %s (errno: %i)", path, errno);
+        chain_store_close_file(&store->data);
+        chain_store_close_file(&store->index);
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+    thread_mutex_init(&store->lock);
+
+    // drop incomplete or corrupted blocks at the end (interrupted write)
+    uint64_t count = (store->index.size - CHAIN_STORE_HEADER_SIZE) / CHAIN_STORE_ENTRY_SIZE;
+    store->count = count;
+    while (count > 0) {
+        uint64_t offset;
+        int size;
+        if (chain_store_entry(store, count - 1, &offset, &size))
+            break;
+        count --;
+    }
+    if ((count != store->count) || (store->index.size != CHAIN_STORE_HEADER_SIZE + count * CHAIN_STORE_ENTRY_SIZE)) {
+        if (count != store->count)
+            log_warn("chain store: dropping %i incomplete blocks", (int)(store->count - count));
+        chain_store_truncate_locked(store, count);
+    }
+
+    log_info("chain store %s: %i blocks", path, (int)store->count);
+    return store;
+}
+
+void chain_store_close(struct chain_store *store) {
+    if (!store)
+        return;
+
+    chain_store_close_file(&store->data);
+    chain_store_close_file(&store->index);
+    thread_mutex_term(&store->lock);
+    free(store->path);
+    free(store);
+}
+
+uint64_t chain_store_count(struct chain_store *store) {
+    if (!store)
+        return 0;
+
+    thread_mutex_lock(&store->lock);
+    uint64_t count = store->count;
+    thread_mutex_unlock(&store->lock);
+    return count;
+}
+
+// writing an existing height drops it and all the blocks above it (replaced top or fork)
+int chain_store_write(struct chain_store *store, uint64_t height, const void *data, int size) {
+    unsigned char entry[CHAIN_STORE_ENTRY_SIZE];
+
+    if ((!store) || (!data) || (size <= 0) || (size > CHAIN_STORE_MAX_RECORD_SIZE))
+        return -1;
+
+    thread_mutex_lock(&store->lock);
+    if (height > store->count) {
+        thread_mutex_unlock(&store->lock);
+        log_warn("chain store: cannot write block %i, chain has %i blocks", (int)height, (int)store->count);
+        return -1;
+    }
+    if ((height < store->count) && (chain_store_truncate_locked(store, height))) {
+        thread_mutex_unlock(&store->lock);
+        return -1;
+    }
+
+    uint64_t offset = store->data.size;
+    chain_store_put64(entry, offset);
+    chain_store_put32(entry + 8, (uint32_t)size);
+    chain_store_put32(entry + 12, XXH32(data, size, 0));
+
+    // data first, a missing index entry just drops the block at open
+    if ((chain_store_write_at(&store->data, offset, data, size)) || (chain_store_write_at(&store->index, CHAIN_STORE_HEADER_SIZE + height * CHAIN_STORE_ENTRY_SIZE, entry, CHAIN_STORE_ENTRY_SIZE))) {
+        log_error("error writing block %i to chain store (errno: %i)", (int)height, errno);
+        chain_store_truncate_locked(store, height);
+        thread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    store->count = height + 1;
+    thread_mutex_unlock(&store->lock);
+    return size;
+}
+
+int chain_store_read(struct chain_store *store, uint64_t height, void *data, int size) {
+    uint64_t offset;
+    int record_size;
+
+    if ((!store) || (!data) || (size <= 0))
+        return -1;
+
+    thread_mutex_lock(&store->lock);
+    const unsigned char *record = NULL;
+    if (height < store->count)
+        record = chain_store_entry(store, height, &offset, &record_size);
+    if (!record) {
+        thread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    if (size > record_size)
+        size = record_size;
+    memcpy(data, record, size);
+    thread_mutex_unlock(&store->lock);
+    return size;
+}
+
+// zero-copy access; the pointer is valid until the next write or truncate
+const unsigned char *chain_store_map(struct chain_store *store, uint64_t height, int *size) {
+    uint64_t offset;
+    int record_size = 0;
+
+    if (!store)
+        return NULL;
+
+    thread_mutex_lock(&store->lock);
+    const unsigned char *record = NULL;
+    if (height < store->count)
+        record = chain_store_entry(store, height, &offset, &record_size);
+    thread_mutex_unlock(&store->lock);
+    if (size)
+        *size = record ? record_size : 0;
+    return record;
+}
+
+int chain_store_truncate(struct chain_store *store, uint64_t count) {
+    if (!store)
+        return -1;
+
+    int err = 0;
+    thread_mutex_lock(&store->lock);
+    if (count < store->count)
+        err = chain_store_truncate_locked(store, count);
+    thread_mutex_unlock(&store->lock);
+    return err;
+}
+
+static int chain_store_sync_file(struct chain_store_file *file) {
+    if (fflush(file->f))
+        return -1;
+#ifdef _WIN32
+    return _commit(_fileno(file->f));
+#else
+    return fsync(fileno(file->f));
+#endif
+}
+
+int chain_store_sync(struct chain_store *store) {
+    if (!store)
+        return -1;
+
+    thread_mutex_lock(&store->lock);
+    int err = chain_store_sync_file(&store->data);
+    if (!err)
+        err = chain_store_sync_file(&store->index);
+    thread_mutex_unlock(&store->lock);
+    return err;
+}
+
+int chain_store_set_checkpoint(struct chain_store *store, uint64_t height, const unsigned char *hash) {
+    unsigned char buf[CHAIN_STORE_CHECK_SIZE];
+    char fullpath[4096];
+
+    if ((!store) || (!hash))
+        return -1;
+
+    chain_store_put32(buf, CHAIN_STORE_CHECK_MAGIC);
+    chain_store_put64(buf + 4, height);
+    memcpy(buf + 12, hash, 32);
+    chain_store_put32(buf + 44, XXH32(buf, CHAIN_STORE_CHECK_SIZE - 4, 0));
+
+    FILE *f = fopen(chain_store_path(store, "chain.chk", fullpath, sizeof(fullpath)), "wb");
+    if (!f)
+        return -1;
+    int written = (int)fwrite(buf, 1, CHAIN_STORE_CHECK_SIZE, f);
+    fclose(f);
+    if (written != CHAIN_STORE_CHECK_SIZE)
+        return -1;
+    return 0;
+}
+
+// returns 1 if a checkpoint exists; it must still be checked against the stored block
+int chain_store_checkpoint(struct chain_store *store, uint64_t *height, unsigned char *hash) {
+    unsigned char buf[CHAIN_STORE_CHECK_SIZE];
+    char fullpath[4096];
+
+    if (!store)
+        return 0;
+
+    FILE *f = fopen(chain_store_path(store, "chain.chk", fullpath, sizeof(fullpath)), "rb");
+    if (!f)
+        return 0;
+    int bytes_read = (int)fread(buf, 1, CHAIN_STORE_CHECK_SIZE, f);
+    fclose(f);
+    if ((bytes_read != CHAIN_STORE_CHECK_SIZE) || (chain_store_get32(buf) != CHAIN_STORE_CHECK_MAGIC) || (chain_store_get32(buf + 44) != XXH32(buf, CHAIN_STORE_CHECK_SIZE - 4, 0)))
+        return 0;
+
+    if (height)
+        *height = chain_store_get64(buf + 4);
+    if (hash)
+        memcpy(hash, buf + 12, 32);
+    return 1;
+}
@@ -0,0 +1,23 @@
+#ifndef __CHAIN_STORE_H
+#define __CHAIN_STORE_H
+
+#include <inttypes.h>
+
+#define CHAIN_STORE_MAX_RECORD_SIZE     0x20000
+// a checkpoint is written every CHAIN_STORE_CHECKPOINT_INTERVAL blocks
+#define CHAIN_STORE_CHECKPOINT_INTERVAL 64
+
+struct chain_store;
+
+struct chain_store *chain_store_open(const char *path);
+void chain_store_close(struct chain_store *store);
+uint64_t chain_store_count(struct chain_store *store);
+int chain_store_write(struct chain_store *store, uint64_t height, const void *data, int size);
+int chain_store_read(struct chain_store *store, uint64_t height, void *data, int size);
+const unsigned char *chain_store_map(struct chain_store *store, uint64_t height, int *size);
+int chain_store_truncate(struct chain_store *store, uint64_t count);
+int chain_store_sync(struct chain_store *store);
+int chain_store_set_checkpoint(struct chain_store *store, uint64_t height, const unsigned char *hash);
+int chain_store_checkpoint(struct chain_store *store, uint64_t *height, unsigned char *hash);
+
+#endif
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk_cache.h"
+#include "thread.h"
+#include "xxhash.h"
+
+#define CHUNK_CACHE_BUCKETS     4096
+
+struct chunk_cache_entry {
+    uint64_t key_id;
+    uint64_t inode;
+    uint64_t chunk;
+    uint32_t version;
+    int size;
+    unsigned char *data;
+
+    struct chunk_cache_entry *prev;
+    struct chunk_cache_entry *next;
+    struct chunk_cache_entry *hash_next;
+};
+
+struct chunk_cache {
+    struct chunk_cache_entry *buckets[CHUNK_CACHE_BUCKETS];
+    struct chunk_cache_entry *head;
+    struct chunk_cache_entry *tail;
+    size_t max_bytes;
+    size_t bytes;
+    int entries;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    thread_mutex_t lock;
+};
+
+static unsigned int chunk_cache_bucket(uint64_t key_id, uint64_t inode, uint64_t chunk) {
+    uint64_t buf[3];
+    buf[0] = key_id;
+    buf[1] = inode;
+    buf[2] = chunk;
+    return (unsigned int)(XXH64(buf, sizeof(buf), 0) % CHUNK_CACHE_BUCKETS);
+}
+
+static struct chunk_cache_entry **chunk_cache_find(struct chunk_cache *cache, uint64_t key_id, uint64_t inode, uint64_t chunk) {
+    struct chunk_cache_entry **entry = &cache->buckets[chunk_cache_bucket(key_id, inode, chunk)];
+    while (*entry) {
+        if (((*entry)->key_id == key_id) && ((*entry)->inode == inode) && ((*entry)->chunk == chunk))
+            return entry;
+        entry = &(*entry)->hash_next;
+    }
+    return entry;
+}
+
+static void chunk_cache_unlink(struct chunk_cache *cache, struct chunk_cache_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void chunk_cache_push(struct chunk_cache *cache, struct chunk_cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+    cache->head = entry;
+}
+
+static void chunk_cache_remove(struct chunk_cache *cache, struct chunk_cache_entry *entry) {
+    struct chunk_cache_entry **ref = chunk_cache_find(cache, entry->key_id, entry->inode, entry->chunk);
+    if (*ref == entry)
+        *ref = entry->hash_next;
+
+    chunk_cache_unlink(cache, entry);
+    cache->bytes -= entry->size;
+    cache->entries --;
+    free(entry->data);
+    free(entry);
+}
+
+struct chunk_cache *chunk_cache_create(size_t max_bytes) {
+    struct chunk_cache *cache = (struct chunk_cache *)malloc(sizeof(struct chunk_cache));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(struct chunk_cache));
+    cache->max_bytes = max_bytes;
+    thread_mutex_init(&cache->lock);
+    return cache;
+}
+
+void chunk_cache_destroy(struct chunk_cache *cache) {
+    if (!cache)
+        return;
+
+    struct chunk_cache_entry *entry = cache->head;
+    while (entry) {
+        struct chunk_cache_entry *next = entry->next;
+        free(entry->data);
+        free(entry);
+        entry = next;
+    }
+    thread_mutex_term(&cache->lock);
+    free(cache);
+}
+
+// returns the number of bytes copied or -1 if chunk is not cached
+int chunk_cache_get(struct chunk_cache *cache, uint64_t key_id, uint64_t inode, uint64_t chunk, uint32_t version, unsigned char *data, int size) {
+    if ((!cache) || (!data) || (size <= 0))
+        return -1;
+
+    thread_mutex_lock(&cache->lock);
+    struct chunk_cache_entry *entry = *chunk_cache_find(cache, key_id, inode, chunk);
+    if ((entry) && (entry->version != version)) {
+        // chunk changed since it was cached
+        chunk_cache_remove(cache, entry);
+        entry = NULL;
+    }
+    if (!entry) {
+        cache->misses ++;
+        thread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    chunk_cache_unlink(cache, entry);
+    chunk_cache_push(cache, entry);
+    if (size > entry->size)
+        size = entry->size;
+    memcpy(data, entry->data, size);
+    cache->hits ++;
+    thread_mutex_unlock(&cache->lock);
+    return size;
+}
+
+void chunk_cache_put(struct chunk_cache *cache, uint64_t key_id, uint64_t inode, uint64_t chunk, uint32_t version, const unsigned char *data, int size) {
+    if ((!cache) || (!data) || (size <= 0) || ((size_t)size > cache->max_bytes))
+        return;
+
+    unsigned char *data_copy = (unsigned char *)malloc(size);
+    if (!data_copy)
+        return;
+    memcpy(data_copy, data, size);
+
+    thread_mutex_lock(&cache->lock);
+    struct chunk_cache_entry *entry = *chunk_cache_find(cache, key_id, inode, chunk);
+    if (entry)
+        chunk_cache_remove(cache, entry);
+
+    while ((cache->tail) && (cache->bytes + size > cache->max_bytes)) {
+        chunk_cache_remove(cache, cache->tail);
+        cache->evictions ++;
+    }
+
+    entry = (struct chunk_cache_entry *)malloc(sizeof(struct chunk_cache_entry));
+    if (!entry) {
+        thread_mutex_unlock(&cache->lock);
+        free(data_copy);
+        return;
+    }
+    entry->key_id = key_id;
+    entry->inode = inode;
+    entry->chunk = chunk;
+    entry->version = version;
+    entry->size = size;
+    entry->data = data_copy;
+
+    struct chunk_cache_entry **ref = chunk_cache_find(cache, key_id, inode, chunk);
+    entry->hash_next = NULL;
+    *ref = entry;
+    chunk_cache_push(cache, entry);
+    cache->bytes += size;
+    cache->entries ++;
+    thread_mutex_unlock(&cache->lock);
+}
+
+// chunk < 0 invalidates all the chunks of the given inode
+void chunk_cache_invalidate(struct chunk_cache *cache, uint64_t key_id, uint64_t inode, int64_t chunk) {
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    if (chunk >= 0) {
+        struct chunk_cache_entry *entry = *chunk_cache_find(cache, key_id, inode, (uint64_t)chunk);
+        if (entry)
+            chunk_cache_remove(cache, entry);
+    } else {
+        struct chunk_cache_entry *entry = cache->head;
+        while (entry) {
+            struct chunk_cache_entry *next = entry->next;
+            if ((entry->key_id == key_id) && (entry->inode == inode))
+                chunk_cache_remove(cache, entry);
+            entry = next;
+        }
+    }
+    thread_mutex_unlock(&cache->lock);
+}
+
+void chunk_cache_stats(struct chunk_cache *cache, struct chunk_cache_stats *stats) {
+    if (!stats)
+        return;
+
+    memset(stats, 0, sizeof(struct chunk_cache_stats));
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->bytes = cache->bytes;
+    stats->entries = cache->entries;
+    thread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,24 @@
+#ifndef __CHUNK_CACHE_H
+#define __CHUNK_CACHE_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+struct chunk_cache;
+
+struct chunk_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bytes;
+    int entries;
+};
+
+struct chunk_cache *chunk_cache_create(size_t max_bytes);
+void chunk_cache_destroy(struct chunk_cache *cache);
+int chunk_cache_get(struct chunk_cache *cache, uint64_t key_id, uint64_t inode, uint64_t chunk, uint32_t version, unsigned char *data, int size);
+void chunk_cache_put(struct chunk_cache *cache, uint64_t key_id, uint64_t inode, uint64_t chunk, uint32_t version, const unsigned char *data, int size);
+void chunk_cache_invalidate(struct chunk_cache *cache, uint64_t key_id, uint64_t inode, int64_t chunk);
+void chunk_cache_stats(struct chunk_cache *cache, struct chunk_cache_stats *stats);
+
+#endif
@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk_codec.h"
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.c"
+
+// lz4 block format
+#define LZ_MIN_MATCH        4
+#define LZ_LAST_LITERALS    5
+#define LZ_MF_LIMIT         12
+#define LZ_MAX_OFFSET       0xFFFF
+#define LZ_HASH_BITS        12
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(uint32_t));
+    return val;
+}
+
+static unsigned int lz_hash(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static int lz_write_length(unsigned char *out, int out_size, int op, int len) {
+    while (len >= 255) {
+        if (op >= out_size)
+            return -1;
+        out[op++] = 255;
+        len -= 255;
+    }
+    if (op >= out_size)
+        return -1;
+    out[op++] = (unsigned char)len;
+    return op;
+}
+
+static int lz_emit(unsigned char *out, int out_size, int op, const unsigned char *literals, int literals_len, int offset, int match_len) {
+    if (op >= out_size)
+        return -1;
+
+    int token = op++;
+    out[token] = (unsigned char)((literals_len >= 15 ? 15 : literals_len) << 4);
+    if (literals_len >= 15) {
+        op = lz_write_length(out, out_size, op, literals_len - 15);
+        if (op < 0)
+            return -1;
+    }
+    if (literals_len > out_size - op)
+        return -1;
+    memcpy(out + op, literals, literals_len);
+    op += literals_len;
+
+    // last sequence has no match
+    if (!match_len)
+        return op;
+
+    if (out_size - op < 2)
+        return -1;
+    out[op++] = (unsigned char)(offset & 0xFF);
+    out[op++] = (unsigned char)(offset >> 8);
+
+    match_len -= LZ_MIN_MATCH;
+    out[token] |= (unsigned char)(match_len >= 15 ? 15 : match_len);
+    if (match_len >= 15)
+        op = lz_write_length(out, out_size, op, match_len - 15);
+    return op;
+}
+
+static int lz_compress(unsigned char *out, int out_size, const unsigned char *in, int len) {
+    int table[1 << LZ_HASH_BITS];
+    int anchor = 0;
+    int ip = 0;
+    int op = 0;
+
+    memset(table, 0xFF, sizeof(table));
+    while (ip < len - LZ_MF_LIMIT) {
+        uint32_t seq = lz_read32(in + ip);
+        unsigned int hash = lz_hash(seq);
+        int ref = table[hash];
+        table[hash] = ip;
+        if ((ref < 0) || (ip - ref > LZ_MAX_OFFSET) || (lz_read32(in + ref) != seq)) {
+            ip ++;
+            continue;
+        }
+
+        int match_len = LZ_MIN_MATCH;
+        int max_match = len - LZ_LAST_LITERALS - ip;
+        while ((match_len < max_match) && (in[ref + match_len] == in[ip + match_len]))
+            match_len ++;
+
+        op = lz_emit(out, out_size, op, in + anchor, ip - anchor, ip - ref, match_len);
+        if (op < 0)
+            return -1;
+        ip += match_len;
+        anchor = ip;
+    }
+    return lz_emit(out, out_size, op, in + anchor, len - anchor, 0, 0);
+}
+
+static int lz_read_length(const unsigned char *in, int len, int *ip, int *length) {
+    unsigned char val;
+    do {
+        if (*ip >= len)
+            return -1;
+        val = in[(*ip)++];
+        *length += val;
+    } while (val == 255);
+    return 0;
+}
+
+static int lz_decompress(unsigned char *out, int out_size, const unsigned char *in, int len) {
+    int ip = 0;
+    int op = 0;
+
+    while (ip < len) {
+        int token = in[ip++];
+        int literals_len = token >> 4;
+        if ((literals_len == 15) && (lz_read_length(in, len, &ip, &literals_len)))
+            return -1;
+        if ((literals_len > len - ip) || (literals_len > out_size - op))
+            return -1;
+        memcpy(out + op, in + ip, literals_len);
+        ip += literals_len;
+        op += literals_len;
+
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return -1;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if ((!offset) || (offset > op))
+            return -1;
+
+        int match_len = token & 0x0F;
+        if ((match_len == 15) && (lz_read_length(in, len, &ip, &match_len)))
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > out_size - op)
+            return -1;
+
+        // may overlap
+        const unsigned char *ref = out + op - offset;
+        int i;
+        for (i = 0; i < match_len; i++)
+            out[op + i] = ref[i];
+        op += match_len;
+    }
+    return op;
+}
+
+int chunk_codec_parse(const char *name) {
+    if (!name)
+        return -1;
+    if (!strcmp(name, "store"))
+        return CHUNK_CODEC_STORE;
+    if (!strcmp(name, "zlib"))
+        return CHUNK_CODEC_ZLIB;
+    if (!strcmp(name, "lz"))
+        return CHUNK_CODEC_LZ;
+    return -1;
+}
+
+const char *chunk_codec_name(int codec) {
+    switch (codec) {
+        case CHUNK_CODEC_STORE:
+            return "store";
+        case CHUNK_CODEC_ZLIB:
+            return "zlib";
+        case CHUNK_CODEC_LZ:
+            return "lz";
+    }
+    return "unknown";
+}
+
+// order-0 byte histogram over a few samples; returns 0 if compression is not worth trying (media, encrypted or already compressed data)
+int chunk_codec_probe(const unsigned char *data, int len) {
+    unsigned int counts[256];
+    int samples = 4;
+    int sample_size = CHUNK_CODEC_PROBE_SIZE / samples;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    int i;
+    int j;
+
+    if ((!data) || (len <= 0))
+        return 1;
+
+    memset(counts, 0, sizeof(counts));
+    if (len <= CHUNK_CODEC_PROBE_SIZE) {
+        for (i = 0; i < len; i++)
+            counts[data[i]] ++;
+        total = len;
+    } else {
+        int stride = (len - sample_size) / (samples - 1);
+        for (i = 0; i < samples; i++) {
+            const unsigned char *sample = data + i * stride;
+            for (j = 0; j < sample_size; j++)
+                counts[sample[j]] ++;
+        }
+        total = sample_size * samples;
+    }
+
+    for (i = 0; i < 256; i++)
+        sum += (uint64_t)counts[i] * counts[i];
+
+    if (total * total >= sum * CHUNK_CODEC_PROBE_LIMIT)
+        return 0;
+    return 1;
+}
+
+// returns the codec used, or -1 on error; lz falls back to store when it doesn't pay off
+int chunk_codec_compress(int codec, unsigned char *out, unsigned long *out_len, const unsigned char *in, int len) {
+    if ((!out) || (!out_len) || (len < 0) || ((!in) && (len)))
+        return -1;
+
+    if (codec == CHUNK_CODEC_ZLIB) {
+        // legacy format, no tag: readable by peers not knowing about codecs
+        // incompressible data is written as stored deflate blocks, skipping the match search
+        mz_ulong max_len = *out_len;
+        if (mz_compress2(out, &max_len, in, len, chunk_codec_probe(in, len) ? MZ_DEFAULT_COMPRESSION : MZ_NO_COMPRESSION) != MZ_OK)
+            return -1;
+        *out_len = max_len;
+        return CHUNK_CODEC_ZLIB;
+    }
+
+    if ((codec != CHUNK_CODEC_STORE) && (!chunk_codec_probe(in, len)))
+        codec = CHUNK_CODEC_STORE;
+
+    switch (codec) {
+        case CHUNK_CODEC_LZ:
+            if (*out_len > CHUNK_CODEC_HEADER_SIZE) {
+                int limit = (int)*out_len - CHUNK_CODEC_HEADER_SIZE;
+                if (limit > len)
+                    limit = len;
+                int written = lz_compress(out + CHUNK_CODEC_HEADER_SIZE, limit, in, len);
+                if ((written >= 0) && (written < len)) {
+                    out[0] = CHUNK_CODEC_TAG;
+                    out[1] = CHUNK_CODEC_LZ;
+                    *out_len = written + CHUNK_CODEC_HEADER_SIZE;
+                    return CHUNK_CODEC_LZ;
+                }
+            }
+            break;
+    }
+
+    if (*out_len < (unsigned long)len + CHUNK_CODEC_HEADER_SIZE)
+        return -1;
+    out[0] = CHUNK_CODEC_TAG;
+    out[1] = CHUNK_CODEC_STORE;
+    if (len)
+        memcpy(out + CHUNK_CODEC_HEADER_SIZE, in, len);
+    *out_len = len + CHUNK_CODEC_HEADER_SIZE;
+    return CHUNK_CODEC_STORE;
+}
+
+// returns 0 on success, -1 on error
+int chunk_codec_decompress(unsigned char *out, unsigned long *out_len, const unsigned char *in, int len) {
+    if ((!out) || (!out_len) || (!in) || (len <= 0))
+        return -1;
+
+    if (in[0] != CHUNK_CODEC_TAG) {
+        mz_ulong max_len = *out_len;
+        if (mz_uncompress(out, &max_len, in, len) != MZ_OK)
+            return -1;
+        *out_len = max_len;
+        return 0;
+    }
+
+    if (len < CHUNK_CODEC_HEADER_SIZE)
+        return -1;
+
+    int written;
+    len -= CHUNK_CODEC_HEADER_SIZE;
+    switch (in[1]) {
+        case CHUNK_CODEC_STORE:
+            if ((unsigned long)len > *out_len)
+                return -1;
+            memcpy(out, in + CHUNK_CODEC_HEADER_SIZE, len);
+            *out_len = len;
+            return 0;
+        case CHUNK_CODEC_LZ:
+            written = lz_decompress(out, (int)*out_len, in + CHUNK_CODEC_HEADER_SIZE, len);
+            if (written < 0)
+                return -1;
+            *out_len = written;
+            return 0;
+    }
+    return -1;
+}
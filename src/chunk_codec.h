@@ -0,0 +1,27 @@
+#ifndef __CHUNK_CODEC_H
+#define __CHUNK_CODEC_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+// tagged chunks start with CHUNK_CODEC_TAG and the codec id; never a valid zlib header (CM != 8)
+// untagged chunks are zlib streams (legacy format)
+#define CHUNK_CODEC_TAG         0xED
+#define CHUNK_CODEC_HEADER_SIZE 2
+
+#define CHUNK_CODEC_STORE       0
+#define CHUNK_CODEC_ZLIB        1
+#define CHUNK_CODEC_LZ          2
+
+// sampled bytes for the entropy probe
+#define CHUNK_CODEC_PROBE_SIZE  4096
+// effective alphabet size (n^2 / sum(count^2)) above which data is considered incompressible
+#define CHUNK_CODEC_PROBE_LIMIT 200
+
+int chunk_codec_parse(const char *name);
+const char *chunk_codec_name(int codec);
+int chunk_codec_probe(const unsigned char *data, int len);
+int chunk_codec_compress(int codec, unsigned char *out, unsigned long *out_len, const unsigned char *in, int len);
+int chunk_codec_decompress(unsigned char *out, unsigned long *out_len, const unsigned char *in, int len);
+
+#endif
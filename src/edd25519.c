@@ -1,3 +1,6 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "edd25519.h"
 
 
@@ -3037,6 +3040,291 @@ int ed25519_verify(const unsigned char *signature, const unsigned char *message,
     return 1;
 } 
 
+/*
+    batch verification
+
+    checks sum(z_i * (S_i * B - R_i - h_i * A_i)) == 0 with a single multi-scalar multiplication,
+    where z_i are 128 bit coefficients derived from a hash of the whole batch. The equation has no
+    cofactor, like ed25519_verify, so it is only used when R_i and A_i are in the prime order
+    subgroup: a small order component could be cancelled by the z_i. Items with torsioned points,
+    invalid or non-canonical encodings, and all the items of a failed batch are verified individually.
+    A batch that passes while an item would fail ed25519_verify requires guessing the z_i, with
+    a probability of about 2^-128.
+*/
+
+typedef struct {
+    ge_cached table[8]; /* P,3P,5P,7P,9P,11P,13P,15P */
+    signed char slide[256];
+} ed25519_batch_point;
+
+static void ed25519_batch_table(ge_cached *table, const ge_p3 *P) {
+    ge_p1p1 t;
+    ge_p3 u;
+    ge_p3 P2;
+    int i;
+
+    ge_p3_to_cached(&table[0], P);
+    ge_p3_dbl(&t, P);
+    ge_p1p1_to_p3(&P2, &t);
+    for (i = 1; i < 8; ++i) {
+        ge_add(&t, &P2, &table[i - 1]);
+        ge_p1p1_to_p3(&u, &t);
+        ge_p3_to_cached(&table[i], &u);
+    }
+}
+
+/* y < 2^255 - 19 and no sign bit for x = 0 */
+static int ed25519_batch_canonical(const unsigned char *s, const ge_p3 *P) {
+    int i;
+
+    if (((s[31] & 0x7f) == 0x7f) && (s[0] >= 0xed)) {
+        for (i = 1; i < 31; ++i) {
+            if (s[i] != 0xff) {
+                break;
+            }
+        }
+        if (i == 31) {
+            return 0;
+        }
+    }
+    if ((s[31] & 0x80) && (!fe_isnonzero(P->X))) {
+        return 0;
+    }
+    return 1;
+}
+
+/* [L]P == 0, P has no small order component */
+static int ed25519_batch_torsion_free(const ge_p3 *P) {
+    static const unsigned char L[32] = {
+        0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+    };
+    static const unsigned char zero[32];
+    ge_p2 r;
+    fe check;
+
+    ge_double_scalarmult_vartime(&r, L, P, zero);
+    fe_sub(check, r.Y, r.Z);
+    return (!fe_isnonzero(r.X)) && (!fe_isnonzero(check));
+}
+
+/* r = b * B + sum(points) */
+static int ed25519_batch_is_neutral(const ed25519_batch_point *points, size_t count, const unsigned char *b) {
+    signed char bslide[256];
+    ge_p2 r;
+    ge_p1p1 t;
+    ge_p3 u;
+    fe check;
+    size_t j;
+    int i;
+    int top = -1;
+
+    slide(bslide, b);
+    for (i = 255; i >= 0; --i) {
+        if (bslide[i]) {
+            top = i;
+            break;
+        }
+    }
+    for (j = 0; j < count; ++j) {
+        for (i = 255; i > top; --i) {
+            if (points[j].slide[i]) {
+                top = i;
+                break;
+            }
+        }
+    }
+
+    ge_p2_0(&r);
+    for (i = top; i >= 0; --i) {
+        ge_p2_dbl(&t, &r);
+
+        for (j = 0; j < count; ++j) {
+            signed char s = points[j].slide[i];
+            if (s > 0) {
+                ge_p1p1_to_p3(&u, &t);
+                ge_add(&t, &u, &points[j].table[s / 2]);
+            } else if (s < 0) {
+                ge_p1p1_to_p3(&u, &t);
+                ge_sub(&t, &u, &points[j].table[(-s) / 2]);
+            }
+        }
+
+        if (bslide[i] > 0) {
+            ge_p1p1_to_p3(&u, &t);
+            ge_madd(&t, &u, &Bi[bslide[i] / 2]);
+        } else if (bslide[i] < 0) {
+            ge_p1p1_to_p3(&u, &t);
+            ge_msub(&t, &u, &Bi[(-bslide[i]) / 2]);
+        }
+
+        ge_p1p1_to_p2(&r, &t);
+    }
+
+    /* neutral element is (0 : Z : Z) */
+    fe_sub(check, r.Y, r.Z);
+    return (!fe_isnonzero(r.X)) && (!fe_isnonzero(check));
+}
+
+int ed25519_verify_batch(const unsigned char **signatures, const unsigned char **messages, const size_t *message_lens, const unsigned char **public_keys, size_t count, int *valid) {
+    ed25519_batch_point *points;
+    unsigned char *scalars;
+    size_t *batched;
+    size_t *item_key;
+    size_t *key_item;
+    unsigned char sum_s[32];
+    unsigned char transcript[64];
+    unsigned char hram[64];
+    unsigned char z[64];
+    unsigned char counter[4];
+    sha512_context hash;
+    sha512_context hash_item;
+    ge_p3 A;
+    ge_p3 R;
+    size_t batched_count = 0;
+    size_t keys = 0;
+    size_t i;
+    size_t j;
+    int all_valid = 1;
+
+    if (!count) {
+        return 1;
+    }
+
+    points = NULL;
+    scalars = NULL;
+    batched = NULL;
+    item_key = NULL;
+    key_item = NULL;
+    if (count > 1) {
+        /* R points first, then one point per distinct public key */
+        points = (ed25519_batch_point *)malloc(2 * count * sizeof(ed25519_batch_point));
+        scalars = (unsigned char *)malloc(2 * count * 32);
+        batched = (size_t *)malloc(count * sizeof(size_t));
+        item_key = (size_t *)malloc(count * sizeof(size_t));
+        key_item = (size_t *)malloc(count * sizeof(size_t));
+    }
+
+    if ((!points) || (!scalars) || (!batched) || (!item_key) || (!key_item)) {
+        free(points);
+        free(scalars);
+        free(batched);
+        free(item_key);
+        free(key_item);
+
+        for (i = 0; i < count; ++i) {
+            valid[i] = ed25519_verify(signatures[i], messages[i], message_lens[i], public_keys[i]);
+            all_valid &= valid[i];
+        }
+        return all_valid;
+    }
+
+    sha512_init(&hash);
+    for (i = 0; i < count; ++i) {
+        valid[i] = 0;
+
+        if (signatures[i][63] & 224) {
+            all_valid = 0;
+            continue;
+        }
+
+        /* both points are decoded negated */
+        if ((ge_frombytes_negate_vartime(&A, public_keys[i]) != 0) || (ge_frombytes_negate_vartime(&R, signatures[i]) != 0)) {
+            valid[i] = ed25519_verify(signatures[i], messages[i], message_lens[i], public_keys[i]);
+            all_valid &= valid[i];
+            continue;
+        }
+
+        /* ed25519_verify compares encodings, so R must be canonical */
+        if ((!ed25519_batch_canonical(signatures[i], &R)) || (!ed25519_batch_torsion_free(&R))) {
+            valid[i] = ed25519_verify(signatures[i], messages[i], message_lens[i], public_keys[i]);
+            all_valid &= valid[i];
+            continue;
+        }
+
+        for (j = 0; j < keys; ++j) {
+            if (!memcmp(public_keys[key_item[j]], public_keys[i], 32)) {
+                break;
+            }
+        }
+        if (j == keys) {
+            if (!ed25519_batch_torsion_free(&A)) {
+                valid[i] = ed25519_verify(signatures[i], messages[i], message_lens[i], public_keys[i]);
+                all_valid &= valid[i];
+                continue;
+            }
+            key_item[keys] = i;
+            ed25519_batch_table(points[count + keys].table, &A);
+            keys++;
+        }
+
+        sha512_init(&hash_item);
+        sha512_update(&hash_item, signatures[i], 32);
+        sha512_update(&hash_item, public_keys[i], 32);
+        sha512_update(&hash_item, messages[i], message_lens[i]);
+        sha512_final(&hash_item, hram);
+        sc_reduce(hram);
+        memcpy(scalars + batched_count * 32, hram, 32);
+
+        ed25519_batch_table(points[batched_count].table, &R);
+        item_key[batched_count] = j;
+        batched[batched_count++] = i;
+
+        sha512_update(&hash, signatures[i], 64);
+        sha512_update(&hash, public_keys[i], 32);
+        sha512_update(&hash, hram, 32);
+    }
+    sha512_final(&hash, transcript);
+
+    if (batched_count > 1) {
+        memset(sum_s, 0, 32);
+        memset(scalars + count * 32, 0, keys * 32);
+        for (i = 0; i < batched_count; ++i) {
+            counter[0] = (unsigned char)i;
+            counter[1] = (unsigned char)(i >> 8);
+            counter[2] = (unsigned char)(i >> 16);
+            counter[3] = (unsigned char)(i >> 24);
+            sha512_init(&hash);
+            sha512_update(&hash, transcript, 64);
+            sha512_update(&hash, counter, 4);
+            sha512_final(&hash, z);
+            memset(z + 16, 0, 16);
+            z[0] |= 1;
+
+            /* sum_s += z_i * S_i, key scalar += z_i * h_i */
+            sc_muladd(sum_s, z, signatures[batched[i]] + 32, sum_s);
+            sc_muladd(scalars + (count + item_key[i]) * 32, z, scalars + i * 32, scalars + (count + item_key[i]) * 32);
+            slide(points[i].slide, z);
+        }
+        for (j = 0; j < keys; ++j) {
+            slide(points[count + j].slide, scalars + (count + j) * 32);
+        }
+        if (batched_count < count) {
+            memmove(&points[batched_count], &points[count], keys * sizeof(ed25519_batch_point));
+        }
+
+        if (ed25519_batch_is_neutral(points, batched_count + keys, sum_s)) {
+            for (i = 0; i < batched_count; ++i) {
+                valid[batched[i]] = 1;
+            }
+            batched_count = 0;
+        }
+    }
+
+    /* single item or failed batch */
+    for (i = 0; i < batched_count; ++i) {
+        valid[batched[i]] = ed25519_verify(signatures[batched[i]], messages[batched[i]], message_lens[batched[i]], public_keys[batched[i]]);
+        all_valid &= valid[batched[i]];
+    }
+
+    free(points);
+    free(scalars);
+    free(batched);
+    free(item_key);
+    free(key_item);
+    return all_valid;
+}
+
 /* the K array */
 static const uint64_t K[80] = {
     UINT64_C(0x428a2f98d728ae22), UINT64_C(0x7137449123ef65cd), 
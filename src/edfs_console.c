@@ -260,8 +260,14 @@ int main(int argc, char *argv[]) {
                 } else
                 if (!strcmp(arg, "rebroadcast")) {
                     edfs_set_rebroadcast(edfs_context, 1);
+                } else
+                if (!strcmp(arg, "packstore")) {
+                    edfs_set_pack_store(edfs_context, 1);
+                } else
+                if (!strcmp(arg, "nowal")) {
+                    edfs_set_rebroadcast_wal(edfs_context, 0);
                 } else {
-                    fprintf(stderr, "EdFS 1.0BETA, unlicensed 2019 by Eduard Suica\nUsage: %s [-port port_number][-loglevel 0 - 5][-readonly][-newkey][-use host[:port]][-resync][-rebroadcast][-app|-debugapp] mount_point\n", argv[0]);
+                    fprintf(stderr, "EdFS 1.0BETA, unlicensed 2019 by Eduard Suica\nUsage: %s [-port port_number][-loglevel 0 - 5][-readonly][-newkey][-use host[:port]][-resync][-rebroadcast][-packstore][-nowal][-app|-debugapp] mount_point\n", argv[0]);
                     exit(-1);
                 }
             }
@@ -44,6 +44,15 @@
 #ifdef EDFS_EMULTATED_STORE
     #include "store.h"
 #endif
+#include "pack_store.h"
+#include "miner.h"
+#include "chunk_cache.h"
+#include "key_cache.h"
+#include "session_cache.h"
+#include "sig_batch.h"
+#include "fetch_scheduler.h"
+#include "writeback.h"
+#include "chunk_codec.h"
 #ifdef __APPLE__
     #include <CoreFoundation/CoreFoundation.h>
 #endif
@@ -52,6 +61,21 @@
 #define BLOCK_SIZE_MAX          BLOCK_SIZE + 0x3000
 #define EDFS_INO_CACHE_ADDR     20
 #define BLOCKCHAIN_COMPLEXITY   22
+#define EDFS_PACK_STORE_GARBAGE 50
+#define EDFS_HASH_TREE_MAGIC    0x45444832
+#define EDFS_HASH_TREE_HEADER_SIZE 56
+#define EDFS_HASH_TREE_LEAF_SIZE 64
+// received chunks for the same inode are written one at a time
+#define EDFS_INODE_LOCKS        64
+#define EDWORK_MESSAGE_SLOTS_BITS   6
+#define EDWORK_MESSAGE_SLOTS        (1 << EDWORK_MESSAGE_SLOTS_BITS)
+
+// requirements of each message type, descriptive only (message statistics); the checks
+// depend on the payload layout and are done by the handlers themselves
+#define EDWORK_MESSAGE_SIGNED           0x01
+#define EDWORK_MESSAGE_PROOF_OF_WORK    0x02
+#define EDWORK_MESSAGE_ENCRYPTED        0x04
+#define EDWORK_MESSAGE_ACK              0x08
 
 #define DEBUG
 
@@ -182,6 +206,35 @@ struct edfs_hash_buffer {
     int64_t chunk;
 };
 
+struct edfs_hash_tree {
+    uint64_t count;
+    uint64_t capacity;
+    uint32_t version;
+    uint32_t chain_version;
+    uint64_t chain_count;
+    unsigned char chain_hash[32];
+    unsigned char *leaves;
+    unsigned char *nodes;
+};
+
+#define EDFS_READAHEAD_RANDOM       0
+#define EDFS_READAHEAD_SEQUENTIAL   1
+#define EDFS_READAHEAD_STRIDED      2
+
+#define EDFS_READAHEAD_MAX_WINDOW   64
+#define EDFS_READAHEAD_MAX_STRIDE   16
+
+struct edfs_readahead {
+    int state;
+    int hits;
+    int window;
+    int64_t stride;
+    uint64_t last_chunk;
+    uint64_t accesses;
+    // next chunk to prefetch
+    uint64_t next;
+};
+
 struct filewritebuf {
     edfs_ino_t ino;
     unsigned char *p;
@@ -209,6 +262,17 @@ struct filewritebuf {
     struct edfs_key_data *key;
     int flags;
 
+    struct edfs_readahead readahead;
+
+    // file_size and hash_buffer, changed by the write-back workers
+    thread_mutex_t write_lock;
+
+    // pending write-back jobs, guarded by writeback_lock
+    thread_mutex_t writeback_lock;
+    thread_signal_t writeback_done;
+    int writeback_pending;
+    int writeback_error;
+
 #ifdef EDFS_USE_READ_QUEUE
     unsigned char proof_cache[512];
     int proof_size;
@@ -266,6 +330,23 @@ struct edfs_peer_discovery_data {
 };
 #endif
 
+struct edfs;
+
+typedef void (*edwork_message_handler)(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket);
+
+struct edwork_message_type {
+    const char *name;
+    edwork_message_handler handler;
+    int flags;
+};
+
+struct edwork_message_slot {
+    // packed 32-bit message type
+    uint32_t type;
+    const struct edwork_message_type *message;
+    thread_atomic_int_t received;
+};
+
 struct edfs {
     int read_only_fs;
     int ping_received;
@@ -286,13 +367,16 @@ struct edfs {
     thread_ptr_t network_thread;
 
     thread_mutex_t shard_lock;
+    thread_mutex_t inode_locks[EDFS_INODE_LOCKS];
+    struct edwork_message_slot messages[EDWORK_MESSAGE_SLOTS];
+    thread_atomic_int_t messages_unsupported;
     struct edwork_shard_io *shard_io;
     thread_ptr_t shard_thread;
 
     thread_mutex_t lock;
-#ifdef EDFS_MULTITHREADED
+    // taken even in single-threaded builds: the network thread, the dispatch workers and
+    // the fuse threads (-mt) all load keys lazily
     thread_mutex_t thread_lock;
-#endif
     int network_done;
     int mutex_initialized;
     struct doops_loop loop;
@@ -331,6 +415,17 @@ struct edfs {
     thread_ptr_t warmup_thread;
 #endif
     uint64_t use_key_id;
+    int pack_store;
+    int no_rebroadcast_wal;
+    struct chunk_cache *chunk_cache;
+    struct key_cache *key_cache;
+    struct session_cache *session_cache;
+    struct sig_batch *sig_batch;
+    struct fetch_scheduler *fetch_scheduler;
+    struct writeback *writeback;
+    int writeback_threads;
+    int dispatch_threads;
+    int chunk_codec;
 
 #ifdef WITH_SMARTCARD
     struct edwork_smartcard_context smartcard_context;
@@ -341,27 +436,26 @@ struct edfs {
 #endif
 };
 
-#ifdef EDFS_MULTITHREADED
-    #define EDFS_THREAD_LOCK(edfs_context)      if (edfs_context->mutex_initialized) thread_mutex_lock(&edfs_context->thread_lock);
-    #define EDFS_THREAD_UNLOCK(edfs_context)    if (edfs_context->mutex_initialized) thread_mutex_unlock(&edfs_context->thread_lock);
-#else
-    #define EDFS_THREAD_LOCK(edfs_context)
-    #define EDFS_THREAD_UNLOCK(edfs_context)
-#endif
+#define EDFS_THREAD_LOCK(edfs_context)      if (edfs_context->mutex_initialized) thread_mutex_lock(&edfs_context->thread_lock);
+#define EDFS_THREAD_UNLOCK(edfs_context)    if (edfs_context->mutex_initialized) thread_mutex_unlock(&edfs_context->thread_lock);
 
 
 int sign(struct edfs *edfs_context, struct edfs_key_data *key, const char *str, int len, unsigned char *hash, int *info_key_type);
 int edfs_flush_chunk(struct edfs *edfs_context, edfs_ino_t ino, struct filewritebuf *fi);
+static void edfs_writeback_wait(struct filewritebuf *fbuf);
+static int edfs_writeback_error(struct filewritebuf *fbuf, int set_err);
 unsigned int edwork_resync(struct edfs *edfs_context, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, int is_sctp, int is_listen_socket);
 unsigned int edwork_resync_desc(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, void *clientaddr, int clientaddrlen, int is_sctp, int is_listen_socket);
 unsigned int edwork_resync_dir_desc(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, void *clientaddr, int clientaddrlen, int is_sctp, int is_listen_socket);
 int edwork_encrypt(struct edfs *edfs_context, struct edfs_key_data *key, const unsigned char *buffer, int size, unsigned char *out, const unsigned char *dest_i_am, const unsigned char *src_i_am, const unsigned char *shared_secret);
 void edfs_block_save(struct edfs *edfs_context, struct edfs_key_data *key, struct block *chain);
+int edfs_chain_write(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t height, const unsigned char *record, int size, int verified);
+int edfs_chain_read(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t height, unsigned char *buffer, int size);
 void edfs_update_proof_inode(struct edfs_key_data *key, uint64_t ino);
 int edfs_lookup_blockchain(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t inode, uint64_t block_timestamp_limit, unsigned char *blockchainhash, uint64_t *generation, uint64_t *timestamp);
 size_t base64_encode_no_padding(const unsigned char *in, int in_size, unsigned char *out, int out_size);
 int edfs_update_hash(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, int64_t chunk, const unsigned char *buf, int size, struct edfs_hash_buffer *hash_buffer);
-int edfs_update_chain(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t ino, int64_t file_size, unsigned char *hash, uint64_t *hash_chunks);
+int edfs_update_chain(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t ino, int64_t file_size, unsigned char *hash, uint64_t *hash_chunks, const unsigned char *expected_hash);
 int edwork_load_key(struct edfs *edfs_context, const char *filename);
 void edfs_broadcast_top(struct edfs *edfs_context, struct edfs_key_data *key, void *use_clientaddr, int clientaddr_len);
 struct edfs_key_data *edfs_find_key(uint64_t keyid, void *userdata);
@@ -438,6 +532,19 @@ int edfs_proof_of_work(int bits, time_t timestamp, const unsigned char *resource
     if (proof_len >= max_proof_len - 10)
         return 0;
 
+#ifndef EDFS_HASHCASH_ASCII_STRING
+    uint64_t counter = 0;
+    unsigned char hash_buf[32];
+    if (!miner_search(proof_str, proof_len, NULL, 0, bits, NULL, &counter, hash_buf, NULL))
+        return 0;
+
+    if (proof_of_work)
+        memcpy(proof_of_work, hash_buf, 32);
+    uint64_t counter_be = htonll(counter);
+    memcpy(proof_str + proof_len, &counter_be, 8);
+    proof_str[proof_len + 8] = 0;
+    return proof_len + 8;
+#else
     uint64_t counter = 0;
     unsigned char *ptr = proof_str + proof_len;
 
@@ -489,6 +596,7 @@ int edfs_proof_of_work(int bits, time_t timestamp, const unsigned char *resource
             return 0;
     }
     return 0;
+#endif
 }
 
 int edfs_proof_of_work_verify(int bits, const unsigned char *proof_str, int proof_len, const unsigned char *verify_str, int verify_len, const unsigned char *prefix, int prefix_len) {
@@ -918,6 +1026,16 @@ uint64_t computeinode(struct edfs_key_data *key, uint64_t parent_inode, const ch
     return computeinode2(key, parent_inode, name, strlen(name));
 }
 
+uint64_t computeinode_cached(struct edfs_key_data *key, uint64_t parent_inode, const char *name, int name_len) {
+    uint64_t inode;
+    if (edfs_key_data_dentry_get(key, parent_inode, name, name_len, &inode))
+        return inode;
+
+    inode = computeinode2(key, parent_inode, name, name_len);
+    edfs_key_data_dentry_set(key, parent_inode, name, name_len, inode);
+    return inode;
+}
+
 const char *computename(uint64_t inode, char *out) {
     inode = htonll(inode);
 #ifdef EDFS_CASE_INSENSITIVE_ENCODING
@@ -1127,7 +1245,8 @@ int verify(struct edfs *edfs_context, struct edfs_key_data *key, const char *str
                 return 0;
             }
             key->pub_loaded = 1;
-            if (ed25519_verify(hash, (const unsigned char *)str, len, key->pubkey))
+            // concurrent verifications (dispatch workers) are checked in batches
+            if (sig_batch_verify(edfs_context ? edfs_context->sig_batch : NULL, hash, (const unsigned char *)str, len, key->pubkey))
                 return 1;
             log_error("verification failed for %i bytes", len);
             return 0;
@@ -1146,6 +1265,13 @@ void derive_storage_key(struct edfs *edfs_context, struct edfs_key_data *used_ke
         EDFS_THREAD_UNLOCK(edfs_context);
     }
 
+    // inode 0 keys do not depend on chunk
+    if (!inode)
+        chunk = 0;
+    int use_cache = ((edfs_context->key_cache) && (used_key->pub_loaded));
+    if ((use_cache) && (key_cache_get(edfs_context->key_cache, used_key->key_id_xxh64_be, inode, chunk, key, ivector)))
+        return;
+
     if (inode) {
         unsigned char hash[32];
         uint64_t inode_be = htonll(inode);
@@ -1155,10 +1281,13 @@ void derive_storage_key(struct edfs *edfs_context, struct edfs_key_data *used_ke
 
         hmac_sha256((const BYTE *)used_key->pubkey, used_key->pub_len, (const BYTE *)"EDFS STORAGEKEY:", 16, (const BYTE *)hash, 32, (BYTE *)key);
         hmac_sha256((const BYTE *)used_key->pubkey, used_key->pub_len, (const BYTE *)"EDFS STORAGE VECTOR:", 20, (const BYTE *)hash, 32, (BYTE *)ivector);
+        key_cache_wipe(hash, sizeof(hash));
     } else {
         hmac_sha256((const BYTE *)used_key->pubkey, used_key->pub_len, (const BYTE *)"EDFS STORAGEKEY:", 16, (const BYTE *)edfs_context->storekey, 32, (BYTE *)key);
         hmac_sha256((const BYTE *)used_key->pubkey, used_key->pub_len, (const BYTE *)"EDFS STORAGE VECTOR:", 20, (const BYTE *)edfs_context->storekey, 32, (BYTE *)ivector);
     }
+    if (use_cache)
+        key_cache_put(edfs_context->key_cache, used_key->key_id_xxh64_be, inode, chunk, key, ivector);
 }
 
 void derive_simple_key(struct edfs *edfs_context, unsigned char key[32], unsigned char ivector[32]) {
@@ -1321,7 +1450,7 @@ int store_read_compressed(struct edfs *edfs_context, struct edfs_key_data *key,
     int bytes_read = store_read_signature(edfs_context, key, compressed_buffer, BLOCK_SIZE_MAX, f, signature, signature_prefix);
     if (bytes_read > 0) {
         mz_ulong max_len = len;
-        if (uncompress(data, &max_len, compressed_buffer, bytes_read) == Z_OK)
+        if (!chunk_codec_decompress(data, &max_len, compressed_buffer, bytes_read))
             return max_len;
         errno = EIO;
         return -EIO;
@@ -1471,6 +1600,111 @@ ssize_t fread_block_with_key(struct edfs *edfs_context, struct edfs_key_data *ke
 }
 
 
+void edfs_crypt_with_key(struct edfs *edfs_context, struct edfs_key_data *used_key, uint64_t inode, int64_t chunk, const unsigned char *in, unsigned char *out, size_t size) {
+    struct chacha_ctx ctx;
+    unsigned char key[32];
+    unsigned char ivector[32];
+
+    derive_storage_key(edfs_context, used_key, inode, chunk, key, ivector);
+
+    chacha_keysetup(&ctx, key, 256);
+    chacha_ivsetup(&ctx, ivector, NULL);
+
+    chacha_encrypt_bytes(&ctx, in, out, size);
+}
+
+int edfs_pack_write(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *prefix, const unsigned char *data, int len, unsigned char *signature, int signature_size, unsigned char *compressed_buffer, mz_ulong *max_len) {
+    int offset = 0;
+    unsigned char *record = (unsigned char *)malloc(PACK_STORE_MAX_RECORD_SIZE);
+    if (!record)
+        return -ENOMEM;
+
+    if ((signature) && (signature_size > 0)) {
+        memcpy(record, signature, signature_size);
+        if (signature_size < 64)
+            memset(record + signature_size, 0, 64 - signature_size);
+        offset = 64;
+    } else
+    if (prefix) {
+        memcpy(record, prefix, 64);
+        offset = 64;
+    }
+
+    const unsigned char *payload = data;
+    int payload_len = len;
+    if ((compressed_buffer) && (max_len)) {
+        if (chunk_codec_compress(edfs_context->chunk_codec, compressed_buffer, max_len, data, len) < 0) {
+            free(record);
+            return -EIO;
+        }
+        payload = compressed_buffer;
+        payload_len = *max_len;
+    }
+    if ((payload_len < 0) || (payload_len > PACK_STORE_MAX_RECORD_SIZE - offset)) {
+        free(record);
+        return -EIO;
+    }
+
+    if ((edfs_context->has_storekey) && (payload_len > 0))
+        edfs_crypt_with_key(edfs_context, key, inode, chunk, payload, record + offset, payload_len);
+    else
+        memcpy(record + offset, payload, payload_len);
+
+    int err = pack_store_write(key->pack, inode, chunk, record, offset + payload_len, 0);
+    free(record);
+    if (err < 0)
+        return -EIO;
+
+    return len;
+}
+
+int edfs_pack_read_signature(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *record, int record_size, unsigned char *data, int len, unsigned char *signature, int signature_prefix) {
+    if (signature) {
+        if (record_size < 64) {
+            errno = EIO;
+            return -EIO;
+        }
+        memcpy(signature, record, 64);
+        record += 64;
+        record_size -= 64;
+        signature_prefix = 0;
+    }
+    if ((edfs_context->has_storekey) && (signature_prefix) && (len >= 64)) {
+        // same semantics as fread_with_key: raw signature prefix, then decrypted data
+        int prefix_size = (record_size < 64) ? record_size : 64;
+        memcpy(data, record, prefix_size);
+        if ((prefix_size != 64) || (len == 64))
+            return prefix_size;
+        data += 64;
+        record += 64;
+        record_size -= 64;
+        len -= 64;
+    }
+    if (len > record_size)
+        len = record_size;
+    if (len <= 0)
+        return 0;
+
+    if (edfs_context->has_storekey)
+        edfs_crypt_with_key(edfs_context, key, inode, chunk, record, data, len);
+    else
+        memcpy(data, record, len);
+    return len;
+}
+
+int edfs_pack_read_compressed(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *record, int record_size, unsigned char *data, int len, unsigned char *signature, int signature_prefix) {
+    unsigned char compressed_buffer[BLOCK_SIZE_MAX];
+    int bytes_read = edfs_pack_read_signature(edfs_context, key, inode, chunk, record, record_size, compressed_buffer, BLOCK_SIZE_MAX, signature, signature_prefix);
+    if (bytes_read > 0) {
+        mz_ulong max_len = len;
+        if (!chunk_codec_decompress(data, &max_len, compressed_buffer, bytes_read))
+            return max_len;
+        errno = EIO;
+        return -EIO;
+    }
+    return bytes_read;
+}
+
 int fwrite_signature(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *data, int len, FILE *f, unsigned char *signature, int signature_size) {
     if ((signature) && (signature_size > 0)) {
         // static => initialized with 0
@@ -1488,7 +1722,7 @@ int fwrite_signature(struct edfs *edfs_context, struct edfs_key_data *key, uint6
 }
 
 int fwrite_compressed(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *data, int len, FILE *f, unsigned char *signature, int signature_size, unsigned char *compressed_buffer, mz_ulong *max_len) {
-    if (compress(compressed_buffer, max_len, data, len) == Z_OK) {
+    if (chunk_codec_compress(edfs_context->chunk_codec, compressed_buffer, max_len, data, len) >= 0) {
         int written = fwrite_signature(edfs_context, key, inode, chunk, compressed_buffer, *max_len, f, signature, signature_size);
         if (written > 0)
             written = len;
@@ -1514,7 +1748,7 @@ int fread_compressed(struct edfs *edfs_context, struct edfs_key_data *key, uint6
     int bytes_read = fread_signature(edfs_context, key, inode, chunk, compressed_buffer, BLOCK_SIZE_MAX, f, signature, signature_prefix);
     if (bytes_read > 0) {
         mz_ulong max_len = len;
-        if (uncompress(data, &max_len, compressed_buffer, bytes_read) == Z_OK)
+        if (!chunk_codec_decompress(data, &max_len, compressed_buffer, bytes_read))
             return max_len;
         errno = EIO;
         return -EIO;
@@ -1522,7 +1756,7 @@ int fread_compressed(struct edfs *edfs_context, struct edfs_key_data *key, uint6
     return bytes_read;
 }
 
-int edfs_write_file(struct edfs *edfs_context, struct edfs_key_data *key, const char *base_path, const char *name, const unsigned char *data, int len, const char *suffix, int do_sign, unsigned char *compressed_buffer, mz_ulong *max_len, unsigned char signature[64], int *sig_size, int signature_prefix, uint64_t inode, int64_t chunk) {
+static int edfs_write_file_data(struct edfs *edfs_context, struct edfs_key_data *key, const char *base_path, const char *name, const unsigned char *data, int len, const char *suffix, int do_sign, unsigned char *compressed_buffer, mz_ulong *max_len, unsigned char signature[64], int *sig_size, int signature_prefix, uint64_t inode, int64_t chunk) {
     FILE *f;
     char fullpath[MAX_PATH_LEN];
     const char *fname;
@@ -1538,17 +1772,25 @@ int edfs_write_file(struct edfs *edfs_context, struct edfs_key_data *key, const
     } else
         fname = name;
 
-    f = fopen(fname, "wb");
-    if (!f)
-        return -errno;
+    // chunk data goes to the pack store, when enabled
+    int use_pack = ((inode) && (key) && (key->pack));
+    if (use_pack) {
+        f = NULL;
+    } else {
+        f = fopen(fname, "wb");
+        if (!f)
+            return -errno;
 
-    edfs_file_lock(edfs_context, f, 1);
+        edfs_file_lock(edfs_context, f, 1);
+    }
     int written_signature = 0;
     if (do_sign) {
         hash_size = sign(edfs_context, key, (const char *)data, len, hash, NULL);
         if (!hash_size) {
-            edfs_file_unlock(edfs_context, f);
-            fclose(f);
+            if (f) {
+                edfs_file_unlock(edfs_context, f);
+                fclose(f);
+            }
             return -EIO;
         }
         if (signature) {
@@ -1560,12 +1802,21 @@ int edfs_write_file(struct edfs *edfs_context, struct edfs_key_data *key, const
             *sig_size = hash_size;
     } else
     if ((signature_prefix) && (len >= 64) && (edfs_context->has_storekey)) {
+        if (use_pack) {
+            int written = edfs_pack_write(edfs_context, key, inode, chunk, data, data + 64, len - 64, NULL, 0, compressed_buffer, max_len);
+            if (written < 0)
+                return written;
+            return written + 64;
+        }
         // write signature
         written_signature = fwrite(data, 1, 64, f);
         data += 64;
         len -= 64;
     }
 
+    if (use_pack)
+        return edfs_pack_write(edfs_context, key, inode, chunk, NULL, data, len, hash, hash_size, compressed_buffer, max_len);
+
     int written;
     if ((compressed_buffer) && (max_len))
         written = fwrite_compressed(edfs_context, key, inode, chunk, data, len, f, hash, hash_size, compressed_buffer, max_len);
@@ -1583,6 +1834,17 @@ int edfs_write_file(struct edfs *edfs_context, struct edfs_key_data *key, const
     return written + written_signature;
 }
 
+int edfs_write_file(struct edfs *edfs_context, struct edfs_key_data *key, const char *base_path, const char *name, const unsigned char *data, int len, const char *suffix, int do_sign, unsigned char *compressed_buffer, mz_ulong *max_len, unsigned char signature[64], int *sig_size, int signature_prefix, uint64_t inode, int64_t chunk) {
+    if ((!inode) || (!key))
+        return edfs_write_file_data(edfs_context, key, base_path, name, data, len, suffix, do_sign, compressed_buffer, max_len, signature, sig_size, signature_prefix, inode, chunk);
+
+    // invalidated again after the write, a concurrent read may have cached the old chunk
+    chunk_cache_invalidate(edfs_context->chunk_cache, key->key_id_xxh64_be, inode, chunk);
+    int written = edfs_write_file_data(edfs_context, key, base_path, name, data, len, suffix, do_sign, compressed_buffer, max_len, signature, sig_size, signature_prefix, inode, chunk);
+    chunk_cache_invalidate(edfs_context->chunk_cache, key->key_id_xxh64_be, inode, chunk);
+    return written;
+}
+
 int edfs_scheduled_event(struct doops_loop *loop) {
     struct edfs_event *updated_event = (struct edfs_event *)loop_event_data(loop);
     if (!updated_event)
@@ -1688,6 +1950,16 @@ int edfs_unlink_file(struct edfs *edfs_context, const char *base_path, const cha
     return unlink(fname);
 }
 
+int edfs_unlink_chunk(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, const char *path, const char *name, uint64_t chunk) {
+    int err;
+    if (key->pack)
+        err = pack_store_unlink(key->pack, inode, chunk);
+    else
+        err = edfs_unlink_file(edfs_context, path, name);
+    chunk_cache_invalidate(edfs_context->chunk_cache, key->key_id_xxh64_be, inode, chunk);
+    return err;
+}
+
 int edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *key, const char *base_path, const char *name, unsigned char *data, int len, const char *suffix, int as_text_file, int check_signature, int compression, int *filesize, uint32_t signature_hash, int signature_prefix, uint64_t inode, int64_t chunk) {
     FILE *f;
     char fullpath[MAX_PATH_LEN];
@@ -1709,16 +1981,38 @@ int edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *key, const c
     } else
         fname = name;
 
-    f = fopen(fname, "rb");
-    if (!f)
-        return -errno;
+    unsigned char *record = NULL;
+    int record_size = 0;
+    if ((inode) && (key) && (key->pack)) {
+        f = NULL;
+        record = (unsigned char *)malloc(PACK_STORE_MAX_RECORD_SIZE);
+        if (!record)
+            return -ENOMEM;
+        record_size = pack_store_read(key->pack, inode, chunk, record, PACK_STORE_MAX_RECORD_SIZE);
+        if (record_size < 0) {
+            int err = -errno;
+            free(record);
+            return err;
+        }
+    } else {
+        f = fopen(fname, "rb");
+        if (!f)
+            return -errno;
+
+        edfs_file_lock(edfs_context, f, 0);
+    }
 
     if (as_text_file)
         len--;
 
-    edfs_file_lock(edfs_context, f, 0);
     int bytes_read;
     if ((compression) || ((check_signature) && ((len < BLOCK_SIZE) && (len > 0)))) {
+        if (record) {
+            if (compression)
+                sig_bytes_read = edfs_pack_read_compressed(edfs_context, key, inode, chunk, record, record_size, sig_buf, BLOCK_SIZE_MAX, check_signature ? hash : NULL, signature_prefix);
+            else
+                sig_bytes_read = edfs_pack_read_signature(edfs_context, key, inode, chunk, record, record_size, sig_buf, BLOCK_SIZE_MAX, check_signature ? hash : NULL, signature_prefix);
+        } else
         if (compression) {
             sig_bytes_read = fread_compressed(edfs_context, key, inode, chunk, sig_buf, BLOCK_SIZE_MAX, f, check_signature ? hash : NULL, signature_prefix);
         } else {
@@ -1732,18 +2026,27 @@ int edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *key, const c
             memcpy(data, sig_buf, bytes_read);
         }
     } else {
-        bytes_read = fread_signature(edfs_context, key, inode, chunk, data, len, f, check_signature ? hash : NULL, signature_prefix);
+        if (record)
+            bytes_read = edfs_pack_read_signature(edfs_context, key, inode, chunk, record, record_size, data, len, check_signature ? hash : NULL, signature_prefix);
+        else
+            bytes_read = fread_signature(edfs_context, key, inode, chunk, data, len, f, check_signature ? hash : NULL, signature_prefix);
         sig_ptr = data;
         sig_bytes_read = bytes_read;
     }
     if ((bytes_read < 0) || (sig_bytes_read < 0)) {
         int err = -errno;
+        if (f) {
+            edfs_file_unlock(edfs_context, f);
+            fclose(f);
+        }
+        free(record);
+        return err;
+    }
+    if (f) {
         edfs_file_unlock(edfs_context, f);
         fclose(f);
-        return err;
     }
-    edfs_file_unlock(edfs_context, f);
-    fclose(f);
+    free(record);
     if (as_text_file)
         data[bytes_read] = 0;
     if (check_signature) {
@@ -1930,6 +2233,7 @@ void write_json(struct edfs *edfs_context, struct edfs_key_data *key, const char
     int string_len = strlen(serialized_string);
     unsigned char signature[64];
     edfs_write_file(edfs_context, key, base_path, b64name, (const unsigned char *)serialized_string, string_len, ".json", 1, NULL, NULL, signature, NULL, 0, 0, 0);
+    edfs_key_data_descriptor_invalidate(key, inode);
 
     // do not broadcast root object
     if ((parent != 0) && (key)) {
@@ -1974,7 +2278,9 @@ int write_json2(struct edfs *edfs_context, struct edfs_key_data *key, const char
 
     int string_len = strlen(serialized_string);
     unsigned char signature[64];
-    if (edfs_write_file(edfs_context, key, key->working_directory, b64name, (const unsigned char *)serialized_string, string_len , ".json", 1, NULL, NULL, signature, NULL, 0, 0, 0) == string_len) {
+    int err = edfs_write_file(edfs_context, key, key->working_directory, b64name, (const unsigned char *)serialized_string, string_len , ".json", 1, NULL, NULL, signature, NULL, 0, 0, 0);
+    edfs_key_data_descriptor_invalidate(key, inode);
+    if (err == string_len) {
         written = string_len;
 
         JSON_Object *root_object = json_value_get_object(root_value);
@@ -2141,40 +2447,97 @@ uint64_t edfs_root_inode(struct edfs_key_data *key) {
     return root;
 }
 
+static void edfs_descriptor_from_json(JSON_Object *root_object, uint64_t inode, struct edfs_descriptor *desc) {
+    memset(desc, 0, sizeof(struct edfs_descriptor));
+
+    desc->inode = inode;
+    desc->generation = (uint64_t)json_object_get_number(root_object, "version");
+    desc->type = (int)json_object_get_number(root_object, "type");
+    if ((int)json_object_get_number(root_object, "deleted")) {
+        // ignore type for deleted objects
+        desc->type = 0;
+    }
+    desc->parent = unpacked_ino(json_object_get_string(root_object, "parent"));
+
+    const char *name = json_object_get_string(root_object, "name");
+    if (name) {
+        int name_len = strlen(name);
+        if (name_len > sizeof(desc->name) - 1)
+            name_len = sizeof(desc->name) - 1;
+        memcpy(desc->name, name, name_len);
+        desc->name[name_len] = 0;
+    }
+
+    desc->size = (int64_t)json_object_get_number(root_object, "size");
+    desc->timestamp = (uint64_t)json_object_get_number(root_object, "timestamp");
+    desc->created = (time_t)json_object_get_number(root_object, "created");
+    desc->modified = (time_t)json_object_get_number(root_object, "modified");
+
+    const char *iohash_mime = json_object_get_string(root_object, "iostamp");
+    if (iohash_mime) {
+        int len = base64_decode_no_padding((const BYTE *)iohash_mime, (BYTE *)desc->iohash, 32);
+        if (len <= 0)
+            memset(desc->iohash, 0, 32);
+    }
+
+    JSON_Array *signatures = json_object_get_array(root_object, "signatures");
+    if ((signatures) && (json_array_get_count(signatures) > 0))
+        desc->has_signature = 1;
+}
+
 int read_file_json(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, uint64_t *parent, int64_t *size, uint64_t *timestamp, edfs_add_directory add_directory, struct dirbuf *b, char *namebuf, int len_namebuf, time_t *created, time_t *modified, uint64_t *generation, unsigned char *iohash, int *has_signature) {
-    JSON_Value *root_value = read_json(edfs_context, key, key->working_directory, inode);
-    if (!root_value) {
-        if (inode == edfs_root_inode(key)) {
-            // first time root
-            char fullpath[MAX_PATH_LEN];
-            char b64name[MAX_B64_HASH_LEN];
-            // EDFS_MKDIR(adjustpath(edfs_context, fullpath, computename(1, b64name)), 0755);
-            write_json(edfs_context, key, key->working_directory, ".", 0, inode, 0, S_IFDIR | 0755, NULL, 0, 0, 0, 0);
-            root_value = read_json(edfs_context, key, key->working_directory, inode);
-        }
-        if (!root_value) {
-            log_trace("invalid JSON file");
+    struct edfs_descriptor desc;
+    JSON_Value *root_value = NULL;
+    const char *name;
+
+    if (edfs_key_data_descriptor_get(key, inode, &desc)) {
+        if (desc.missing)
             return 0;
+        name = desc.name;
+    } else {
+        uint64_t epoch = edfs_key_data_descriptor_epoch(key);
+        root_value = read_json(edfs_context, key, key->working_directory, inode);
+        if (!root_value) {
+            uint64_t root_inode = edfs_root_inode(key);
+            if (inode == root_inode) {
+                // first time root
+                char fullpath[MAX_PATH_LEN];
+                char b64name[MAX_B64_HASH_LEN];
+                // EDFS_MKDIR(adjustpath(edfs_context, fullpath, computename(1, b64name)), 0755);
+                write_json(edfs_context, key, key->working_directory, ".", 0, inode, 0, S_IFDIR | 0755, NULL, 0, 0, 0, 0);
+                epoch = edfs_key_data_descriptor_epoch(key);
+                root_value = read_json(edfs_context, key, key->working_directory, inode);
+            }
+            if (!root_value) {
+                if (inode != root_inode) {
+                    // negative entry, dropped when the descriptor is written
+                    memset(&desc, 0, sizeof(struct edfs_descriptor));
+                    desc.inode = inode;
+                    desc.missing = 1;
+                    edfs_key_data_descriptor_set(key, &desc, epoch);
+                }
+                log_trace("invalid JSON file");
+                return 0;
+            }
         }
+        JSON_Object *root_object = json_value_get_object(root_value);
+        edfs_descriptor_from_json(root_object, inode, &desc);
+
+        name = json_object_get_string(root_object, "name");
+        // names that do not fit the cache entry are always read from disk
+        if ((!name) || (strlen(name) < sizeof(desc.name)))
+            edfs_key_data_descriptor_set(key, &desc, epoch);
     }
-    JSON_Object *root_object = json_value_get_object(root_value);
 
-    if (generation)
-        *generation = (uint64_t)json_object_get_number(root_object, "version");
+    int type = desc.type;
 
-    int type = (int)json_object_get_number(root_object, "type");
-    if ((int)json_object_get_number(root_object, "deleted")) {
-        // ignore type for deleted objects
-        type = 0;
-    }
+    if (generation)
+        *generation = desc.generation;
 
-    if (parent) {
-        const char *parent_str = json_object_get_string(root_object, "parent");
-        *parent = unpacked_ino(parent_str);
-    }
+    if (parent)
+        *parent = desc.parent;
 
     if ((add_directory) || ((namebuf) && (len_namebuf > 0))) {
-        const char *name = json_object_get_string(root_object, "name");
         if ((name) && (name[0])) {
             // ignore deleted objects
             if ((add_directory) && (type)) {
@@ -2182,7 +2545,7 @@ int read_file_json(struct edfs *edfs_context, struct edfs_key_data *key, uint64_
 #ifndef EDFS_NO_JS
                     if (edfs_key_js_call_args(key, "edwork.events.onreaddir", "s__", name, inode, parent ? *parent : (uint64_t)0) != 1)
 #endif
-                    b->size += add_directory(name, inode, type, (int64_t)json_object_get_number(root_object, "size"), (time_t)json_object_get_number(root_object, "created"), (time_t)json_object_get_number(root_object, "modified"), (time_t)(json_object_get_number(root_object, "timestamp") / 1000000), b->userdata);
+                    b->size += add_directory(name, inode, type, desc.size, desc.created, desc.modified, (time_t)(desc.timestamp / 1000000), b->userdata);
                 }
             }
             if ((namebuf) && (len_namebuf)) {
@@ -2194,37 +2557,22 @@ int read_file_json(struct edfs *edfs_context, struct edfs_key_data *key, uint64_
             }
         }
     }
-    if (has_signature)
-        *has_signature = 0;
 
     if (size)
-        *size = (int64_t)json_object_get_number(root_object, "size");
+        *size = desc.size;
     if (timestamp)
-        *timestamp = (uint64_t)json_object_get_number(root_object, "timestamp");
+        *timestamp = desc.timestamp;
     if (created)
-        *created = (time_t)json_object_get_number(root_object, "created");
+        *created = desc.created;
     if (modified)
-        *modified = (time_t)json_object_get_number(root_object, "modified");
-
-    if (iohash) {
-        const char *iohash_mime = json_object_get_string(root_object, "iostamp");
-        if (iohash_mime) {
-            int mime_len = strlen(iohash_mime);
-            if (mime_len > 43)
-                mime_len = 43;
-            int len = base64_decode_no_padding((const BYTE *)iohash_mime, (BYTE *)iohash, 32);
-            if (len <= 0)
-                memset(iohash, 0, 32);
-        } else
-            memset(iohash, 0, 32);
-    }
-    if (has_signature) {
-        JSON_Array *signatures = json_object_get_array(root_object, "signatures");
-        if ((signatures) && (json_array_get_count(signatures) > 0))
-            *has_signature = 1;
-    }
+        *modified = desc.modified;
+    if (iohash)
+        memcpy(iohash, desc.iohash, 32);
+    if (has_signature)
+        *has_signature = desc.has_signature;
 
-    json_value_free(root_value);
+    if (root_value)
+        json_value_free(root_value);
     return type;
 }
 
@@ -2325,6 +2673,7 @@ void truncate_inode(struct edfs *edfs_context, struct edfs_key_data *key, const
     int64_t start_offset = new_size / BLOCK_SIZE;
     int64_t end_offset = old_size / BLOCK_SIZE;
     char blockname[MAX_PATH_LEN];
+    chunk_cache_invalidate(edfs_context->chunk_cache, key->key_id_xxh64_be, unpacked_ino(b64name), -1);
     if ((!USE_COMPRESSION) && (new_size % BLOCK_SIZE)) {
         snprintf(blockname, MAX_PATH_LEN, "%s/%s/%" PRIu64, key->working_directory, b64name, (uint64_t)start_offset);
         log_info("truncating block %s", blockname);
@@ -2332,6 +2681,14 @@ void truncate_inode(struct edfs *edfs_context, struct edfs_key_data *key, const
             log_error("error truncating block %s", blockname);
         start_offset++;
     }
+    if (key->pack) {
+        uint64_t inode = unpacked_ino(b64name);
+        while (start_offset <= end_offset) {
+            pack_store_unlink(key->pack, inode, start_offset);
+            start_offset++;
+        }
+        return;
+    }
     while (start_offset <= end_offset) {
         snprintf(blockname, MAX_PATH_LEN, "%s/%s/%" PRIu64, key->working_directory, b64name, (uint64_t)start_offset);
         log_info("dropping block %s", blockname);
@@ -2602,7 +2959,7 @@ edfs_ino_t edfs_lookup(struct edfs *edfs_context, edfs_ino_t parent, const char
     if (!key)
         return 0;
 
-    uint64_t inode = computeinode(key, parent, name);
+    uint64_t inode = computeinode_cached(key, parent, name, strlen(name));
     int type = read_file_json(edfs_context, key, inode, NULL, &size, &timestamp, NULL, NULL, NULL, 0, &created, &modified, NULL, NULL, NULL);
     if (!type)
         return 0;
@@ -2676,16 +3033,25 @@ int edfs_reply_chunk(struct edfs *edfs_context, struct edfs_key_data *key, edfs_
     char fullpath[MAX_PATH_LEN];
     char name[MAX_PATH_LEN];
 
-    snprintf(name, MAX_PATH_LEN, "%s/%" PRIu64, adjustpath(key, fullpath, computename(ino, b64name)), (uint64_t)chunk);
+    int err;
+    if (key->pack) {
+        err = pack_store_read(key->pack, ino, chunk, buf, size);
+        if (err < 0)
+            return -errno;
+        if ((edfs_context->has_storekey) && (err > 64))
+            edfs_crypt_with_key(edfs_context, key, ino, chunk, buf + 64, buf + 64, err - 64);
+    } else {
+        snprintf(name, MAX_PATH_LEN, "%s/%" PRIu64, adjustpath(key, fullpath, computename(ino, b64name)), (uint64_t)chunk);
 
-    FILE *f = fopen(name, "rb");
-    if (!f)
-        return -errno;
+        FILE *f = fopen(name, "rb");
+        if (!f)
+            return -errno;
 
-    edfs_file_lock(edfs_context, f, 0);
-    int err = fread_block_with_key(edfs_context, key, ino, chunk, buf, 1, size, f);
-    edfs_file_unlock(edfs_context, f);
-    fclose(f);
+        edfs_file_lock(edfs_context, f, 0);
+        err = fread_block_with_key(edfs_context, key, ino, chunk, buf, 1, size, f);
+        edfs_file_unlock(edfs_context, f);
+        fclose(f);
+    }
 
     if (chunk_hash) {
         if ((err > 0) && (err < 64))
@@ -2730,7 +3096,7 @@ int edfs_reply_hash(struct edfs *edfs_context, struct edfs_key_data *key, edfs_i
             err = 0;
         }
 
-        if ((!edfs_update_chain(edfs_context, key, ino, file_size, computed_hash, NULL)) || (memcmp(computed_hash, hash, 32))) {
+        if ((!edfs_update_chain(edfs_context, key, ino, file_size, computed_hash, NULL, hash)) || (memcmp(computed_hash, hash, 32))) {
             log_warn("computed hash differs from descriptor hash");
             err = 0;
         }
@@ -2738,7 +3104,10 @@ int edfs_reply_hash(struct edfs *edfs_context, struct edfs_key_data *key, edfs_i
     return err;
 }
 
-int chunk_exists(const char *path, uint64_t chunk) {
+int chunk_exists(struct edfs_key_data *key, uint64_t inode, const char *path, uint64_t chunk) {
+    if ((key) && (key->pack))
+        return pack_store_exists(key->pack, inode, chunk);
+
     char name[MAX_PATH_LEN];
     name[0] = 0;
 #ifdef EDFS_EMULATED_STORE
@@ -2753,6 +3122,9 @@ int chunk_exists(const char *path, uint64_t chunk) {
 }
 
 int chunk_exists2(struct edfs_key_data *key, uint64_t inode, uint64_t chunk) {
+    if (key->pack)
+        return pack_store_exists(key->pack, inode, chunk);
+
     char fullpath[MAX_PATH_LEN];
     char b64name[MAX_B64_HASH_LEN];
 #ifdef EDFS_EMULATED_STORE
@@ -2766,6 +3138,26 @@ int chunk_exists2(struct edfs_key_data *key, uint64_t inode, uint64_t chunk) {
 #endif
 }
 
+// waits for a chunk to be written by edfs_write_block, up to timeout microseconds
+int edfs_wait_chunk(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, uint64_t ino, uint64_t chunk, uint64_t timeout) {
+    struct edfs_chunk_waiter waiter;
+    edfs_key_data_chunk_waiter_add(key, &waiter, ino, chunk);
+
+    uint64_t start = microseconds();
+    int exists = chunk_exists(key, ino, path, chunk);
+    while ((!exists) && (!edfs_context->network_done)) {
+        uint64_t delta = microseconds() - start;
+        if (delta >= timeout)
+            break;
+        int timeout_ms = (int)((timeout - delta + 999) / 1000);
+        thread_signal_wait(&waiter.signal, timeout_ms);
+        exists = chunk_exists(key, ino, path, chunk);
+    }
+
+    edfs_key_data_chunk_waiter_remove(key, &waiter);
+    return exists;
+}
+
 int request_data(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t ino, uint64_t chunk, int encrypted, int use_cached_addr, unsigned char *proof_cache, int *proof_size, uint32_t chunk_hash) {
     unsigned char additional_data[20];
     *(uint64_t *)additional_data = htonll(ino);
@@ -2788,10 +3180,21 @@ int request_data(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_
         if ((avl_cache) && (avl_cache->len >= 1)) {
             if ((avl_cache->len >= 2) || (edwork_random() % 20 != 0)) {
                 unsigned int to_client;
-                if (use_cached_addr > 1)
+                if (use_cached_addr > 1) {
                     to_client = use_cached_addr - 2;
-                else
-                    to_client = (unsigned int)edwork_random();
+                } else {
+                    // forward chunk requests carry no proof cache and may be postponed
+                    int selected = fetch_scheduler_select(edfs_context->fetch_scheduler, key->key_id_xxh64_be, ino, chunk, avl_cache->clientaddr, avl_cache->len, sizeof(struct sockaddr_in), avl_cache->clientaddr_size, proof_cache != NULL, microseconds());
+                    if ((selected == FETCH_IN_FLIGHT) || (selected == FETCH_BUSY)) {
+                        if (edfs_context->mutex_initialized)
+                            thread_mutex_unlock(&key->ino_cache_lock);
+                        return is_sctp;
+                    }
+                    if (selected >= 0)
+                        to_client = (unsigned int)selected;
+                    else
+                        to_client = (unsigned int)edwork_random();
+                }
 
                 memcpy(&addrbuffer, &avl_cache->clientaddr[to_client % avl_cache->len], avl_cache->clientaddr_size);
                 use_clientaddr = &addrbuffer;
@@ -2818,7 +3221,7 @@ int request_data(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_
     return is_sctp;
 }
 
-int request_data_sctp(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t ino, uint64_t chunk, int use_cached_addr, unsigned char *proof_cache, int *proof_size, uint32_t chunk_hash, const char *path, int timeout, int *proof_type) {
+int request_data_sctp(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t ino, uint64_t chunk, int use_cached_addr, unsigned char *proof_cache, int *proof_size, uint32_t chunk_hash, const char *path, int timeout, int *proof_type, struct edfs_readahead *readahead) {
 #ifdef WITH_SCTP
     unsigned char additional_data[62];
 #else
@@ -2843,7 +3246,14 @@ int request_data_sctp(struct edfs *edfs_context, struct edfs_key_data *key, edfs
     if ((avl_cache) && (avl_cache->len >= 1)) {
         if (use_cached_addr) {
             if ((avl_cache->len >= 2) || (edwork_random() % 20 != 0)) {
-                memcpy(&addrbuffer, &avl_cache->clientaddr[edwork_random() % avl_cache->len], avl_cache->clientaddr_size);
+                int selected = fetch_scheduler_select(edfs_context->fetch_scheduler, key->key_id_xxh64_be, ino, chunk, avl_cache->clientaddr, avl_cache->len, sizeof(struct sockaddr_in), avl_cache->clientaddr_size, 1, microseconds());
+                if (selected == FETCH_IN_FLIGHT) {
+                    if (edfs_context->mutex_initialized)
+                        thread_mutex_unlock(&key->ino_cache_lock);
+                    return is_sctp;
+                }
+                unsigned int to_client = (selected >= 0) ? (unsigned int)selected : (unsigned int)edwork_random();
+                memcpy(&addrbuffer, &avl_cache->clientaddr[to_client % avl_cache->len], avl_cache->clientaddr_size);
                 use_clientaddr = &addrbuffer;
                 clientaddr_size = avl_cache->clientaddr_size;
 #ifdef WITH_SCTP
@@ -2860,23 +3270,37 @@ int request_data_sctp(struct edfs *edfs_context, struct edfs_key_data *key, edfs
     if ((is_sctp) && (use_clientaddr) && (clientaddr_size)) {
         // up to 5 forward chunks
         int forward_chunks = 5;
+        int64_t forward_step = 10;
+        uint64_t forward_chunk_index = chunk + 10;
+        if (readahead) {
+            // ask for the chunks after the readahead window, using the detected stride
+            if (readahead->state == EDFS_READAHEAD_RANDOM) {
+                forward_chunks = 0;
+            } else {
+                if (forward_chunks > readahead->window)
+                    forward_chunks = readahead->window;
+                forward_step = readahead->stride;
+                forward_chunk_index = chunk + forward_step;
+                if (readahead->next > forward_chunk_index)
+                    forward_chunk_index = readahead->next;
+            }
+        }
         *(uint16_t *)(additional_data + 20) = htons(forward_chunks);
         int i = 0;
-        int forward_chunk_index = chunk + 10;
         int loop_count = 0;
 
         for (i = 0; i < forward_chunks; i++) {
-            int exists = chunk_exists(path, forward_chunk_index);
+            int exists = chunk_exists(key, ino, path, forward_chunk_index);
             while (exists) {
                 loop_count ++;
                 if (loop_count > 50)
                     goto loop_out;
-                forward_chunk_index += 10;
-                exists = chunk_exists(path, forward_chunk_index);
+                forward_chunk_index += forward_step;
+                exists = chunk_exists(key, ino, path, forward_chunk_index);
             }
             *(uint64_t *)(additional_data + 22 + i * sizeof(uint64_t)) = htonll(forward_chunk_index);
             if ((!exists) && (loop_count <= 50))
-                forward_chunk_index += 10;
+                forward_chunk_index += forward_step;
         }
 loop_out:
         if ((proof_type) && (*proof_type != 2)) {
@@ -2886,15 +3310,16 @@ loop_out:
         }
         edfs_notify_io(edfs_context, key, "wan5", additional_data, 22 + i * sizeof(uint64_t), edfs_context->key.pk, 32, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, use_clientaddr, clientaddr_size, proof_cache, proof_size);
         uint64_t start = microseconds();
-        uint64_t last_sent = start;
         thread_set_high_priority();
-        while ((!chunk_exists(path, chunk)) && (microseconds() - start < timeout)) {
-            usleep(1000);
-            if (microseconds() - last_sent >= 200000) {
-                edfs_notify_io(edfs_context, key, "wan5", additional_data, 22 + i * sizeof(uint64_t), edfs_context->key.pk, 32, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, use_clientaddr, clientaddr_size, proof_cache, proof_size);
-                last_sent = microseconds();
-            }
-            thread_yield();
+        while (microseconds() - start < timeout) {
+            uint64_t wait_time = timeout - (microseconds() - start);
+            if (wait_time > 200000)
+                wait_time = 200000;
+            if (edfs_wait_chunk(edfs_context, key, path, ino, chunk, wait_time))
+                break;
+            if (microseconds() - start >= timeout)
+                break;
+            edfs_notify_io(edfs_context, key, "wan5", additional_data, 22 + i * sizeof(uint64_t), edfs_context->key.pk, 32, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, use_clientaddr, clientaddr_size, proof_cache, proof_size);
         }
     } else {
         if ((proof_type) && (*proof_type != 1)) {
@@ -2912,6 +3337,8 @@ loop_out:
 
 void edfs_make_key(struct edfs *edfs_context) {
     unsigned char random_bytes[32];
+    // sessions negotiated with the key being dropped are no longer usable
+    session_cache_invalidate(edfs_context->session_cache, edfs_context->previous_key.secret);
     memcpy(&edfs_context->previous_key, &edfs_context->key, sizeof(struct edfs_x25519_key));
     edwork_random_bytes(random_bytes, 32);
     sha256(random_bytes, 32, edfs_context->key.secret);
@@ -2923,6 +3350,18 @@ void edfs_make_key(struct edfs *edfs_context) {
     curve25519(edfs_context->key.pk, edfs_context->key.secret, NULL);
 }
 
+// curve25519 shared secret with the given peer, negotiated once per (local key, peer key) pair
+static void edfs_shared_secret(struct edfs *edfs_context, const struct edfs_x25519_key *local_key, const unsigned char *peer_pk, unsigned char *shared_secret) {
+    unsigned char secret[32];
+    // local copy, the key may be rotated by another thread
+    memcpy(secret, local_key->secret, 32);
+    if (!session_cache_get(edfs_context->session_cache, secret, peer_pk, shared_secret)) {
+        curve25519(shared_secret, secret, peer_pk);
+        session_cache_put(edfs_context->session_cache, secret, peer_pk, shared_secret);
+    }
+    key_cache_wipe(secret, sizeof(secret));
+}
+
 int edfs_file_exists(const char *name) {
     struct stat statbuf;
     return (stat(name, &statbuf) == 0);
@@ -2999,7 +3438,7 @@ int edfs_data_request(struct edfs *edfs_context, uint64_t inode, uint64_t not_us
 
     adjustpath(filebuf->key, fullpath, computename(filebuf->ino, b64name));
 
-    if (chunk_exists(fullpath, filebuf->requested_chunk)) {
+    if (chunk_exists(filebuf->key, filebuf->ino, fullpath, filebuf->requested_chunk)) {
         filebuf->proof_size = 0;
         return 0;
     }
@@ -3018,30 +3457,124 @@ int edfs_data_request(struct edfs *edfs_context, uint64_t inode, uint64_t not_us
 }
 #endif
 
-int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, const char *name, unsigned char *buf, int size, edfs_ino_t ino, uint64_t chunk, struct filewritebuf *filebuf) {
-    int i = 0;
-    uint64_t start = microseconds();
-    uint64_t last_key_timestamp = start;
-    uint64_t forward_chunk = chunk + 10;
-    uint64_t last_file_chunk = filebuf->file_size / BLOCK_SIZE;
-    uint32_t sig_hash = 0;
-    int forward_chunks_requested = 0;
-    unsigned char proof_cache[1024];
-    int proof_size = 0;
+static void edfs_readahead_cancel(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t ino, struct edfs_readahead *readahead, uint64_t chunk) {
+    if (readahead->next <= readahead->last_chunk + 1)
+        return;
 
-    if (!filebuf->file_size)
-        return 0;
-    if ((filebuf->file_size % BLOCK_SIZE == 0) && (last_file_chunk))
-        last_file_chunk--;
+    // keep the request for the chunk being read
+    uint64_t last = readahead->next - 1;
+    if ((chunk > readahead->last_chunk) && (chunk <= last)) {
+        if (chunk > readahead->last_chunk + 1)
+            fetch_scheduler_cancel(edfs_context->fetch_scheduler, key->key_id_xxh64_be, ino, readahead->last_chunk + 1, chunk - 1);
+        if (chunk < last)
+            fetch_scheduler_cancel(edfs_context->fetch_scheduler, key->key_id_xxh64_be, ino, chunk + 1, last);
+    } else
+        fetch_scheduler_cancel(edfs_context->fetch_scheduler, key->key_id_xxh64_be, ino, readahead->last_chunk + 1, last);
+}
 
-    if (chunk > last_file_chunk)
+// detects sequential, strided or random access, called for every chunk read
+static void edfs_readahead_update(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t ino, struct filewritebuf *filebuf, uint64_t chunk) {
+    struct edfs_readahead *readahead = &filebuf->readahead;
+    if ((readahead->accesses) && (chunk == readahead->last_chunk))
+        return;
+
+    int64_t delta = (int64_t)(chunk - readahead->last_chunk);
+    if ((!readahead->accesses) && (!chunk)) {
+        // reading from the start of the file, assume a sequential read
+        readahead->state = EDFS_READAHEAD_SEQUENTIAL;
+        readahead->stride = 1;
+        readahead->hits = 1;
+        readahead->window = edfs_context->forward_chunks;
+        readahead->next = 1;
+    } else
+    if ((readahead->accesses) && (readahead->stride) && (delta == readahead->stride)) {
+        readahead->hits ++;
+        if ((readahead->state == EDFS_READAHEAD_RANDOM) && (readahead->hits >= 2)) {
+            readahead->state = (readahead->stride == 1) ? EDFS_READAHEAD_SEQUENTIAL : EDFS_READAHEAD_STRIDED;
+            readahead->window = edfs_context->forward_chunks;
+            readahead->next = chunk + readahead->stride;
+            log_trace("readahead: %s access detected (stride %i)", (readahead->stride == 1) ? "sequential" : "strided", (int)readahead->stride);
+        }
+    } else {
+        if (readahead->state != EDFS_READAHEAD_RANDOM) {
+            edfs_readahead_cancel(edfs_context, key, ino, readahead, chunk);
+            log_trace("readahead: access pattern broken at chunk %" PRIu64, chunk);
+        }
+        readahead->state = EDFS_READAHEAD_RANDOM;
+        readahead->window = 0;
+        readahead->hits = 1;
+        readahead->next = 0;
+        if ((readahead->accesses) && (delta > 0) && (delta <= EDFS_READAHEAD_MAX_STRIDE))
+            readahead->stride = delta;
+        else
+            readahead->stride = 0;
+    }
+    readahead->last_chunk = chunk;
+    readahead->accesses ++;
+}
+
+// keeps the prefetch window ahead of the reader, returns the number of requested chunks
+static int edfs_readahead_request(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, edfs_ino_t ino, struct filewritebuf *filebuf, uint64_t chunk, uint64_t last_file_chunk) {
+    struct edfs_readahead *readahead = &filebuf->readahead;
+    if ((readahead->state == EDFS_READAHEAD_RANDOM) || (readahead->window <= 0) || (readahead->stride <= 0))
         return 0;
 
-    // if ((filebuf->check_hash) && ((filebuf->flags & 3) == O_RDONLY) && (edfs_is_write(edfs_context, key, ino)))
-    //     filebuf->check_hash = 0;
+    uint64_t stride = (uint64_t)readahead->stride;
+    if (readahead->next < chunk + stride)
+        readahead->next = chunk + stride;
 
-    int may_notify_write_block = 0;
+    // top up only when less than half of the window is ahead of the reader
+    if (readahead->next > chunk + stride * (readahead->window / 2 + 1))
+        return 0;
+
+    // the reader caught up with the window, grow it
+    if (readahead->next > chunk + stride) {
+        readahead->window *= 2;
+        if (readahead->window > EDFS_READAHEAD_MAX_WINDOW)
+            readahead->window = EDFS_READAHEAD_MAX_WINDOW;
+    }
+
+    uint64_t limit = chunk + stride * readahead->window;
+    if (limit > last_file_chunk)
+        limit = last_file_chunk;
+
+    int requested = 0;
+    while (readahead->next <= limit) {
+        if (!chunk_exists(key, ino, path, readahead->next)) {
+            request_data(edfs_context, key, ino, readahead->next, 1, 1, NULL, NULL, 0);
+            requested ++;
+        }
+        readahead->next += stride;
+    }
+    return requested;
+}
+
+int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, const char *name, unsigned char *buf, int size, edfs_ino_t ino, uint64_t chunk, struct filewritebuf *filebuf, int64_t file_size) {
+    int i = 0;
+    uint64_t start = microseconds();
+    uint64_t last_key_timestamp = start;
+    uint64_t last_file_chunk = file_size / BLOCK_SIZE;
+    uint32_t sig_hash = 0;
+    unsigned char proof_cache[1024];
+    int proof_size = 0;
+
+    if (!file_size)
+        return 0;
+    if ((file_size % BLOCK_SIZE == 0) && (last_file_chunk))
+        last_file_chunk--;
+
+    if (chunk > last_file_chunk)
+        return 0;
+
+    edfs_readahead_update(edfs_context, key, ino, filebuf, chunk);
+
+    // if ((filebuf->check_hash) && ((filebuf->flags & 3) == O_RDONLY) && (edfs_is_write(edfs_context, key, ino)))
+    //     filebuf->check_hash = 0;
+
+    int may_notify_write_block = 0;
     if (filebuf->check_hash) {
+        // hash_buffer is changed by the write-back workers, the lock is not held while waiting for the network
+        thread_mutex_lock(&filebuf->write_lock);
         if ((filebuf->written_data) && (filebuf->hash_buffer) && (filebuf->hash_buffer->read_size)) {
             char b64name[MAX_B64_HASH_LEN];
             char fullpath[MAX_PATH_LEN];
@@ -3053,6 +3586,7 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
             filebuf->read_hash_cunk = 0;
             may_notify_write_block = 1;
         }
+        thread_mutex_unlock(&filebuf->write_lock);
         sig_hash = edfs_get_hash(edfs_context, key, path, ino, chunk, ((filebuf->flags & 3) == O_RDONLY) ? filebuf : NULL);
     }
     int use_addr_cache = 1;
@@ -3072,10 +3606,19 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
     }
     filebuf->requested_sig_hash = sig_hash;
 #endif
+    int use_chunk_cache = ((edfs_context->chunk_cache) && (filebuf) && (!filebuf->written_data));
+    if (use_chunk_cache) {
+        int read_size = chunk_cache_get(edfs_context->chunk_cache, key->key_id_xxh64_be, ino, chunk, sig_hash, buf, size);
+        if (read_size > 0) {
+            filebuf->last_read_chunk = chunk;
+            filebuf->last_read_size = read_size;
+            return read_size;
+        }
+    }
     do {
         int read_size = -1;
         // avoid I/O lock
-        if (chunk_exists(path, chunk)) {
+        if (chunk_exists(key, ino, path, chunk)) {
             int filesize;
             if (!filebuf->read_buffer)
                 filebuf->read_buffer = (unsigned char *)malloc(BLOCK_SIZE);
@@ -3117,7 +3660,7 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
 #ifdef EDFS_EMULTATED_STORE
                     store_unlink(path, chunk % STORE_CHUNKS_PER_FILE);
 #else
-                    edfs_unlink_file(edfs_context, path, name);
+                    edfs_unlink_chunk(edfs_context, key, ino, path, name, chunk);
 #endif
                 }
             }
@@ -3128,7 +3671,7 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
 #ifdef EDFS_EMULTATED_STORE
                     store_unlink(path, chunk % STORE_CHUNKS_PER_FILE);
 #else
-                    edfs_unlink_file(edfs_context, path, name);
+                    edfs_unlink_chunk(edfs_context, key, ino, path, name, chunk);
 #endif
                 }
                 read_size = -2;
@@ -3190,7 +3733,7 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
             }
             // end of file, no more queries
             // this is made to avoid an unnecessary edwork query
-            if ((filebuf) && (filebuf->file_size > 0)) {
+            if (file_size > 0) {
                 if (chunk > last_file_chunk) {
                     if (may_notify_write_block == 2)
                         edfs_notify_allow_write_block(edfs_context, key, ino, 0);
@@ -3204,7 +3747,7 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
             }
             uint64_t wait_count = (EDWORK_SCTP_TTL / 2) * 1000;
 #else
-            is_sctp = request_data_sctp(edfs_context, key, ino, chunk, use_addr_cache, proof_cache, &proof_size, sig_hash, path, EDWORK_SCTP_TTL / 2 * 1000, &proof_type);
+            is_sctp = request_data_sctp(edfs_context, key, ino, chunk, use_addr_cache, proof_cache, &proof_size, sig_hash, path, EDWORK_SCTP_TTL / 2 * 1000, &proof_type, &filebuf->readahead);
             if (is_sctp)
                 do_forward = 0;
             log_trace("requesting chunk %s:%" PRIu64 " (sctp: %i)", path, chunk, is_sctp);
@@ -3214,49 +3757,26 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
             uint64_t wait_count = 50000;
 #endif
 #ifndef EDFS_NO_FORWARD_WAIT
-            if (do_forward) {
+            if ((do_forward) && (filebuf->readahead.state != EDFS_READAHEAD_RANDOM)) {
                 uint64_t start = microseconds();
-                if (forward_chunks_requested < edfs_context->forward_chunks) {
-                    while (chunk_exists(path, forward_chunk)) {
-                        forward_chunk ++;
-                        if (forward_chunk - chunk > 30) {
-                            do_forward = 0;
-                            forward_chunk = last_file_chunk + 1;
-                            break;
-                        }
-                    }
-                    if (forward_chunk <= last_file_chunk) {
-                        int i;
-                        // wait 10 ms before requesting another chunk
-                        int exists = 0;
-                        for (i = 0; i < 10; i++) {
-                            usleep(1000);
-                            exists = chunk_exists(path, chunk);
-                            if (exists)
-                                break;
-                        }
-                        if (!exists) {
-                            forward_chunks_requested ++;
-                            request_data(edfs_context, key, ino, forward_chunk ++, 1, 1, NULL, NULL, 0);
-                            uint64_t delta = (microseconds() - start);
-                            if ((delta >= wait_count) || (delta < 2000))
-                                continue;
-
-                            wait_count = delta;
-                        }
+                // wait 10 ms before requesting the readahead window
+                if (!edfs_wait_chunk(edfs_context, key, path, ino, chunk, 10000)) {
+                    if (edfs_readahead_request(edfs_context, key, path, ino, filebuf, chunk, last_file_chunk) > 0) {
+                        uint64_t delta = (microseconds() - start);
+                        if ((delta >= wait_count) || (delta < 2000))
+                            continue;
+
+                        wait_count = delta;
                     }
-                }
+                } else
+                    continue;
             }
 #endif
 #endif
-            uint64_t start = microseconds();
-            while ((!chunk_exists(path, chunk)) && (microseconds() - start < wait_count)) {
-                usleep(1000);
-                thread_yield();
-            }
+            edfs_wait_chunk(edfs_context, key, path, ino, chunk, wait_count);
         } else {
 #ifdef EDFS_USE_READ_QUEUE
-            if (!chunk_exists(path, chunk + 1)) {
+            if (!chunk_exists(key, ino, path, chunk + 1)) {
                 filebuf->requested_chunk = chunk + 1;
                 filebuf->timestamp = 0;
                 filebuf->request_timestamp = microseconds();
@@ -3264,13 +3784,18 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
                 filebuf->requested_sig_hash = 0;
             }
 #endif
-#ifdef EDFS_FORWARD_REQUEST
-            if ((!chunk_exists(path, forward_chunk)) && (forward_chunk <= last_file_chunk))
-                request_data(edfs_context, key, ino, forward_chunk, 1, 1, NULL, NULL, 0);
-#endif
+            edfs_readahead_request(edfs_context, key, path, ino, filebuf, chunk, last_file_chunk);
             if ((filebuf) && (read_size > 0)) {
                 filebuf->last_read_chunk = chunk;
                 filebuf->last_read_size = read_size;
+                // cache only complete chunks
+                if (use_chunk_cache) {
+                    if (filebuf->read_buffer_size > 0)
+                        chunk_cache_put(edfs_context->chunk_cache, key->key_id_xxh64_be, ino, chunk, sig_hash, filebuf->read_buffer, filebuf->read_buffer_size);
+                    else
+                    if ((read_size < size) || (size >= BLOCK_SIZE))
+                        chunk_cache_put(edfs_context->chunk_cache, key->key_id_xxh64_be, ino, chunk, sig_hash, buf, read_size);
+                }
             }
 #ifdef WITH_CACHE_WARMUP
             edfs_request_cache_warming(edfs_context, filebuf->key, ino, chunk + 5);
@@ -3286,7 +3811,7 @@ int broadcast_edfs_read_file(struct edfs *edfs_context, struct edfs_key_data *ke
     return -EIO;
 }
 
-int read_chunk(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, int64_t chunk, char *buf, size_t size, edfs_ino_t ino, int64_t offset, struct filewritebuf *filebuf) {
+int read_chunk(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, int64_t chunk, char *buf, size_t size, edfs_ino_t ino, int64_t offset, struct filewritebuf *filebuf, int64_t file_size) {
     if ((chunk == filebuf->last_read_chunk) && (offset < filebuf->read_buffer_size) && (filebuf->read_buffer) && (filebuf->expires > microseconds())) {
         int read_size = filebuf->read_buffer_size - offset;
         if (size < read_size)
@@ -3303,8 +3828,8 @@ int read_chunk(struct edfs *edfs_context, struct edfs_key_data *key, const char
             size = max_size;
     }
 
-    if (offset + size > filebuf->file_size)
-        size = filebuf->file_size - offset;
+    if (offset + size > file_size)
+        size = file_size - offset;
 
     if (size <= 0)
         return 0;
@@ -3315,14 +3840,14 @@ int read_chunk(struct edfs *edfs_context, struct edfs_key_data *key, const char
     char name[MAX_PATH_LEN];
     snprintf(name, MAX_PATH_LEN, "%" PRIu64, (uint64_t)chunk);
     if (!offset) {
-        int err = broadcast_edfs_read_file(edfs_context, key, path, name, (unsigned char *)buf, size, ino, chunk, filebuf);
+        int err = broadcast_edfs_read_file(edfs_context, key, path, name, (unsigned char *)buf, size, ino, chunk, filebuf, file_size);
         if (err == -ENOENT)
             return 0;
         return err;
     }
 
     unsigned char block_data[BLOCK_SIZE];
-    int read_size = broadcast_edfs_read_file(edfs_context, key, path, name, block_data, (int)offset + size, ino, chunk, filebuf);
+    int read_size = broadcast_edfs_read_file(edfs_context, key, path, name, block_data, (int)offset + size, ino, chunk, filebuf, file_size);
     if (read_size < 0) {
         if (read_size == -ENOENT)
             return 0;
@@ -3354,11 +3879,367 @@ uint64_t edfs_get_max_chunk(int64_t file_size) {
     return max_chunk;
 }
 
-int edfs_update_chain(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t ino, int64_t file_size, unsigned char *hash, uint64_t *hash_chunks) {
+// hash.tree keeps the signature of every hash.N file of an inode (the leaves) and a binary
+// sha256 tree over them (the nodes), so neither the file hash nor the tree needs all the hash
+// files to be reopened. Layout: header, leaves[capacity], nodes[2 * capacity].
+// Setting a leaf rewrites only the leaf and the O(log n) nodes above it.
+static void edfs_hash_tree_free(struct edfs_hash_tree *tree) {
+    if (!tree)
+        return;
+    free(tree->leaves);
+    free(tree->nodes);
+    memset(tree, 0, sizeof(struct edfs_hash_tree));
+}
+
+static int edfs_hash_tree_leaf_valid(const struct edfs_hash_tree *tree, uint64_t index) {
+    static unsigned char null_leaf[EDFS_HASH_TREE_LEAF_SIZE];
+    if (index >= tree->count)
+        return 0;
+    return (memcmp(tree->leaves + index * EDFS_HASH_TREE_LEAF_SIZE, null_leaf, EDFS_HASH_TREE_LEAF_SIZE) != 0);
+}
+
+static void edfs_hash_tree_leaf_digest(const unsigned char *leaf, unsigned char *digest) {
+    static unsigned char null_leaf[EDFS_HASH_TREE_LEAF_SIZE];
+    if (memcmp(leaf, null_leaf, EDFS_HASH_TREE_LEAF_SIZE)) {
+        SHA256_CTX ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, (const BYTE *)leaf, EDFS_HASH_TREE_LEAF_SIZE);
+        sha256_final(&ctx, digest);
+    } else
+        memset(digest, 0, 32);
+}
+
+static void edfs_hash_tree_update_node(struct edfs_hash_tree *tree, uint64_t index) {
+    uint64_t node = tree->capacity + index;
+    edfs_hash_tree_leaf_digest(tree->leaves + index * EDFS_HASH_TREE_LEAF_SIZE, tree->nodes + node * 32);
+
+    // O(log n) parent updates
+    node /= 2;
+    while (node) {
+        SHA256_CTX ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, (const BYTE *)tree->nodes + node * 2 * 32, 64);
+        sha256_final(&ctx, tree->nodes + node * 32);
+        node /= 2;
+    }
+}
+
+static void edfs_hash_tree_build(struct edfs_hash_tree *tree) {
+    uint64_t i;
+    memset(tree->nodes, 0, tree->capacity * 2 * 32);
+    for (i = 0; i < tree->count; i++)
+        edfs_hash_tree_leaf_digest(tree->leaves + i * EDFS_HASH_TREE_LEAF_SIZE, tree->nodes + (tree->capacity + i) * 32);
+    // each node is hashed once
+    for (i = tree->capacity - 1; i > 0; i--) {
+        SHA256_CTX ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, (const BYTE *)tree->nodes + i * 2 * 32, 64);
+        sha256_final(&ctx, tree->nodes + i * 32);
+    }
+}
+
+static int edfs_hash_tree_resize(struct edfs_hash_tree *tree, uint64_t count) {
+    if (count <= tree->count)
+        return 1;
+
+    uint64_t capacity = tree->capacity ? tree->capacity : 1;
+    while (capacity < count)
+        capacity *= 2;
+
+    unsigned char *leaves = (unsigned char *)realloc(tree->leaves, capacity * EDFS_HASH_TREE_LEAF_SIZE);
+    if (!leaves)
+        return 0;
+    memset(leaves + tree->count * EDFS_HASH_TREE_LEAF_SIZE, 0, (capacity - tree->count) * EDFS_HASH_TREE_LEAF_SIZE);
+    tree->leaves = leaves;
+
+    uint64_t old_count = tree->count;
+    tree->count = count;
+    if (capacity != tree->capacity) {
+        unsigned char *nodes = (unsigned char *)calloc(capacity * 2, 32);
+        if (!nodes)
+            return 0;
+        free(tree->nodes);
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+        edfs_hash_tree_build(tree);
+    } else {
+        uint64_t i;
+        for (i = old_count; i < count; i++)
+            edfs_hash_tree_update_node(tree, i);
+    }
+    return 1;
+}
+
+static int edfs_hash_tree_read_header(FILE *f, struct edfs_hash_tree *tree) {
+    unsigned char header[EDFS_HASH_TREE_HEADER_SIZE];
+
+    if ((fseek(f, 0, SEEK_SET)) || (fread(header, 1, EDFS_HASH_TREE_HEADER_SIZE, f) != EDFS_HASH_TREE_HEADER_SIZE) || (ntohl(*(uint32_t *)header) != EDFS_HASH_TREE_MAGIC))
+        return 0;
+
+    uint64_t count = ntohl(*(uint32_t *)(header + 4));
+    uint64_t capacity = ntohl(*(uint32_t *)(header + 8));
+    // capacity must be a power of 2, holding all the leaves
+    if ((!capacity) || (capacity & (capacity - 1)) || (count > capacity))
+        return 0;
+
+    tree->count = count;
+    tree->capacity = capacity;
+    tree->version = ntohl(*(uint32_t *)(header + 12));
+    tree->chain_version = ntohl(*(uint32_t *)(header + 16));
+    tree->chain_count = ntohl(*(uint32_t *)(header + 20));
+    memcpy(tree->chain_hash, header + 24, 32);
+    return 1;
+}
+
+static int edfs_hash_tree_write_header(FILE *f, const struct edfs_hash_tree *tree) {
+    unsigned char header[EDFS_HASH_TREE_HEADER_SIZE];
+
+    *(uint32_t *)header = htonl(EDFS_HASH_TREE_MAGIC);
+    *(uint32_t *)(header + 4) = htonl((uint32_t)tree->count);
+    *(uint32_t *)(header + 8) = htonl((uint32_t)tree->capacity);
+    *(uint32_t *)(header + 12) = htonl(tree->version);
+    *(uint32_t *)(header + 16) = htonl(tree->chain_version);
+    *(uint32_t *)(header + 20) = htonl((uint32_t)tree->chain_count);
+    memcpy(header + 24, tree->chain_hash, 32);
+    if ((fseek(f, 0, SEEK_SET)) || (fwrite(header, 1, EDFS_HASH_TREE_HEADER_SIZE, f) != EDFS_HASH_TREE_HEADER_SIZE))
+        return 0;
+    return 1;
+}
+
+static int edfs_hash_tree_load(struct edfs *edfs_context, const char *path, struct edfs_hash_tree *tree) {
+    char fullpath[MAX_PATH_LEN];
+
+    memset(tree, 0, sizeof(struct edfs_hash_tree));
+    snprintf(fullpath, MAX_PATH_LEN, "%s/hash.tree", path);
+
+    FILE *f = fopen(fullpath, "rb");
+    if (!f)
+        return 0;
+
+    edfs_file_lock(edfs_context, f, 0);
+    int loaded = 0;
+    if ((edfs_hash_tree_read_header(f, tree)) && (tree->count)) {
+        tree->leaves = (unsigned char *)malloc(tree->capacity * EDFS_HASH_TREE_LEAF_SIZE);
+        tree->nodes = (unsigned char *)malloc(tree->capacity * 2 * 32);
+        // nodes are read as stored, not rehashed
+        if ((tree->leaves) && (tree->nodes) && (fread(tree->leaves, EDFS_HASH_TREE_LEAF_SIZE, tree->capacity, f) == tree->capacity) && (fread(tree->nodes, 32, tree->capacity * 2, f) == tree->capacity * 2))
+            loaded = 1;
+    }
+    edfs_file_unlock(edfs_context, f);
+    fclose(f);
+    if (!loaded)
+        edfs_hash_tree_free(tree);
+    return loaded;
+}
+
+static int edfs_hash_tree_write(FILE *f, const struct edfs_hash_tree *tree) {
+    if (!edfs_hash_tree_write_header(f, tree))
+        return 0;
+    if (fwrite(tree->leaves, EDFS_HASH_TREE_LEAF_SIZE, tree->capacity, f) != tree->capacity)
+        return 0;
+    if (fwrite(tree->nodes, 32, tree->capacity * 2, f) != tree->capacity * 2)
+        return 0;
+    return 1;
+}
+
+static int edfs_hash_tree_save(struct edfs *edfs_context, const char *path, const struct edfs_hash_tree *tree) {
+    char fullpath[MAX_PATH_LEN];
+
+    snprintf(fullpath, MAX_PATH_LEN, "%s/hash.tree", path);
+    FILE *f = fopen(fullpath, "wb");
+    if (!f)
+        return 0;
+
+    edfs_file_lock(edfs_context, f, 1);
+    int written = edfs_hash_tree_write(f, tree);
+    edfs_file_unlock(edfs_context, f);
+    fclose(f);
+    if (!written)
+        log_warn("error writing %s", fullpath);
+    return written;
+}
+
+int edfs_hash_tree_set(struct edfs *edfs_context, const char *path, uint64_t index, const unsigned char *signature) {
+    char fullpath[MAX_PATH_LEN];
+    struct edfs_hash_tree tree;
+    unsigned char digest[64];
+
+    snprintf(fullpath, MAX_PATH_LEN, "%s/hash.tree", path);
+
+    FILE *f = fopen(fullpath, "r+b");
+    if (!f)
+        f = fopen(fullpath, "w+b");
+    if (!f)
+        return 0;
+
+    edfs_file_lock(edfs_context, f, 1);
+    memset(&tree, 0, sizeof(struct edfs_hash_tree));
+    int written = 1;
+    if ((!edfs_hash_tree_read_header(f, &tree)) || (index >= tree.capacity)) {
+        // new or growing tree: rewritten once, the capacity doubles
+        struct edfs_hash_tree new_tree;
+        memset(&new_tree, 0, sizeof(struct edfs_hash_tree));
+        if ((tree.capacity) && (tree.count)) {
+            new_tree.leaves = (unsigned char *)malloc(tree.capacity * EDFS_HASH_TREE_LEAF_SIZE);
+            new_tree.nodes = (unsigned char *)malloc(tree.capacity * 2 * 32);
+            if ((new_tree.leaves) && (new_tree.nodes) && (fread(new_tree.leaves, EDFS_HASH_TREE_LEAF_SIZE, tree.capacity, f) == tree.capacity)) {
+                new_tree.count = tree.count;
+                new_tree.capacity = tree.capacity;
+            } else
+                edfs_hash_tree_free(&new_tree);
+        }
+        if ((edfs_hash_tree_resize(&new_tree, index + 1)) && (new_tree.nodes)) {
+            new_tree.version = tree.version + 1;
+            memcpy(new_tree.leaves + index * EDFS_HASH_TREE_LEAF_SIZE, signature, EDFS_HASH_TREE_LEAF_SIZE);
+            edfs_hash_tree_update_node(&new_tree, index);
+            written = edfs_hash_tree_write(f, &new_tree);
+        } else
+            written = 0;
+        edfs_hash_tree_free(&new_tree);
+    } else {
+        uint64_t node = tree.capacity + index;
+        uint64_t nodes_offset = EDFS_HASH_TREE_HEADER_SIZE + tree.capacity * EDFS_HASH_TREE_LEAF_SIZE;
+        if (index >= tree.count)
+            tree.count = index + 1;
+        // cached file hash is no longer valid
+        tree.version ++;
+        written = edfs_hash_tree_write_header(f, &tree);
+        if ((written) && ((fseek(f, EDFS_HASH_TREE_HEADER_SIZE + index * EDFS_HASH_TREE_LEAF_SIZE, SEEK_SET)) || (fwrite(signature, 1, EDFS_HASH_TREE_LEAF_SIZE, f) != EDFS_HASH_TREE_LEAF_SIZE)))
+            written = 0;
+        edfs_hash_tree_leaf_digest(signature, digest);
+        while ((written) && (node)) {
+            if ((fseek(f, nodes_offset + node * 32, SEEK_SET)) || (fwrite(digest, 1, 32, f) != 32)) {
+                written = 0;
+                break;
+            }
+            node /= 2;
+            if (!node)
+                break;
+            // read both children, then hash them into the parent
+            if ((fseek(f, nodes_offset + node * 2 * 32, SEEK_SET)) || (fread(digest, 1, 64, f) != 64)) {
+                written = 0;
+                break;
+            }
+            SHA256_CTX ctx;
+            sha256_init(&ctx);
+            sha256_update(&ctx, (const BYTE *)digest, 64);
+            sha256_final(&ctx, digest);
+        }
+    }
+
+    edfs_file_unlock(edfs_context, f);
+    fclose(f);
+    if (!written)
+        log_warn("error updating %s", fullpath);
+    return written;
+}
+
+// caches the file hash computed from the given tree version
+static void edfs_hash_tree_set_chain(struct edfs *edfs_context, const char *path, uint32_t version, uint64_t chain_count, const unsigned char *hash) {
+    char fullpath[MAX_PATH_LEN];
+    struct edfs_hash_tree tree;
+
+    snprintf(fullpath, MAX_PATH_LEN, "%s/hash.tree", path);
+    FILE *f = fopen(fullpath, "r+b");
+    if (!f)
+        return;
+
+    edfs_file_lock(edfs_context, f, 1);
+    memset(&tree, 0, sizeof(struct edfs_hash_tree));
+    // a leaf changed in the meantime
+    if ((edfs_hash_tree_read_header(f, &tree)) && (tree.version == version)) {
+        tree.chain_version = version;
+        tree.chain_count = chain_count;
+        memcpy(tree.chain_hash, hash, 32);
+        edfs_hash_tree_write_header(f, &tree);
+    }
+    edfs_file_unlock(edfs_context, f);
+    fclose(f);
+}
+
+static void edfs_hash_tree_diff(const struct edfs_hash_tree *old_tree, const struct edfs_hash_tree *tree, uint64_t node, unsigned char *changed, uint64_t max_chunks) {
+    if (!memcmp(old_tree->nodes + node * 32, tree->nodes + node * 32, 32))
+        return;
+
+    if (node >= tree->capacity) {
+        uint64_t index = node - tree->capacity;
+        if (index < max_chunks)
+            changed[index] = 1;
+        return;
+    }
+    edfs_hash_tree_diff(old_tree, tree, node * 2, changed, max_chunks);
+    edfs_hash_tree_diff(old_tree, tree, node * 2 + 1, changed, max_chunks);
+}
+
+// requested is the hash tree snapshot taken when the hash chunks were first requested;
+// later calls request only the hash chunks that didn't change since that snapshot
+int edfs_request_hash_chunks(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, uint64_t ino, uint64_t max_chunks, unsigned char *additional_data, int additional_data_size, struct edfs_hash_tree *requested) {
+    struct edfs_hash_tree tree;
+    unsigned char *changed = NULL;
+    uint64_t i;
+
+    edfs_hash_tree_load(edfs_context, path, &tree);
+    edfs_hash_tree_resize(&tree, max_chunks);
+
+    if ((requested->count) && (tree.count) && (max_chunks)) {
+        changed = (unsigned char *)calloc(1, max_chunks);
+        if (changed) {
+            if (requested->capacity == tree.capacity) {
+                edfs_hash_tree_diff(requested, &tree, 1, changed, max_chunks);
+            } else {
+                for (i = 0; i < max_chunks; i++) {
+                    if ((i >= requested->count) || (i >= tree.count))
+                        continue;
+                    if (memcmp(requested->leaves + i * EDFS_HASH_TREE_LEAF_SIZE, tree.leaves + i * EDFS_HASH_TREE_LEAF_SIZE, EDFS_HASH_TREE_LEAF_SIZE))
+                        changed[i] = 1;
+                }
+            }
+        }
+    }
+
+    int requests = 0;
+    for (i = 0; i < max_chunks; i++) {
+        if ((changed) && (changed[i]))
+            continue;
+        *(uint64_t *)(additional_data + 8)= htonll(i);
+        edfs_notify_io(edfs_context, key, "hash", additional_data, additional_data_size, edfs_context->key.pk, 32, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
+        requests ++;
+    }
+    free(changed);
+
+    if (!requested->count)
+        memcpy(requested, &tree, sizeof(struct edfs_hash_tree));
+    else
+        edfs_hash_tree_free(&tree);
+    return requests;
+}
+
+static int edfs_read_chain_leaf(struct edfs *edfs_context, const char *path, uint64_t index, unsigned char *signature_data) {
+    char fullpath[MAX_PATH_LEN];
+
+    fullpath[0] = 0;
+    snprintf(fullpath, MAX_PATH_LEN, "%s/hash.%" PRIu64, path, index);
+    FILE *f = fopen(fullpath, "rb");
+    if (!f) {
+        log_warn("error reading %s", fullpath);
+        return 0;
+    }
+    edfs_file_lock(edfs_context, f, 0);
+    int read_ok = (fread(signature_data, 1, 64, f) == 64);
+    edfs_file_unlock(edfs_context, f);
+    fclose(f);
+    if (!read_ok)
+        log_error("error reading signature in %s", fullpath);
+    return read_ok;
+}
+
+// expected_hash (optional) is the hash the caller checks against; on mismatch, the leaves are
+// reread from the hash.N files (the hash.tree may be stale) and the tree is rewritten
+int edfs_update_chain(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t ino, int64_t file_size, unsigned char *hash, uint64_t *hash_chunks, const unsigned char *expected_hash) {
     char fullpath[MAX_PATH_LEN];
-    char fullpath2[MAX_PATH_LEN];
     char b64name[MAX_B64_HASH_LEN];
     unsigned char signature_data[64];
+    struct edfs_hash_tree tree;
     uint64_t i;
 
     uint64_t max_chunk = edfs_get_max_chunk(file_size);
@@ -3368,28 +4249,59 @@ int edfs_update_chain(struct edfs *edfs_context, struct edfs_key_data *key, uint
 
     adjustpath(key, fullpath, computename(ino, b64name));
 
-    SHA256_CTX ctx;
-    sha256_init(&ctx);
-    for (i = 0; i < max_chunk; i++) {
-        fullpath2[0] = 0;
-        snprintf(fullpath2, MAX_PATH_LEN, "%s/hash.%" PRIu64, fullpath, i);
-        FILE *f = fopen(fullpath2, "rb");
-        if (!f) {
-            log_warn("error reading %s", fullpath2);
-            return 0;
+    edfs_hash_tree_load(edfs_context, fullpath, &tree);
+    // cached file hash, valid until a leaf changes
+    if ((max_chunk) && (tree.count) && (tree.chain_version == tree.version) && (tree.chain_count == max_chunk) && ((!expected_hash) || (!memcmp(tree.chain_hash, expected_hash, 32)))) {
+        memcpy(hash, tree.chain_hash, 32);
+        edfs_hash_tree_free(&tree);
+        return 1;
+    }
+
+    int from_files = 0;
+    while (1) {
+        int updated = 0;
+        SHA256_CTX ctx;
+        sha256_init(&ctx);
+        for (i = 0; i < max_chunk; i++) {
+            if ((!from_files) && (edfs_hash_tree_leaf_valid(&tree, i))) {
+                sha256_update(&ctx, (const BYTE *)tree.leaves + i * EDFS_HASH_TREE_LEAF_SIZE, 64);
+                continue;
+            }
+            // leaf not yet in hash.tree, or verifying the tree
+            if (!edfs_read_chain_leaf(edfs_context, fullpath, i, signature_data)) {
+                // write what was already read
+                if (updated) {
+                    tree.version ++;
+                    edfs_hash_tree_save(edfs_context, fullpath, &tree);
+                }
+                edfs_hash_tree_free(&tree);
+                return 0;
+            }
+            if ((!edfs_hash_tree_leaf_valid(&tree, i)) || (memcmp(tree.leaves + i * EDFS_HASH_TREE_LEAF_SIZE, signature_data, 64))) {
+                if (edfs_hash_tree_resize(&tree, i + 1)) {
+                    memcpy(tree.leaves + i * EDFS_HASH_TREE_LEAF_SIZE, signature_data, 64);
+                    edfs_hash_tree_update_node(&tree, i);
+                    updated ++;
+                }
+            }
+            sha256_update(&ctx, (const BYTE *)signature_data, 64);
         }
-        edfs_file_lock(edfs_context, f, 0);
-        if (fread(signature_data, 1, 64, f) != 64) {
-            edfs_file_unlock(edfs_context, f);
-            fclose(f);
-            log_error("error reading signature in %s", fullpath2);
-            return 0;
+        sha256_final(&ctx, hash);
+        if (updated) {
+            if (from_files)
+                log_warn("%i stale hash.tree leaves for %s", updated, fullpath);
+            tree.version ++;
+            edfs_hash_tree_save(edfs_context, fullpath, &tree);
         }
-        edfs_file_unlock(edfs_context, f);
-        fclose(f);
-        sha256_update(&ctx, (const BYTE *)signature_data, 64);
+        if ((from_files) || (!expected_hash) || (!memcmp(hash, expected_hash, 32)))
+            break;
+        from_files = 1;
     }
-    sha256_final(&ctx, hash);
+    uint32_t version = tree.version;
+    int cache = (tree.count > 0);
+    edfs_hash_tree_free(&tree);
+    if ((max_chunk) && (cache))
+        edfs_hash_tree_set_chain(edfs_context, fullpath, version, max_chunk, hash);
     return 1;
 }
 
@@ -3473,7 +4385,7 @@ int edfs_request_hash_if_needed(struct edfs *edfs_context, struct edfs_key_data
     if ((!type) || (!size))
         return 0;
 
-    if ((edfs_update_chain(edfs_context, key, ino, size, computed_hash, NULL)) && (!memcmp(hash, computed_hash, 32))) {
+    if ((edfs_update_chain(edfs_context, key, ino, size, computed_hash, NULL, hash)) && (!memcmp(hash, computed_hash, 32))) {
         log_trace("hash is up-to-date");
         return 0;
     }
@@ -3544,16 +4456,22 @@ int edfs_open_key(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino
             // file hash hash
             int valid_hash = 0;
             uint64_t max_chunks = edfs_get_max_chunk(size);
-            uint64_t i;
             uint64_t start = microseconds();
+            struct edfs_hash_tree requested_tree;
+            char b64name[MAX_B64_HASH_LEN];
+            char fullpath[MAX_PATH_LEN];
+            memset(&requested_tree, 0, sizeof(struct edfs_hash_tree));
+            adjustpath(key, fullpath, computename(ino, b64name));
             thread_mutex_lock(&key->ino_cache_lock);
             void *hash_error = (struct edfs_ino_cache *)avl_search(&key->ino_checksum_mismatch, (void *)(uintptr_t)ino);
             thread_mutex_unlock(&key->ino_cache_lock);
+            int verify_chain = 1;
             do {
                 if (blockchain_error)
                     blockchain_error = 0;
 
-                if (edfs_update_chain(edfs_context, key, ino, size, computed_hash, &max_chunks)) {
+                // hash.tree is checked against the hash files once, then updated as hash chunks arrive
+                if (edfs_update_chain(edfs_context, key, ino, size, computed_hash, &max_chunks, verify_chain ? hash : NULL)) {
                     if (!memcmp(hash, computed_hash, 32)) {
                         valid_hash = 1;
                         break;
@@ -3564,14 +4482,12 @@ int edfs_open_key(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino
                     }
                 }
 
+                verify_chain = 0;
                 if (send_want) {
                     edfs_notify_io(edfs_context, key, "wand", additional_data, 8, NULL, 0, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
                     send_want = 0;
                 }
-                for (i = 0; i < max_chunks; i++) {
-                    *(uint64_t *)(additional_data + 8)= htonll(i);
-                    edfs_notify_io(edfs_context, key, "hash", additional_data, sizeof(additional_data), edfs_context->key.pk, 32, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
-                }
+                edfs_request_hash_chunks(edfs_context, key, fullpath, ino, max_chunks, additional_data, sizeof(additional_data), &requested_tree);
 
                 if (microseconds() - start >= EDWORK_MAX_RETRY_TIMEOUT * 1000) {
                     log_error("hash read timed out");
@@ -3597,6 +4513,7 @@ int edfs_open_key(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino
 
                 thread_yield();
             } while (!valid_hash);
+            edfs_hash_tree_free(&requested_tree);
 
             if (valid_hash) {
                 check_hash = 1;
@@ -3617,6 +4534,9 @@ int edfs_open_key(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino
         *fbuf = (struct filewritebuf *)malloc(sizeof(struct filewritebuf));
         if (*fbuf) {
             memset(*fbuf, 0, sizeof(struct filewritebuf));
+            thread_mutex_init(&(*fbuf)->write_lock);
+            thread_mutex_init(&(*fbuf)->writeback_lock);
+            thread_signal_init(&(*fbuf)->writeback_done);
             (*fbuf)->ino = ino;
             (*fbuf)->file_size = size;
             (*fbuf)->check_hash = check_hash;
@@ -3650,6 +4570,9 @@ int edfs_create_with_key(struct edfs *edfs_context, struct edfs_key_data *key, e
         *buf = (struct filewritebuf *)malloc(sizeof(struct filewritebuf));
         if (*buf) {
             memset(*buf, 0, sizeof(struct filewritebuf));
+            thread_mutex_init(&(*buf)->write_lock);
+            thread_mutex_init(&(*buf)->writeback_lock);
+            thread_signal_init(&(*buf)->writeback_done);
             (*buf)->ino = *inode;
             (*buf)->key = key;
             key->opened_files ++;
@@ -3677,8 +4600,16 @@ int edfs_read(struct edfs *edfs_context, edfs_ino_t ino, size_t size, int64_t of
         return -EIO;
 
     ++ filebuf->in_read;
-    edfs_flush_chunk(edfs_context, ino, filebuf);
+    int err = edfs_flush_chunk(edfs_context, ino, filebuf);
+    // read after write, keep the error for flush or close
+    edfs_writeback_wait(filebuf);
+    if (err < 0)
+        edfs_writeback_error(filebuf, err);
 
+    // snapshot of file_size, read_chunk may wait for the network for missing chunks
+    thread_mutex_lock(&filebuf->write_lock);
+    int64_t file_size = filebuf->file_size;
+    thread_mutex_unlock(&filebuf->write_lock);
 
     int64_t chunk = off / BLOCK_SIZE;
     int64_t offset = off % BLOCK_SIZE;
@@ -3688,13 +4619,12 @@ int edfs_read(struct edfs *edfs_context, edfs_ino_t ino, size_t size, int64_t of
 
     char *buf = ptr;
     while (size > 0) {
-        int read_bytes = read_chunk(edfs_context, filebuf->key, fullpath, chunk, buf, size, ino, offset, filebuf);
+        int read_bytes = read_chunk(edfs_context, filebuf->key, fullpath, chunk, buf, size, ino, offset, filebuf, file_size);
         if (read_bytes <= 0) {
             if ((bytes_read != 0) || (read_bytes == 0))
                 break;
             log_error("read chunk in %s, errno %i", fullpath, (int)-read_bytes);
-            if (filebuf)
-                -- filebuf->in_read;
+            -- filebuf->in_read;
             return read_bytes;
         }
         bytes_read += read_bytes;
@@ -3766,8 +4696,10 @@ int edfs_update_hash(struct edfs *edfs_context, struct edfs_key_data *key, const
     if (hash_buffer) {
         buffer = hash_buffer->buffer;
         if (((chunk < 0) || (hash_buffer->chunk != hash_chunk)) && (hash_buffer->read_size)) {
+            unsigned char signature[64];
             snprintf(hash_file, sizeof(hash_file), "hash.%" PRIu64, hash_buffer->chunk);
-            edfs_write_file(edfs_context, key, path, hash_file, buffer, hash_buffer->read_size, NULL, 1, NULL, NULL, NULL, NULL, 0, 0, 0);
+            if (edfs_write_file(edfs_context, key, path, hash_file, buffer, hash_buffer->read_size, NULL, 1, NULL, NULL, signature, NULL, 0, 0, 0) == hash_buffer->read_size)
+                edfs_hash_tree_set(edfs_context, path, hash_buffer->chunk, signature);
             hash_buffer->chunk = hash_chunk;
             hash_buffer->read_size = 0;
         }
@@ -3800,14 +4732,17 @@ int edfs_update_hash(struct edfs *edfs_context, struct edfs_key_data *key, const
         read_size = offset + sizeof(uint32_t);
     }
     memcpy(buffer + offset, &hash, sizeof(uint32_t));
-    if (hash_buffer)
+    if (hash_buffer) {
         hash_buffer->read_size = read_size;
-    else
-        edfs_write_file(edfs_context, key, path, hash_file, buffer, read_size, NULL, 1, NULL, NULL, NULL, NULL, 0, 0, 0);
+    } else {
+        unsigned char signature[64];
+        if (edfs_write_file(edfs_context, key, path, hash_file, buffer, read_size, NULL, 1, NULL, NULL, signature, NULL, 0, 0, 0) == read_size)
+            edfs_hash_tree_set(edfs_context, path, hash_chunk, signature);
+    }
     return 0;
 }
 
-int edfs_try_make_hash(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, uint64_t file_size) {
+int edfs_try_make_hash(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, const char *path, uint64_t file_size) {
     if (!file_size)
         return 1;
 
@@ -3822,7 +4757,7 @@ int edfs_try_make_hash(struct edfs *edfs_context, struct edfs_key_data *key, con
         unsigned char signature[64];
         char chunk_file[MAX_PATH_LEN];
         snprintf(chunk_file, MAX_PATH_LEN, "%" PRIu64, (uint64_t)chunk);
-        int read_size = edfs_read_file(edfs_context, key, path, chunk_file, signature, 64, NULL, 0, 0, 0, NULL, 0, 1, 0, 0);
+        int read_size = edfs_read_file(edfs_context, key, path, chunk_file, signature, 64, NULL, 0, 0, 0, NULL, 0, 1, inode, chunk);
         if (read_size != 64)
             return 0;
         edfs_update_hash(edfs_context, key, path, chunk, signature, 64, &hash_buffer);
@@ -3857,7 +4792,13 @@ int make_chunk(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t
     unsigned char compressed_buffer[BLOCK_SIZE_MAX];
     mz_ulong max_len = sizeof(compressed_buffer);
 
-    int read_data = edfs_read_file(edfs_context, key, path, name, old_data, BLOCK_SIZE, NULL, 0, 1, USE_COMPRESSION, NULL, 0, 0, ino, chunk);
+    // full chunk overwrite, or nothing to keep from the old chunk (write covers all its data or starts past eof): skip read-modify-write
+    int64_t chunk_start = chunk * BLOCK_SIZE;
+    int replace = ((!offset) && ((size == BLOCK_SIZE) || (chunk_start + (int64_t)size >= *filesize))) || (chunk_start >= *filesize);
+
+    int read_data = 0;
+    if (!replace)
+        read_data = edfs_read_file(edfs_context, key, path, name, old_data, BLOCK_SIZE, NULL, 0, 1, USE_COMPRESSION, NULL, 0, 0, ino, chunk);
 
     if (read_data > 0) {
         if (!(*filesize))
@@ -3934,18 +4875,22 @@ int make_chunk(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t
         memcpy(old_data + offset, buf, size);
 
         written_bytes = edfs_write_file(edfs_context, key, path, name, (const unsigned char *)old_data, (int)offset + size, NULL, 1, compressed_buffer, USE_COMPRESSION ? &max_len : NULL, additional_data + 32, NULL, 0, ino, chunk);
-        if ((written_bytes > 0) && (offset)) {
-            // increment file size by offset (null padded)
-            *filesize += offset;
+        if ((written_bytes > 0) && (offset))
             written_bytes -= offset;
-        }
     } else
     if (offset) {
         return -EBUSY;
     } else
         written_bytes = edfs_write_file(edfs_context, key, path, name, (const unsigned char *)buf, (int)size, NULL, 1, compressed_buffer, USE_COMPRESSION ? &max_len : NULL, additional_data + 32, NULL, 0, ino, chunk);
     if (written_bytes > 0) {
-        *filesize += written_bytes;
+        if (replace) {
+            // may leave a (null) hole when writing past eof
+            if (*filesize < chunk_start + offset + written_bytes)
+                *filesize = chunk_start + offset + written_bytes;
+        } else {
+            // increment file size by offset (null padded)
+            *filesize += offset + written_bytes;
+        }
 #ifdef EDFS_FORCE_BROADCAST
         if (written_bytes == BLOCK_SIZE) {
             if (USE_COMPRESSION) {
@@ -3975,37 +4920,85 @@ int edfs_check_block_hash(struct edfs *edfs_context, struct edfs_key_data *key,
     return 0;
 }
 
-int edfs_write_block(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *data, size_t size, time_t timestamp) {
-    char fullpath[MAX_PATH_LEN];
-    char b64name[MAX_B64_HASH_LEN];
+int edfs_write_pack_block(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *data, size_t size, time_t timestamp) {
     struct stat attrib;
+    unsigned char signature[64];
 
-#ifdef EDFS_EMULATED_STORE
-    store_adjustpath2(key, fullpath, computename(inode, b64name), chunk / STORE_CHUNKS_PER_FILE);
-    if (!store_stat(fullpath, chunk % STORE_CHUNKS_PER_FILE, &attrib)) {
+    if (size > PACK_STORE_MAX_RECORD_SIZE)
+        return -1;
+
+    if (!pack_store_stat(key->pack, inode, chunk, &attrib)) {
         if (!edfs_may_write_block(edfs_context, key, inode)) {
             log_warn("refused to update file block because file is open for write");
             return -1;
         }
-        if (timestamp) {
-            // at least 3 seconds after creation
-            if (attrib.st_ctime - attrib.st_mtime >= 3) {
-                if ((attrib.st_mtime > timestamp) && (attrib.st_size >= size)) {
-                    log_info("file block %s is newer than received", fullpath);
-                    return -1;
-                }
-
-                if ((attrib.st_mtime == timestamp) && (attrib.st_size == size)) {
-                    log_info("file block %s seems the same (%i bytes)", fullpath, size);
-                    return -1;
-                }
-            }
+        if ((timestamp) && (attrib.st_mtime == timestamp) && (attrib.st_size == size)) {
+            log_info("file block %" PRIu64 ":%" PRIu64 " seems the same (%i bytes)", inode, (uint64_t)chunk, size);
+            return -1;
         }
         if (!edfs_check_block_hash(edfs_context, key, inode, chunk, data, size)) {
             log_warn("refused to update file block: hash mismatch");
             return -1;
         }
-    }
+        if ((size >= 64) && (pack_store_read(key->pack, inode, chunk, signature, 64) == 64) && (!memcmp(signature, data, 64))) {
+            log_debug("file block is exactly the same, not rewriting");
+            return -1;
+        }
+    }
+
+    const unsigned char *record = data;
+    unsigned char *buffer = NULL;
+    if ((edfs_context->has_storekey) && (size >= 64)) {
+        buffer = (unsigned char *)malloc(size);
+        if (!buffer)
+            return -1;
+        memcpy(buffer, data, 64);
+        edfs_crypt_with_key(edfs_context, key, inode, chunk, data + 64, buffer + 64, size - 64);
+        record = buffer;
+    }
+
+    int written = pack_store_write(key->pack, inode, chunk, record, (int)size, 0);
+    if (written < 0)
+        log_error("error writing %i bytes to pack store (errno: %i)", size, errno);
+    free(buffer);
+
+    return written;
+}
+
+static int edfs_write_block_data(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *data, size_t size, time_t timestamp) {
+    char fullpath[MAX_PATH_LEN];
+    char b64name[MAX_B64_HASH_LEN];
+    struct stat attrib;
+
+    if (key->pack)
+        return edfs_write_pack_block(edfs_context, key, inode, chunk, data, size, timestamp);
+
+#ifdef EDFS_EMULATED_STORE
+    store_adjustpath2(key, fullpath, computename(inode, b64name), chunk / STORE_CHUNKS_PER_FILE);
+    if (!store_stat(fullpath, chunk % STORE_CHUNKS_PER_FILE, &attrib)) {
+        if (!edfs_may_write_block(edfs_context, key, inode)) {
+            log_warn("refused to update file block because file is open for write");
+            return -1;
+        }
+        if (timestamp) {
+            // at least 3 seconds after creation
+            if (attrib.st_ctime - attrib.st_mtime >= 3) {
+                if ((attrib.st_mtime > timestamp) && (attrib.st_size >= size)) {
+                    log_info("file block %s is newer than received", fullpath);
+                    return -1;
+                }
+
+                if ((attrib.st_mtime == timestamp) && (attrib.st_size == size)) {
+                    log_info("file block %s seems the same (%i bytes)", fullpath, size);
+                    return -1;
+                }
+            }
+        }
+        if (!edfs_check_block_hash(edfs_context, key, inode, chunk, data, size)) {
+            log_warn("refused to update file block: hash mismatch");
+            return -1;
+        }
+    }
     struct store_data *f = store_open(fullpath, 1, chunk % STORE_CHUNKS_PER_FILE);
     if (!f) {
         log_error("error opening block file %s", fullpath);
@@ -4084,7 +5077,17 @@ int edfs_write_block(struct edfs *edfs_context, struct edfs_key_data *key, uint6
     edfs_file_unlock(edfs_context, f);
     fclose(f);
 #endif
+    return written;
+}
 
+int edfs_write_block(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t inode, int64_t chunk, const unsigned char *data, size_t size, time_t timestamp) {
+    // remote update, invalidated again after the write: a concurrent read may have cached the old chunk
+    chunk_cache_invalidate(edfs_context->chunk_cache, key->key_id_xxh64_be, inode, chunk);
+    int written = edfs_write_block_data(edfs_context, key, inode, chunk, data, size, timestamp);
+    chunk_cache_invalidate(edfs_context->chunk_cache, key->key_id_xxh64_be, inode, chunk);
+    // readers waiting for this chunk are woken only after the cache is clean
+    if (written > 0)
+        edfs_key_data_notify_chunk(key, inode, chunk);
     return written;
 }
 
@@ -4141,6 +5144,9 @@ int edfs_write_hash_block(struct edfs *edfs_context, struct edfs_key_data *key,
     edfs_file_unlock(edfs_context, f);
     fclose(f);
 
+    if ((written == size) && (size >= 64))
+        edfs_hash_tree_set(edfs_context, adjustpath(key, fullpath, b64name), chunk, data);
+
     return written;
 }
 
@@ -4185,37 +5191,103 @@ int edfs_write_chunk(struct edfs *edfs_context, struct edfs_key_data *key, edfs_
     return bytes_written;
 }
 
+struct edfs_writeback_job {
+    struct filewritebuf *fbuf;
+    edfs_ino_t ino;
+    unsigned char *p;
+    int size;
+    int64_t offset;
+};
+
+static int edfs_write_buffer(struct edfs *edfs_context, edfs_ino_t ino, struct filewritebuf *fbuf, const unsigned char *buf, int size, int64_t offset) {
+    const char *p = (const char *)buf;
+    int err = 0;
+    thread_mutex_lock(&fbuf->write_lock);
+    int64_t initial_filesize = get_size_json(edfs_context, fbuf->key, ino);
+    int64_t filesize = initial_filesize;
+    fbuf->file_size = filesize;
+    while (size > 0) {
+        // keep writes chunk-aligned, so full chunks skip the read-modify-write in make_chunk
+        int to_write = BLOCK_SIZE - (int)(offset % BLOCK_SIZE);
+        if (to_write > size)
+            to_write = size;
+        if (!fbuf->hash_buffer) {
+            fbuf->hash_buffer = (struct edfs_hash_buffer *)malloc(sizeof(struct edfs_hash_buffer));
+            if (fbuf->hash_buffer) {
+                fbuf->hash_buffer->read_size = 0;
+                fbuf->hash_buffer->chunk = 0;
+            }
+        }
+        err = edfs_write_chunk(edfs_context, fbuf->key, ino, (const char *)p, to_write, offset, &filesize, 0, fbuf->hash_buffer);
+        if (err <= 0)
+            break;
+
+        p += err;
+        size -= err;
+        offset += err;
+    }
+
+    if (offset > initial_filesize) {
+         edfs_set_size_key(edfs_context, fbuf->key, ino, filesize);
+         fbuf->file_size = filesize;
+    }
+    thread_mutex_unlock(&fbuf->write_lock);
+    return err;
+}
+
+static void edfs_writeback_run(void *data, void *userdata) {
+    struct edfs_writeback_job *job = (struct edfs_writeback_job *)data;
+    struct filewritebuf *fbuf = job->fbuf;
+
+    int err = edfs_write_buffer((struct edfs *)userdata, job->ino, fbuf, job->p, job->size, job->offset);
+    free(job->p);
+    free(job);
+
+    // fbuf may be freed by edfs_close as soon as the lock is released
+    thread_mutex_lock(&fbuf->writeback_lock);
+    if ((err < 0) && (!fbuf->writeback_error))
+        fbuf->writeback_error = err;
+    fbuf->writeback_pending --;
+    thread_signal_raise(&fbuf->writeback_done);
+    thread_mutex_unlock(&fbuf->writeback_lock);
+}
+
+// flush barrier, waits for all the queued writes of fbuf
+static void edfs_writeback_wait(struct filewritebuf *fbuf) {
+    while (1) {
+        thread_mutex_lock(&fbuf->writeback_lock);
+        int pending = fbuf->writeback_pending;
+        thread_mutex_unlock(&fbuf->writeback_lock);
+        if (!pending)
+            break;
+        thread_signal_wait(&fbuf->writeback_done, 10);
+    }
+}
+
+// returns (and clears) the first write-back error
+static int edfs_writeback_error(struct filewritebuf *fbuf, int set_err) {
+    thread_mutex_lock(&fbuf->writeback_lock);
+    int err = fbuf->writeback_error;
+    if (set_err < 0)
+        fbuf->writeback_error = set_err;
+    else
+        fbuf->writeback_error = 0;
+    thread_mutex_unlock(&fbuf->writeback_lock);
+    return err;
+}
+
 int edfs_flush_chunk(struct edfs *edfs_context, edfs_ino_t ino, struct filewritebuf *fbuf) {
-    if ((fbuf) && (fbuf->size)) {
+    if (!fbuf)
+        return 0;
+
+    // report errors from previous (asynchronous) writes
+    int err = edfs_writeback_error(fbuf, 0);
+
+    if (fbuf->size) {
         int size = fbuf->size;
-        const char *p = (const char *)fbuf->p;
-        int err = 0;
+        unsigned char *p = fbuf->p;
         int64_t offset = fbuf->offset - fbuf->size;
-        int64_t initial_filesize = get_size_json(edfs_context, fbuf->key, ino);
-        int64_t filesize = initial_filesize;
-        fbuf->file_size = filesize;
-        while (size > 0) {
-            if (!fbuf->hash_buffer) {
-                fbuf->hash_buffer = (struct edfs_hash_buffer *)malloc(sizeof(struct edfs_hash_buffer));
-                if (fbuf->hash_buffer) {
-                    fbuf->hash_buffer->read_size = 0;
-                    fbuf->hash_buffer->chunk = 0;
-                }
-            }
-            err = edfs_write_chunk(edfs_context, fbuf->key, ino, (const char *)p, edfs_min(BLOCK_SIZE, size), offset, &filesize, 0, fbuf->hash_buffer);
-            if (err <= 0)
-                break;
 
-            p += err;
-            size -= err;
-            offset += err;
-        }
-
-        if (offset > initial_filesize) {
-             edfs_set_size_key(edfs_context, fbuf->key, ino, filesize);
-             fbuf->file_size = filesize;
-        }
-        free(fbuf->p);
         fbuf->p = NULL;
         free(fbuf->read_buffer);
         fbuf->read_buffer = NULL;
@@ -4227,12 +5299,38 @@ int edfs_flush_chunk(struct edfs *edfs_context, edfs_ino_t ino, struct filewrite
         fbuf->size = 0;
         fbuf->offset = 0;
 
-        if (err < 0)
-            return err;
-
-        return err;
+        if (edfs_context->writeback) {
+            struct edfs_writeback_job *job = (struct edfs_writeback_job *)malloc(sizeof(struct edfs_writeback_job));
+            if (job) {
+                job->fbuf = fbuf;
+                job->ino = ino;
+                job->p = p;
+                job->size = size;
+                job->offset = offset;
+
+                thread_mutex_lock(&fbuf->writeback_lock);
+                fbuf->writeback_pending ++;
+                thread_mutex_unlock(&fbuf->writeback_lock);
+                if (!writeback_submit(edfs_context->writeback, ino, job))
+                    return err;
+
+                thread_mutex_lock(&fbuf->writeback_lock);
+                fbuf->writeback_pending --;
+                thread_mutex_unlock(&fbuf->writeback_lock);
+                free(job);
+            }
+        }
+        // synchronous write, queued jobs must complete first
+        edfs_writeback_wait(fbuf);
+        int wait_err = edfs_writeback_error(fbuf, 0);
+        if (!err)
+            err = wait_err;
+        int written = edfs_write_buffer(edfs_context, ino, fbuf, p, size, offset);
+        free(p);
+        if ((written < 0) && (!err))
+            err = written;
     }
-    return 0;
+    return err;
 }
 
 int edfs_write_cache(struct edfs *edfs_context, edfs_ino_t ino, const char *buf, size_t size, int64_t off, struct filewritebuf *fbuf) {
@@ -4295,7 +5393,13 @@ int edfs_close(struct edfs *edfs_context, struct filewritebuf *fbuf) {
         }
 #endif
 
-        edfs_flush_chunk(edfs_context, fbuf->ino, fbuf);
+        int err = edfs_flush_chunk(edfs_context, fbuf->ino, fbuf);
+        edfs_writeback_wait(fbuf);
+        if (!err)
+            err = edfs_writeback_error(fbuf, 0);
+        if (err < 0)
+            log_error("write-back error %i on close", -err);
+        thread_mutex_lock(&fbuf->write_lock);
         if (fbuf->written_data) {
             uint64_t max_size = fbuf->offset; 
             unsigned char hash[32];
@@ -4305,7 +5409,7 @@ int edfs_close(struct edfs *edfs_context, struct filewritebuf *fbuf) {
             adjustpath(fbuf->key, fullpath, computename(fbuf->ino, b64name));
             if (fbuf->hash_buffer)
                 edfs_update_hash(edfs_context, fbuf->key, fullpath, -1, NULL, 0, fbuf->hash_buffer);
-            if (edfs_update_chain(edfs_context, fbuf->key, fbuf->ino, fbuf->file_size, hash, NULL)) {
+            if (edfs_update_chain(edfs_context, fbuf->key, fbuf->ino, fbuf->file_size, hash, NULL, NULL)) {
                 const char *update_data[] = {"iostamp", (const char *)hash, NULL, NULL};
                 edfs_update_json(edfs_context, fbuf->key, fbuf->ino, update_data);
             } else
@@ -4316,6 +5420,7 @@ int edfs_close(struct edfs *edfs_context, struct filewritebuf *fbuf) {
                 edfs_update_json_number_if_less(edfs_context, fbuf->key, fbuf->ino, "size", max_size);
             edfs_notify_write(edfs_context, fbuf->key, fbuf->ino, 0);
         }
+        thread_mutex_unlock(&fbuf->write_lock);
         if (edfs_context->mutex_initialized)
             thread_mutex_lock(&fbuf->key->ino_cache_lock);
         void *ino_cache = avl_remove(&fbuf->key->ino_cache, (void *)(uintptr_t)fbuf->ino);
@@ -4332,8 +5437,13 @@ int edfs_close(struct edfs *edfs_context, struct filewritebuf *fbuf) {
         free(fbuf->read_buffer);
         free(fbuf->read_hash_buffer);
         free(fbuf->hash_buffer);
+        thread_signal_term(&fbuf->writeback_done);
+        thread_mutex_term(&fbuf->writeback_lock);
+        thread_mutex_term(&fbuf->write_lock);
         free(fbuf);
 
+        if (err < 0)
+            return err;
     }
     return 0;
 }
@@ -4362,35 +5472,19 @@ int edfs_lookup_blockchain(struct edfs *edfs_context, struct edfs_key_data *key,
     if (generation)
         *generation = 0;
 
-    struct block *blockchain = key->chain;
-    int i;
-    int record_size = sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t) + 32;
-    uint64_t inode_be = htonll(inode);
-    while ((blockchain) && ((blockchain->timestamp + EDFS_BLOCKCHAIN_NEW_BLOCK_TIMEOUT) >= block_timestamp_limit)) {
-        int len = blockchain->data_len - 72;
-        if (len >= record_size) {
-            unsigned char *ptr = blockchain->data;
-            for (i = 0; i < len; i += record_size) {
-                if (*(uint64_t *)ptr == inode_be) {
-                    if (generation) {
-                        memcpy(generation, ptr + sizeof(uint64_t), sizeof(uint64_t));
-                        *generation = ntohll(*generation);
-                    }
-                    if (timestamp) {
-                        memcpy(timestamp, ptr + sizeof(uint64_t) + sizeof(uint64_t), sizeof(uint64_t));
-                        *timestamp = ntohll(*timestamp);
-                    }
-                    if (blockchainhash)
-                        memcpy(blockchainhash, ptr + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t), 32);
-                    log_debug("got data from blockchain");
-                    return 1;
-                }
-                ptr += record_size;
-            }
-        }
-        blockchain = (struct block *)blockchain->previous_block;
-    }
-    return 0;
+    // latest record for inode (block timestamps increase with the height)
+    struct chain_index_record record;
+    if ((!chain_index_lookup(key->chain_index, inode, &record)) || (record.block_timestamp + EDFS_BLOCKCHAIN_NEW_BLOCK_TIMEOUT < block_timestamp_limit))
+        return 0;
+
+    if (generation)
+        *generation = record.generation;
+    if (timestamp)
+        *timestamp = record.timestamp;
+    if (blockchainhash)
+        memcpy(blockchainhash, record.hash, 32);
+    log_debug("got data from blockchain");
+    return 1;
 }
 
 struct dirbuf *edfs_opendir_key(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t ino) {
@@ -4606,6 +5700,9 @@ int remove_node(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t
     char parentb64name[MAX_B64_HASH_LEN];
     int err;
     adjustpath(key, fullpath, computename(inode, b64name));
+    chunk_cache_invalidate(edfs_context->chunk_cache, key->key_id_xxh64_be, inode, -1);
+    if (key->pack)
+        pack_store_unlink_inode(key->pack, inode);
     if (recursive)
         recursive_rmdir(fullpath);
     else
@@ -4614,6 +5711,7 @@ int remove_node(struct edfs *edfs_context, struct edfs_key_data *key, edfs_ino_t
 #ifdef EDFS_USE_HARD_DELETE
     strcat(fullpath, ".json");
     unlink(fullpath);
+    edfs_key_data_descriptor_invalidate(key, inode);
 #else
     if (!is_broadcast)
         edfs_update_json_number(edfs_context, key, inode, "deleted", 1);
@@ -4719,15 +5817,19 @@ int edfs_unlink(struct edfs *edfs_context, edfs_ino_t parent, const char *name)
 }
 
 int edfs_flush(struct edfs *edfs_context, struct filewritebuf *fbuf) {
-    if (fbuf)
-        edfs_flush_chunk(edfs_context, fbuf->ino, fbuf);
+    if (fbuf) {
+        int err = edfs_flush_chunk(edfs_context, fbuf->ino, fbuf);
+        edfs_writeback_wait(fbuf);
+        if (!err)
+            err = edfs_writeback_error(fbuf, 0);
+        if (err < 0)
+            return err;
+    }
     return 0;
 }
 
 int edfs_fsync(struct edfs *edfs_context, int datasync, struct filewritebuf *fbuf) {
-    if (fbuf)
-        edfs_flush_chunk(edfs_context, fbuf->ino, fbuf);
-    return 0;
+    return edfs_flush(edfs_context, fbuf);
 }
 
 int edfs_mknod(struct edfs *edfs_context, edfs_ino_t parent, const char *name, mode_t mode, uint64_t *inode) {
@@ -4755,6 +5857,7 @@ int edfs_genesis_if_new(struct edfs *edfs_context, struct edfs_key_data *key) {
     log_info("please wait while initializing first block");
     key->chain = block_new(NULL, edwork_who_i_am(edfs_context->edwork), 32);
     block_mine(key->chain, BLOCKCHAIN_COMPLEXITY);
+    chain_index_update(key->chain_index, key->chain);
     edfs_block_save(edfs_context, key, key->chain);
     key->top_broadcast_timestamp = 0;
     log_info("done");
@@ -5007,16 +6110,26 @@ int edfs_rmkey(struct edfs *edfs_context, const char *key_id) {
                 log_error("cannot delete primary key");
                 return -1;
             }
-            if ((key->opened_files > 0) || (key->mining_flag)) {
+            if ((key->opened_files > 0) || (key->mining_flag) || (thread_atomic_int_load(&key->pending_jobs) > 0)) {
                 log_error("key is in use");
                 return -1;
             }
+            // no packet handler is running while the key is unlinked
+            if (edfs_context->edwork)
+                edwork_callback_lock(edfs_context->edwork, 1);
             avl_remove(&edfs_context->key_tree, (void *)(uintptr_t)key->key_id_xxh64_be);
             if (prev_key)
                 prev_key->next_key = key->next_key;
             else
                 edfs_context->key_data = (struct edfs_key_data *)key->next_key;
+            if (edfs_context->edwork)
+                edwork_callback_lock(edfs_context->edwork, 0);
+
+            // packets queued before the key was unlinked
+            while (thread_atomic_int_load(&key->pending_jobs) > 0)
+                usleep(1000);
 
+            key_cache_invalidate(edfs_context->key_cache, key->key_id_xxh64_be);
             edfs_key_data_deinit(key);
             free(key);
 
@@ -5115,6 +6228,35 @@ int edfs_peers_info(struct edfs *edfs_context, char *buffer, int buffer_size, in
     return edwork_debug_node_list(edfs_context->edwork, buffer, buffer_size, (unsigned int)0, time(NULL) - EDWROK_LAST_SEEN_TIMEOUT, html);
 }
 
+int edfs_messages_info(struct edfs *edfs_context, char *buffer, int buffer_size, int html) {
+    if ((!edfs_context) || (!buffer) || (buffer_size <= 0))
+        return -1;
+
+    const char *prefix = html ? "\n<br/>" : "\n";
+    int records = 0;
+    int i;
+    buffer[0] = 0;
+    for (i = 0; i < EDWORK_MESSAGE_SLOTS; i++) {
+        struct edwork_message_slot *slot = &edfs_context->messages[i];
+        if (!slot->message)
+            continue;
+        int received = thread_atomic_int_load(&slot->received);
+        if (!received)
+            continue;
+        int flags = slot->message->flags;
+        int written = snprintf(buffer, buffer_size, "%s%.4s: %i received%s%s%s%s", prefix, slot->message->name, received, (flags & EDWORK_MESSAGE_SIGNED) ? ", signed" : "", (flags & EDWORK_MESSAGE_PROOF_OF_WORK) ? ", proof of work" : "", (flags & EDWORK_MESSAGE_ENCRYPTED) ? ", encrypted" : "", (flags & EDWORK_MESSAGE_ACK) ? ", acknowledged" : "");
+        if ((written <= 0) || (written >= buffer_size))
+            return records;
+        buffer += written;
+        buffer_size -= written;
+        records ++;
+    }
+    int unsupported = thread_atomic_int_load(&edfs_context->messages_unsupported);
+    if (unsupported)
+        snprintf(buffer, buffer_size, "%sunsupported: %i received", prefix, unsupported);
+    return records;
+}
+
 int edfs_list_keys(struct edfs *edfs_context, char *buffer, int buffer_size) {
     if (!edfs_context)
         return -1;
@@ -5239,14 +6381,14 @@ int edfs_shard_data_request(struct edfs *edfs_context, uint64_t inode, uint64_t
 
     adjustpath(key, fullpath, computename(inode, b64name));
 
-    if (chunk_exists(fullpath, chunk))
+    if (chunk_exists(key, inode, fullpath, chunk))
         return 1;
 
     // file was deleted
     if (get_deleted_json(edfs_context, key, inode))
         return 1;
 #ifdef WITH_SCTP
-    request_data_sctp(edfs_context, key, inode, chunk, edwork_random() % 10, NULL, NULL, 0, fullpath, 0, NULL);
+    request_data_sctp(edfs_context, key, inode, chunk, edwork_random() % 10, NULL, NULL, 0, fullpath, 0, NULL, NULL);
 #else
     request_data(edfs_context, key, inode, chunk, 1, edwork_random() % 10, NULL, NULL, 0);
 #endif
@@ -5285,7 +6427,7 @@ void edfs_ensure_data(struct edfs *edfs_context, struct edfs_key_data *key, uint
     uint32_t hash_buffer[BLOCK_SIZE / sizeof(uint32_t)];
     unsigned int chunk_offset = 0;
     int has_hash = edfs_get_hash2(edfs_context, key, fullpath, inode, chunk, hash_buffer, &chunk_offset);
-    while (chunk_exists(fullpath, chunk)) {
+    while (chunk_exists(key, inode, fullpath, chunk)) {
         uint32_t signature_hash = 0;
         if (has_hash > 0) {
             if (chunk_offset >= has_hash)
@@ -5331,7 +6473,7 @@ void edfs_ensure_data(struct edfs *edfs_context, struct edfs_key_data *key, uint
         }
     } else {
         if (try_update_hash) {
-            edfs_try_make_hash(edfs_context, key, fullpath, file_size);
+            edfs_try_make_hash(edfs_context, key, inode, fullpath, file_size);
             edfs_request_hash_if_needed(edfs_context, key, inode);
         }
 
@@ -5418,7 +6560,9 @@ int edwork_process_json(struct edfs *edfs_context, struct edfs_key_data *key, co
                 json_value_free(root_value);
                 return 0;
             }
-            if (edfs_write_file(edfs_context, key, key->working_directory, b64name, (const unsigned char *)payload, size , ".json", 0, NULL, NULL, NULL, NULL, 1, 0, 0) != size ) {
+            int err = edfs_write_file(edfs_context, key, key->working_directory, b64name, (const unsigned char *)payload, size , ".json", 0, NULL, NULL, NULL, NULL, 1, 0, 0);
+            edfs_key_data_descriptor_invalidate(key, inode);
+            if (err != size) {
                 log_warn("error writing root file %s", b64name);
                 written = -1;
             }
@@ -5471,7 +6615,9 @@ int edwork_process_json(struct edfs *edfs_context, struct edfs_key_data *key, co
                     else
                         remove_node(edfs_context, key, parent, inode, 1, generation, 1);
                 }
-                if (edfs_write_file(edfs_context, key, key->working_directory, b64name, (const unsigned char *)payload, size , ".json", 0, NULL, NULL, NULL, NULL, 1, 0, 0) != size ) {
+                int err = edfs_write_file(edfs_context, key, key->working_directory, b64name, (const unsigned char *)payload, size , ".json", 0, NULL, NULL, NULL, NULL, 1, 0, 0);
+                edfs_key_data_descriptor_invalidate(key, inode);
+                if (err != size) {
                     log_warn("error writing file %s", b64name);
                     written = -1;
                 } else
@@ -5557,6 +6703,18 @@ int edwork_cache_addr(struct edfs *edfs_context, struct edfs_key_data *key, uint
     return 1;
 }
 
+// data packets may be handled by several dispatch threads
+static void edfs_inode_lock(struct edfs *edfs_context, uint64_t inode, int lock) {
+    if (!edfs_context->mutex_initialized)
+        return;
+
+    thread_mutex_t *mutex = &edfs_context->inode_locks[(inode ^ (inode >> 32)) % EDFS_INODE_LOCKS];
+    if (lock)
+        thread_mutex_lock(mutex);
+    else
+        thread_mutex_unlock(mutex);
+}
+
 int edwork_process_data(struct edfs *edfs_context, struct edfs_key_data *key, const unsigned char *payload, int size, int do_verify, void *clientaddr, int clientaddrlen) {
     if (do_verify) {
         if (size <= 160) {
@@ -5599,7 +6757,7 @@ int edwork_process_data(struct edfs *edfs_context, struct edfs_key_data *key, co
 #ifdef USE_COMPRESSION
             unsigned char compressed_buffer[BLOCK_SIZE_MAX];
             mz_ulong max_len = sizeof(compressed_buffer);
-            if (uncompress(compressed_buffer, &max_len, payload + delta_size + signature_size + 64, datasize - 64) != Z_OK) {
+            if (chunk_codec_decompress(compressed_buffer, &max_len, payload + delta_size + signature_size + 64, datasize - 64)) {
                 log_warn("error uncompressing data packet");
                 return -1;
             }
@@ -5619,8 +6777,12 @@ int edwork_process_data(struct edfs *edfs_context, struct edfs_key_data *key, co
         // includes a signature
         if (signature_size)
             datasize += 64;
+        edfs_inode_lock(edfs_context, inode, 1);
         int written_bytes = edfs_write_block(edfs_context, key, inode, chunk, payload + 32 + signature_size, datasize, timestamp / 1000000);
+        edfs_inode_lock(edfs_context, inode, 0);
         edwork_cache_addr(edfs_context, key, inode, clientaddr, clientaddrlen);
+        if (written_bytes == datasize)
+            fetch_scheduler_complete(edfs_context->fetch_scheduler, key->key_id_xxh64_be, inode, chunk, clientaddr, clientaddrlen, size, microseconds());
 
         if ((edfs_context->shards) && ((inode % edfs_context->shards) == edfs_context->shard_id))
             edfs_queue_ensure_data(edfs_context, key, inode, (uint64_t)0, 1, 0, 0);
@@ -5666,7 +6828,9 @@ int edwork_process_hash(struct edfs *edfs_context, struct edfs_key_data *key, co
         if (signature_size)
             datasize += 64;
 
+        edfs_inode_lock(edfs_context, inode, 1);
         int written_bytes = edfs_write_hash_block(edfs_context, key, inode, chunk, payload + 32 + signature_size, datasize, timestamp / 1000000);
+        edfs_inode_lock(edfs_context, inode, 0);
         edwork_cache_addr(edfs_context, key, inode, clientaddr, clientaddrlen);
         if (written_bytes == datasize) {
             written = 1;
@@ -5826,9 +6990,8 @@ void edfs_broadcast_top(struct edfs *edfs_context, struct edfs_key_data *key, vo
         if (microseconds() - key->client_top_broadcast_timestamp < 1000000)
             return;
     }
-    char b64name[MAX_B64_HASH_LEN];
     unsigned char buffer[EDWORK_PACKET_SIZE];
-    int len = edfs_read_file(edfs_context, key, key->blockchain_directory, computeblockname(key->chain->index, b64name), buffer, EDWORK_PACKET_SIZE, NULL, 0, 0, 0, NULL, 0, 1, 0, 0);
+    int len = edfs_chain_read(edfs_context, key, key->chain->index, buffer, EDWORK_PACKET_SIZE);
     if (len > 0) {
         edfs_notify_io(edfs_context, key, "topb", (const unsigned char *)buffer, len, NULL, 0, 0, 0, 0, 0, 0, use_clientaddr, clientaddr_len, NULL, NULL);
         log_info("broadcasting chain block");
@@ -5837,25 +7000,12 @@ void edfs_broadcast_top(struct edfs *edfs_context, struct edfs_key_data *key, vo
     }
 }
 
-int edfs_block_contains_descriptor(struct block *blockchain, uint64_t inode, uint64_t inode_generation) {
-    if (!blockchain)
+int edfs_block_contains_descriptor(struct edfs_key_data *key, uint64_t inode, uint64_t inode_generation) {
+    struct chain_index_record record;
+    if ((!key->chain) || (!chain_index_lookup(key->chain_index, inode, &record)))
         return 0;
 
-    int i;
-    int record_size = sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t) + 32;
-    int len = blockchain->data_len - 72;
-    uint64_t blockchain_generation = 0;
-    if (len >= record_size) {
-        unsigned char *ptr = blockchain->data;
-        for (i = 0; i < len; i += record_size) {
-            uint64_t blockchain_inode = ntohll(*(uint64_t *)ptr);
-            memcpy(&blockchain_generation, ptr + sizeof(uint64_t), sizeof(uint64_t));
-            blockchain_generation = ntohll(blockchain_generation);
-            if ((inode == blockchain_inode) && (inode_generation == blockchain_generation))
-                return 1;
-        }
-    }
-    return 0;
+    return (record.generation == inode_generation);
 }
 
 void edfs_try_new_block(struct edfs *edfs_context, struct edfs_key_data *key) {
@@ -5882,7 +7032,7 @@ void edfs_try_new_block(struct edfs *edfs_context, struct edfs_key_data *key) {
                 if (!read_file_json(edfs_context, key, inode, NULL, NULL, &timestamp, NULL, NULL, NULL, 0, NULL, NULL, &generation, ptr + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t), NULL))
                     memset(ptr + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t), 0, 32);
 
-                if (edfs_block_contains_descriptor(key->chain, inode, generation)) {
+                if (edfs_block_contains_descriptor(key, inode, generation)) {
                     log_debug("data already in blockchain");
                     continue;
                 }
@@ -5930,6 +7080,7 @@ void edfs_try_new_block(struct edfs *edfs_context, struct edfs_key_data *key) {
                 // check if someone finished faster
                 if ((has_new_block) && (key->chain->index == newblock->index - 1) && (key->chain == old_chain)) {
                     key->chain = newblock;
+                    chain_index_update(key->chain_index, key->chain);
                     edfs_block_save(edfs_context, key, key->chain);
                     // TODO: update all directory hashes
                     edfs_broadcast_top(edfs_context, key, NULL, 0);
@@ -5987,13 +7138,13 @@ int edfs_check_blockhash(struct edfs *edfs_context, struct edfs_key_data *key, c
     if (!key->chain)
         return 0;
 
-    struct block *block2 = key->chain;
-    do {
-        if (!memcmp(block2->hash, blockhash, 32))
-            return 1;
+    uint64_t height;
+    uint64_t chain_size = chain_index_size(key->chain_index);
+    if (maxlevel < 0)
+        maxlevel = 0;
+    if ((chain_index_find_hash(key->chain_index, blockhash, &height)) && (chain_size) && (chain_size - 1 - height <= (uint64_t)maxlevel))
+        return 1;
 
-        block2 = (struct block *)block2->previous_block;
-    } while ((block2) && (maxlevel-- > 0));
     if (!key->hblk_scheduled) {
         key->block_timestamp = time(NULL);
         key->hblk_scheduled = 1;
@@ -6003,6 +7154,13 @@ int edfs_check_blockhash(struct edfs *edfs_context, struct edfs_key_data *key, c
     return 0;
 }
 
+static int edfs_chain_latest_record(struct edfs_key_data *key, struct block *blockchain, uint64_t inode) {
+    struct chain_index_record record;
+    if (!chain_index_lookup(key->chain_index, inode, &record))
+        return 1;
+    return (record.height <= blockchain->index);
+}
+
 void edfs_new_chain_request_descriptors(struct edfs *edfs_context, struct edfs_key_data *key, int level) {
     struct block *blockchain = key->chain;
     unsigned char hash[32];
@@ -6020,6 +7178,10 @@ void edfs_new_chain_request_descriptors(struct edfs *edfs_context, struct edfs_k
             unsigned char *ptr = blockchain->data;
             for (i = 0; i < len; i += record_size) {
                 uint64_t inode = ntohll(*(uint64_t *)ptr);
+                if (!edfs_chain_latest_record(key, blockchain, inode)) {
+                    ptr += record_size;
+                    continue;
+                }
                 uint64_t inode_version = 0;
                 int64_t file_size = 0;
                 int type = read_file_json(edfs_context, key, inode, NULL, &file_size, NULL, NULL, NULL, NULL, 0, NULL, NULL, &inode_version, hash, NULL);
@@ -6055,6 +7217,11 @@ void edfs_chain_ensure_descriptors(struct edfs *edfs_context, struct edfs_key_da
             unsigned char *ptr = blockchain->data;
             for (i = 0; i < len; i += record_size) {
                 uint64_t inode = ntohll(*(uint64_t *)ptr);
+                // inode descriptor was updated in a newer block
+                if (!edfs_chain_latest_record(key, blockchain, inode)) {
+                    ptr += record_size;
+                    continue;
+                }
                 uint64_t inode_version = 0;
                 int64_t file_size = 0;
 
@@ -6166,976 +7333,1175 @@ int edwork_vote_received(struct edfs *edfs_context, const unsigned char *payload
     return vote_err;
 }
 
-void edwork_callback(struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, void *userdata, int is_sctp, int is_listen_socket) {
-    unsigned char buffer[BLOCK_SIZE_MAX];
-    struct edfs *edfs_context = (struct edfs *)userdata;
+static void edwork_handle_ping(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("PING received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    edfs_context->ping_received = time(NULL);
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+}
 
-    if ((!edwork) || (!type) || (!edfs_context))
-        return;
-    uint64_t now = microseconds();
-    // 30 seconds before
-    if (timestamp > microseconds() + 30000000) {
-        log_warn("ignoring message with timestamp in the future received (%s)", edwork_addr_ipv4(clientaddr));
+static void edwork_handle_helo(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("HELO received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    if (is_sctp) {
+        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+        if (edwork_send_to_peer(edwork, key, "ping", NULL, 0, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) > 0)
+            log_info("PING sent");
+    } else
+    if (!payload_size) {
+        // udp peers send helo only to advertise their capabilities
+        log_warn("HELO received on non-SCTP socket");
+    }
+}
+
+static void edwork_handle_addr(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    log_info("ADDR list received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    if (time(NULL) - edfs_context->list_timestamp > 10) {
+        log_warn("dropping non-requested ADDR");
         return;
     }
-    // 5 minutes back
-    if (timestamp < microseconds() - 300000000) {
-        log_warn("ignoring too old message (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 4) {
+        log_warn("ADDR packet too small");
         return;
     }
-    if (!memcmp(type, "ping", 4)) {
-        log_info("PING received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        edfs_context->ping_received = time(NULL);
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    int records = edwork_add_node_list(edwork, payload + 4, payload_size - 4);
+    if (records > 0) {
+        uint32_t offset = htonl(ntohl(*(uint32_t *)payload) + records);
+        edfs_notify_io(edfs_context, key, "list", (const unsigned char *)&offset, sizeof(uint32_t), NULL, 0, 0, 0, 0, EDWORK_LIST_WORK_LEVEL, 0, clientaddr, clientaddrlen, NULL, NULL);
+        edfs_context->list_timestamp = time(NULL);
+    }
+}
+
+static void edwork_handle_ack(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("ACK received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    if ((!payload) || (payload_size != 8)) {
+        log_error("invalid payload");
         return;
     }
-    if (!memcmp(type, "helo", 4)) {
-        log_info("HELO received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        if (is_sctp) {
-            edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-            if (edwork_send_to_peer(edwork, key, "ping", NULL, 0, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) > 0)
-                log_info("PING sent");
-        } else {
-            log_warn("HELO received on non-SCTP socket");
-        }
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edwork_confirm_seq(edwork, key, ntohll(*(uint64_t *)payload), 1);
+}
+
+static void edwork_handle_nack(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("NACK received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    if ((!payload) || (payload_size != 8)) {
+        log_error("invalid payload");
         return;
     }
-    if (!memcmp(type, "addr", 4)) {
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        log_info("ADDR list received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        if (time(NULL) - edfs_context->list_timestamp > 10) {
-            log_warn("dropping non-requested ADDR");
-            return;
-        }
-        if (payload_size < 4) {
-            log_warn("ADDR packet too small");
-            return;
-        }
-        int records = edwork_add_node_list(edwork, payload + 4, payload_size - 4);
-        if (records > 0) {
-            uint32_t offset = htonl(ntohl(*(uint32_t *)payload) + records);
-            edfs_notify_io(edfs_context, key, "list", (const unsigned char *)&offset, sizeof(uint32_t), NULL, 0, 0, 0, 0, EDWORK_LIST_WORK_LEVEL, 0, clientaddr, clientaddrlen, NULL, NULL);
-            edfs_context->list_timestamp = time(NULL);
-        }
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edwork_confirm_seq(edwork, key, ntohll(*(uint64_t *)payload), 1);
+}
+
+static void edwork_handle_want(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    log_info("WANT received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+#ifdef EDFS_RANDOMLY_IGNORE_REQUESTS
+    int magnitude = edwork_magnitude(edwork);
+    int randomly_ignore = 0;
+    if (magnitude >= 1000)
+        randomly_ignore = ((edwork_random() % 2) == 1);
+    else
+    if (magnitude >= 500)
+        randomly_ignore = ((edwork_random() % 4) == 1);
+    else
+    if (magnitude >= 100)
+        randomly_ignore = ((edwork_random() % 6) == 1);
+    else
+    if (magnitude >= 50)
+        randomly_ignore = ((edwork_random() % 10) == 1);
+    else
+    if (magnitude >= 20)
+        randomly_ignore = ((edwork_random() % 20) == 1);
+
+    if (randomly_ignore) {
+        log_info("randomly ignoring request");
         return;
     }
-    if (!memcmp(type, "ack\x00", 4)) {
-        log_info("ACK received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        if ((!payload) || (payload_size != 8)) {
-            log_error("invalid payload");
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        edwork_confirm_seq(edwork, key, ntohll(*(uint64_t *)payload), 1);
+#endif
+
+    int is_bigchunk = !memcmp(type, "wan5", 4);
+    int is_encrypted = (is_bigchunk) || (!memcmp(type, "wan4", 4));
+
+    if ((!payload) || (payload_size < 68)) {
+        log_warn("WANT packet too small");
         return;
     }
-    if (!memcmp(type, "nack", 4)) {
-        log_info("NACK received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        if ((!payload) || (payload_size != 8)) {
-            log_error("invalid payload");
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        edwork_confirm_seq(edwork, key, ntohll(*(uint64_t *)payload), 1);
+
+    if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
+        log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+        edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
         return;
     }
-    if ((!memcmp(type, "want", 4)) || (!memcmp(type, "wan3", 4)) || (!memcmp(type, "wan4", 4)) || (!memcmp(type, "wan5", 4))) {
-        log_info("WANT received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-#ifdef EDFS_RANDOMLY_IGNORE_REQUESTS
-        int magnitude = edwork_magnitude(edwork);
-        int randomly_ignore = 0;
-        if (magnitude >= 1000)
-            randomly_ignore = ((edwork_random() % 2) == 1);
-        else
-        if (magnitude >= 500)
-            randomly_ignore = ((edwork_random() % 4) == 1);
-        else
-        if (magnitude >= 100)
-            randomly_ignore = ((edwork_random() % 6) == 1);
-        else
-        if (magnitude >= 50)
-            randomly_ignore = ((edwork_random() % 10) == 1);
-        else
-        if (magnitude >= 20)
-            randomly_ignore = ((edwork_random() % 20) == 1);
 
-        if (randomly_ignore) {
-            log_info("randomly ignoring request");
-            return;
-        }
-#endif
+    uint64_t ino = ntohll(*(uint64_t *)payload);
+    uint64_t chunk = ntohll(*(uint64_t *)(payload + 8));
+    unsigned short other_chunks = 0;
+    int other_chunk_index = 0;
+    int payload_offset;
+    if (is_bigchunk) {
+        other_chunks = ntohs(*(uint16_t *)(payload + 20));
+        payload_offset = 54 + other_chunks * sizeof(uint64_t);
 
-        int is_bigchunk = !memcmp(type, "wan5", 4);
-        int is_encrypted = (is_bigchunk) || (!memcmp(type, "wan4", 4));
+        log_debug("big chunk requested (%i chunks)", (int)other_chunks);
 
-        if ((!payload) || (payload_size < 68)) {
-            log_warn("WANT packet too small");
+        if (other_chunks > 10) {
+            log_warn("too many forward chunks requested");
             return;
         }
 
-        if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
-            log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-            edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
+        if (payload_size < 70 + other_chunks * sizeof(uint64_t)) {
+            log_warn("WANT packet too small");
             return;
         }
+    } else
+        payload_offset = is_encrypted ? 52 : 20;
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, payload_offset, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
 
-        uint64_t ino = ntohll(*(uint64_t *)payload);
-        uint64_t chunk = ntohll(*(uint64_t *)(payload + 8));
-        unsigned short other_chunks = 0;
-        int other_chunk_index = 0;
-        int payload_offset;
-        if (is_bigchunk) {
-            other_chunks = ntohs(*(uint16_t *)(payload + 20));
-            payload_offset = 54 + other_chunks * sizeof(uint64_t);
-
-            log_debug("big chunk requested (%i chunks)", (int)other_chunks);
-
-            if (other_chunks > 10) {
-                log_warn("too many forward chunks requested");
-                return;
-            }
-
-            if (payload_size < 70 + other_chunks * sizeof(uint64_t)) {
-                log_warn("WANT packet too small");
+    void *clientinfo = edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    if (clientinfo) {
+        uint64_t last_ino;
+        uint64_t last_chunk;
+        uint64_t last_msg_timestamp;
+        if (edwork_get_info(clientinfo, &last_ino, &last_chunk, &last_msg_timestamp)) {
+            if ((ino == last_ino) && (chunk == last_chunk) && ((microseconds() - last_msg_timestamp) <= 50000)) {
+                log_info("ignoring same request from same client");
                 return;
             }
-        } else
-            payload_offset = is_encrypted ? 52 : 20;
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, payload_offset, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
         }
+        edwork_set_info(clientinfo, ino, chunk, microseconds());
+    }
 
-        void *clientinfo = edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        if (clientinfo) {
-            uint64_t last_ino;
-            uint64_t last_chunk;
-            uint64_t last_msg_timestamp;
-            if (edwork_get_info(clientinfo, &last_ino, &last_chunk, &last_msg_timestamp)) {
-                if ((ino == last_ino) && (chunk == last_chunk) && ((microseconds() - last_msg_timestamp) <= 50000)) {
-                    log_info("ignoring same request from same client");
+    if (ino > 0) {
+        int loop_count = 0;
+        int size;
+        uint32_t chunk_hash = ntohll(*(uint32_t *)(payload + 16));
+one_loop:
+        size = edfs_reply_chunk(edfs_context, key, ino, chunk, buffer + 32, sizeof(buffer), chunk_hash);
+        if (size > 0) {
+            unsigned char *additional_data = buffer;
+            *(uint64_t *)additional_data = htonll(ino);
+            *(uint64_t *)(additional_data + 8) = htonll(chunk);
+            *(uint64_t *)(additional_data + 16) = htonll(microseconds());
+            *(uint64_t *)(additional_data + 24) = htonll(size);
+
+            if (is_encrypted) {
+                if (payload_size < 100) {
+                    log_warn("WAN4 packet too small");
                     return;
                 }
-            }
-            edwork_set_info(clientinfo, ino, chunk, microseconds());
-        }
-
-        if (ino > 0) {
-            int loop_count = 0;
-            int size;
-            uint32_t chunk_hash = ntohll(*(uint32_t *)(payload + 16));
-one_loop:
-            size = edfs_reply_chunk(edfs_context, key, ino, chunk, buffer + 32, sizeof(buffer), chunk_hash);
-            if (size > 0) {
-                unsigned char *additional_data = buffer;
-                *(uint64_t *)additional_data = htonll(ino);
-                *(uint64_t *)(additional_data + 8) = htonll(chunk);
-                *(uint64_t *)(additional_data + 16) = htonll(microseconds());
-                *(uint64_t *)(additional_data + 24) = htonll(size);
-
-                if (is_encrypted) {
-                    if (payload_size < 100) {
-                        log_warn("WAN4 packet too small");
-                        return;
-                    }
-                    unsigned char shared_secret[32];
+                unsigned char shared_secret[32];
 
-                    if (is_bigchunk)
-                        curve25519(shared_secret, edfs_context->key.secret, payload + 22 + other_chunks * sizeof(uint64_t));
-                    else
-                        curve25519(shared_secret, edfs_context->key.secret, payload + 20);
+                if (is_bigchunk)
+                    edfs_shared_secret(edfs_context, &edfs_context->key, payload + 22 + other_chunks * sizeof(uint64_t), shared_secret);
+                else
+                    edfs_shared_secret(edfs_context, &edfs_context->key, payload + 20, shared_secret);
 
-                    unsigned char buf2[BLOCK_SIZE_MAX];
-                    memcpy(buf2, edfs_context->key.pk, 32);
+                unsigned char buf2[BLOCK_SIZE_MAX];
+                memcpy(buf2, edfs_context->key.pk, 32);
 
-                    int size2 = edwork_encrypt(edfs_context, key, buffer, size + 32, buf2 + 32, who_am_i, edwork_who_i_am(edwork), shared_secret);
-                    if (edwork_send_to_peer(edwork, key, "dat4", buf2, size2 + 32, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
-                        log_error("error sending DAT4");
-                        if ((!loop_count) && (edwork_unspend(edwork, payload + payload_offset, payload_size - payload_offset)))
-                            log_trace("token unspent");
-                    } else {
-                        log_info("DAT4 sent");
-                        if (other_chunks > 0) {
-                            if (other_chunk_index < other_chunks) {
-                                chunk_hash = 0;
-                                uint64_t other_chunk = ntohll(*(uint64_t *)(payload + 22 + other_chunk_index * sizeof(uint64_t)));
-                                if (other_chunk != chunk) {
-                                    other_chunk_index ++;
-                                    chunk = other_chunk;
-                                    goto one_loop;
-                                }
-                            }
-                        }
-#ifndef EDFS_DISABLE_FORWARD_BLOCK_SEND
-                        else
-                        if ((is_sctp) && (loop_count < 2)) {
+                int size2 = edwork_encrypt(edfs_context, key, buffer, size + 32, buf2 + 32, who_am_i, edwork_who_i_am(edwork), shared_secret);
+                if (edwork_send_to_peer(edwork, key, "dat4", buf2, size2 + 32, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
+                    log_error("error sending DAT4");
+                    if ((!loop_count) && (edwork_unspend(edwork, payload + payload_offset, payload_size - payload_offset)))
+                        log_trace("token unspent");
+                } else {
+                    log_info("DAT4 sent");
+                    if (other_chunks > 0) {
+                        if (other_chunk_index < other_chunks) {
                             chunk_hash = 0;
-                            chunk += 10;
-                            loop_count ++;
-                            goto one_loop;
+                            uint64_t other_chunk = ntohll(*(uint64_t *)(payload + 22 + other_chunk_index * sizeof(uint64_t)));
+                            if (other_chunk != chunk) {
+                                other_chunk_index ++;
+                                chunk = other_chunk;
+                                goto one_loop;
+                            }
                         }
-#endif
                     }
-                } else
-                if (!memcmp(type, "wan3", 4)) {
-                    unsigned char buf2[BLOCK_SIZE_MAX];
-                    int size2 = edwork_encrypt(edfs_context, key, buffer, size + 32, buf2, who_am_i, edwork_who_i_am(edwork), NULL);
-                    if (edwork_send_to_peer(edwork, key, "dat3", buf2, size2, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
-                        log_error("error sending DAT3");
-                    else
-                        log_info("DAT3 sent");
-                } else {
-                    if (edwork_send_to_peer(edwork, key, "dat2", buffer, size + 32, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
-                        log_error("error sending DAT2");
+#ifndef EDFS_DISABLE_FORWARD_BLOCK_SEND
                     else
-                        log_info("DAT2 sent");
+                    if ((is_sctp) && (loop_count < 2)) {
+                        chunk_hash = 0;
+                        chunk += 10;
+                        loop_count ++;
+                        goto one_loop;
+                    }
+#endif
                 }
             } else
-            if ((edfs_context->proxy) && (microseconds() - edfs_context->proxy_timestamp > 500000)) {
-                log_trace("forwarding chunk request");
-                request_data(edfs_context, key, ino, chunk, 1, 0, NULL, NULL, chunk_hash);
-                edfs_context->proxy_timestamp = microseconds();
+            if (!memcmp(type, "wan3", 4)) {
+                unsigned char buf2[BLOCK_SIZE_MAX];
+                int size2 = edwork_encrypt(edfs_context, key, buffer, size + 32, buf2, who_am_i, edwork_who_i_am(edwork), NULL);
+                if (edwork_send_to_peer(edwork, key, "dat3", buf2, size2, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
+                    log_error("error sending DAT3");
+                else
+                    log_info("DAT3 sent");
+            } else {
+                if (edwork_send_to_peer(edwork, key, "dat2", buffer, size + 32, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
+                    log_error("error sending DAT2");
+                else
+                    log_info("DAT2 sent");
             }
+        } else
+        if ((edfs_context->proxy) && (microseconds() - edfs_context->proxy_timestamp > 500000)) {
+            log_trace("forwarding chunk request");
+            request_data(edfs_context, key, ino, chunk, 1, 0, NULL, NULL, chunk_hash);
+            edfs_context->proxy_timestamp = microseconds();
         }
+    }
+}
+
+static void edwork_handle_list(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    log_info("LIST request received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    uint32_t offset = 0;
+    if ((payload) && (payload_size >= sizeof(uint32_t))) {
+        offset = ntohl(*(uint32_t *)payload);
+    } else {
+        log_warn("invalid ADDR package");
         return;
     }
-    if (!memcmp(type, "list", 4)) {
-        log_info("LIST request received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        uint32_t offset = 0;
-        if ((payload) && (payload_size >= sizeof(uint32_t))) {
-            offset = ntohl(*(uint32_t *)payload);
-        } else {
-            log_warn("invalid ADDR package");
-            return;
-        }
 
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 4, timestamp, EDWORK_LIST_WORK_LEVEL, EDWORK_LIST_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
-        }
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 4, timestamp, EDWORK_LIST_WORK_LEVEL, EDWORK_LIST_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
 
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
 
-        // add offset
-        int size = BLOCK_SIZE - 4;
-        memcpy(buffer, payload, 4);
-        int records = edwork_get_node_list(edwork, buffer + 4, &size, (unsigned int)offset, time(NULL) - EDWROK_LAST_SEEN_TIMEOUT, 0);
-        log_info("%i records found (offset: %i)", records, offset);
-        if (records > 0) {
-            size += 4;
-            if (edwork_send_to_peer(edwork, key, "addr", buffer, size, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL * 10) <= 0) {
-                log_warn("error sending address list");
-            }
+    // add offset
+    int size = BLOCK_SIZE - 4;
+    memcpy(buffer, payload, 4);
+    int records = edwork_get_node_list(edwork, buffer + 4, &size, (unsigned int)offset, time(NULL) - EDWROK_LAST_SEEN_TIMEOUT, 0);
+    log_info("%i records found (offset: %i)", records, offset);
+    if (records > 0) {
+        size += 4;
+        if (edwork_send_to_peer(edwork, key, "addr", buffer, size, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL * 10) <= 0) {
+            log_warn("error sending address list");
         }
-        return;
     }
-    if (!memcmp(type, "desc", 4)) {
-        log_info("DESC received (%s)", edwork_addr_ipv4(clientaddr));
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        // json payload
-        uint64_t ino;
-        int err = edwork_process_json(edfs_context, key, payload, payload_size, &ino);
-        *(uint64_t *)buffer = htonll(ino);
-        if (err > 0) {
-            edfs_update_proof_hash(key, sequence, timestamp, type, payload, payload_size, who_am_i, ino);
-            edfs_update_proof_inode(key, ino);
-            if (edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
-                log_error("error sending ACK");
+}
+
+static void edwork_handle_desc(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    uint64_t now = microseconds();
+    log_info("DESC received (%s)", edwork_addr_ipv4(clientaddr));
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    // json payload
+    uint64_t ino;
+    int err = edwork_process_json(edfs_context, key, payload, payload_size, &ino);
+    *(uint64_t *)buffer = htonll(ino);
+    if (err > 0) {
+        edfs_update_proof_hash(key, sequence, timestamp, type, payload, payload_size, who_am_i, ino);
+        edfs_update_proof_inode(key, ino);
+        if (edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
+            log_error("error sending ACK");
+            return;
+        }
+        log_info("DESC acknoledged");
+        // rebroadcast without ack 3 seconds
+        if (timestamp > now - 3000000UL)
+            edwork_broadcast_except(edwork, key, "desc", payload, payload_size, 0, EDWORK_NODES, clientaddr, clientaddrlen, timestamp, ino);
+    } else {
+        if (!err) {
+            if (edwork_send_to_peer(edwork, key, "nack", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
+                log_error("error sending NACK");
                 return;
             }
-            log_info("DESC acknoledged");
-            // rebroadcast without ack 3 seconds
-            if (timestamp > now - 3000000UL)
-                edwork_broadcast_except(edwork, key, "desc", payload, payload_size, 0, EDWORK_NODES, clientaddr, clientaddrlen, timestamp, ino);
-        } else {
-            if (!err) {
-                if (edwork_send_to_peer(edwork, key, "nack", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
-                    log_error("error sending NACK");
-                    return;
-                }
-            } else
-                log_warn("invalid data received");
-        }
+        } else
+            log_warn("invalid data received");
+    }
+}
+
+// received data packets are checked against the blockchain on the network thread (under callback_lock), then verified and written by the dispatch workers.
+// data and dat2 are routed by inode, so chunks of an inode are applied in the order they were received, whoever sent them.
+// dat3, dat4 and dati show the inode only after a per-peer decryption, and are routed by sender: these are answers to our own
+// requests, the same chunk answered by two peers is applied in any order, edfs_write_block
+// compares the timestamps and the hash list before replacing a stored chunk
+struct edfs_data_job {
+    void (*run)(struct edfs_data_job *job);
+    struct edfs *edfs_context;
+    struct edwork_data *edwork;
+    struct edfs_key_data *key;
+    uint64_t sequence;
+    unsigned char who_am_i[32];
+    struct sockaddr_storage clientaddr;
+    int clientaddrlen;
+    int is_sctp;
+    int is_listen_socket;
+    unsigned int payload_size;
+    unsigned char payload[1];
+};
+
+static void edfs_data_job_run(void *arg) {
+    struct edfs_data_job *job = (struct edfs_data_job *)arg;
+    struct edfs_key_data *key = job->key;
+    job->run(job);
+    free(job);
+    thread_atomic_int_dec(&key->pending_jobs);
+}
+
+// who_am_i is random for each peer
+static uint64_t edfs_route_sender(const unsigned char *who_am_i) {
+    uint64_t sender;
+    memcpy(&sender, who_am_i, sizeof(uint64_t));
+    return sender;
+}
+
+static void edfs_defer_data(struct edfs *edfs_context, struct edwork_data *edwork, void (*run)(struct edfs_data_job *job), uint64_t route, uint64_t sequence, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, int is_sctp, int is_listen_socket) {
+    if ((clientaddrlen < 0) || (clientaddrlen > (int)sizeof(struct sockaddr_storage)))
+        return;
+
+    struct edfs_data_job *job = (struct edfs_data_job *)malloc(sizeof(struct edfs_data_job) + payload_size);
+    if (!job) {
+        log_error("error allocating data job");
         return;
     }
-    if (!memcmp(type, "data", 4)) {
-        log_info("DATA received (%s)", edwork_addr_ipv4(clientaddr));
-        if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
-            log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-            edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
+    job->run = run;
+    job->edfs_context = edfs_context;
+    job->edwork = edwork;
+    job->key = key;
+    job->sequence = sequence;
+    memcpy(job->who_am_i, who_am_i, 32);
+    memset(&job->clientaddr, 0, sizeof(struct sockaddr_storage));
+    if ((clientaddr) && (clientaddrlen))
+        memcpy(&job->clientaddr, clientaddr, clientaddrlen);
+    job->clientaddrlen = clientaddrlen;
+    job->is_sctp = is_sctp;
+    job->is_listen_socket = is_listen_socket;
+    job->payload_size = payload_size;
+    if (payload_size)
+        memcpy(job->payload, payload, payload_size);
+    job->payload[payload_size] = 0;
+
+    // released by edfs_data_job_run, edfs_rmkey waits for it
+    thread_atomic_int_inc(&key->pending_jobs);
+    edwork_defer(edwork, route, edfs_data_job_run, job);
+}
+
+static void edfs_data_job_data(struct edfs_data_job *job) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    struct edfs *edfs_context = job->edfs_context;
+    struct edwork_data *edwork = job->edwork;
+    struct edfs_key_data *key = job->key;
+    const unsigned char *payload = job->payload;
+    unsigned int payload_size = job->payload_size;
+    void *clientaddr = &job->clientaddr;
+    int clientaddrlen = job->clientaddrlen;
+    int is_sctp = job->is_sctp;
+    int is_listen_socket = job->is_listen_socket;
+    uint64_t sequence = job->sequence;
+    // already decrypted by edwork_handle_data
+    int err = edwork_process_data(edfs_context, key, payload, payload_size, 1, NULL, 0);
+    if (err > 0) {
+#ifndef EDWORK_NO_ACK_DATA
+        *(uint64_t *)buffer = htonll(sequence);
+        if (edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
+            log_error("error sending ACK");
             return;
         }
-        int err;
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        if (EDFS_DATA_BROADCAST_ENCRYPTED) {
-            int size = edwork_decrypt(edfs_context, key, payload, payload_size, buffer, who_am_i, NULL, NULL);
-            if (size <= 0) {
-                log_warn("error decrypting DATA packet");
-                return;
-            }
-            err = edwork_process_data(edfs_context, key, buffer, size, 1, NULL, 0);
-        }  else
-            err = edwork_process_data(edfs_context, key, payload, payload_size, 1, NULL, 0);
-        if (err > 0) {
-#ifndef EDWORK_NO_ACK_DATA
-            *(uint64_t *)buffer = htonll(sequence);
-            if (edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
-                log_error("error sending ACK");
-                return;
-            }
-            log_info("DATA acknoledged");
+        log_info("DATA acknoledged");
 #endif
-        } else {
-            if (!err) {
-                // refused to write
-                if (edwork_send_to_peer(edwork, key, "nack", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
-                    log_error("error sending NACK");
-                    return;
-                }
+    } else {
+        if (!err) {
+            // refused to write
+            if (edwork_send_to_peer(edwork, key, "nack", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
+                log_error("error sending NACK");
+                return;
             }
-            log_warn("will not write data block");
         }
-        return;
+        log_warn("will not write data block");
     }
-    if (!memcmp(type, "dat2", 4)) {
-        log_info("DAT2 received (%s)", edwork_addr_ipv4(clientaddr));
-        if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
-            log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-            edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        int err = edwork_process_data(edfs_context, key, payload, payload_size, 0, clientaddr, clientaddrlen);
-        if (err <= 0)
-            log_warn("DAT2: will not write data block");
+}
+
+static void edwork_handle_data(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("DATA received (%s)", edwork_addr_ipv4(clientaddr));
+    if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
+        log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+        edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
         return;
     }
-    if (!memcmp(type, "dat3", 4)) {
-        log_info("DAT3 received (%s)", edwork_addr_ipv4(clientaddr));
-        if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
-            log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-            edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    // the broadcast key is cheap to use, decrypting here gives the inode to route by
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    if (EDFS_DATA_BROADCAST_ENCRYPTED) {
+        int size = edwork_decrypt(edfs_context, key, payload, payload_size, buffer, who_am_i, NULL, NULL);
+        if (size <= 0) {
+            log_warn("error decrypting DATA packet");
             return;
         }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        int size = edwork_decrypt(edfs_context, key, payload, payload_size, buffer, who_am_i, edwork_who_i_am(edwork), NULL);
-        int err = edwork_process_data(edfs_context, key, buffer, size, 0, clientaddr, clientaddrlen);
-        if (err <= 0)
-            log_warn("DAT3: will not write data block");
+        payload = buffer;
+        payload_size = size;
+    }
+    // signature[64], inode
+    if (payload_size <= 160) {
+        log_warn("dropping DATA, packet too small");
         return;
     }
-    if (!memcmp(type, "dat4", 4)) {
-        log_info("DAT4 received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 32) {
-            log_error("DAT4 packet too small");
-            return;
-        }
-        if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
-            log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-            edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edfs_defer_data(edfs_context, edwork, edfs_data_job_data, ntohll(*(uint64_t *)(payload + 64)), sequence, payload, payload_size, key, clientaddr, clientaddrlen, who_am_i, is_sctp, is_listen_socket);
+}
 
-        unsigned char shared_secret[32];
-        curve25519(shared_secret, edfs_context->key.secret, payload);
+static void edfs_data_job_dat2(struct edfs_data_job *job) {
+    int err = edwork_process_data(job->edfs_context, job->key, job->payload, job->payload_size, 0, &job->clientaddr, job->clientaddrlen);
+    if (err <= 0)
+        log_warn("DAT2: will not write data block");
+}
 
-        int size = edwork_decrypt(edfs_context, key, payload + 32, payload_size - 32, buffer, who_am_i, edwork_who_i_am(edwork), shared_secret);
-        int err = edwork_process_data(edfs_context, key, buffer, size, 0, clientaddr, clientaddrlen);
-        if (err == 0) {
-            curve25519(shared_secret, edfs_context->previous_key.secret, payload);
-            size = edwork_decrypt(edfs_context, key, payload + 32, payload_size - 32, buffer, who_am_i, edwork_who_i_am(edwork), shared_secret);
-            err = edwork_process_data(edfs_context, key, buffer, size, 0, clientaddr, clientaddrlen);
-        }
-        if (err <= 0)
-            log_warn("DAT4: will not write data block");
+static void edwork_handle_dat2(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("DAT2 received (%s)", edwork_addr_ipv4(clientaddr));
+    if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
+        log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+        edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
         return;
     }
-    if (!memcmp(type, "del\x00", 4)) {
-        log_info("DEL received (%s)", edwork_addr_ipv4(clientaddr));
-        uint64_t ino;
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        if (edwork_delete(edfs_context, key, payload, payload_size, &ino)) {
-            *(uint64_t *)buffer = htonll(sequence);
-            if (edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
-                log_error("error sending ACK");
-                return;
-            }
-            log_info("DEL acknoledged");
-            // rebroadcast without acks 3 seconds
-            if (timestamp > now - 3000000UL)
-                edwork_broadcast_except(edwork, key, "del\x00", payload, payload_size, 0, EDWORK_NODES, clientaddr, clientaddrlen, timestamp, ino);
-        } else {
-            log_warn("will not delete data");
-        }
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    if (payload_size <= 96) {
+        log_warn("dropping DAT2, packet too small");
         return;
     }
-    if (!memcmp(type, "root", 4)) {
-        log_info("ROOT request received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 8) {
-            log_warn("invalid ROOT request");
-            return;
-        }
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_ROOT_WORK_LEVEL, EDWORK_ROOT_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
-        }
+    edfs_defer_data(edfs_context, edwork, edfs_data_job_dat2, ntohll(*(uint64_t *)payload), sequence, payload, payload_size, key, clientaddr, clientaddrlen, who_am_i, is_sctp, is_listen_socket);
+}
 
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        edwork_resync(edfs_context, key, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        *(uint64_t *)buffer = htonll(1);
-        edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL);
-        log_info("ROOT acknoledged");
+static void edfs_data_job_dat3(struct edfs_data_job *job) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    int size = edwork_decrypt(job->edfs_context, job->key, job->payload, job->payload_size, buffer, job->who_am_i, edwork_who_i_am(job->edwork), NULL);
+    int err = edwork_process_data(job->edfs_context, job->key, buffer, size, 0, &job->clientaddr, job->clientaddrlen);
+    if (err <= 0)
+        log_warn("DAT3: will not write data block");
+}
+
+static void edwork_handle_dat3(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("DAT3 received (%s)", edwork_addr_ipv4(clientaddr));
+    if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
+        log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+        edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
         return;
     }
-    if (!memcmp(type, "roo2", 4)) {
-        log_info("ROO2 request received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 8) {
-            log_warn("invalid ROO2 request");
-            return;
-        }
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_ROOT_WORK_LEVEL, EDWORK_ROOT_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        edwork_resync_desc(edfs_context, key, ntohll(*(uint64_t *)payload), clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        usleep(500);
-        edwork_resync_dir_desc(edfs_context, key, ntohll(*(uint64_t *)payload), clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edfs_defer_data(edfs_context, edwork, edfs_data_job_dat3, edfs_route_sender(who_am_i), sequence, payload, payload_size, key, clientaddr, clientaddrlen, who_am_i, is_sctp, is_listen_socket);
+}
+
+static void edfs_data_job_dat4(struct edfs_data_job *job) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    struct edfs *edfs_context = job->edfs_context;
+    unsigned char shared_secret[32];
+    edfs_shared_secret(edfs_context, &edfs_context->key, job->payload, shared_secret);
+
+    int size = edwork_decrypt(edfs_context, job->key, job->payload + 32, job->payload_size - 32, buffer, job->who_am_i, edwork_who_i_am(job->edwork), shared_secret);
+    int err = edwork_process_data(edfs_context, job->key, buffer, size, 0, &job->clientaddr, job->clientaddrlen);
+    if (err == 0) {
+        edfs_shared_secret(edfs_context, &edfs_context->previous_key, job->payload, shared_secret);
+        size = edwork_decrypt(edfs_context, job->key, job->payload + 32, job->payload_size - 32, buffer, job->who_am_i, edwork_who_i_am(job->edwork), shared_secret);
+        err = edwork_process_data(edfs_context, job->key, buffer, size, 0, &job->clientaddr, job->clientaddrlen);
+    }
+    if (err <= 0)
+        log_warn("DAT4: will not write data block");
+}
+
+static void edwork_handle_dat4(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("DAT4 received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 32) {
+        log_error("DAT4 packet too small");
         return;
     }
-    if (!memcmp(type, "roo3", 4)) {
-        log_info("ROO3 request received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 8) {
-            log_warn("invalid ROO3 request");
-            return;
-        }
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_ROOT_WORK_LEVEL, EDWORK_ROOT_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        edwork_resync_desc(edfs_context, key, ntohll(*(uint64_t *)payload), clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
+        log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+        edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
         return;
     }
-    if (!memcmp(type, "hash", 4)) {
-        log_info("HASH request received (%s)", edwork_addr_ipv4(clientaddr));
-        void *clientinfo = edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-#ifdef EDFS_RANDOMLY_IGNORE_REQUESTS
-        int magnitude = edwork_magnitude(edwork);
-        int randomly_ignore = 0;
-        if (magnitude >= 1000)
-            randomly_ignore = ((edwork_random() % 2) == 1);
-        else
-        if (magnitude >= 500)
-            randomly_ignore = ((edwork_random() % 4) == 1);
-        else
-        if (magnitude >= 100)
-            randomly_ignore = ((edwork_random() % 6) == 1);
-        else
-        if (magnitude >= 50)
-            randomly_ignore = ((edwork_random() % 10) == 1);
-        else
-        if (magnitude >= 20)
-            randomly_ignore = ((edwork_random() % 20) == 1);
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edfs_defer_data(edfs_context, edwork, edfs_data_job_dat4, edfs_route_sender(who_am_i), sequence, payload, payload_size, key, clientaddr, clientaddrlen, who_am_i, is_sctp, is_listen_socket);
+}
 
-        if (randomly_ignore) {
-            log_info("randomly ignoring request");
+static void edwork_handle_del(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    uint64_t now = microseconds();
+    log_info("DEL received (%s)", edwork_addr_ipv4(clientaddr));
+    uint64_t ino;
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    if (edwork_delete(edfs_context, key, payload, payload_size, &ino)) {
+        *(uint64_t *)buffer = htonll(sequence);
+        if (edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0) {
+            log_error("error sending ACK");
             return;
         }
-#endif
+        log_info("DEL acknoledged");
+        // rebroadcast without acks 3 seconds
+        if (timestamp > now - 3000000UL)
+            edwork_broadcast_except(edwork, key, "del\x00", payload, payload_size, 0, EDWORK_NODES, clientaddr, clientaddrlen, timestamp, ino);
+    } else {
+        log_warn("will not delete data");
+    }
+}
 
-        if ((!payload) || (payload_size < 100)) {
-            log_warn("HASH packet too small");
-            return;
-        }
+static void edwork_handle_root(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    log_info("ROOT request received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 8) {
+        log_warn("invalid ROOT request");
+        return;
+    }
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_ROOT_WORK_LEVEL, EDWORK_ROOT_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
 
-        uint64_t ino = ntohll(*(uint64_t *)payload);
-        uint64_t chunk = ntohll(*(uint64_t *)(payload + 8));
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edwork_resync(edfs_context, key, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    *(uint64_t *)buffer = htonll(1);
+    edwork_send_to_peer(edwork, key, "ack\x00", buffer, sizeof(uint64_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL);
+    log_info("ROOT acknoledged");
+}
 
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 52, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
-        }
+static void edwork_handle_roo2(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("ROO2 request received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 8) {
+        log_warn("invalid ROO2 request");
+        return;
+    }
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_ROOT_WORK_LEVEL, EDWORK_ROOT_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edwork_resync_desc(edfs_context, key, ntohll(*(uint64_t *)payload), clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    usleep(500);
+    edwork_resync_dir_desc(edfs_context, key, ntohll(*(uint64_t *)payload), clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+}
 
-        if (clientinfo) {
-            uint64_t last_ino;
-            uint64_t last_chunk;
-            uint64_t last_msg_timestamp;
-            if (edwork_get_info(clientinfo, &last_ino, &last_chunk, &last_msg_timestamp)) {
-                if ((ino == last_ino) && (chunk == last_chunk) && ((microseconds() - last_msg_timestamp) <= 50000)) {
-                    log_info("ignoring same request from same client");
-                    return;
-                }
-            }
-            edwork_set_info(clientinfo, ino, chunk, microseconds());
-        }
+static void edwork_handle_roo3(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("ROO3 request received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 8) {
+        log_warn("invalid ROO3 request");
+        return;
+    }
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_ROOT_WORK_LEVEL, EDWORK_ROOT_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edwork_resync_desc(edfs_context, key, ntohll(*(uint64_t *)payload), clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+}
 
-        if (ino > 0) {
-            int size = edfs_reply_hash(edfs_context, key, ino, chunk, buffer + 32, sizeof(buffer), ntohl(*(uint64_t *)(payload + 16)));
-            if (size > 0) {
-                if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
-                    log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-                    edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
-                    return;
-                }
+static void edwork_handle_hash(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    log_info("HASH request received (%s)", edwork_addr_ipv4(clientaddr));
+    void *clientinfo = edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+#ifdef EDFS_RANDOMLY_IGNORE_REQUESTS
+    int magnitude = edwork_magnitude(edwork);
+    int randomly_ignore = 0;
+    if (magnitude >= 1000)
+        randomly_ignore = ((edwork_random() % 2) == 1);
+    else
+    if (magnitude >= 500)
+        randomly_ignore = ((edwork_random() % 4) == 1);
+    else
+    if (magnitude >= 100)
+        randomly_ignore = ((edwork_random() % 6) == 1);
+    else
+    if (magnitude >= 50)
+        randomly_ignore = ((edwork_random() % 10) == 1);
+    else
+    if (magnitude >= 20)
+        randomly_ignore = ((edwork_random() % 20) == 1);
 
-                // unsigned char additional_data[32];
-                unsigned char *additional_data = buffer;
-                *(uint64_t *)additional_data = htonll(ino);
-                *(uint64_t *)(additional_data + 8) = htonll(chunk);
-                *(uint64_t *)(additional_data + 16) = htonll(microseconds());
-                *(uint64_t *)(additional_data + 24) = htonll(size);
+    if (randomly_ignore) {
+        log_info("randomly ignoring request");
+        return;
+    }
+#endif
 
+    if ((!payload) || (payload_size < 100)) {
+        log_warn("HASH packet too small");
+        return;
+    }
 
-                unsigned char shared_secret[32];
-                curve25519(shared_secret, edfs_context->key.secret, payload + 20);
+    uint64_t ino = ntohll(*(uint64_t *)payload);
+    uint64_t chunk = ntohll(*(uint64_t *)(payload + 8));
 
-                unsigned char buf2[BLOCK_SIZE_MAX];
-                memcpy(buf2, edfs_context->key.pk, 32);
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 52, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
 
-                int size2 = edwork_encrypt(edfs_context, key, buffer, size + 32, buf2 + 32, who_am_i, edwork_who_i_am(edwork), shared_secret);
-                if (edwork_send_to_peer(edwork, key, "dati", buf2, size2 + 32, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
-                    log_error("error sending DATI");
-                else
-                    log_info("DATI sent");
-            } else
-            if ((edfs_context->proxy) && (microseconds() - edfs_context->proxy_timestamp > 500000)) {
-                edfs_notify_io(edfs_context, key, "hash", payload, 20, edfs_context->key.pk, 32, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
-                edfs_context->proxy_timestamp = microseconds();
+    if (clientinfo) {
+        uint64_t last_ino;
+        uint64_t last_chunk;
+        uint64_t last_msg_timestamp;
+        if (edwork_get_info(clientinfo, &last_ino, &last_chunk, &last_msg_timestamp)) {
+            if ((ino == last_ino) && (chunk == last_chunk) && ((microseconds() - last_msg_timestamp) <= 50000)) {
+                log_info("ignoring same request from same client");
+                return;
             }
         }
-        return;
+        edwork_set_info(clientinfo, ino, chunk, microseconds());
     }
-    if (!memcmp(type, "wand", 4)) {
-        if (payload_size < 8) {
-            log_warn("WAND packet too small");
-            return;
-        }
 
-       if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
-        }
+    if (ino > 0) {
+        int size = edfs_reply_hash(edfs_context, key, ino, chunk, buffer + 32, sizeof(buffer), ntohl(*(uint64_t *)(payload + 16)));
+        if (size > 0) {
+            if (!edfs_check_blockhash(edfs_context, key, blockhash, 0)) {
+                log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+                edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
+                return;
+            }
 
-        uint64_t ino = ntohll(*(uint64_t *)payload);
-        if (!ino) {
-            log_warn("invalid WAND request");
-            return;
-        }
-        // if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
-        //     log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-        //     return;
-        // }
-        char b64name[MAX_B64_HASH_LEN];
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
-        int len = edfs_read_file(edfs_context, key, key->working_directory, computename(ino, b64name), buffer, EDWORK_PACKET_SIZE, ".json", 0, 0, 0, NULL, 0, 1, 0, 0);
-        if (len > 0) {
-            if (edwork_send_to_peer(edfs_context->edwork, key, "desc", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
-                log_error("error sending DESC");
+            // unsigned char additional_data[32];
+            unsigned char *additional_data = buffer;
+            *(uint64_t *)additional_data = htonll(ino);
+            *(uint64_t *)(additional_data + 8) = htonll(chunk);
+            *(uint64_t *)(additional_data + 16) = htonll(microseconds());
+            *(uint64_t *)(additional_data + 24) = htonll(size);
+
+
+            unsigned char shared_secret[32];
+            edfs_shared_secret(edfs_context, &edfs_context->key, payload + 20, shared_secret);
+
+            unsigned char buf2[BLOCK_SIZE_MAX];
+            memcpy(buf2, edfs_context->key.pk, 32);
+
+            int size2 = edwork_encrypt(edfs_context, key, buffer, size + 32, buf2 + 32, who_am_i, edwork_who_i_am(edwork), shared_secret);
+            if (edwork_send_to_peer(edwork, key, "dati", buf2, size2 + 32, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
+                log_error("error sending DATI");
             else
-                log_info("DESC sent");
+                log_info("DATI sent");
         } else
         if ((edfs_context->proxy) && (microseconds() - edfs_context->proxy_timestamp > 500000)) {
-            // EDFS_THREAD_LOCK(edfs_context);
-            edfs_notify_io(edfs_context, key, "wand", payload, 8, NULL, 0, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
-            // EDFS_THREAD_UNLOCK(edfs_context);
+            edfs_notify_io(edfs_context, key, "hash", payload, 20, edfs_context->key.pk, 32, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
             edfs_context->proxy_timestamp = microseconds();
         }
+    }
+}
+
+static void edwork_handle_wand(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    if (payload_size < 8) {
+        log_warn("WAND packet too small");
         return;
     }
-    if (!memcmp(type, "dati", 4)) {
-        log_info("DATI received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 32) {
-            log_error("DATI packet too small");
-            return;
-        }
-        if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
-            log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
-            edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
 
-        unsigned char shared_secret[32];
-        curve25519(shared_secret, edfs_context->key.secret, payload);
+   if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
 
-        int size = edwork_decrypt(edfs_context, key, payload + 32, payload_size - 32, buffer, who_am_i, edwork_who_i_am(edwork), shared_secret);
-        int err = edwork_process_hash(edfs_context, key, buffer, size, clientaddr, clientaddrlen);
-        if (err <= 0)
-            log_warn("DATI: will not write data block");
+    uint64_t ino = ntohll(*(uint64_t *)payload);
+    if (!ino) {
+        log_warn("invalid WAND request");
         return;
     }
-    if (!memcmp(type, "hblk", 4)) {
-        log_info("HBLK request received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        int is_top = 0;
-        if (payload_size < 48) {
-            log_error("HBLK packet too small");
-            return;
-        }
-        // index is 0 for last block, or 1 for genesis block, 2 for second block and so on
-        uint64_t index = ntohll(*(uint64_t *)payload);
-        if (!index) {
-            // is top
-            is_top = 1;
-            if (key->chain) {
-                index = key->chain->index;
-            } else {
-                log_warn("HBLK request cannot be fulfilled");
-                return;
-            }
-        } else
-            index --;
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work", payload_size);
-            return;
-        }
-        edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    // if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
+    //     log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+    //     return;
+    // }
+    char b64name[MAX_B64_HASH_LEN];
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    int len = edfs_read_file(edfs_context, key, key->working_directory, computename(ino, b64name), buffer, EDWORK_PACKET_SIZE, ".json", 0, 0, 0, NULL, 0, 1, 0, 0);
+    if (len > 0) {
+        if (edwork_send_to_peer(edfs_context->edwork, key, "desc", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
+            log_error("error sending DESC");
+        else
+            log_info("DESC sent");
+    } else
+    if ((edfs_context->proxy) && (microseconds() - edfs_context->proxy_timestamp > 500000)) {
+        // EDFS_THREAD_LOCK(edfs_context);
+        edfs_notify_io(edfs_context, key, "wand", payload, 8, NULL, 0, 0, 0, ino, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
+        // EDFS_THREAD_UNLOCK(edfs_context);
+        edfs_context->proxy_timestamp = microseconds();
+    }
+}
 
-        char b64name[MAX_B64_HASH_LEN];
-        computeblockname(index, b64name);
-        int len = edfs_read_file(edfs_context, key, key->blockchain_directory, b64name, buffer, EDWORK_PACKET_SIZE, NULL, 0, 0, 0, NULL, 0, 1, 0, 0);
-        if (len > 0) {
-            if (edwork_send_to_peer(edfs_context->edwork, key, is_top ? "topb" : "blkd", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
-                log_error("error sending chain block");
-            else
-                log_info("chain block sent");
-        }
+static void edfs_data_job_dati(struct edfs_data_job *job) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    unsigned char shared_secret[32];
+    edfs_shared_secret(job->edfs_context, &job->edfs_context->key, job->payload, shared_secret);
+
+    int size = edwork_decrypt(job->edfs_context, job->key, job->payload + 32, job->payload_size - 32, buffer, job->who_am_i, edwork_who_i_am(job->edwork), shared_secret);
+    int err = edwork_process_hash(job->edfs_context, job->key, buffer, size, &job->clientaddr, job->clientaddrlen);
+    if (err <= 0)
+        log_warn("DATI: will not write data block");
+}
+
+static void edwork_handle_dati(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("DATI received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 32) {
+        log_error("DATI packet too small");
         return;
     }
-    if (!memcmp(type, "blkd", 4)) {
-        log_info("BLKD received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 120) {
-            log_warn("invalid BLKD packet");
-            return;
-        }
-        if (!verify(edfs_context, key, (const char *)payload + 64, payload_size - 64, payload, 64)) {
-            log_warn("blockchain packet signature verification failed, dropping");
-            return;
-        }
-        struct block *newblock = block_load_buffer(payload + 64, payload_size - 64);
-        if (!newblock) {
-            log_error("invalid chain block received");
+    if (!edfs_check_blockhash(edfs_context, key, blockhash, 1)) {
+        log_warn("blockchain has different hash or length for %s", edwork_addr_ipv4(clientaddr));
+        edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
+        return;
+    }
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+    edfs_defer_data(edfs_context, edwork, edfs_data_job_dati, edfs_route_sender(who_am_i), sequence, payload, payload_size, key, clientaddr, clientaddrlen, who_am_i, is_sctp, is_listen_socket);
+}
+
+static void edwork_handle_hblk(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    log_info("HBLK request received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    int is_top = 0;
+    if (payload_size < 48) {
+        log_error("HBLK packet too small");
+        return;
+    }
+    // index is 0 for last block, or 1 for genesis block, 2 for second block and so on
+    uint64_t index = ntohll(*(uint64_t *)payload);
+    if (!index) {
+        // is top
+        is_top = 1;
+        if (key->chain) {
+            index = key->chain->index;
+        } else {
+            log_warn("HBLK request cannot be fulfilled");
             return;
         }
-        // hblk is index 1-based, blocks are 0-based
-        uint64_t requested_block = htonll(newblock->index + 2);
-        char b64name[MAX_B64_HASH_LEN];
-        if ((!key->chain) && (!newblock->index)) {
-            edfs_write_file(edfs_context, key, key->blockchain_directory, computeblockname(newblock->index, b64name), payload, payload_size, NULL, 0, NULL, NULL, NULL, NULL, 1, 0, 0);
+    } else
+        index --;
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 8, timestamp, EDWORK_WANT_WORK_LEVEL, EDWORK_WANT_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work", payload_size);
+        return;
+    }
+    edwork_ensure_node_in_list(edwork, clientaddr, clientaddrlen, is_sctp, is_listen_socket);
+
+    int len = edfs_chain_read(edfs_context, key, index, buffer, EDWORK_PACKET_SIZE);
+    if (len > 0) {
+        if (edwork_send_to_peer(edfs_context->edwork, key, is_top ? "topb" : "blkd", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
+            log_error("error sending chain block");
+        else
+            log_info("chain block sent");
+    }
+}
+
+static void edwork_handle_blkd(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    log_info("BLKD received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 120) {
+        log_warn("invalid BLKD packet");
+        return;
+    }
+    if (!verify(edfs_context, key, (const char *)payload + 64, payload_size - 64, payload, 64)) {
+        log_warn("blockchain packet signature verification failed, dropping");
+        return;
+    }
+    struct block *newblock = block_load_buffer(payload + 64, payload_size - 64);
+    if (!newblock) {
+        log_error("invalid chain block received");
+        return;
+    }
+    // hblk is index 1-based, blocks are 0-based
+    uint64_t requested_block = htonll(newblock->index + 2);
+    if ((!key->chain) && (!newblock->index)) {
+        edfs_chain_write(edfs_context, key, newblock->index, payload, payload_size, 0);
+        key->chain = newblock;
+        chain_index_update(key->chain_index, key->chain);
+        key->mining_flag = 0;
+        edfs_new_chain_request_descriptors(edfs_context, key, 0);
+        key->top_broadcast_timestamp = 0;
+        edfs_try_reset_proof(edfs_context, key);
+        key->block_timestamp = time(NULL);
+        edfs_notify_io(edfs_context, key, "hblk", (const unsigned char *)&requested_block, sizeof(uint64_t), NULL, 0, 0, 0, 0, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
+    } else
+    if ((key->chain) && (newblock->index == key->chain->index + 1)) {
+        newblock->previous_block = key->chain;
+        if (block_verify(newblock, BLOCKCHAIN_COMPLEXITY)) {
+            edfs_notify_io(edfs_context, key, "hblk", (const unsigned char *)&requested_block, sizeof(uint64_t), NULL, 0, 0, 0, 0, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
+            edfs_chain_write(edfs_context, key, newblock->index, payload, payload_size, 1);
             key->chain = newblock;
+            chain_index_update(key->chain_index, key->chain);
             key->mining_flag = 0;
             edfs_new_chain_request_descriptors(edfs_context, key, 0);
             key->top_broadcast_timestamp = 0;
             edfs_try_reset_proof(edfs_context, key);
             key->block_timestamp = time(NULL);
-            edfs_notify_io(edfs_context, key, "hblk", (const unsigned char *)&requested_block, sizeof(uint64_t), NULL, 0, 0, 0, 0, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
-        } else
-        if ((key->chain) && (newblock->index == key->chain->index + 1)) {
-            newblock->previous_block = key->chain;
-            if (block_verify(newblock, BLOCKCHAIN_COMPLEXITY)) {
-                edfs_notify_io(edfs_context, key, "hblk", (const unsigned char *)&requested_block, sizeof(uint64_t), NULL, 0, 0, 0, 0, EDWORK_WANT_WORK_LEVEL, 0, NULL, 0, NULL, NULL);
-                edfs_write_file(edfs_context, key, key->blockchain_directory, computeblockname(newblock->index, b64name), payload, payload_size, NULL, 0, NULL, NULL, NULL, NULL, 1, 0, 0);
-                key->chain = newblock;
+            key->chain_errors = 0;
+        } else {
+            log_error("block verify error");
+            // fork? resync chain
+            if (key->chain) {
+                struct block *previous_block = (struct block *)key->chain->previous_block;
+                block_free(key->chain);
+                key->chain = previous_block;
+                chain_index_update(key->chain_index, key->chain);
                 key->mining_flag = 0;
-                edfs_new_chain_request_descriptors(edfs_context, key, 0);
-                key->top_broadcast_timestamp = 0;
-                edfs_try_reset_proof(edfs_context, key);
+                edfs_schedule(edfs_context, edfs_blockchain_request, 50000, 0, 0, 0, 0, 1, key);
                 key->block_timestamp = time(NULL);
-                key->chain_errors = 0;
+            }
+            block_free(newblock);
+        }
+    } else {
+        unsigned char owned_hash[32];
+        int len;
+        // compare with the block in memory, the stored copy is read only when it must be sent
+        if (chain_index_block_hash(key->chain_index, newblock->index, owned_hash)) {
+            if (memcmp(owned_hash, newblock->hash, 32)) {
+                len = edfs_chain_read(edfs_context, key, newblock->index, buffer, EDWORK_PACKET_SIZE);
+                if ((len > 64) && (edwork_send_to_peer(edfs_context->edwork, key, "blkd", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0))
+                    log_error("error sending chain block");
+                log_warn("invalid block received (%i)", (int)newblock->index);
+                key->chain_errors ++;
             } else {
-                log_error("block verify error");
-                // fork? resync chain
-                if (key->chain) {
-                    struct block *previous_block = (struct block *)key->chain->previous_block;
-                    block_free(key->chain);
-                    key->chain = previous_block;
-                    key->mining_flag = 0;
-                    edfs_schedule(edfs_context, edfs_blockchain_request, 50000, 0, 0, 0, 0, 1, key);
-                    key->block_timestamp = time(NULL);
-                }
-                block_free(newblock);
+                log_trace("already owned received block (%i)", (int)newblock->index);
+                key->chain_errors = 0;
             }
+
+            block_free(newblock);
+            newblock = NULL;
         } else {
-            char b64name[MAX_B64_HASH_LEN];
-            computeblockname(newblock->index, b64name);
-            int len = edfs_read_file(edfs_context, key, key->blockchain_directory, b64name, buffer, EDWORK_PACKET_SIZE, NULL, 0, 0, 0, NULL, 0, 1, 0, 0);
-            if (len > 64) {
-                struct block *temp_block = block_load_buffer(buffer + 64, len - 64);
-                if ((temp_block) && (memcmp(temp_block->hash, newblock->hash, 32))) {
-                    if (edwork_send_to_peer(edfs_context->edwork, key, "blkd", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
-                        log_error("error sending chain block");
-                    log_warn("invalid block received (%i)", (int)newblock->index);
-                    key->chain_errors ++;
-                } else {
-                    log_trace("already owned received block (%i)", (int)newblock->index);
-                    key->chain_errors = 0;
-                }
+            key->chain_errors ++;
+            log_warn("invalid block received (%i)", (int)newblock->index);
+        }
 
-                block_free(temp_block);
-                block_free(newblock);
-                newblock = NULL;
-            } else {
-                key->chain_errors ++;
-                log_warn("invalid block received (%i)", (int)newblock->index);
+        if (newblock) {
+            len = edfs_chain_read(edfs_context, key, newblock->index + 1, buffer, EDWORK_PACKET_SIZE);
+            if (len > 64) {
+                if (edwork_send_to_peer(edfs_context->edwork, key, "blkd", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
+                    log_error("error sending chain block");
             }
+            block_free(newblock);
+        }
 
-            if (newblock) {
-                computeblockname(newblock->index  + 1, b64name);
-                len = edfs_read_file(edfs_context, key, key->blockchain_directory, b64name, buffer, EDWORK_PACKET_SIZE, NULL, 0, 0, 0, NULL, 0, 1, 0, 0);
-                if (len > 64) {
-                    if (edwork_send_to_peer(edfs_context->edwork, key, "blkd", buffer, len, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL) <= 0)
-                        log_error("error sending chain block");
+        if (key->chain_errors >= 10000) {
+            EDFS_THREAD_LOCK(edfs_context);
+            blockchain_free(key->chain);
+            key->chain = NULL;
+            chain_index_update(key->chain_index, key->chain);
+            key->mining_flag = 0;
+            EDFS_THREAD_UNLOCK(edfs_context);
+            key->chain_errors = 0;
+            key->block_timestamp = time(NULL);
+            edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
+        }
+    }
+}
+
+static void edwork_handle_topb(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("TOPB received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 120) {
+        log_warn("invalid TOPB packet");
+        return;
+    }
+    if (!verify(edfs_context, key, (const char *)payload + 64, payload_size - 64, payload, 64)) {
+        log_warn("blockchain packet signature verification failed, dropping");
+        return;
+    }
+    struct block *topblock = block_load_buffer(payload + 64, payload_size - 64);
+    if (!topblock) {
+        log_error("invalid top block received");
+        return;
+    }
+    if ((key->chain) && (key->chain->index >= topblock->index)) {
+        int update_current_chain = 0;
+        if (key->chain->index == topblock->index) {
+            int hash_compare = memcmp(topblock->hash, key->chain->hash, 32);
+            if (!hash_compare) {
+                log_info("same block, chain is valid");
+                key->block_timestamp = time(NULL);
+                block_free(topblock);
+                return;
+            }
+            // conflict, mediate
+            if (topblock->data_len > key->chain->data_len) {
+                log_trace("block is larger");
+                update_current_chain = 1;
+            } else
+            if (topblock->data_len == key->chain->data_len) {
+                if (hash_compare > 0) {
+                    update_current_chain = 1;
+                    log_trace("block hash is larger");
+                } else {
+                    log_trace("block hash is smaller");
                 }
-                block_free(newblock);
             }
-
-            if (key->chain_errors >= 10000) {
-                EDFS_THREAD_LOCK(edfs_context);
-                blockchain_free(key->chain);
-                key->chain = NULL;
+        }
+        if (update_current_chain) {
+            struct block *previous_block = (struct block *)key->chain->previous_block;
+            if ((previous_block) && (previous_block->timestamp + EDFS_BLOCKCHAIN_MIN_TIMEOUT > topblock->timestamp)) {
+                log_warn("updated top block is too early");
+                block_free(topblock);
+                return;
+            }
+            topblock->previous_block = previous_block;
+            if (block_verify(topblock, BLOCKCHAIN_COMPLEXITY)) {
+                block_free(key->chain);
+                key->chain = topblock;
+                chain_index_update(key->chain_index, key->chain);
                 key->mining_flag = 0;
-                EDFS_THREAD_UNLOCK(edfs_context);
+                edfs_chain_write(edfs_context, key, topblock->index, payload, payload_size, 1);
+                edfs_new_chain_request_descriptors(edfs_context, key, 0);
+                key->top_broadcast_timestamp = 0;
+                edfs_try_reset_proof(edfs_context, key);
+                edfs_broadcast_top(edfs_context, key, NULL, 0);
+                log_warn("mediated current block");
                 key->chain_errors = 0;
                 key->block_timestamp = time(NULL);
-                edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
-            }
-        }
-        return;
-    }
-    if (!memcmp(type, "topb", 4)) {
-        log_info("TOPB received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 120) {
-            log_warn("invalid TOPB packet");
-            return;
-        }
-        if (!verify(edfs_context, key, (const char *)payload + 64, payload_size - 64, payload, 64)) {
-            log_warn("blockchain packet signature verification failed, dropping");
-            return;
-        }
-        struct block *topblock = block_load_buffer(payload + 64, payload_size - 64);
-        if (!topblock) {
-            log_error("invalid top block received");
-            return;
-        }
-        char b64name[MAX_B64_HASH_LEN];
-        if ((key->chain) && (key->chain->index >= topblock->index)) {
-            int update_current_chain = 0;
-            if (key->chain->index == topblock->index) {
-                int hash_compare = memcmp(topblock->hash, key->chain->hash, 32);
-                if (!hash_compare) {
-                    log_info("same block, chain is valid");
-                    key->block_timestamp = time(NULL);
-                    block_free(topblock);
-                    return;
-                }
-                // conflict, mediate
-                if (topblock->data_len > key->chain->data_len) {
-                    log_trace("block is larger");
-                    update_current_chain = 1;
-                } else
-                if (topblock->data_len == key->chain->data_len) {
-                    if (hash_compare > 0) {
-                        update_current_chain = 1;
-                        log_trace("block hash is larger");
+            } else {
+                log_warn("cannot mediate received block (block verify failed)");
+                // fork? resync chain
+                if (key->chain) {
+                    key->chain_errors ++;
+                    struct block *previous_block = NULL;
+                    if (key->chain_errors < 10000) {
+                        EDFS_THREAD_LOCK(edfs_context);
+                        previous_block = (struct block *)key->chain->previous_block;
+                        block_free(key->chain);
+                        key->chain = previous_block;
+                        chain_index_update(key->chain_index, key->chain);
+                        key->mining_flag = 0;
+                        EDFS_THREAD_UNLOCK(edfs_context);
                     } else {
-                        log_trace("block hash is smaller");
+                        EDFS_THREAD_LOCK(edfs_context);
+                        blockchain_free(key->chain);
+                        key->chain = NULL;
+                        chain_index_update(key->chain_index, key->chain);
+                        key->mining_flag = 0;
+                        EDFS_THREAD_UNLOCK(edfs_context);
+                        key->chain_errors = 0;
                     }
-                }
-            }
-            if (update_current_chain) {
-                struct block *previous_block = (struct block *)key->chain->previous_block;
-                if ((previous_block) && (previous_block->timestamp + EDFS_BLOCKCHAIN_MIN_TIMEOUT > topblock->timestamp)) {
-                    log_warn("updated top block is too early");
-                    block_free(topblock);
-                    return;
-                }
-                topblock->previous_block = previous_block;
-                if (block_verify(topblock, BLOCKCHAIN_COMPLEXITY)) {
-                    block_free(key->chain);
-                    key->chain = topblock;
-                    key->mining_flag = 0;
-                    edfs_write_file(edfs_context, key, key->blockchain_directory, computeblockname(topblock->index, b64name), payload, payload_size, NULL, 0, NULL, NULL, NULL, NULL, 1, 0, 0);
-                    edfs_new_chain_request_descriptors(edfs_context, key, 0);
-                    key->top_broadcast_timestamp = 0;
-                    edfs_try_reset_proof(edfs_context, key);
-                    edfs_broadcast_top(edfs_context, key, NULL, 0);
-                    log_warn("mediated current block");
-                    key->chain_errors = 0;
                     key->block_timestamp = time(NULL);
-                } else {
-                    log_warn("cannot mediate received block (block verify failed)");
-                    // fork? resync chain
-                    if (key->chain) {
-                        key->chain_errors ++;
-                        struct block *previous_block = NULL;
-                        if (key->chain_errors < 10000) {
-                            EDFS_THREAD_LOCK(edfs_context);
-                            previous_block = (struct block *)key->chain->previous_block;
-                            block_free(key->chain);
-                            key->chain = previous_block;
-                            key->mining_flag = 0;
-                            EDFS_THREAD_UNLOCK(edfs_context);
-                        } else {
-                            EDFS_THREAD_LOCK(edfs_context);
-                            blockchain_free(key->chain);
-                            key->chain = NULL;
-                            key->mining_flag = 0;
-                            EDFS_THREAD_UNLOCK(edfs_context);
-                            key->chain_errors = 0;
-                        }
-                        key->block_timestamp = time(NULL);
-                        edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
-                    }
-                    block_free(topblock);
-                }
-            } else {
-                if (key->chain->index == topblock->index)
-                    log_warn("owned chain index is bigger");
-                else
-                if (key->chain->index > topblock->index)
-                    log_warn("owned chain index is newer");
-                // force rebroadcast top
-                key->chain_errors ++;
-                edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
-                if ((key->chain->index == topblock->index) && (microseconds() - key->top_broadcast_timestamp >= EDFS_BLOCKCHAIN_MIN_TIMEOUT / 2)) {
-                    key->top_broadcast_timestamp = microseconds();
-                    edfs_broadcast_top(edfs_context, key, NULL, 0);
+                    edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
                 }
                 block_free(topblock);
             }
-            return;
-        }
-        if ((!key->chain) && (topblock->index)) {
-            // request all chain
-            key->block_timestamp = time(NULL);
-            edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
-        }
-        if ((key->chain) && (topblock->index != key->chain->index + 1)) {
-            log_warn("invalid block index");
-            key->chain_errors ++;
-            key->block_timestamp = time(NULL);
-            edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
-            block_free(topblock);
-            return;
-        }
-        if ((key->chain) && (key->chain->timestamp + EDFS_BLOCKCHAIN_MIN_TIMEOUT > topblock->timestamp)) {
-            log_warn("top block is too early");
-            block_free(topblock);
-            return;
-        }
-        edfs_write_file(edfs_context, key, key->blockchain_directory, computeblockname(topblock->index, b64name), payload, payload_size, NULL, 0, NULL, NULL, NULL, NULL, 1, 0, 0);
-        topblock->previous_block = key->chain;
-        key->chain = topblock;
-        if (block_verify(topblock, BLOCKCHAIN_COMPLEXITY)) {
-            key->mining_flag = 0;
-            edfs_new_chain_request_descriptors(edfs_context, key, 0);
-            key->top_broadcast_timestamp = 0;
-            edfs_try_reset_proof(edfs_context, key);
-            log_trace("set new block");
-            usleep(1000);
-            edfs_broadcast_top(edfs_context, key, NULL, 0);
-            key->block_timestamp = time(NULL);
         } else {
-            log_error("block verify error");
+            if (key->chain->index == topblock->index)
+                log_warn("owned chain index is bigger");
+            else
+            if (key->chain->index > topblock->index)
+                log_warn("owned chain index is newer");
+            // force rebroadcast top
             key->chain_errors ++;
-            key->chain = (struct block *)key->chain->previous_block;
+            edfs_broadcast_top(edfs_context, key, clientaddr, clientaddrlen);
+            if ((key->chain->index == topblock->index) && (microseconds() - key->top_broadcast_timestamp >= EDFS_BLOCKCHAIN_MIN_TIMEOUT / 2)) {
+                key->top_broadcast_timestamp = microseconds();
+                edfs_broadcast_top(edfs_context, key, NULL, 0);
+            }
             block_free(topblock);
         }
-        if (key->chain_errors >= 10000) {
-            EDFS_THREAD_LOCK(edfs_context);
-            blockchain_free(key->chain);
-            key->chain = NULL;
-            key->mining_flag = 0;
-            EDFS_THREAD_UNLOCK(edfs_context);
-            key->chain_errors = 0;
-            key->block_timestamp = time(NULL);
-            edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
-        }
         return;
     }
-    if (!memcmp(type, "vote", 4)) {
-        log_info("VOTE received (%s)", edwork_addr_ipv4(clientaddr));
-        if (payload_size < 32) {
-            log_warn("VOTE packet too small");
-            return;
-        }
+    if ((!key->chain) && (topblock->index)) {
+        // request all chain
+        key->block_timestamp = time(NULL);
+        edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
+    }
+    if ((key->chain) && (topblock->index != key->chain->index + 1)) {
+        log_warn("invalid block index");
+        key->chain_errors ++;
+        key->block_timestamp = time(NULL);
+        edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
+        block_free(topblock);
+        return;
+    }
+    if ((key->chain) && (key->chain->timestamp + EDFS_BLOCKCHAIN_MIN_TIMEOUT > topblock->timestamp)) {
+        log_warn("top block is too early");
+        block_free(topblock);
+        return;
+    }
+    topblock->previous_block = key->chain;
+    key->chain = topblock;
+    if (block_verify(topblock, BLOCKCHAIN_COMPLEXITY)) {
+        edfs_chain_write(edfs_context, key, topblock->index, payload, payload_size, 1);
+        chain_index_update(key->chain_index, key->chain);
+        key->mining_flag = 0;
+        edfs_new_chain_request_descriptors(edfs_context, key, 0);
+        key->top_broadcast_timestamp = 0;
+        edfs_try_reset_proof(edfs_context, key);
+        log_trace("set new block");
+        usleep(1000);
+        edfs_broadcast_top(edfs_context, key, NULL, 0);
+        key->block_timestamp = time(NULL);
+    } else {
+        log_error("block verify error");
+        key->chain_errors ++;
+        key->chain = (struct block *)key->chain->previous_block;
+        block_free(topblock);
+    }
+    if (key->chain_errors >= 10000) {
+        EDFS_THREAD_LOCK(edfs_context);
+        blockchain_free(key->chain);
+        key->chain = NULL;
+        chain_index_update(key->chain_index, key->chain);
+        key->mining_flag = 0;
+        EDFS_THREAD_UNLOCK(edfs_context);
+        key->chain_errors = 0;
+        key->block_timestamp = time(NULL);
+        edfs_schedule(edfs_context, edfs_blockchain_request, 100000, 0, 0, 0, 0, 1, key);
+    }
+}
+
+static void edwork_handle_vote(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("VOTE received (%s)", edwork_addr_ipv4(clientaddr));
+    if (payload_size < 32) {
+        log_warn("VOTE packet too small");
+        return;
+    }
+
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 32, timestamp, EDWORK_VOTE_WORK_LEVEL, EDWORK_VOTE_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
+        return;
+    }
+    edwork_vote_received(edfs_context, payload, payload_size);
+}
+
+#ifdef EDWORK_PEER_DISCOVERY_SERVICE
+static void edwork_handle_disc(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    unsigned char buffer[BLOCK_SIZE_MAX];
+    log_info("DISC received (%s)", edwork_addr_ipv4(clientaddr));
+
+    if (payload_size < 32) {
+        log_warn("DISC packet too small");
+        return;
+    }
 
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 32, timestamp, EDWORK_VOTE_WORK_LEVEL, EDWORK_VOTE_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
-            return;
-        }
-        edwork_vote_received(edfs_context, payload, payload_size);
+    if (!edwork_check_proof_of_work(edwork, payload, payload_size, 32, timestamp, EDWORK_LIST_WORK_LEVEL, EDWORK_LIST_WORK_PREFIX, who_am_i)) {
+        log_warn("no valid proof of work");
         return;
     }
-#ifdef EDWORK_PEER_DISCOVERY_SERVICE
-    if (!memcmp(type, "disc", 4)) {
-        log_info("DISC received (%s)", edwork_addr_ipv4(clientaddr));
 
-        if (payload_size < 32) {
-            log_warn("DISC packet too small");
-            return;
-        }
+    unsigned char key_hash[32];
+    uint64_t key_checksum = XXH64(payload, 32, 0);
 
-        if (!edwork_check_proof_of_work(edwork, payload, payload_size, 32, timestamp, EDWORK_LIST_WORK_LEVEL, EDWORK_LIST_WORK_PREFIX, who_am_i)) {
-            log_warn("no valid proof of work");
+    struct edfs_key_data *own_key = edfs_context->key_data;
+    while (own_key) {
+        sha256(own_key->pubkey, own_key->pub_len, key_hash);
+        hmac_sha256((const BYTE *)"key id", 6, (const BYTE *)key_hash, 32, NULL, 0, (BYTE *)key_hash);
+        if (XXH64(key_hash, 32, 0) == key_checksum) {
+            log_trace("ignoring discovery request for own key");
             return;
         }
+        own_key = (struct edfs_key_data *)own_key->next_key;
+    }
 
-        unsigned char key_hash[32];
-        uint64_t key_checksum = XXH64(payload, 32, 0);
-
-        struct edfs_key_data *key = edfs_context->key_data;
-        while (key) {
-            sha256(key->pubkey, key->pub_len, key_hash);
-            hmac_sha256((const BYTE *)"key id", 6, (const BYTE *)key_hash, 32, NULL, 0, (BYTE *)key_hash);
-            if (XXH64(key_hash, 32, 0) == key_checksum) {
-                log_trace("ignoring discovery request for own key");
-                return;
-            }
-            key = (struct edfs_key_data *)key->next_key;
+    struct edfs_peer_discovery_data *peers = (struct edfs_peer_discovery_data *)avl_search(&edfs_context->peer_discovery, (void *)(uintptr_t)key_checksum);
+    if (!peers) {
+        peers = (struct edfs_peer_discovery_data *)malloc(sizeof(struct edfs_peer_discovery_data));
+        if (peers) {
+            memset(peers, 0, sizeof(struct edfs_peer_discovery_data));
+            avl_insert(&edfs_context->peer_discovery, (void *)(uintptr_t)key_checksum, peers);
         }
+    }
 
-        struct edfs_peer_discovery_data *peers = (struct edfs_peer_discovery_data *)avl_search(&edfs_context->peer_discovery, (void *)(uintptr_t)key_checksum);
-        if (!peers) {
-            peers = (struct edfs_peer_discovery_data *)malloc(sizeof(struct edfs_peer_discovery_data));
-            if (peers) {
-                memset(peers, 0, sizeof(struct edfs_peer_discovery_data));
-                avl_insert(&edfs_context->peer_discovery, (void *)(uintptr_t)key_checksum, peers);
-            }
-        }
+    if (!peers)
+        return;
 
-        if (!peers)
-            return;
+    int size = BLOCK_SIZE;
+    int records = edfs_get_peer_list(peers, buffer, &size);
+    if (records > 0) {
+        if (edwork_send_to_peer(edwork, NULL, "add2", buffer, size, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL * 10) <= 0) {
+            log_warn("error sending address list");
+        } else
+            log_info("sent %i peer addresses", records);
+    }
 
-        int size = BLOCK_SIZE;
-        int records = edfs_get_peer_list(peers, buffer, &size);
-        if (records > 0) {
-            if (edwork_send_to_peer(edwork, key, "add2", buffer, size, clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL * 10) <= 0) {
-                log_warn("error sending address list");
-            } else
-                log_info("sent %i peer addresses", records);
-        }
+    edfs_add_to_peer_discovery(peers, clientaddr, clientaddrlen);
+}
 
-        edfs_add_to_peer_discovery(peers, clientaddr, clientaddrlen);
+static void edwork_handle_add2(struct edfs *edfs_context, struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, int is_sctp, int is_listen_socket) {
+    log_info("ADD2 list received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
+    if (time(NULL) - edfs_context->disc_timestamp > 10) {
+        log_warn("dropping non-requested ADD2");
         return;
     }
-    if (!memcmp(type, "add2", 4)) {
-        log_info("ADD2 list received (non-signed) (%s)", edwork_addr_ipv4(clientaddr));
-        if (time(NULL) - edfs_context->disc_timestamp > 10) {
-            log_warn("dropping non-requested ADD2");
-            return;
-        }
-        if (payload_size < 7) {
-            log_warn("ADDR packet too small");
-            return;
-        }
-        // offset is ignore
-        edwork_add_node_list(edwork, payload, payload_size);
+    if (payload_size < 7) {
+        log_warn("ADDR packet too small");
         return;
     }
+    // offset is ignore
+    edwork_add_node_list(edwork, payload, payload_size);
+}
 #endif
-    log_error("unsupported message type received: %s", type);
+
+static const struct edwork_message_type edwork_message_types[] = {
+    { "ping", edwork_handle_ping, 0 },
+    { "helo", edwork_handle_helo, 0 },
+    { "addr", edwork_handle_addr, 0 },
+    { "ack\x00", edwork_handle_ack, 0 },
+    { "nack", edwork_handle_nack, 0 },
+    { "want", edwork_handle_want, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "wan3", edwork_handle_want, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "wan4", edwork_handle_want, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "wan5", edwork_handle_want, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "list", edwork_handle_list, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "desc", edwork_handle_desc, EDWORK_MESSAGE_SIGNED | EDWORK_MESSAGE_ACK },
+    { "data", edwork_handle_data, EDWORK_MESSAGE_SIGNED | EDWORK_MESSAGE_ENCRYPTED | EDWORK_MESSAGE_ACK },
+    { "dat2", edwork_handle_dat2, EDWORK_MESSAGE_SIGNED },
+    { "dat3", edwork_handle_dat3, EDWORK_MESSAGE_SIGNED | EDWORK_MESSAGE_ENCRYPTED },
+    { "dat4", edwork_handle_dat4, EDWORK_MESSAGE_SIGNED | EDWORK_MESSAGE_ENCRYPTED },
+    { "del\x00", edwork_handle_del, EDWORK_MESSAGE_SIGNED | EDWORK_MESSAGE_ACK },
+    { "root", edwork_handle_root, EDWORK_MESSAGE_PROOF_OF_WORK | EDWORK_MESSAGE_ACK },
+    { "roo2", edwork_handle_roo2, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "roo3", edwork_handle_roo3, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "hash", edwork_handle_hash, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "wand", edwork_handle_wand, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "dati", edwork_handle_dati, EDWORK_MESSAGE_SIGNED | EDWORK_MESSAGE_ENCRYPTED },
+    { "hblk", edwork_handle_hblk, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "blkd", edwork_handle_blkd, EDWORK_MESSAGE_SIGNED },
+    { "topb", edwork_handle_topb, EDWORK_MESSAGE_SIGNED },
+    { "vote", edwork_handle_vote, EDWORK_MESSAGE_PROOF_OF_WORK },
+#ifdef EDWORK_PEER_DISCOVERY_SERVICE
+    { "disc", edwork_handle_disc, EDWORK_MESSAGE_PROOF_OF_WORK },
+    { "add2", edwork_handle_add2, 0 },
+#endif
+    { NULL, NULL, 0 }
+};
+
+static uint32_t edwork_message_pack(const char *type) {
+    return ((uint32_t)(unsigned char)type[0] << 24) | ((uint32_t)(unsigned char)type[1] << 16) | ((uint32_t)(unsigned char)type[2] << 8) | (uint32_t)(unsigned char)type[3];
+}
+
+static unsigned int edwork_message_slot(uint32_t type) {
+    return (unsigned int)((type * 0x9E3779B1U) >> (32 - EDWORK_MESSAGE_SLOTS_BITS));
+}
+
+static void edwork_register_messages(struct edfs *edfs_context) {
+    const struct edwork_message_type *message = edwork_message_types;
+    while (message->name) {
+        uint32_t type = edwork_message_pack(message->name);
+        unsigned int slot = edwork_message_slot(type);
+        while (edfs_context->messages[slot].message)
+            slot = (slot + 1) & (EDWORK_MESSAGE_SLOTS - 1);
+        edfs_context->messages[slot].type = type;
+        edfs_context->messages[slot].message = message;
+        message ++;
+    }
+}
+
+static struct edwork_message_slot *edwork_find_message(struct edfs *edfs_context, const char *type) {
+    uint32_t packed_type = edwork_message_pack(type);
+    unsigned int slot = edwork_message_slot(packed_type);
+    while (edfs_context->messages[slot].message) {
+        if (edfs_context->messages[slot].type == packed_type)
+            return &edfs_context->messages[slot];
+        slot = (slot + 1) & (EDWORK_MESSAGE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+void edwork_callback(struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, void *userdata, int is_sctp, int is_listen_socket) {
+    struct edfs *edfs_context = (struct edfs *)userdata;
+
+    if ((!edwork) || (!type) || (!edfs_context))
+        return;
+    // 30 seconds before
+    if (timestamp > microseconds() + 30000000) {
+        log_warn("ignoring message with timestamp in the future received (%s)", edwork_addr_ipv4(clientaddr));
+        return;
+    }
+    // 5 minutes back
+    if (timestamp < microseconds() - 300000000) {
+        log_warn("ignoring too old message (%s)", edwork_addr_ipv4(clientaddr));
+        return;
+    }
+    struct edwork_message_slot *slot = edwork_find_message(edfs_context, type);
+    if (!slot) {
+        thread_atomic_int_inc(&edfs_context->messages_unsupported);
+        log_error("unsupported message type received: %s", type);
+        return;
+    }
+    thread_atomic_int_inc(&slot->received);
+    slot->message->handler(edfs_context, edwork, sequence, timestamp, type, payload, payload_size, key, clientaddr, clientaddrlen, who_am_i, blockhash, is_sctp, is_listen_socket);
 }
 
 void edwork_save_nodes(struct edfs *edfs_context) {
@@ -7393,6 +8759,123 @@ struct edfs_key_data *edfs_find_key(uint64_t keyid, void *userdata) {
     return (struct edfs_key_data *)avl_search(&edfs_context->key_tree, (void *)(uintptr_t)keyid);
 }
 
+#ifndef EDFS_EMULATED_STORE
+// moves the chunks of an inode directory in the pack store, or removes the already moved ones
+static int edfs_pack_import_inode(struct edfs *edfs_context, struct edfs_key_data *key, const char *path, uint64_t inode, unsigned char *buffer, int remove_files) {
+    tinydir_dir dir;
+    char fullpath[MAX_PATH_LEN];
+    int count = 0;
+
+    if (tinydir_open(&dir, path))
+        return 0;
+
+    while (dir.has_next) {
+        tinydir_file file;
+        tinydir_readfile(&dir, &file);
+        tinydir_next(&dir);
+
+        char *end = NULL;
+        uint64_t chunk = (uint64_t)strtoull(file.name, &end, 10);
+        if ((file.is_dir) || (file.name[0] < '0') || (file.name[0] > '9') || ((end) && (*end)))
+            continue;
+
+        snprintf(fullpath, MAX_PATH_LEN, "%s/%s", path, file.name);
+        if (remove_files) {
+            if ((pack_store_exists(key->pack, inode, chunk)) && (!unlink(fullpath)))
+                count ++;
+            continue;
+        }
+        if (pack_store_exists(key->pack, inode, chunk))
+            continue;
+
+        struct stat attrib;
+        FILE *f = fopen(fullpath, "rb");
+        if ((!f) || (fstat(fileno(f), &attrib))) {
+            if (f)
+                fclose(f);
+            log_warn("error reading chunk %s (errno: %i)", fullpath, errno);
+            continue;
+        }
+        int size = (int)fread(buffer, 1, PACK_STORE_MAX_RECORD_SIZE, f);
+        fclose(f);
+        if ((size <= 0) || (attrib.st_size > PACK_STORE_MAX_RECORD_SIZE)) {
+            log_warn("invalid chunk %s, not imported", fullpath);
+            continue;
+        }
+        // chunk files and pack records use the same (signature, payload) layout
+        if (pack_store_write(key->pack, inode, chunk, buffer, size, (uint32_t)attrib.st_mtime) < 0) {
+            count = -1;
+            break;
+        }
+        count ++;
+    }
+    tinydir_close(&dir);
+    return count;
+}
+
+static int edfs_pack_import_walk(struct edfs *edfs_context, struct edfs_key_data *key, unsigned char *buffer, int remove_files) {
+    tinydir_dir dir;
+    char path[MAX_PATH_LEN];
+    int count = 0;
+
+    if (tinydir_open(&dir, key->working_directory))
+        return 0;
+
+    while (dir.has_next) {
+        tinydir_file file;
+        tinydir_readfile(&dir, &file);
+        tinydir_next(&dir);
+
+        uint64_t inode = file.is_dir ? unpacked_ino(file.name) : 0;
+        if (!inode)
+            continue;
+
+        snprintf(path, MAX_PATH_LEN, "%s/%s", key->working_directory, file.name);
+        int inode_count = edfs_pack_import_inode(edfs_context, key, path, inode, buffer, remove_files);
+        if (inode_count < 0) {
+            count = -1;
+            break;
+        }
+        count += inode_count;
+    }
+    tinydir_close(&dir);
+    return count;
+}
+#endif
+
+// one-time import of the chunk files written before the pack store was enabled
+static void edfs_pack_import(struct edfs *edfs_context, struct edfs_key_data *key, const char *pack_path) {
+#ifndef EDFS_EMULATED_STORE
+    char marker[MAX_PATH_LEN];
+    snprintf(marker, MAX_PATH_LEN, "%s/imported", pack_path);
+    if (edfs_file_exists(marker))
+        return;
+
+    unsigned char *buffer = (unsigned char *)malloc(PACK_STORE_MAX_RECORD_SIZE);
+    if (!buffer)
+        return;
+
+    int count = edfs_pack_import_walk(edfs_context, key, buffer, 0);
+    free(buffer);
+    // keep the files on error, the import is resumed on the next start
+    if (count < 0) {
+        log_error("error importing chunks in pack store (errno: %i)", errno);
+        return;
+    }
+    if (pack_store_sync(key->pack)) {
+        log_error("error syncing pack store (errno: %i)", errno);
+        return;
+    }
+    int removed = edfs_pack_import_walk(edfs_context, key, NULL, 1);
+    if ((count) || (removed))
+        log_info("imported %i chunks in pack store, removed %i chunk files", count, removed);
+
+    FILE *f = fopen(marker, "wb");
+    if (f)
+        fclose(f);
+#endif
+}
+
 int edwork_load_key(struct edfs *edfs_context, const char *filename) {
     char fullpath[MAX_PATH_LEN];
     fullpath[0] = 0;
@@ -7478,6 +8961,21 @@ int edwork_load_key(struct edfs *edfs_context, const char *filename) {
     recursive_mkdir(key->cache_directory);
     recursive_mkdir(key->blockchain_directory);
 
+    key->chain_store = chain_store_open(key->blockchain_directory);
+    if (!key->chain_store)
+        log_error("error opening chain store %s, using block files", key->blockchain_directory);
+
+    if (edfs_context->pack_store) {
+        char pack_path[MAX_PATH_LEN];
+        snprintf(pack_path, MAX_PATH_LEN, "%s/pack", fullpath);
+        recursive_mkdir(pack_path);
+        key->pack = pack_store_open(pack_path);
+        if (key->pack)
+            edfs_pack_import(edfs_context, key, pack_path);
+        else
+            log_error("error opening pack store %s, using file store", pack_path);
+    }
+
     key->next_key = edfs_context->key_data;
     edfs_context->key_data = key;
 
@@ -7578,6 +9076,10 @@ int edwork_thread(void *userdata) {
     if (edfs_context->force_sctp)
         edwork_force_sctp(edfs_context->edwork, 1);
 #endif
+    if (edfs_context->no_rebroadcast_wal)
+        edwork_set_rebroadcast_wal(edfs_context->edwork, 0);
+    if (edfs_context->dispatch_threads > 0)
+        edwork_set_dispatch_threads(edfs_context->edwork, edfs_context->dispatch_threads);
 
     char *host_and_port = edfs_context->host_and_port;
     if ((host_and_port) && (host_and_port[0])) {
@@ -7607,7 +9109,6 @@ int edwork_thread(void *userdata) {
 
     edwork_load_nodes(edfs_context);
     time_t startup = time(NULL);
-    int broadcast_offset = 0;
 
     struct edfs_key_data *key = edfs_context->key_data;
     while (key) {
@@ -7706,16 +9207,12 @@ int edwork_thread(void *userdata) {
         int count = 0;
         key = edfs_context->key_data;
         while (key) {
-            count += edwork_rebroadcast(edwork, key, EDWORK_REBROADCAST, broadcast_offset);
+            count += edwork_rebroadcast(edwork, key, EDWORK_REBROADCAST);
             key = (struct edfs_key_data *)key->next_key;
         }
 
         if (count)
-            log_info("rebroadcasted %i edwork blocks, offset %i", count, broadcast_offset);
-        if (count < EDWORK_REBROADCAST)
-            broadcast_offset = 0;
-        else
-            broadcast_offset += count;
+            log_info("rebroadcasted %i edwork blocks", count);
     }, EDWORK_REBROADCAST_INTERVAL * 1000);
 
 #ifdef WITH_SMARTCARD
@@ -7735,6 +9232,17 @@ int edwork_thread(void *userdata) {
         }, 50);
     }
 #endif
+    if (edfs_context->pack_store) {
+        loop_schedule(&edfs_context->loop, {
+            key = edfs_context->key_data;
+            while (key) {
+                if (key->pack)
+                    pack_store_compact(key->pack, EDFS_PACK_STORE_GARBAGE);
+                key = (struct edfs_key_data *)key->next_key;
+            }
+        }, 1000);
+    }
+
     loop_schedule(&edfs_context->loop, {
         log_info("generating new identity");
         edwork_reset_id(edfs_context->edwork);
@@ -7802,7 +9310,7 @@ uint64_t edfs_pathtoinode_key(struct edfs_key_data *key, const char *path, uint6
             if (chunk_len > 0) {
                 if (parentinode)
                     *parentinode = inode;
-                inode = computeinode2(key ? key : NULL, inode, path + start, chunk_len);
+                inode = computeinode_cached(key, inode, path + start, chunk_len);
                 if (nameptr)
                     *nameptr = path + start;
                 start = i + 1;
@@ -7813,7 +9321,7 @@ uint64_t edfs_pathtoinode_key(struct edfs_key_data *key, const char *path, uint6
     if (chunk_len > 0) {
         if (parentinode)
             *parentinode = inode;
-        inode = computeinode2(key ? key : NULL, inode, path + start, chunk_len);
+        inode = computeinode_cached(key, inode, path + start, chunk_len);
         if (nameptr)
             *nameptr = path + start;
         start = i + 1;
@@ -7899,9 +9407,10 @@ void edfs_edwork_init(struct edfs *edfs_context, int port) {
         thread_mutex_lock(&edfs_context->lock);
 
         thread_mutex_init(&edfs_context->shard_lock);
-#ifdef EDFS_MULTITHREADED
+        int i;
+        for (i = 0; i < EDFS_INODE_LOCKS; i++)
+            thread_mutex_init(&edfs_context->inode_locks[i]);
         thread_mutex_init(&edfs_context->thread_lock);
-#endif
 
         edfs_context->mutex_initialized = 1;
         edfs_context->network_thread = thread_create(edwork_thread, (void *)edfs_context, "edwork", 8192 * 1024);
@@ -7909,6 +9418,11 @@ void edfs_edwork_init(struct edfs *edfs_context, int port) {
 #ifdef WITH_CACHE_WARMUP
         edfs_context->warmup_thread = thread_create(edwork_warmup_thread, (void *)edfs_context, "edwork warmup", 8192 * 1024);
 #endif
+        if (edfs_context->writeback_threads > 0) {
+            edfs_context->writeback = writeback_create(edfs_context->writeback_threads, WRITEBACK_MAX_JOBS, edfs_writeback_run, edfs_context);
+            if (!edfs_context->writeback)
+                log_warn("error creating write-back threads, using synchronous writes");
+        }
         thread_mutex_unlock(&edfs_context->lock);
 
         edfs_context->start_timestamp = microseconds();
@@ -7948,6 +9462,13 @@ void edfs_edwork_done(struct edfs *edfs_context) {
         log_error("edwork not initialized");
         return;
     }
+    if (edfs_context->writeback) {
+        // new writes are synchronous from now on
+        struct writeback *writeback = edfs_context->writeback;
+        edfs_context->writeback = NULL;
+        log_info("waiting for write-back threads to finish ...");
+        writeback_destroy(writeback);
+    }
     if (edfs_context->shard_thread) {
         log_info("waiting for shard thread to finish ...");
         edfs_context->network_done = 1;
@@ -7975,9 +9496,10 @@ void edfs_edwork_done(struct edfs *edfs_context) {
     edfs_context->mutex_initialized = 0;
     thread_mutex_term(&edfs_context->lock);
     thread_mutex_term(&edfs_context->shard_lock);
-#ifdef EDFS_MULTITHREADED
+    int i;
+    for (i = 0; i < EDFS_INODE_LOCKS; i++)
+        thread_mutex_term(&edfs_context->inode_locks[i]);
     thread_mutex_term(&edfs_context->thread_lock);
-#endif
 }
 
 static void recursive_mkdir(const char *dir) {
@@ -8000,6 +9522,55 @@ static void recursive_mkdir(const char *dir) {
     EDFS_MKDIR(tmp, S_IRWXU);
 }
 
+// chain records are signature[64] followed by the block buffer; the block buffer is encrypted with the storage key, using negative chunk numbers
+int edfs_chain_write(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t height, const unsigned char *record, int size, int verified) {
+    char b64name[MAX_B64_HASH_LEN];
+    if ((!record) || (size <= 64))
+        return -EINVAL;
+
+    if (!key->chain_store)
+        return edfs_write_file(edfs_context, key, key->blockchain_directory, computeblockname(height, b64name), record, size, NULL, 0, NULL, NULL, NULL, NULL, 1, 0, 0);
+
+    if (size > CHAIN_STORE_MAX_RECORD_SIZE)
+        return -EINVAL;
+
+    const unsigned char *data = record;
+    unsigned char *buffer = NULL;
+    if (edfs_context->has_storekey) {
+        buffer = (unsigned char *)malloc(size);
+        if (!buffer)
+            return -ENOMEM;
+        memcpy(buffer, record, 64);
+        edfs_crypt_with_key(edfs_context, key, 0, -1 - (int64_t)height, record + 64, buffer + 64, size - 64);
+        data = buffer;
+    }
+    int err = chain_store_write(key->chain_store, height, data, size);
+    free(buffer);
+    if (err < 0) {
+        log_error("error writing block %" PRIu64 " to chain store", height);
+        return -EIO;
+    }
+    // block hash
+    if ((verified) && (!(height % CHAIN_STORE_CHECKPOINT_INTERVAL)))
+        chain_store_set_checkpoint(key->chain_store, height, record + 64 + 24);
+    return size;
+}
+
+// returns signature[64] followed by the (decrypted) block buffer
+int edfs_chain_read(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t height, unsigned char *buffer, int size) {
+    char b64name[MAX_B64_HASH_LEN];
+    if (!key->chain_store)
+        return edfs_read_file(edfs_context, key, key->blockchain_directory, computeblockname(height, b64name), buffer, size, NULL, 0, 0, 0, NULL, 0, 1, 0, 0);
+
+    int len = chain_store_read(key->chain_store, height, buffer, size);
+    if (len <= 64)
+        return -EIO;
+
+    if (edfs_context->has_storekey)
+        edfs_crypt_with_key(edfs_context, key, 0, -1 - (int64_t)height, buffer + 64, buffer + 64, len - 64);
+    return len;
+}
+
 void edfs_block_save(struct edfs *edfs_context, struct edfs_key_data *key, struct block *chain) {
     if (!chain)
         return;
@@ -8011,15 +9582,30 @@ void edfs_block_save(struct edfs *edfs_context, struct edfs_key_data *key, struc
 #ifndef EDFS_NO_JS
         if (edfs_key_js_call(key, "edwork.events.onblockchain", "mine", NULL) == 1) {
             log_warn("block write denied by JS function");
+            free(buffer);
             return;
         }
 #endif
-        edfs_write_file(edfs_context, key, key->blockchain_directory, computeblockname(chain->index, b64name), buffer, size, NULL, 1, NULL, NULL, NULL, NULL, 0, 0, 0);
+        if (key->chain_store) {
+            unsigned char *record = (unsigned char *)malloc(size + 64);
+            if (record) {
+                int signature_size = sign(edfs_context, key, (const char *)buffer, size, record, NULL);
+                if (signature_size > 0) {
+                    if (signature_size < 64)
+                        memset(record + signature_size, 0, 64 - signature_size);
+                    memcpy(record + 64, buffer, size);
+                    edfs_chain_write(edfs_context, key, chain->index, record, size + 64, 1);
+                } else
+                    log_error("error signing block %" PRIu64, chain->index);
+                free(record);
+            }
+        } else
+            edfs_write_file(edfs_context, key, key->blockchain_directory, computeblockname(chain->index, b64name), buffer, size, NULL, 1, NULL, NULL, NULL, NULL, 0, 0, 0);
         free(buffer);
     }
 }
 
-struct block *edfs_blockchain_load(struct edfs *edfs_context, struct edfs_key_data *key) {
+static struct block *edfs_blockchain_load_files(struct edfs *edfs_context, struct edfs_key_data *key) {
     uint64_t i = 0;
     struct block *newblock = NULL;
     struct block *top_block;
@@ -8039,6 +9625,142 @@ struct block *edfs_blockchain_load(struct edfs *edfs_context, struct edfs_key_da
     return top_block;
 }
 
+// one-time import of the legacy one file per block layout
+static void edfs_blockchain_migrate(struct edfs *edfs_context, struct edfs_key_data *key) {
+    uint64_t i = 0;
+    char b64name[MAX_B64_HASH_LEN];
+    unsigned char buffer[BLOCK_SIZE_MAX];
+
+    if (chain_store_count(key->chain_store))
+        return;
+
+    while (1) {
+        int len = edfs_read_file(edfs_context, key, key->blockchain_directory, computeblockname(i, b64name), buffer, BLOCK_SIZE_MAX, NULL, 0, 0, 0, NULL, 0, 1, 0, 0);
+        if (len <= 64)
+            break;
+        if (edfs_chain_write(edfs_context, key, i, buffer, len, 0) <= 0) {
+            // keep the legacy files, the import is retried on the next load
+            log_error("error importing block %" PRIu64 " in chain store", i);
+            chain_store_truncate(key->chain_store, 0);
+            return;
+        }
+        i ++;
+    }
+    if (!i)
+        return;
+
+    if (chain_store_sync(key->chain_store)) {
+        log_error("error syncing chain store (errno: %i)", errno);
+        chain_store_truncate(key->chain_store, 0);
+        return;
+    }
+    // the store is the only copy from now on, stale block files are not left behind
+    uint64_t j;
+    for (j = 0; j < i; j ++)
+        edfs_unlink_file(edfs_context, key->blockchain_directory, computeblockname(j, b64name));
+    log_info("imported %" PRIu64 " blocks in chain store", i);
+}
+
+static struct block *edfs_blockchain_load_store(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t *trusted) {
+    uint64_t count = chain_store_count(key->chain_store);
+    uint64_t checkpoint = 0;
+    unsigned char checkpoint_hash[32];
+    struct block *top_block = NULL;
+    unsigned char *buffer = NULL;
+    uint64_t i;
+    int size;
+
+    if (!count)
+        return NULL;
+
+    if (edfs_context->has_storekey) {
+        buffer = (unsigned char *)malloc(CHAIN_STORE_MAX_RECORD_SIZE);
+        if (!buffer)
+            return NULL;
+    }
+
+    int has_checkpoint = chain_store_checkpoint(key->chain_store, &checkpoint, checkpoint_hash);
+    if ((has_checkpoint) && (checkpoint < count)) {
+        const unsigned char *record = chain_store_map(key->chain_store, checkpoint, &size);
+        if ((record) && (size >= 64 + 24 + 32)) {
+            const unsigned char *hash = record + 64 + 24;
+            if (buffer) {
+                edfs_crypt_with_key(edfs_context, key, 0, -1 - (int64_t)checkpoint, record + 64, buffer, 24 + 32);
+                hash = buffer + 24;
+            }
+            if (memcmp(hash, checkpoint_hash, 32))
+                has_checkpoint = 0;
+        } else
+            has_checkpoint = 0;
+    } else
+        has_checkpoint = 0;
+
+    if (has_checkpoint)
+        log_info("chain checkpoint at %" PRIu64, checkpoint);
+    else
+        log_info("no valid chain checkpoint, verifying all blocks");
+
+    for (i = 0; i < count; i++) {
+        const unsigned char *record = chain_store_map(key->chain_store, i, &size);
+        if ((!record) || (size <= 64))
+            break;
+
+        const unsigned char *data = record + 64;
+        if (buffer) {
+            edfs_crypt_with_key(edfs_context, key, 0, -1 - (int64_t)i, record + 64, buffer, size - 64);
+            data = buffer;
+        }
+        // blocks up to the checkpoint were verified before being checkpointed
+        if (((!has_checkpoint) || (i > checkpoint)) && (!verify(edfs_context, key, (const char *)data, size - 64, record, 64))) {
+            log_error("block %" PRIu64 " signature verification failed", i);
+            break;
+        }
+
+        struct block *newblock = block_load_buffer(data, size - 64);
+        if (!newblock)
+            break;
+        if (newblock->index != i) {
+            block_free(newblock);
+            break;
+        }
+        newblock->previous_block = top_block;
+        top_block = newblock;
+    }
+    free(buffer);
+
+    if (i < count) {
+        log_warn("dropping %" PRIu64 " invalid blocks from chain store", count - i);
+        chain_store_truncate(key->chain_store, i);
+    }
+
+    if ((trusted) && (has_checkpoint) && (top_block) && (top_block->index >= checkpoint))
+        *trusted = checkpoint + 1;
+    return top_block;
+}
+
+struct block *edfs_blockchain_load(struct edfs *edfs_context, struct edfs_key_data *key, uint64_t *trusted) {
+    if (trusted)
+        *trusted = 0;
+    if (!key->chain_store)
+        return edfs_blockchain_load_files(edfs_context, key);
+
+    edfs_blockchain_migrate(edfs_context, key);
+    return edfs_blockchain_load_store(edfs_context, key, trusted);
+}
+
+// verifies only the blocks above the trusted height
+static int edfs_blockchain_verify(struct block *chain, uint64_t trusted) {
+    if (!chain)
+        return 0;
+
+    while ((chain) && (chain->index >= trusted)) {
+        if (!block_verify(chain, BLOCKCHAIN_COMPLEXITY))
+            return 0;
+        chain = (struct block *)chain->previous_block;
+    }
+    return 1;
+}
+
 int edfs_init(struct edfs *edfs_context) {
     if (!edfs_context)
         return -1;
@@ -8060,12 +9782,15 @@ int edfs_init(struct edfs *edfs_context) {
     while (key) {
         recursive_mkdir(key->working_directory);
         recursive_mkdir(key->cache_directory);
-        key->chain = edfs_blockchain_load(edfs_context, key);
+        uint64_t trusted = 0;
+        key->chain = edfs_blockchain_load(edfs_context, key, &trusted);
         if (key->chain) {
             time_t stamp = (time_t)(key->chain->timestamp / 1000000UL);
             struct tm *tstamp = gmtime(&stamp);
-            if (blockchain_verify(key->chain, BLOCKCHAIN_COMPLEXITY)) {
+            if (edfs_blockchain_verify(key->chain, trusted)) {
                 key->top_broadcast_timestamp = 0;
+                if (key->chain_store)
+                    chain_store_set_checkpoint(key->chain_store, key->chain->index, key->chain->hash);
                 log_info("blockchain verified, head is %" PRIu64 ", UTC: %s", key->chain->index, asctime(tstamp));
             } else {
                 log_error("blockchain is invalid, head is %" PRIu64 ", UTC: %s", key->chain->index, asctime(tstamp));
@@ -8089,16 +9814,22 @@ int edfs_init(struct edfs *edfs_context) {
                 if (key->chain)
                     log_info("blockchain is invalid, new head is %" PRIu64 ", UTC: %s", key->chain->index, asctime(tstamp));
 
-                recursive_rmdir(key->blockchain_directory);
-                recursive_mkdir(key->blockchain_directory);
-                struct block *chain = key->chain;
-                while (chain) {
-                    edfs_block_save(edfs_context, key, chain);
-                    chain = (struct block *)chain->previous_block;
+                if (key->chain_store) {
+                    // the valid blocks are already stored
+                    chain_store_truncate(key->chain_store, key->chain ? key->chain->index + 1 : 0);
+                } else {
+                    recursive_rmdir(key->blockchain_directory);
+                    recursive_mkdir(key->blockchain_directory);
+                    struct block *chain = key->chain;
+                    while (chain) {
+                        edfs_block_save(edfs_context, key, chain);
+                        chain = (struct block *)chain->previous_block;
+                    }
                 }
             }
             key->top_broadcast_timestamp = 0;
         }
+        chain_index_update(key->chain_index, key->chain);
         recursive_mkdir(key->blockchain_directory);
         key = (struct edfs_key_data *)key->next_key;
     }
@@ -8111,6 +9842,8 @@ void edfs_set_store_key(struct edfs *edfs_context, const unsigned char *key, int
         edfs_context->has_storekey = 1;
     } else
         edfs_context->has_storekey = 0;
+    // keys derived from the previous store key are no longer valid
+    key_cache_clear(edfs_context->key_cache);
 }
 
 char *edfs_add_to_path(const char *path, const char *subpath) {
@@ -8134,7 +9867,17 @@ struct edfs *edfs_create_context(const char *use_working_directory) {
         edfs_context->nodes_file = edfs_add_to_path(use_working_directory, "nodes");
         edfs_context->default_nodes = edfs_add_to_path(use_working_directory, "default_nodes.json");
         edfs_context->forward_chunks = 5;
+        edfs_context->chunk_cache = chunk_cache_create(EDFS_CHUNK_CACHE_SIZE);
+        edfs_context->key_cache = key_cache_create(EDFS_KEY_CACHE_ENTRIES);
+        edfs_context->session_cache = session_cache_create(EDFS_SESSION_CACHE_ENTRIES, EDFS_SESSION_TTL);
+        edfs_context->sig_batch = sig_batch_create(SIG_BATCH_MAX);
+        edfs_context->fetch_scheduler = fetch_scheduler_create();
+        // synchronous writes, unless -writeback is set
+        edfs_context->writeback_threads = 0;
+        edfs_context->dispatch_threads = 0;
+        edfs_context->chunk_codec = CHUNK_CODEC_ZLIB;
         edfs_make_key(edfs_context);
+        edwork_register_messages(edfs_context);
 
 #ifdef EDWORK_PEER_DISCOVERY_SERVICE
         avl_initialize(&edfs_context->peer_discovery, ino_compare, avl_ino_destructor);
@@ -8160,6 +9903,9 @@ void edfs_destroy_context(struct edfs *edfs_context) {
 
     while (edfs_context->key_data) {
         struct edfs_key_data *next = (struct edfs_key_data *)edfs_context->key_data->next_key;
+        // next startup verifies only the blocks added after this point
+        if ((edfs_context->key_data->chain_store) && (edfs_context->key_data->chain))
+            chain_store_set_checkpoint(edfs_context->key_data->chain_store, edfs_context->key_data->chain->index, edfs_context->key_data->chain->hash);
         edfs_key_data_deinit(edfs_context->key_data);
         free(edfs_context->key_data);
         edfs_context->key_data = next;
@@ -8168,6 +9914,36 @@ void edfs_destroy_context(struct edfs *edfs_context) {
     free(edfs_context->nodes_file);
     free(edfs_context->default_nodes);
     free(edfs_context->host_and_port);
+    if (edfs_context->chunk_cache) {
+        struct chunk_cache_stats stats;
+        chunk_cache_stats(edfs_context->chunk_cache, &stats);
+        log_info("chunk cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions", stats.hits, stats.misses, stats.evictions);
+        chunk_cache_destroy(edfs_context->chunk_cache);
+    }
+    if (edfs_context->key_cache) {
+        struct key_cache_stats stats;
+        key_cache_stats(edfs_context->key_cache, &stats);
+        log_info("storage key cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions", stats.hits, stats.misses, stats.evictions);
+        key_cache_destroy(edfs_context->key_cache);
+    }
+    if (edfs_context->session_cache) {
+        struct session_cache_stats stats;
+        session_cache_stats(edfs_context->session_cache, &stats);
+        log_info("peer session cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " expired, %" PRIu64 " evictions", stats.hits, stats.misses, stats.expired, stats.evictions);
+        session_cache_destroy(edfs_context->session_cache);
+    }
+    if (edfs_context->sig_batch) {
+        struct sig_batch_stats stats;
+        sig_batch_stats(edfs_context->sig_batch, &stats);
+        log_info("signature batches: %" PRIu64 " verified, %" PRIu64 " in %" PRIu64 " batches, largest batch %i", stats.verified, stats.batched, stats.batches, stats.max_batch);
+        sig_batch_destroy(edfs_context->sig_batch);
+    }
+    if (edfs_context->fetch_scheduler) {
+        struct fetch_scheduler_stats stats;
+        fetch_scheduler_stats(edfs_context->fetch_scheduler, &stats);
+        log_info("fetch scheduler: %" PRIu64 " requests, %" PRIu64 " completed, %" PRIu64 " hedged, %" PRIu64 " lost, %i peers", stats.requests, stats.completed, stats.hedged, stats.lost, stats.peers);
+        fetch_scheduler_destroy(edfs_context->fetch_scheduler);
+    }
 #ifdef WITH_SMARTCARD
     edwork_smartcard_done(&edfs_context->smartcard_context);
 #endif
@@ -8180,6 +9956,41 @@ void edfs_set_resync(struct edfs *edfs_context, int resync_val) {
     edfs_context->resync = resync_val;
 }
 
+void edfs_set_writeback_threads(struct edfs *edfs_context, int threads) {
+    if (!edfs_context)
+        return;
+    // 0 = synchronous writes
+    if (threads < 0)
+        threads = 0;
+    edfs_context->writeback_threads = threads;
+}
+
+void edfs_set_dispatch_threads(struct edfs *edfs_context, int threads) {
+    if (!edfs_context)
+        return;
+    // 0 = all packets are handled on the network thread
+    if (threads < 0)
+        threads = 0;
+    edfs_context->dispatch_threads = threads;
+}
+
+void edfs_set_miner_threads(struct edfs *edfs_context, int threads) {
+    // 0 = number of cores
+    if (threads < 0)
+        threads = 0;
+    miner_set_threads(threads);
+}
+
+int edfs_set_chunk_codec(struct edfs *edfs_context, const char *codec) {
+    if (!edfs_context)
+        return -1;
+    int codec_id = chunk_codec_parse(codec);
+    if (codec_id < 0)
+        return -1;
+    edfs_context->chunk_codec = codec_id;
+    return 0;
+}
+
 void edfs_set_forward_chunks(struct edfs *edfs_context, int forward_chunks) {
     if (!edfs_context)
         return;
@@ -8246,6 +10057,42 @@ void edfs_set_initial_friend(struct edfs *edfs_context, const char *peer) {
     edfs_context->host_and_port[len] = 0;
 }
 
+void edfs_set_pack_store(struct edfs *edfs_context, int pack_store) {
+    if (!edfs_context)
+        return;
+    edfs_context->pack_store = (pack_store != 0);
+}
+
+void edfs_set_chunk_cache_size(struct edfs *edfs_context, int size_mb) {
+    if (!edfs_context)
+        return;
+    chunk_cache_destroy(edfs_context->chunk_cache);
+    edfs_context->chunk_cache = NULL;
+    if (size_mb > 0)
+        edfs_context->chunk_cache = chunk_cache_create((size_t)size_mb * 1024 * 1024);
+}
+
+int edfs_chunk_cache_stats(struct edfs *edfs_context, uint64_t *hits, uint64_t *misses, uint64_t *bytes) {
+    if ((!edfs_context) || (!edfs_context->chunk_cache))
+        return 0;
+
+    struct chunk_cache_stats stats;
+    chunk_cache_stats(edfs_context->chunk_cache, &stats);
+    if (hits)
+        *hits = stats.hits;
+    if (misses)
+        *misses = stats.misses;
+    if (bytes)
+        *bytes = stats.bytes;
+    return stats.entries;
+}
+
+void edfs_set_rebroadcast_wal(struct edfs *edfs_context, int wal) {
+    if (!edfs_context)
+        return;
+    edfs_context->no_rebroadcast_wal = (wal == 0);
+}
+
 void edfs_set_proxy(struct edfs *edfs_context, int proxy) {
     if (!edfs_context)
         return;
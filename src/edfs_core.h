@@ -65,6 +65,13 @@
 #define MAX_INODE_DESCRIPTOR_SIZE   0x1FFF
 #define BLOCK_SIZE                  57280
 #define PROOF_OF_WORK_MAX_SIZE      0x1000
+// 64MB of decrypted chunks, shared by all open files
+#define EDFS_CHUNK_CACHE_SIZE       0x4000000
+// derived chunk storage keys, wiped on eviction
+#define EDFS_KEY_CACHE_ENTRIES      4096
+// curve25519 shared secrets per (ephemeral key, peer key), renegotiated after EDFS_SESSION_TTL seconds
+#define EDFS_SESSION_CACHE_ENTRIES  1024
+#define EDFS_SESSION_TTL            300
 
 #define EDWORK_WANT_WORK_LEVEL      11
 #define EDWORK_WANT_WORK_PREFIX     "edwork:1:11:"
@@ -170,7 +177,15 @@ void edfs_set_rebroadcast(struct edfs *edfs_context, int rebroadcast_val);
 void edfs_set_readonly(struct edfs *edfs_context, int readonly_val);
 void edfs_set_initial_friend(struct edfs *edfs_context, const char *peer);
 void edfs_set_forward_chunks(struct edfs *edfs_context, int forward_chunks);
+void edfs_set_writeback_threads(struct edfs *edfs_context, int threads);
+void edfs_set_dispatch_threads(struct edfs *edfs_context, int threads);
+void edfs_set_miner_threads(struct edfs *edfs_context, int threads);
+int edfs_set_chunk_codec(struct edfs *edfs_context, const char *codec);
 void edfs_set_proxy(struct edfs *edfs_context, int proxy);
+void edfs_set_pack_store(struct edfs *edfs_context, int pack_store);
+void edfs_set_rebroadcast_wal(struct edfs *edfs_context, int wal);
+void edfs_set_chunk_cache_size(struct edfs *edfs_context, int size_mb);
+int edfs_chunk_cache_stats(struct edfs *edfs_context, uint64_t *hits, uint64_t *misses, uint64_t *bytes);
 void edfs_set_shard(struct edfs *edfs_context, int shard_id, int shards);
 void edfs_set_force_sctp(struct edfs *edfs_context, int force_sctp);
 void edfs_set_store_key(struct edfs *edfs_context, const unsigned char *key, int len);
@@ -180,6 +195,7 @@ int edfs_chkey(struct edfs *edfs_context, const char *key_id);
 int edfs_rmkey(struct edfs *edfs_context, const char *key_id);
 int edfs_storage_info(struct edfs *edfs_context, const char *key_id, uint64_t *size, uint64_t *files, uint64_t *directories, uint64_t *top_block, uint64_t *timestamp);
 int edfs_peers_info(struct edfs *edfs_context, char *buffer, int buffer_size, int html);
+int edfs_messages_info(struct edfs *edfs_context, char *buffer, int buffer_size, int html);
 int edfs_list_keys(struct edfs *edfs_context, char *buffer, int buffer_size);
 int edfs_remove_data(struct edfs *edfs_context, const char *key_id);
 void *edfs_find_key_opaque(struct edfs *edfs_context, const char *key_id);
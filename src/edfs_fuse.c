@@ -38,6 +38,9 @@
 
 #include "log.h"
 #include "edfs_core.h"
+#ifdef EDFS_FUSE_LOWLEVEL
+    #include "edfs_fuse_lowlevel.h"
+#endif
 
 static struct edfs *edfs_context;
 static int server_pipe_is_valid = 1;
@@ -562,8 +565,13 @@ void edfs_gui_callback(void *window) {
                 } else
                     buf_offset = snprintf(buf, sizeof(buf), " <b>%.3fGB</b> in %" PRIu64 " files and %" PRIu64 " directories (<a href='javascript: window.edworkData = \"$%s\"; window.external.notify();\'>clean</a>)<br/><br/>Recent peers:", (double)size / (1024 * 1024 * 1024), files, directories, foo + 1);
 
-                if (buf_offset > 0)
+                if (buf_offset > 0) {
                     edfs_peers_info(edfs_context, buf + buf_offset, sizeof(buf) - buf_offset, 1);
+                    buf_offset += strlen(buf + buf_offset);
+                    int written = snprintf(buf + buf_offset, sizeof(buf) - buf_offset, "<br/><br/>Messages:");
+                    if ((written > 0) && (written < (int)sizeof(buf) - buf_offset))
+                        edfs_messages_info(edfs_context, buf + buf_offset + written, sizeof(buf) - buf_offset - written, 1);
+                }
                 const char *arg[] = { foo + 1, buf, NULL };
                 ui_call(window, "filesystem_usage", arg);
                 break;
@@ -841,6 +849,9 @@ int edfs_loop_named_pipe() {
                         fuse_exit(fuse_session);
                         fuse_session = NULL;
                     }
+#ifdef EDFS_FUSE_LOWLEVEL
+                    edfs_fuse_lowlevel_exit();
+#endif
                 }
 #if defined(_WIN32) || defined(__APPLE__)
                 else
@@ -947,6 +958,14 @@ int main(int argc, char *argv[]) {
     static struct fuse_operations edfs_fuse;
     int initial_friend_set = 0;
     int foreground = 1;
+#ifdef EDFS_FUSE_LOWLEVEL
+    int lowlevel = 0;
+#ifdef EDFS_MULTITHREADED
+    int lowlevel_mt = 1;
+#else
+    int lowlevel_mt = 0;
+#endif
+#endif
 #ifdef __APPLE__
     int gui = 0;
 #endif
@@ -1081,12 +1100,70 @@ int main(int argc, char *argv[]) {
                     i++;
                     edfs_set_forward_chunks(edfs_context, atoi(argv[i]));
                 } else
+                if (!strcmp(arg, "writeback")) {
+                    if (i >= argc - 1) {
+                        fprintf(stderr, "edfs: number of threads expected after -writeback parameter. Try -help option.\n");
+                        exit(-1);
+                    }
+                    i++;
+                    edfs_set_writeback_threads(edfs_context, atoi(argv[i]));
+                } else
+                if (!strcmp(arg, "dispatch")) {
+                    if (i >= argc - 1) {
+                        fprintf(stderr, "edfs: number of threads expected after -dispatch parameter. Try -help option.\n");
+                        exit(-1);
+                    }
+                    i++;
+                    edfs_set_dispatch_threads(edfs_context, atoi(argv[i]));
+                } else
+                if (!strcmp(arg, "miners")) {
+                    if (i >= argc - 1) {
+                        fprintf(stderr, "edfs: number of threads expected after -miners parameter. Try -help option.\n");
+                        exit(-1);
+                    }
+                    i++;
+                    edfs_set_miner_threads(edfs_context, atoi(argv[i]));
+                } else
+                if (!strcmp(arg, "codec")) {
+                    if (i >= argc - 1) {
+                        fprintf(stderr, "edfs: codec name expected after -codec parameter. Try -help option.\n");
+                        exit(-1);
+                    }
+                    i++;
+                    if (edfs_set_chunk_codec(edfs_context, argv[i])) {
+                        fprintf(stderr, "edfs: unknown codec %s (expected zlib, lz or store). Try -help option.\n", argv[i]);
+                        exit(-1);
+                    }
+                } else
+                if (!strcmp(arg, "chunkcache")) {
+                    if (i >= argc - 1) {
+                        fprintf(stderr, "edfs: cache size (MB) expected after -chunkcache parameter. Try -help option.\n");
+                        exit(-1);
+                    }
+                    i++;
+                    edfs_set_chunk_cache_size(edfs_context, atoi(argv[i]));
+                } else
                 if (!strcmp(arg, "daemonize")) {
                     foreground = 0;
                 } else
+#ifdef EDFS_FUSE_LOWLEVEL
+                if (!strcmp(arg, "lowlevel")) {
+                    lowlevel = 1;
+                } else
+                if (!strcmp(arg, "mt")) {
+                    lowlevel = 1;
+                    lowlevel_mt = 1;
+                } else
+#endif
                 if (!strcmp(arg, "proxy")) {
                     edfs_set_proxy(edfs_context, 1);
                 } else
+                if (!strcmp(arg, "packstore")) {
+                    edfs_set_pack_store(edfs_context, 1);
+                } else
+                if (!strcmp(arg, "nowal")) {
+                    edfs_set_rebroadcast_wal(edfs_context, 0);
+                } else
                 if (!strcmp(arg, "shard")) {
                     if (i >= argc - 2) {
                         fprintf(stderr, "edfs: shard id and number of shards expected after -shard parameter. Try -help option.\n");
@@ -1207,9 +1284,20 @@ int main(int argc, char *argv[]) {
                         "    -use host[:port]   use host:port as initial host\n"
                         "    -resync            request data resync\n"
                         "    -rebroadcast       force rebroadcast all local data\n"
-                        "    -chunks n          set the number of forward chunks to be requested on read\n"
+                        "    -chunks n          set the initial readahead window, in chunks\n"
+                        "    -chunkcache mb     set the shared chunk cache size in MB (0 to disable)\n"
+                        "    -writeback n       set the number of write-back threads (default 0, synchronous writes)\n"
+                        "    -dispatch n        set the number of threads decrypting and writing received data packets (default 0, use the network thread)\n"
+                        "    -miners n          set the number of proof-of-work threads (default 0, one per core)\n"
+                        "    -codec name        chunk compression codec: zlib (default), lz or store\n"
                         "    -daemonize         run as daemon/service\n"
+#ifdef EDFS_FUSE_LOWLEVEL
+                        "    -lowlevel          use the low-level fuse interface (inode based, kernel caching)\n"
+                        "    -mt                use the low-level fuse interface with a multithreaded session loop\n"
+#endif
                         "    -proxy             enable proxy mode (forward WANT requets)\n"
+                        "    -packstore         store chunks in append-only pack files\n"
+                        "    -nowal             keep unconfirmed messages in memory only (lost on restart)\n"
                         "    -shard id shards   set shard id, as id number of shard, eg.: -shards 1 2\n"
                         "    -dir directory     set the edfs working directory (default is ./edfs)\n"
 #if defined(_WIN32) || defined(__APPLE__)
@@ -1269,6 +1357,24 @@ int main(int argc, char *argv[]) {
 #endif
     log_info("starting edfs on port %i, mount point [%s]", port, mountpoint);
     edfs_edwork_init(edfs_context, port);
+#ifdef EDFS_FUSE_LOWLEVEL
+    if (lowlevel) {
+        // not joined, the pipe thread may be in a blocking read operation (see below)
+        edfs_pipe();
+        err = edfs_fuse_lowlevel_loop(edfs_context, mountpoint, &args, lowlevel_mt);
+        if (server_pipe_is_valid)
+            server_pipe_is_valid = 0;
+
+        edfs_edwork_done(edfs_context);
+        edfs_destroy_context(edfs_context);
+        edfs_context = NULL;
+
+        fuse_opt_free_args(&args);
+        if (fp)
+            fclose(fp);
+        return err ? 1 : 0;
+    }
+#endif
     if ((ch = fuse_mount(mountpoint, &args)) != NULL) {
         struct fuse *se;
 
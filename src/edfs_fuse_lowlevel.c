@@ -0,0 +1,499 @@
+#ifdef EDFS_FUSE_LOWLEVEL
+
+#define FUSE_USE_VERSION 26
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/statvfs.h>
+#include <fuse_lowlevel.h>
+
+#include "log.h"
+#include "edfs_core.h"
+#include "edfs_fuse_lowlevel.h"
+
+struct edfs_fuse_dir {
+    struct dirbuf *dir;
+    char *buf;
+    size_t size;
+    int filled;
+};
+
+struct edfs_fuse_dir_fill {
+    struct edfs *edfs_context;
+    fuse_req_t req;
+    struct edfs_fuse_dir *dir;
+};
+
+static struct fuse_session *edfs_fuse_ll_session = NULL;
+static int edfs_fuse_ll_splice = 0;
+
+#define EDFS_CONTEXT(req)   ((struct edfs *)fuse_req_userdata(req))
+
+// fuse uses FUSE_ROOT_ID for the mount root, edfs uses the key root inode
+static edfs_ino_t edfs_fuse_ll_inode(struct edfs *edfs_context, fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID)
+        return edfs_pathtoinode(edfs_context, NULL, NULL, NULL);
+    return ino;
+}
+
+static fuse_ino_t edfs_fuse_ll_ino(struct edfs *edfs_context, edfs_ino_t inode) {
+    if (inode == edfs_pathtoinode(edfs_context, NULL, NULL, NULL))
+        return FUSE_ROOT_ID;
+    return inode;
+}
+
+static void edfs_fuse_ll_init(void *userdata, struct fuse_conn_info *conn) {
+#ifdef FUSE_CAP_BIG_WRITES
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+        conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_SPLICE_WRITE
+    // decrypted data is in memory, replies may be moved to the kernel without another copy
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+        if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+            conn->want |= FUSE_CAP_SPLICE_MOVE;
+        edfs_fuse_ll_splice = 1;
+    }
+    if (conn->capable & FUSE_CAP_SPLICE_READ)
+        conn->want |= FUSE_CAP_SPLICE_READ;
+#endif
+    log_info("fuse low-level frontend initialized (big writes: %i, splice: %i)", (conn->want & FUSE_CAP_BIG_WRITES) ? 1 : 0, edfs_fuse_ll_splice);
+}
+
+static int edfs_fuse_ll_entry(struct edfs *edfs_context, edfs_ino_t ino, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    int err = edfs_getattr(edfs_context, ino, &e->attr);
+    if (err)
+        return err;
+
+    e->ino = edfs_fuse_ll_ino(edfs_context, ino);
+    e->attr.st_ino = e->ino;
+    e->generation = 1;
+    e->attr_timeout = EDFS_FUSE_ATTR_TIMEOUT;
+    e->entry_timeout = EDFS_FUSE_ENTRY_TIMEOUT;
+    return 0;
+}
+
+static void edfs_fuse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct edfs *edfs_context = EDFS_CONTEXT(req);
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+
+    edfs_ino_t ino = edfs_lookup(edfs_context, edfs_fuse_ll_inode(edfs_context, parent), name, &e.attr);
+    if ((int64_t)ino == -EACCES) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    if (!ino) {
+        // negative entry, cached by the kernel
+        e.ino = 0;
+        e.entry_timeout = EDFS_FUSE_NEGATIVE_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    e.ino = edfs_fuse_ll_ino(edfs_context, ino);
+    e.attr.st_ino = e.ino;
+    e.generation = 1;
+    e.attr_timeout = EDFS_FUSE_ATTR_TIMEOUT;
+    e.entry_timeout = EDFS_FUSE_ENTRY_TIMEOUT;
+    fuse_reply_entry(req, &e);
+}
+
+static void edfs_fuse_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    // inodes are not reference counted
+    fuse_reply_none(req);
+}
+
+static void edfs_fuse_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    edfs_stat stbuf;
+    int err = edfs_getattr(EDFS_CONTEXT(req), edfs_fuse_ll_inode(EDFS_CONTEXT(req), ino), &stbuf);
+    stbuf.st_ino = ino;
+    if (err)
+        fuse_reply_err(req, -err);
+    else
+        fuse_reply_attr(req, &stbuf, EDFS_FUSE_ATTR_TIMEOUT);
+}
+
+static void edfs_fuse_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct edfs *edfs_context = EDFS_CONTEXT(req);
+    edfs_ino_t inode = edfs_fuse_ll_inode(edfs_context, ino);
+    edfs_stat stbuf;
+    int err = 0;
+
+    // FUSE_SET_ATTR_UID and FUSE_SET_ATTR_GID (chown) are not supported, and silently ignored
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (!edfs_set_size(edfs_context, inode, attr->st_size))
+            err = -ENOENT;
+    }
+
+    memset(&stbuf, 0, sizeof(edfs_stat));
+    int edfs_to_set = 0;
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        stbuf.st_mode = attr->st_mode;
+        edfs_to_set |= EDFS_SET_ATTR_MODE;
+    }
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        stbuf.st_mtime = time(NULL);
+        edfs_to_set |= EDFS_SET_ATTR_MTIME;
+    } else
+#endif
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+        stbuf.st_mtime = attr->st_mtime;
+        edfs_to_set |= EDFS_SET_ATTR_MTIME;
+    }
+    if ((!err) && (edfs_to_set))
+        err = edfs_setattr(edfs_context, inode, &stbuf, edfs_to_set);
+
+    if (!err)
+        err = edfs_getattr(edfs_context, inode, &stbuf);
+    stbuf.st_ino = ino;
+
+    if (err)
+        fuse_reply_err(req, -err);
+    else
+        fuse_reply_attr(req, &stbuf, EDFS_FUSE_ATTR_TIMEOUT);
+}
+
+static void edfs_fuse_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    struct edfs *edfs_context = EDFS_CONTEXT(req);
+    struct fuse_entry_param e;
+    uint64_t inode = 0;
+
+    int err = edfs_mknod(edfs_context, edfs_fuse_ll_inode(edfs_context, parent), name, mode, &inode);
+    if (!err)
+        err = edfs_fuse_ll_entry(edfs_context, inode, &e);
+    if (err)
+        fuse_reply_err(req, -err);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void edfs_fuse_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct edfs *edfs_context = EDFS_CONTEXT(req);
+    struct fuse_entry_param e;
+
+    parent = edfs_fuse_ll_inode(edfs_context, parent);
+    int err = edfs_mkdir(edfs_context, parent, name, mode);
+    if (!err) {
+        edfs_ino_t ino = edfs_lookup(edfs_context, parent, name, NULL);
+        if ((ino) && ((int64_t)ino > 0))
+            err = edfs_fuse_ll_entry(edfs_context, ino, &e);
+        else
+            err = -EIO;
+    }
+    if (err)
+        fuse_reply_err(req, -err);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void edfs_fuse_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -edfs_unlink(EDFS_CONTEXT(req), edfs_fuse_ll_inode(EDFS_CONTEXT(req), parent), name));
+}
+
+static void edfs_fuse_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -edfs_rmdir(EDFS_CONTEXT(req), edfs_fuse_ll_inode(EDFS_CONTEXT(req), parent), name));
+}
+
+static void edfs_fuse_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct edfs *edfs_context = EDFS_CONTEXT(req);
+    edfs_stat stbuf;
+
+    ino = edfs_fuse_ll_inode(edfs_context, ino);
+    int err = edfs_getattr(edfs_context, ino, &stbuf);
+    if (err) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+    if (stbuf.st_mode & S_IFDIR) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    struct filewritebuf *buf = NULL;
+    err = edfs_open(edfs_context, ino, fi->flags, &buf);
+    if (err) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t)buf;
+    // data may be changed by other nodes
+    fi->keep_cache = 0;
+    if (fuse_reply_open(req, fi) == -ENOENT)
+        edfs_close(edfs_context, buf);
+}
+
+static void edfs_fuse_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct edfs *edfs_context = EDFS_CONTEXT(req);
+    struct fuse_entry_param e;
+    struct filewritebuf *buf = NULL;
+    uint64_t inode = 0;
+
+    int err = edfs_create(edfs_context, edfs_fuse_ll_inode(edfs_context, parent), name, mode, &inode, &buf);
+    if (!err)
+        err = edfs_fuse_ll_entry(edfs_context, inode, &e);
+    if (err) {
+        if (buf)
+            edfs_close(edfs_context, buf);
+        fuse_reply_err(req, -err);
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t)buf;
+    if (fuse_reply_create(req, &e, fi) == -ENOENT)
+        edfs_close(edfs_context, buf);
+}
+
+static void edfs_fuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct filewritebuf *filebuf = (struct filewritebuf *)(uintptr_t)fi->fh;
+    if (!filebuf) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+
+    char *buf = (char *)malloc(size ? size : 1);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int read_size = edfs_read(EDFS_CONTEXT(req), edfs_fuse_ll_inode(EDFS_CONTEXT(req), ino), size, off, buf, filebuf);
+    if (read_size < 0) {
+        fuse_reply_err(req, -read_size);
+    } else
+#ifdef FUSE_CAP_SPLICE_WRITE
+    if ((edfs_fuse_ll_splice) && (read_size > 0)) {
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(read_size);
+        bufv.buf[0].mem = buf;
+        fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+    } else
+#endif
+        fuse_reply_buf(req, buf, read_size);
+
+    free(buf);
+}
+
+static void edfs_fuse_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct filewritebuf *filebuf = (struct filewritebuf *)(uintptr_t)fi->fh;
+    int written = edfs_write(EDFS_CONTEXT(req), edfs_fuse_ll_inode(EDFS_CONTEXT(req), ino), buf, size, off, filebuf);
+    if (written < 0)
+        fuse_reply_err(req, -written);
+    else
+        fuse_reply_write(req, written);
+}
+
+#ifdef FUSE_CAP_SPLICE_READ
+static void edfs_fuse_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(bufv);
+    // data must be compressed and encrypted, so spliced buffers are copied only once, here
+    if ((bufv->count == 1) && (!(bufv->buf[0].flags & FUSE_BUF_IS_FD))) {
+        edfs_fuse_ll_write(req, ino, (const char *)bufv->buf[0].mem, size, off, fi);
+        return;
+    }
+
+    char *buf = (char *)malloc(size ? size : 1);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    struct fuse_bufvec mem_buf = FUSE_BUFVEC_INIT(size);
+    mem_buf.buf[0].mem = buf;
+    ssize_t copied = fuse_buf_copy(&mem_buf, bufv, 0);
+    if (copied < 0)
+        fuse_reply_err(req, (int)-copied);
+    else
+        edfs_fuse_ll_write(req, ino, buf, (size_t)copied, off, fi);
+    free(buf);
+}
+#endif
+
+static void edfs_fuse_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -edfs_flush(EDFS_CONTEXT(req), (struct filewritebuf *)(uintptr_t)fi->fh));
+}
+
+static void edfs_fuse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -edfs_fsync(EDFS_CONTEXT(req), datasync, (struct filewritebuf *)(uintptr_t)fi->fh));
+}
+
+static void edfs_fuse_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (fi->fh)
+        edfs_close(EDFS_CONTEXT(req), (struct filewritebuf *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void edfs_fuse_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct edfs *edfs_context = EDFS_CONTEXT(req);
+    edfs_stat stbuf;
+
+    ino = edfs_fuse_ll_inode(edfs_context, ino);
+    int err = edfs_getattr(edfs_context, ino, &stbuf);
+    if (err) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+    if ((stbuf.st_mode & S_IFDIR) == 0) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct edfs_fuse_dir *dir = (struct edfs_fuse_dir *)malloc(sizeof(struct edfs_fuse_dir));
+    if (!dir) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    memset(dir, 0, sizeof(struct edfs_fuse_dir));
+    dir->dir = edfs_opendir(edfs_context, ino);
+    if (!dir->dir) {
+        free(dir);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uint64_t)(uintptr_t)dir;
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        edfs_releasedir(dir->dir);
+        free(dir);
+    }
+}
+
+static unsigned int edfs_fuse_ll_add_directory(const char *name, edfs_ino_t ino, int type, int64_t size, time_t created, time_t modified, time_t timestamp, void *userdata) {
+    struct edfs_fuse_dir_fill *fill = (struct edfs_fuse_dir_fill *)userdata;
+    struct edfs_fuse_dir *dir = fill->dir;
+
+    edfs_stat stbuf;
+    memset(&stbuf, 0, sizeof(edfs_stat));
+    stbuf.st_ino = edfs_fuse_ll_ino(fill->edfs_context, ino);
+    stbuf.st_mode = type;
+
+    size_t entry_size = fuse_add_direntry(fill->req, NULL, 0, name, NULL, 0);
+    char *buf = (char *)realloc(dir->buf, dir->size + entry_size);
+    if (!buf)
+        return 0;
+
+    dir->buf = buf;
+    fuse_add_direntry(fill->req, dir->buf + dir->size, entry_size, name, &stbuf, dir->size + entry_size);
+    dir->size += entry_size;
+    return 1;
+}
+
+static void edfs_fuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct edfs_fuse_dir *dir = (struct edfs_fuse_dir *)(uintptr_t)fi->fh;
+    if (!dir) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+
+    // the whole directory is listed on the first call, next calls use the buffered entries
+    if (!dir->filled) {
+        struct edfs_fuse_dir_fill fill;
+        fill.edfs_context = EDFS_CONTEXT(req);
+        fill.req = req;
+        fill.dir = dir;
+
+        int err = edfs_readdir(fill.edfs_context, edfs_fuse_ll_inode(fill.edfs_context, ino), 0x7FFFFFFF, 0, dir->dir, edfs_fuse_ll_add_directory, &fill);
+        if (err) {
+            fuse_reply_err(req, -err);
+            return;
+        }
+        dir->filled = 1;
+    }
+
+    if (off < dir->size) {
+        size_t remaining = dir->size - off;
+        fuse_reply_buf(req, dir->buf + off, remaining < size ? remaining : size);
+    } else
+        fuse_reply_buf(req, NULL, 0);
+}
+
+static void edfs_fuse_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct edfs_fuse_dir *dir = (struct edfs_fuse_dir *)(uintptr_t)fi->fh;
+    if (dir) {
+        edfs_releasedir(dir->dir);
+        free(dir->buf);
+        free(dir);
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void edfs_fuse_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs stbuf;
+    int read_only = edwork_readonly(EDFS_CONTEXT(req));
+
+    memset(&stbuf, 0, sizeof(struct statvfs));
+    stbuf.f_bsize = 4096;
+    stbuf.f_frsize = 4096;
+    stbuf.f_blocks = 0x10000000;
+    stbuf.f_bfree = read_only ? 0 : (stbuf.f_blocks / 2);
+    stbuf.f_bavail = read_only ? 0 : stbuf.f_bfree;
+    stbuf.f_files = 0x10000000;
+    stbuf.f_ffree = read_only ? 0 : (stbuf.f_files / 2);
+    stbuf.f_favail = read_only ? 0 : stbuf.f_ffree;
+    stbuf.f_namemax = 4096;
+    fuse_reply_statfs(req, &stbuf);
+}
+
+int edfs_fuse_lowlevel_loop(struct edfs *edfs_context, const char *mountpoint, struct fuse_args *args, int multithreaded) {
+    static struct fuse_lowlevel_ops edfs_fuse_ll;
+    struct fuse_chan *ch;
+    int err = -1;
+
+    memset(&edfs_fuse_ll, 0, sizeof(edfs_fuse_ll));
+    edfs_fuse_ll.init       = edfs_fuse_ll_init;
+    edfs_fuse_ll.lookup     = edfs_fuse_ll_lookup;
+    edfs_fuse_ll.forget     = edfs_fuse_ll_forget;
+    edfs_fuse_ll.getattr    = edfs_fuse_ll_getattr;
+    edfs_fuse_ll.setattr    = edfs_fuse_ll_setattr;
+    edfs_fuse_ll.mknod      = edfs_fuse_ll_mknod;
+    edfs_fuse_ll.mkdir      = edfs_fuse_ll_mkdir;
+    edfs_fuse_ll.unlink     = edfs_fuse_ll_unlink;
+    edfs_fuse_ll.rmdir      = edfs_fuse_ll_rmdir;
+    edfs_fuse_ll.open       = edfs_fuse_ll_open;
+    edfs_fuse_ll.create     = edfs_fuse_ll_create;
+    edfs_fuse_ll.read       = edfs_fuse_ll_read;
+    edfs_fuse_ll.write      = edfs_fuse_ll_write;
+#ifdef FUSE_CAP_SPLICE_READ
+    edfs_fuse_ll.write_buf  = edfs_fuse_ll_write_buf;
+#endif
+    edfs_fuse_ll.flush      = edfs_fuse_ll_flush;
+    edfs_fuse_ll.fsync      = edfs_fuse_ll_fsync;
+    edfs_fuse_ll.release    = edfs_fuse_ll_release;
+    edfs_fuse_ll.opendir    = edfs_fuse_ll_opendir;
+    edfs_fuse_ll.readdir    = edfs_fuse_ll_readdir;
+    edfs_fuse_ll.releasedir = edfs_fuse_ll_releasedir;
+    edfs_fuse_ll.statfs     = edfs_fuse_ll_statfs;
+
+    if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(args, &edfs_fuse_ll, sizeof(edfs_fuse_ll), edfs_context);
+        if (se) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                edfs_fuse_ll_session = se;
+                if (multithreaded)
+                    err = fuse_session_loop_mt(se);
+                else
+                    err = fuse_session_loop(se);
+                edfs_fuse_ll_session = NULL;
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    } else
+        log_error("error mounting %s", mountpoint);
+
+    return err;
+}
+
+void edfs_fuse_lowlevel_exit() {
+    if (edfs_fuse_ll_session)
+        fuse_session_exit(edfs_fuse_ll_session);
+}
+
+#endif
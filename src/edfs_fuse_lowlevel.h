@@ -0,0 +1,16 @@
+#ifndef __EDFS_FUSE_LOWLEVEL_H
+#define __EDFS_FUSE_LOWLEVEL_H
+
+#include "edfs_core.h"
+
+// kernel cache timeouts, in seconds
+#define EDFS_FUSE_ENTRY_TIMEOUT     1.0
+#define EDFS_FUSE_ATTR_TIMEOUT      1.0
+#define EDFS_FUSE_NEGATIVE_TIMEOUT  0.5
+
+struct fuse_args;
+
+int edfs_fuse_lowlevel_loop(struct edfs *edfs_context, const char *mountpoint, struct fuse_args *args, int multithreaded);
+void edfs_fuse_lowlevel_exit();
+
+#endif
@@ -2,7 +2,9 @@
 #include <stdio.h>
 
 #include "log.h"
+#include "xxhash.h"
 #include "edfs_key_data.h"
+#include "pack_store.h"
 
 #ifdef _WIN32
     #include <windows.h>
@@ -26,6 +28,13 @@ static void avl_key_data_destroy(void *key, void *data) {
     free(data);
 }
 
+static void avl_rebroadcast_destroy(void *key, void *data) {
+    struct edfs_rebroadcast_entry *entry = (struct edfs_rebroadcast_entry *)data;
+    if (entry)
+        free(entry->packet);
+    free(data);
+}
+
 void avl_dummy_destructor(void *key, void *data) {
     // nothing
 }
@@ -39,15 +48,22 @@ int edfs_key_data_init(struct edfs_key_data *key_data, const char *use_working_d
 
     thread_mutex_init(&key_data->ino_cache_lock);
     thread_mutex_init(&key_data->notify_write_lock);
+    thread_mutex_init(&key_data->chunk_waiters_lock);
+    thread_mutex_init(&key_data->descriptors_lock);
+    thread_mutex_init(&key_data->dentries_lock);
+    thread_mutex_init(&key_data->rebroadcast_lock);
 #ifndef EDFS_NO_JS
     thread_mutex_init(&key_data->js_lock);
 #endif
+    key_data->chain_index = chain_index_create();
 
     avl_initialize(&key_data->ino_cache, avl_ino_compare, avl_dummy_key_destructor);
     avl_initialize(&key_data->ino_checksum_mismatch, avl_ino_compare, avl_dummy_key_destructor);
     avl_initialize(&key_data->ino_sync_file, avl_ino_compare, avl_dummy_key_destructor);
     avl_initialize(&key_data->notify_write, avl_ino_compare, avl_dummy_key_destructor);
     avl_initialize(&key_data->allow_data, avl_ino_compare, avl_dummy_key_destructor);
+    avl_initialize(&key_data->descriptors, avl_ino_compare, avl_dummy_key_destructor);
+    avl_initialize(&key_data->rebroadcast, avl_ino_compare, avl_dummy_key_destructor);
 
     key_data->working_directory = edfs_add_to_path(use_working_directory, "inode");
     key_data->cache_directory = edfs_add_to_path(use_working_directory, "cache");
@@ -372,6 +388,331 @@ int edfs_key_data_vote_winner(struct edfs_key_data *key_data, const unsigned cha
     return 0;
 }
 
+void edfs_key_data_chunk_waiter_add(struct edfs_key_data *key_data, struct edfs_chunk_waiter *waiter, uint64_t inode, uint64_t chunk) {
+    if ((!key_data) || (!waiter))
+        return;
+
+    waiter->inode = inode;
+    waiter->chunk = chunk;
+    thread_signal_init(&waiter->signal);
+
+    thread_mutex_lock(&key_data->chunk_waiters_lock);
+    waiter->next = key_data->chunk_waiters;
+    key_data->chunk_waiters = waiter;
+    thread_mutex_unlock(&key_data->chunk_waiters_lock);
+}
+
+void edfs_key_data_chunk_waiter_remove(struct edfs_key_data *key_data, struct edfs_chunk_waiter *waiter) {
+    if ((!key_data) || (!waiter))
+        return;
+
+    thread_mutex_lock(&key_data->chunk_waiters_lock);
+    struct edfs_chunk_waiter **ref = &key_data->chunk_waiters;
+    while (*ref) {
+        if (*ref == waiter) {
+            *ref = waiter->next;
+            break;
+        }
+        ref = &(*ref)->next;
+    }
+    thread_mutex_unlock(&key_data->chunk_waiters_lock);
+
+    waiter->next = NULL;
+    thread_signal_term(&waiter->signal);
+}
+
+int edfs_key_data_notify_chunk(struct edfs_key_data *key_data, uint64_t inode, uint64_t chunk) {
+    if (!key_data)
+        return 0;
+
+    int notified = 0;
+    thread_mutex_lock(&key_data->chunk_waiters_lock);
+    struct edfs_chunk_waiter *waiter = key_data->chunk_waiters;
+    while (waiter) {
+        if ((waiter->inode == inode) && (waiter->chunk == chunk)) {
+            thread_signal_raise(&waiter->signal);
+            notified ++;
+        }
+        waiter = waiter->next;
+    }
+    thread_mutex_unlock(&key_data->chunk_waiters_lock);
+    return notified;
+}
+
+static void edfs_key_data_descriptor_unlink(struct edfs_key_data *key_data, struct edfs_descriptor *desc) {
+    if (desc->prev)
+        desc->prev->next = desc->next;
+    else
+        key_data->descriptors_head = desc->next;
+
+    if (desc->next)
+        desc->next->prev = desc->prev;
+    else
+        key_data->descriptors_tail = desc->prev;
+
+    desc->prev = NULL;
+    desc->next = NULL;
+}
+
+static void edfs_key_data_descriptor_push(struct edfs_key_data *key_data, struct edfs_descriptor *desc) {
+    desc->prev = NULL;
+    desc->next = key_data->descriptors_head;
+    if (key_data->descriptors_head)
+        key_data->descriptors_head->prev = desc;
+    else
+        key_data->descriptors_tail = desc;
+    key_data->descriptors_head = desc;
+}
+
+uint64_t edfs_key_data_descriptor_epoch(struct edfs_key_data *key_data) {
+    if (!key_data)
+        return 0;
+
+    thread_mutex_lock(&key_data->descriptors_lock);
+    uint64_t epoch = key_data->descriptors_epoch;
+    thread_mutex_unlock(&key_data->descriptors_lock);
+    return epoch;
+}
+
+int edfs_key_data_descriptor_get(struct edfs_key_data *key_data, uint64_t inode, struct edfs_descriptor *desc) {
+    if ((!key_data) || (!desc))
+        return 0;
+
+    thread_mutex_lock(&key_data->descriptors_lock);
+    struct edfs_descriptor *cached = (struct edfs_descriptor *)avl_search(&key_data->descriptors, (void *)(uintptr_t)inode);
+    if (cached) {
+        // most recently used descriptors are kept at head
+        edfs_key_data_descriptor_unlink(key_data, cached);
+        edfs_key_data_descriptor_push(key_data, cached);
+        memcpy(desc, cached, sizeof(struct edfs_descriptor));
+        desc->prev = NULL;
+        desc->next = NULL;
+    }
+    thread_mutex_unlock(&key_data->descriptors_lock);
+    return (cached != NULL);
+}
+
+void edfs_key_data_descriptor_set(struct edfs_key_data *key_data, const struct edfs_descriptor *desc, uint64_t epoch) {
+    if ((!key_data) || (!desc))
+        return;
+
+    thread_mutex_lock(&key_data->descriptors_lock);
+    // descriptor was changed after the caller read it
+    if (epoch != key_data->descriptors_epoch) {
+        thread_mutex_unlock(&key_data->descriptors_lock);
+        return;
+    }
+    struct edfs_descriptor *cached = (struct edfs_descriptor *)avl_search(&key_data->descriptors, (void *)(uintptr_t)desc->inode);
+    if (cached) {
+        edfs_key_data_descriptor_unlink(key_data, cached);
+    } else {
+        if (key_data->descriptors_count >= EDFS_DESCRIPTOR_CACHE_SIZE) {
+            cached = key_data->descriptors_tail;
+            edfs_key_data_descriptor_unlink(key_data, cached);
+            avl_remove(&key_data->descriptors, (void *)(uintptr_t)cached->inode);
+        } else {
+            cached = (struct edfs_descriptor *)malloc(sizeof(struct edfs_descriptor));
+            if (!cached) {
+                thread_mutex_unlock(&key_data->descriptors_lock);
+                return;
+            }
+            key_data->descriptors_count ++;
+        }
+        avl_insert(&key_data->descriptors, (void *)(uintptr_t)desc->inode, cached);
+    }
+    memcpy(cached, desc, sizeof(struct edfs_descriptor));
+    edfs_key_data_descriptor_push(key_data, cached);
+    thread_mutex_unlock(&key_data->descriptors_lock);
+}
+
+void edfs_key_data_descriptor_invalidate(struct edfs_key_data *key_data, uint64_t inode) {
+    if (!key_data)
+        return;
+
+    thread_mutex_lock(&key_data->descriptors_lock);
+    key_data->descriptors_epoch ++;
+    struct edfs_descriptor *cached = (struct edfs_descriptor *)avl_remove(&key_data->descriptors, (void *)(uintptr_t)inode);
+    if (cached) {
+        edfs_key_data_descriptor_unlink(key_data, cached);
+        key_data->descriptors_count --;
+        free(cached);
+    }
+    thread_mutex_unlock(&key_data->descriptors_lock);
+}
+
+static struct edfs_dentry *edfs_key_data_dentry_slot(struct edfs_key_data *key_data, uint64_t parent, const char *name, int name_len) {
+    return &key_data->dentries[XXH64(name, name_len, parent) % EDFS_DENTRY_CACHE_SIZE];
+}
+
+int edfs_key_data_dentry_get(struct edfs_key_data *key_data, uint64_t parent, const char *name, int name_len, uint64_t *inode) {
+    if ((!key_data) || (!name) || (name_len <= 0) || (name_len > EDFS_DENTRY_NAME_SIZE))
+        return 0;
+
+    int found = 0;
+    thread_mutex_lock(&key_data->dentries_lock);
+    if (key_data->dentries) {
+        struct edfs_dentry *dentry = edfs_key_data_dentry_slot(key_data, parent, name, name_len);
+        if ((dentry->inode) && (dentry->parent == parent) && (dentry->name_len == name_len) && (!memcmp(dentry->name, name, name_len))) {
+            if (inode)
+                *inode = dentry->inode;
+            found = 1;
+        }
+    }
+    thread_mutex_unlock(&key_data->dentries_lock);
+    return found;
+}
+
+void edfs_key_data_dentry_set(struct edfs_key_data *key_data, uint64_t parent, const char *name, int name_len, uint64_t inode) {
+    if ((!key_data) || (!name) || (name_len <= 0) || (name_len > EDFS_DENTRY_NAME_SIZE) || (!inode))
+        return;
+
+    thread_mutex_lock(&key_data->dentries_lock);
+    if (!key_data->dentries)
+        key_data->dentries = (struct edfs_dentry *)calloc(EDFS_DENTRY_CACHE_SIZE, sizeof(struct edfs_dentry));
+    if (key_data->dentries) {
+        // direct mapped, newer entries replace older ones
+        struct edfs_dentry *dentry = edfs_key_data_dentry_slot(key_data, parent, name, name_len);
+        dentry->parent = parent;
+        dentry->inode = inode;
+        dentry->name_len = name_len;
+        memcpy(dentry->name, name, name_len);
+    }
+    thread_mutex_unlock(&key_data->dentries_lock);
+}
+
+static void edfs_key_data_rebroadcast_unlink(struct edfs_key_data *key_data, struct edfs_rebroadcast_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        key_data->rebroadcast_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        key_data->rebroadcast_tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void edfs_key_data_rebroadcast_append(struct edfs_key_data *key_data, struct edfs_rebroadcast_entry *entry) {
+    entry->next = NULL;
+    entry->prev = key_data->rebroadcast_tail;
+    if (key_data->rebroadcast_tail)
+        key_data->rebroadcast_tail->next = entry;
+    else
+        key_data->rebroadcast_head = entry;
+    key_data->rebroadcast_tail = entry;
+}
+
+int edfs_key_data_rebroadcast_add(struct edfs_key_data *key_data, uint64_t ino, uint64_t sequence, uint32_t acks, uint32_t original_acks, const unsigned char *packet, int len, uint64_t next_send, int replace) {
+    if ((!key_data) || (!packet) || (len <= 0))
+        return -1;
+
+    unsigned char *packet_copy = (unsigned char *)malloc(len);
+    if (!packet_copy)
+        return -1;
+    memcpy(packet_copy, packet, len);
+
+    thread_mutex_lock(&key_data->rebroadcast_lock);
+    struct edfs_rebroadcast_entry *entry = (struct edfs_rebroadcast_entry *)avl_search(&key_data->rebroadcast, (void *)(uintptr_t)ino);
+    if (entry) {
+        if (!replace) {
+            thread_mutex_unlock(&key_data->rebroadcast_lock);
+            free(packet_copy);
+            return 0;
+        }
+        edfs_key_data_rebroadcast_unlink(key_data, entry);
+        free(entry->packet);
+    } else {
+        entry = (struct edfs_rebroadcast_entry *)malloc(sizeof(struct edfs_rebroadcast_entry));
+        if (!entry) {
+            thread_mutex_unlock(&key_data->rebroadcast_lock);
+            free(packet_copy);
+            return -1;
+        }
+        avl_insert(&key_data->rebroadcast, (void *)(uintptr_t)ino, entry);
+        key_data->rebroadcast_count ++;
+    }
+    memset(entry, 0, sizeof(struct edfs_rebroadcast_entry));
+    entry->ino = ino;
+    entry->sequence = sequence;
+    entry->acks = acks;
+    entry->original_acks = original_acks;
+    entry->next_send = next_send;
+    entry->packet = packet_copy;
+    entry->len = len;
+    edfs_key_data_rebroadcast_append(key_data, entry);
+    thread_mutex_unlock(&key_data->rebroadcast_lock);
+    return 1;
+}
+
+// returns 1 if the entry was removed
+int edfs_key_data_rebroadcast_confirm(struct edfs_key_data *key_data, uint64_t ino, int acks) {
+    if ((!key_data) || (!acks))
+        return 0;
+
+    thread_mutex_lock(&key_data->rebroadcast_lock);
+    struct edfs_rebroadcast_entry *entry = (struct edfs_rebroadcast_entry *)avl_search(&key_data->rebroadcast, (void *)(uintptr_t)ino);
+    if (!entry) {
+        thread_mutex_unlock(&key_data->rebroadcast_lock);
+        return 0;
+    }
+    if ((acks > 0) && (entry->acks) && (entry->acks > (uint32_t)acks)) {
+        entry->acks --;
+        thread_mutex_unlock(&key_data->rebroadcast_lock);
+        return 0;
+    }
+    avl_remove(&key_data->rebroadcast, (void *)(uintptr_t)ino);
+    edfs_key_data_rebroadcast_unlink(key_data, entry);
+    key_data->rebroadcast_count --;
+    thread_mutex_unlock(&key_data->rebroadcast_lock);
+
+    free(entry->packet);
+    free(entry);
+    return 1;
+}
+
+// copies up to max_count entries due for retransmission in due (caller must free the packets)
+int edfs_key_data_rebroadcast_due(struct edfs_key_data *key_data, uint64_t now, uint64_t interval, struct edfs_rebroadcast_entry *due, int max_count) {
+    if ((!key_data) || (!due) || (max_count <= 0))
+        return 0;
+
+    int count = 0;
+    thread_mutex_lock(&key_data->rebroadcast_lock);
+    struct edfs_rebroadcast_entry *entry = key_data->rebroadcast_head;
+    struct edfs_rebroadcast_entry *last = key_data->rebroadcast_tail;
+    while ((entry) && (count < max_count)) {
+        struct edfs_rebroadcast_entry *next = entry->next;
+        if (entry->next_send <= now) {
+            unsigned char *packet_copy = (unsigned char *)malloc(entry->len);
+            if (!packet_copy)
+                break;
+            memcpy(packet_copy, entry->packet, entry->len);
+            memcpy(&due[count], entry, sizeof(struct edfs_rebroadcast_entry));
+            due[count].packet = packet_copy;
+            due[count].prev = NULL;
+            due[count].next = NULL;
+            count ++;
+
+            // exponential backoff
+            uint32_t shift = entry->attempts;
+            if (shift > EDFS_REBROADCAST_MAX_BACKOFF)
+                shift = EDFS_REBROADCAST_MAX_BACKOFF;
+            entry->next_send = now + (interval << shift);
+            entry->attempts ++;
+            // keep round-robin between entries
+            if (entry != key_data->rebroadcast_tail) {
+                edfs_key_data_rebroadcast_unlink(key_data, entry);
+                edfs_key_data_rebroadcast_append(key_data, entry);
+            }
+        }
+        if (entry == last)
+            break;
+        entry = next;
+    }
+    thread_mutex_unlock(&key_data->rebroadcast_lock);
+    return count;
+}
+
 void edfs_key_data_deinit(struct edfs_key_data *key_data) {
     if (!key_data)
         return;
@@ -386,6 +727,18 @@ void edfs_key_data_deinit(struct edfs_key_data *key_data) {
     avl_destroy(&key_data->ino_cache, avl_key_data_destroy);
     avl_destroy(&key_data->ino_checksum_mismatch, avl_dummy_destructor);
     avl_destroy(&key_data->ino_sync_file, avl_dummy_destructor);
+    avl_destroy(&key_data->descriptors, avl_key_data_destroy);
+    key_data->descriptors_head = NULL;
+    key_data->descriptors_tail = NULL;
+    key_data->descriptors_count = 0;
+    free(key_data->dentries);
+    key_data->dentries = NULL;
+    avl_destroy(&key_data->rebroadcast, avl_rebroadcast_destroy);
+    key_data->rebroadcast_head = NULL;
+    key_data->rebroadcast_tail = NULL;
+    key_data->rebroadcast_count = 0;
+    chain_index_destroy(key_data->chain_index);
+    key_data->chain_index = NULL;
     blockchain_free(key_data->chain);
 
     if (key_data->votes) {
@@ -405,7 +758,20 @@ void edfs_key_data_deinit(struct edfs_key_data *key_data) {
     free(key_data->js_working_directory);
 #endif
 
+    if (key_data->chain_store) {
+        chain_store_close(key_data->chain_store);
+        key_data->chain_store = NULL;
+    }
+    if (key_data->pack) {
+        pack_store_close(key_data->pack);
+        key_data->pack = NULL;
+    }
+
     thread_mutex_term(&key_data->notify_write_lock);
+    thread_mutex_term(&key_data->chunk_waiters_lock);
+    thread_mutex_term(&key_data->descriptors_lock);
+    thread_mutex_term(&key_data->dentries_lock);
+    thread_mutex_term(&key_data->rebroadcast_lock);
     thread_mutex_term(&key_data->ino_cache_lock);
 #ifndef EDFS_NO_JS
     thread_mutex_term(&key_data->js_lock);
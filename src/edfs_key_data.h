@@ -3,9 +3,12 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
+#include <time.h>
 #include "thread.h"
 #include "avl.h"
 #include "blockchain.h"
+#include "chain_index.h"
+#include "chain_store.h"
 
 #ifndef EDFS_NO_JS
     #include "duktape.h"
@@ -14,6 +17,13 @@
 
 #define MAX_KEY_SIZE                8192
 #define MAX_PROOF_INODES        300
+#define EDFS_DESCRIPTOR_CACHE_SIZE  8192
+#define EDFS_DESCRIPTOR_NAME_SIZE   256
+#define EDFS_DENTRY_CACHE_SIZE      4096
+#define EDFS_DENTRY_NAME_SIZE       120
+#define EDFS_REBROADCAST_MAX_BACKOFF 6
+
+struct pack_store;
 
 struct edfs_key_vote_item {
     unsigned char vote_key[0xFF];
@@ -27,6 +37,52 @@ struct edfs_key_vote_data {
     int timeout;
 };
 
+struct edfs_chunk_waiter {
+    uint64_t inode;
+    uint64_t chunk;
+    thread_signal_t signal;
+    struct edfs_chunk_waiter *next;
+};
+
+struct edfs_descriptor {
+    uint64_t inode;
+    uint64_t parent;
+    int64_t size;
+    uint64_t timestamp;
+    uint64_t generation;
+    time_t created;
+    time_t modified;
+    int type;
+    int has_signature;
+    int missing;
+    unsigned char iohash[32];
+    char name[EDFS_DESCRIPTOR_NAME_SIZE];
+
+    struct edfs_descriptor *prev;
+    struct edfs_descriptor *next;
+};
+
+struct edfs_dentry {
+    uint64_t parent;
+    uint64_t inode;
+    int name_len;
+    char name[EDFS_DENTRY_NAME_SIZE];
+};
+
+struct edfs_rebroadcast_entry {
+    uint64_t ino;
+    uint64_t sequence;
+    uint32_t acks;
+    uint32_t original_acks;
+    uint32_t attempts;
+    uint64_t next_send;
+    unsigned char *packet;
+    int len;
+
+    struct edfs_rebroadcast_entry *prev;
+    struct edfs_rebroadcast_entry *next;
+};
+
 struct edfs_key_data {
     unsigned char pubkey[MAX_KEY_SIZE];
     unsigned char sigkey[MAX_KEY_SIZE];
@@ -50,10 +106,34 @@ struct edfs_key_data {
     avl_tree_t allow_data;
     thread_mutex_t notify_write_lock;
 
+    struct edfs_chunk_waiter *chunk_waiters;
+    thread_mutex_t chunk_waiters_lock;
+
+    struct pack_store *pack;
+
+    avl_tree_t descriptors;
+    struct edfs_descriptor *descriptors_head;
+    struct edfs_descriptor *descriptors_tail;
+    int descriptors_count;
+    uint64_t descriptors_epoch;
+    thread_mutex_t descriptors_lock;
+
+    struct edfs_dentry *dentries;
+    thread_mutex_t dentries_lock;
+
+    avl_tree_t rebroadcast;
+    struct edfs_rebroadcast_entry *rebroadcast_head;
+    struct edfs_rebroadcast_entry *rebroadcast_tail;
+    int rebroadcast_count;
+    int rebroadcast_loaded;
+    thread_mutex_t rebroadcast_lock;
+
     unsigned char proof_of_time[40];
     uint64_t proof_inodes[MAX_PROOF_INODES];
     int proof_inodes_len;
     struct block *chain;
+    struct chain_index *chain_index;
+    struct chain_store *chain_store;
 
     size_t pub_len;
     int pubkey_size;
@@ -79,6 +159,8 @@ struct edfs_key_data {
     int opened_files;
 
     int mining_flag;
+    // received data packets queued to the dispatch workers, the key must outlive them
+    thread_atomic_int_t pending_jobs;
 
 #ifndef EDFS_NO_JS
     duk_context *js;
@@ -106,6 +188,18 @@ struct edfs_key_data {
 int edfs_key_data_init(struct edfs_key_data *key_data, const char *use_working_directory);
 int edfs_key_data_vote(struct edfs_key_data *key_data, const unsigned char *subject, int subject_size, const unsigned char *vote, int vote_size, int timeout);
 int edfs_key_data_vote_winner(struct edfs_key_data *key_data, const unsigned char *subject, int subject_size, unsigned char *vote, int vote_size);
+void edfs_key_data_chunk_waiter_add(struct edfs_key_data *key_data, struct edfs_chunk_waiter *waiter, uint64_t inode, uint64_t chunk);
+void edfs_key_data_chunk_waiter_remove(struct edfs_key_data *key_data, struct edfs_chunk_waiter *waiter);
+int edfs_key_data_notify_chunk(struct edfs_key_data *key_data, uint64_t inode, uint64_t chunk);
+uint64_t edfs_key_data_descriptor_epoch(struct edfs_key_data *key_data);
+int edfs_key_data_descriptor_get(struct edfs_key_data *key_data, uint64_t inode, struct edfs_descriptor *desc);
+void edfs_key_data_descriptor_set(struct edfs_key_data *key_data, const struct edfs_descriptor *desc, uint64_t epoch);
+void edfs_key_data_descriptor_invalidate(struct edfs_key_data *key_data, uint64_t inode);
+int edfs_key_data_dentry_get(struct edfs_key_data *key_data, uint64_t parent, const char *name, int name_len, uint64_t *inode);
+void edfs_key_data_dentry_set(struct edfs_key_data *key_data, uint64_t parent, const char *name, int name_len, uint64_t inode);
+int edfs_key_data_rebroadcast_add(struct edfs_key_data *key_data, uint64_t ino, uint64_t sequence, uint32_t acks, uint32_t original_acks, const unsigned char *packet, int len, uint64_t next_send, int replace);
+int edfs_key_data_rebroadcast_confirm(struct edfs_key_data *key_data, uint64_t ino, int acks);
+int edfs_key_data_rebroadcast_due(struct edfs_key_data *key_data, uint64_t now, uint64_t interval, struct edfs_rebroadcast_entry *due, int max_count);
 void edfs_key_data_deinit(struct edfs_key_data *key_data);
 #ifndef EDFS_NO_JS
 void edfs_key_data_js_lock(struct edfs_key_data *key_data, int lock);
@@ -1,3 +1,8 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    // sendmmsg/recvmmsg
+    #define _GNU_SOURCE
+#endif
+
 #include "edwork.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -111,6 +116,9 @@
 #include "avl.h"
 #include "log.h"
 #include "xxhash.h"
+#include "writeback.h"
+#include "chacha.h"
+#include "poly1305.h"
 
 uint64_t microseconds();
 uint64_t switchorder(uint64_t input);
@@ -128,6 +136,8 @@ uint64_t switchorder(uint64_t input);
 #define MAX_EDWORK_SYNC_BLOCK_SIZE      0x12000
 // one week
 #define EDWORK_SYNC_MAX_TTL             604800
+// first retransmission after 3 seconds, doubled on every retry
+#define EDWORK_REBROADCAST_BACKOFF_US   3000000
 // 16MB buffer
 #define EDWORK_SOCKET_BUFFER            0x1000000
 
@@ -138,6 +148,36 @@ uint64_t switchorder(uint64_t input);
 
 #define EDWORK_SCTP_EVENTS              { SCTP_ASSOC_CHANGE, SCTP_REMOTE_ERROR, SCTP_SHUTDOWN_EVENT }
 
+// udp packets sent/received per system call
+#define EDWORK_SEND_BATCH               64
+#define EDWORK_RECV_BATCH               16
+// pending packets in the dispatch workers, before the network thread blocks
+#define EDWORK_DISPATCH_MAX_JOBS        256
+#define EDWORK_RECV_BUFFER              0x10000
+
+// peer table: segments double in size and never move, lookups are sharded by address
+#define EDWORK_PEER_SHARDS              16
+#define EDWORK_PEER_SEGMENTS            24
+#define EDWORK_PEER_FIRST_SEGMENT       64
+// lock-free readers may still use a removed peer for a while, its slot is reused after this many seconds
+#define EDWORK_PEER_REUSE_DELAY         60
+#define EDWORK_PEER_TOMBSTONE           ((unsigned int)-1)
+
+#ifdef EDWORK_NO_AEAD
+    #define EDWORK_CAPABILITIES         0
+#else
+    #define EDWORK_CAPABILITIES         EDWORK_CAP_AEAD
+#endif
+// set when a peer advertised its capabilities
+#define EDWORK_CAP_KNOWN                0x80000000U
+// unanswered helo messages are repeated after 2 minutes
+#define EDWORK_HELO_INTERVAL            120
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+    #define EDWORK_USE_MMSG
+    #include <sys/uio.h>
+#endif
+
 struct client_data {
     struct sockaddr_in clientaddr;
     int clientlen;
@@ -151,6 +191,15 @@ struct client_data {
 
     unsigned char is_listen_socket;
     unsigned char sctp_socket;
+    // removed peers are skipped by readers; the slot goes to the free list
+    unsigned char removed;
+    time_t removed_timestamp;
+    // next free slot (index + 1)
+    unsigned int next_free;
+    // read without clients_lock; written under clients_lock, after checking clientaddr
+    thread_atomic_int_t capabilities;
+    // time of the last helo sent, in seconds (truncated to 32 bits)
+    thread_atomic_int_t helo_timestamp;
 #ifdef WITH_SCTP
     time_t sctp_timestamp;
     time_t sctp_reconnect_timestamp;
@@ -159,6 +208,15 @@ struct client_data {
 #endif
 };
 
+struct edwork_peer_shard {
+    thread_mutex_t lock;
+    // open addressing, peer index + 1 (0 is an empty slot, EDWORK_PEER_TOMBSTONE a removed peer)
+    unsigned int *slots;
+    unsigned int size;
+    unsigned int count;
+    unsigned int tombstones;
+};
+
 struct edwork_data {
     int socket;
 #ifdef WITH_SCTP
@@ -173,10 +231,14 @@ struct edwork_data {
 
     uint64_t sequence;
 
-    struct client_data *clients;
-    unsigned int clients_count;
+    // readers iterate up to clients_count without locking; clients_lock serializes writers
+    struct client_data *client_segments[EDWORK_PEER_SEGMENTS];
+    thread_atomic_int_t clients_count;
+    struct edwork_peer_shard peer_shards[EDWORK_PEER_SHARDS];
+    // removed peer slots, oldest first (index + 1)
+    unsigned int free_head;
+    unsigned int free_tail;
 
-    avl_tree_t tree;
     avl_tree_t spent;
     int spent_count;
 
@@ -187,6 +249,8 @@ struct edwork_data {
     thread_mutex_t clients_lock;
     thread_mutex_t lock;
     thread_mutex_t callback_lock;
+    // packets are made concurrently (network thread, dispatch and write-back workers, fuse threads)
+    thread_mutex_t sequence_lock;
 #ifdef EDFS_MULTITHREADED
     thread_mutex_t thread_lock;
 #endif
@@ -204,6 +268,34 @@ struct edwork_data {
     int force_sctp;
 #endif
     int default_port;
+    int no_rebroadcast_wal;
+
+    // deferred jobs (decryption and writing of data packets), in order per sender
+    struct writeback *workers;
+
+#ifdef EDWORK_USE_MMSG
+    unsigned char *recv_buffers;
+    struct mmsghdr recv_msgs[EDWORK_RECV_BATCH];
+    struct iovec recv_iov[EDWORK_RECV_BATCH];
+    struct sockaddr_in recv_addr[EDWORK_RECV_BATCH];
+#endif
+};
+
+struct edwork_dispatch_job {
+    edwork_deferred_callback callback;
+    void *arg;
+};
+
+struct edwork_send_batch {
+    const void *buf;
+    size_t len;
+    time_t threshold;
+    unsigned int count;
+    unsigned int clients[EDWORK_SEND_BATCH];
+#ifdef EDWORK_USE_MMSG
+    struct iovec iov;
+    struct mmsghdr msgs[EDWORK_SEND_BATCH];
+#endif
 };
 
 #ifdef EDFS_MULTITHREADED
@@ -258,20 +350,167 @@ static int sockaddr_compare(void *k1, void *k2) {
     return 0;
 }
 
-static int spent_compare(void *k1, void *k2) {
-    return strcmp((const char *)k1, (const char *)k2);
+static unsigned int edwork_peer_segment(unsigned int index) {
+    unsigned int n = index / EDWORK_PEER_FIRST_SEGMENT + 1;
+    unsigned int segment = 0;
+    while (n >>= 1)
+        segment ++;
+    return segment;
 }
 
-void avl_key_destructor(void *key) {
-    free(key);
+static struct client_data *edwork_peer(struct edwork_data *data, unsigned int index) {
+    unsigned int segment = edwork_peer_segment(index);
+    return &data->client_segments[segment][index - EDWORK_PEER_FIRST_SEGMENT * ((1U << segment) - 1)];
 }
 
-void avl_spent_key_destructor(void *key) {
-    free(key);
+static unsigned int edwork_peer_count(struct edwork_data *data) {
+    return (unsigned int)thread_atomic_int_load(&data->clients_count);
+}
+
+// must be called with clients_lock held
+static struct client_data *edwork_peer_alloc(struct edwork_data *data, unsigned int index) {
+    unsigned int segment = edwork_peer_segment(index);
+    if (segment >= EDWORK_PEER_SEGMENTS)
+        return NULL;
+    if (!data->client_segments[segment]) {
+        data->client_segments[segment] = (struct client_data *)calloc(EDWORK_PEER_FIRST_SEGMENT << segment, sizeof(struct client_data));
+        if (!data->client_segments[segment])
+            return NULL;
+    }
+    return edwork_peer(data, index);
+}
+
+static unsigned int edwork_peer_hash(const struct sockaddr_in *sin) {
+    uint32_t hash = ((uint32_t)sin->sin_addr.s_addr * 0x9E3779B1U) ^ ((uint32_t)sin->sin_port * 0x85EBCA77U);
+    return hash ^ (hash >> 16);
+}
+
+// returns peer index + 1, or 0 if not found
+static unsigned int edwork_peer_lookup(struct edwork_data *data, const void *addr) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    unsigned int hash = edwork_peer_hash(sin);
+    struct edwork_peer_shard *shard = &data->peer_shards[hash % EDWORK_PEER_SHARDS];
+    unsigned int found = 0;
+
+    thread_mutex_lock(&shard->lock);
+    if (shard->size) {
+        unsigned int pos = (hash / EDWORK_PEER_SHARDS) & (shard->size - 1);
+        unsigned int slot;
+        while ((slot = shard->slots[pos])) {
+            if ((slot != EDWORK_PEER_TOMBSTONE) && (!sockaddr_compare(&edwork_peer(data, slot - 1)->clientaddr, (void *)sin))) {
+                found = slot;
+                break;
+            }
+            pos = (pos + 1) & (shard->size - 1);
+        }
+    }
+    thread_mutex_unlock(&shard->lock);
+    // removal is in progress
+    if ((found) && (edwork_peer(data, found - 1)->removed))
+        return 0;
+    return found;
+}
+
+// the address is not in the shard, the first tombstone on the probe path is reused
+static void edwork_peer_shard_insert(struct edwork_peer_shard *shard, unsigned int hash, unsigned int slot) {
+    unsigned int pos = (hash / EDWORK_PEER_SHARDS) & (shard->size - 1);
+    while ((shard->slots[pos]) && (shard->slots[pos] != EDWORK_PEER_TOMBSTONE))
+        pos = (pos + 1) & (shard->size - 1);
+    if (shard->slots[pos] == EDWORK_PEER_TOMBSTONE)
+        shard->tombstones --;
+    shard->slots[pos] = slot;
 }
 
-void avl_key_data_destructor(void *key, void *data) {
-    avl_key_destructor(key);
+// must be called with clients_lock held
+static int edwork_peer_index_add(struct edwork_data *data, const struct sockaddr_in *sin, unsigned int index) {
+    unsigned int hash = edwork_peer_hash(sin);
+    struct edwork_peer_shard *shard = &data->peer_shards[hash % EDWORK_PEER_SHARDS];
+
+    thread_mutex_lock(&shard->lock);
+    if ((shard->count + shard->tombstones + 1) * 2 > shard->size) {
+        // rehashing drops the tombstones, the size grows only if live peers need it
+        unsigned int size = shard->size ? shard->size : 64;
+        if ((shard->count + 1) * 4 > size)
+            size *= 2;
+        unsigned int *slots = (unsigned int *)calloc(size, sizeof(unsigned int));
+        if (!slots) {
+            thread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        unsigned int *old_slots = shard->slots;
+        unsigned int old_size = shard->size;
+        unsigned int i;
+        shard->slots = slots;
+        shard->size = size;
+        shard->tombstones = 0;
+        for (i = 0; i < old_size; i++) {
+            if ((old_slots[i]) && (old_slots[i] != EDWORK_PEER_TOMBSTONE))
+                edwork_peer_shard_insert(shard, edwork_peer_hash(&edwork_peer(data, old_slots[i] - 1)->clientaddr), old_slots[i]);
+        }
+        free(old_slots);
+    }
+    edwork_peer_shard_insert(shard, hash, index + 1);
+    shard->count ++;
+    thread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// must be called with clients_lock held
+static void edwork_peer_index_remove(struct edwork_data *data, const struct sockaddr_in *sin, unsigned int index) {
+    unsigned int hash = edwork_peer_hash(sin);
+    struct edwork_peer_shard *shard = &data->peer_shards[hash % EDWORK_PEER_SHARDS];
+
+    thread_mutex_lock(&shard->lock);
+    if (shard->size) {
+        unsigned int pos = (hash / EDWORK_PEER_SHARDS) & (shard->size - 1);
+        unsigned int slot;
+        while ((slot = shard->slots[pos])) {
+            if (slot == index + 1) {
+                shard->slots[pos] = EDWORK_PEER_TOMBSTONE;
+                shard->count --;
+                shard->tombstones ++;
+                break;
+            }
+            pos = (pos + 1) & (shard->size - 1);
+        }
+    }
+    thread_mutex_unlock(&shard->lock);
+}
+
+// must be called with clients_lock held; returns index + 1 of a reusable slot, or 0
+static unsigned int edwork_peer_reuse(struct edwork_data *data, time_t now) {
+    if (!data->free_head)
+        return 0;
+
+    unsigned int index = data->free_head;
+    struct client_data *peer = edwork_peer(data, index - 1);
+    if (now - peer->removed_timestamp < EDWORK_PEER_REUSE_DELAY)
+        return 0;
+
+    data->free_head = peer->next_free;
+    if (!data->free_head)
+        data->free_tail = 0;
+    peer->next_free = 0;
+    return index;
+}
+
+// must be called with clients_lock held
+static void edwork_peer_release(struct edwork_data *data, unsigned int index) {
+    struct client_data *peer = edwork_peer(data, index);
+    peer->next_free = 0;
+    if (data->free_tail)
+        edwork_peer(data, data->free_tail - 1)->next_free = index + 1;
+    else
+        data->free_head = index + 1;
+    data->free_tail = index + 1;
+}
+
+static int spent_compare(void *k1, void *k2) {
+    return strcmp((const char *)k1, (const char *)k2);
+}
+
+void avl_spent_key_destructor(void *key) {
+    free(key);
 }
 
 void avl_spent_key_data_destructor(void *key, void *data) {
@@ -375,10 +614,10 @@ static void edwork_sctp_update_socket(struct edwork_data *edwork, struct socket
     unsigned short port = edword_sctp_get_remote_encapsulation_port(sock, rcvinfo, addrs);
     if ((port) && (addrs)) {
         thread_mutex_lock(&edwork->clients_lock);
-        uintptr_t data_index = (uintptr_t)avl_search(&edwork->tree, (void *)addrs);
+        unsigned int data_index = edwork_peer_lookup(edwork, addrs);
         if (data_index > 1) {
-            edwork->clients[data_index - 1].encapsulation_port = port;
-            log_trace("set encapsulation port to %i for %s", (int)edwork->clients[data_index - 1].encapsulation_port, edwork_addr_ipv4(addrs));
+            edwork_peer(edwork, data_index - 1)->encapsulation_port = port;
+            log_trace("set encapsulation port to %i for %s", (int)edwork_peer(edwork, data_index - 1)->encapsulation_port, edwork_addr_ipv4(addrs));
         }
         thread_mutex_unlock(&edwork->clients_lock);
     }
@@ -388,13 +627,13 @@ static void edwork_sctp_update_socket(struct edwork_data *edwork, struct socket
 
     int i;
     thread_mutex_lock(&edwork->clients_lock);
-    for (i = 0; i < edwork->clients_count; i++) {
-        if ((edwork->clients[i].socket) && (edwork->clients[i].socket == sock)) {
-            edwork->clients[i].is_sctp = 1;
-            edwork->clients[i].sctp_socket |= 1;
-            edwork->clients[i].sctp_timestamp = time(NULL);
-            edwork->clients[i].last_seen = time(NULL);
-            edwork->sctp_timestamp = edwork->clients[i].sctp_timestamp;
+    for (i = 0; i < edwork_peer_count(edwork); i++) {
+        if ((edwork_peer(edwork, i)->socket) && (edwork_peer(edwork, i)->socket == sock)) {
+            edwork_peer(edwork, i)->is_sctp = 1;
+            edwork_peer(edwork, i)->sctp_socket |= 1;
+            edwork_peer(edwork, i)->sctp_timestamp = time(NULL);
+            edwork_peer(edwork, i)->last_seen = time(NULL);
+            edwork->sctp_timestamp = edwork_peer(edwork, i)->sctp_timestamp;
             break;
         }
     }
@@ -420,12 +659,13 @@ static void edwork_sctp_notification(struct edwork_data *edwork, struct socket *
                         if ((SCTP_getpaddrs(sock, rcvinfo->rcv_assoc_id, &addrs) <= 0) || (!addrs)) {
                             log_error("error in sctp_getpaddrs (%i)", errno);
                         } else {
+                            uint32_t capabilities = htonl(EDWORK_CAPABILITIES);
                             if (addrs->sa_family == AF_INET6)
-                                edwork_send_to_sctp_socket(edwork, edwork->find_key(0, edwork->userdata), sock, "helo", NULL, 0, addrs, sizeof(struct sockaddr_in6), 0);
+                                edwork_send_to_sctp_socket(edwork, edwork->find_key(0, edwork->userdata), sock, "helo", (const unsigned char *)&capabilities, sizeof(uint32_t), addrs, sizeof(struct sockaddr_in6), 0);
                             else
                             if (addrs->sa_family == AF_INET) {
                                 log_trace("SCTP_COMM_UP (%s)", edwork_addr_ipv4(addrs));
-                                edwork_send_to_sctp_socket(edwork, edwork->find_key(0, edwork->userdata), sock, "helo", NULL, 0, addrs, sizeof(struct sockaddr_in), 0);
+                                edwork_send_to_sctp_socket(edwork, edwork->find_key(0, edwork->userdata), sock, "helo", (const unsigned char *)&capabilities, sizeof(uint32_t), addrs, sizeof(struct sockaddr_in), 0);
                             }
                         }
                         edwork_sctp_update_socket(edwork, sock, rcvinfo, addrs);
@@ -530,44 +770,44 @@ static void edwork_sctp_notification(struct edwork_data *edwork, struct socket *
     if (reset) {
         if (sock != edwork->sctp_socket) {
             thread_mutex_lock(&edwork->clients_lock);
-            for (i = 0; i < edwork->clients_count; i++) {
-                if ((edwork->clients[i].socket) && (edwork->clients[i].socket == sock)) {
-                    if ((reset == 3) && (edwork->clients[i].sctp_timestamp)) {
-                        edwork->clients[i].last_seen = time(NULL);
+            for (i = 0; i < edwork_peer_count(edwork); i++) {
+                if ((edwork_peer(edwork, i)->socket) && (edwork_peer(edwork, i)->socket == sock)) {
+                    if ((reset == 3) && (edwork_peer(edwork, i)->sctp_timestamp)) {
+                        edwork_peer(edwork, i)->last_seen = time(NULL);
                         break;
                     }
 
                     if ((SCTP_getpaddrs(sock, rcvinfo->rcv_assoc_id, &addrs) > 0) && (addrs))
                         log_trace("SCTP connection reset %s", edwork_addr_ipv4(addrs));
 
-                    if (edwork->clients[i].is_listen_socket) {
+                    if (edwork_peer(edwork, i)->is_listen_socket) {
                         if (addrs) {
                             SCTP_freepaddrs(addrs);
                             addrs = NULL;
                         }
                         thread_mutex_unlock(&edwork->clients_lock);
-                        edwork_remove_addr(edwork, &edwork->clients[i].clientaddr, edwork->clients[i].clientlen);
+                        edwork_remove_addr(edwork, &edwork_peer(edwork, i)->clientaddr, edwork_peer(edwork, i)->clientlen);
                         return;
                     } else {
-                        SCTP_close(edwork->clients[i].socket);
+                        SCTP_close(edwork_peer(edwork, i)->socket);
 
-                        edwork->clients[i].socket = 0;
-                        edwork->clients[i].is_sctp = 0;
-                        edwork->clients[i].sctp_timestamp = 0;
+                        edwork_peer(edwork, i)->socket = 0;
+                        edwork_peer(edwork, i)->is_sctp = 0;
+                        edwork_peer(edwork, i)->sctp_timestamp = 0;
                         if (addrs) {
                             if (reset == 2) {
                                 if (addrs->sa_family == AF_INET6)
-                                    edwork->clients[i].socket = edwork_sctp_connect(edwork, (const struct sockaddr *)addrs, sizeof(struct sockaddr_in6), edwork->clients[i].encapsulation_port);
+                                    edwork_peer(edwork, i)->socket = edwork_sctp_connect(edwork, (const struct sockaddr *)addrs, sizeof(struct sockaddr_in6), edwork_peer(edwork, i)->encapsulation_port);
                                 else
                                 if (addrs->sa_family == AF_INET)
-                                    edwork->clients[i].socket = edwork_sctp_connect(edwork, (const struct sockaddr *)addrs, sizeof(struct sockaddr_in), edwork->clients[i].encapsulation_port);
-                                if (edwork->clients[i].socket) {
-                                    edwork->clients[i].sctp_reconnect_timestamp = time(NULL);
-                                    edwork->clients[i].last_seen = time(NULL);
+                                    edwork_peer(edwork, i)->socket = edwork_sctp_connect(edwork, (const struct sockaddr *)addrs, sizeof(struct sockaddr_in), edwork_peer(edwork, i)->encapsulation_port);
+                                if (edwork_peer(edwork, i)->socket) {
+                                    edwork_peer(edwork, i)->sctp_reconnect_timestamp = time(NULL);
+                                    edwork_peer(edwork, i)->last_seen = time(NULL);
                                 } else
-                                    edwork->clients[i].sctp_reconnect_timestamp = 0;
+                                    edwork_peer(edwork, i)->sctp_reconnect_timestamp = 0;
                             } else {
-                                if (edwork->clients[i].sctp_timestamp == edwork->sctp_timestamp)
+                                if (edwork_peer(edwork, i)->sctp_timestamp == edwork->sctp_timestamp)
                                     edwork->sctp_timestamp = 0;
                             }
                             SCTP_freepaddrs(addrs);
@@ -584,21 +824,21 @@ static void edwork_sctp_notification(struct edwork_data *edwork, struct socket *
                 log_trace("SCTP connection reset %s", edwork_addr_ipv4(addrs));
 
             thread_mutex_lock(&edwork->clients_lock);
-            uintptr_t data_index = 0;
+            unsigned int data_index = 0;
             if (addrs) {
-                data_index = (uintptr_t)avl_search(&edwork->tree, (void *)addrs);
+                data_index = edwork_peer_lookup(edwork, addrs);
                 SCTP_freepaddrs(addrs);
                 addrs = NULL;
             }
             if (data_index > 1) {
-                if (edwork->clients[data_index - 1].is_listen_socket) {
+                if (edwork_peer(edwork, data_index - 1)->is_listen_socket) {
                     thread_mutex_unlock(&edwork->clients_lock);
-                    edwork_remove_addr(edwork, &edwork->clients[data_index - 1].clientaddr, edwork->clients[data_index - 1].clientlen);
+                    edwork_remove_addr(edwork, &edwork_peer(edwork, data_index - 1)->clientaddr, edwork_peer(edwork, data_index - 1)->clientlen);
                     return;
                 } else {
-                    edwork->clients[data_index - 1].is_sctp = 0;
-                    edwork->clients[data_index - 1].sctp_timestamp = 0;
-                    edwork->clients[data_index - 1].is_listen_socket = 0;
+                    edwork_peer(edwork, data_index - 1)->is_sctp = 0;
+                    edwork_peer(edwork, data_index - 1)->sctp_timestamp = 0;
+                    edwork_peer(edwork, data_index - 1)->is_listen_socket = 0;
                 }
             }
             thread_mutex_unlock(&edwork->clients_lock);
@@ -611,16 +851,16 @@ int edwork_reconnect(struct edwork_data *data, int seconds) {
     time_t now = time(NULL);
     int reconnected_sockets = 0;
     thread_mutex_lock(&data->clients_lock);
-    for (i = 0; i < data->clients_count; i++) {
-        if ((data->clients[i].sctp_socket & 1) && (data->clients[i].sctp_timestamp < now - seconds) && (!data->clients[i].is_listen_socket) && (data->clients[i].sctp_reconnect_timestamp < now - seconds)) {
-            SCTP_SOCKET_TYPE old_socket = data->clients[i].socket;
+    for (i = 0; i < edwork_peer_count(data); i++) {
+        if ((edwork_peer(data, i)->sctp_socket & 1) && (edwork_peer(data, i)->sctp_timestamp < now - seconds) && (!edwork_peer(data, i)->is_listen_socket) && (edwork_peer(data, i)->sctp_reconnect_timestamp < now - seconds)) {
+            SCTP_SOCKET_TYPE old_socket = edwork_peer(data, i)->socket;
             if (old_socket) {
                 // ensure the socket is not found, to avoid double-close
-                data->clients[i].socket = NULL;
+                edwork_peer(data, i)->socket = NULL;
                 SCTP_close(old_socket);
             }
-            data->clients[i].socket = edwork_sctp_connect(data, (const struct sockaddr *)&data->clients[i].clientaddr, data->clients[i].clientlen, data->clients[i].encapsulation_port);
-            data->clients[i].sctp_reconnect_timestamp = time(NULL);
+            edwork_peer(data, i)->socket = edwork_sctp_connect(data, (const struct sockaddr *)&edwork_peer(data, i)->clientaddr, edwork_peer(data, i)->clientlen, edwork_peer(data, i)->encapsulation_port);
+            edwork_peer(data, i)->sctp_reconnect_timestamp = time(NULL);
             reconnected_sockets ++;
         }
 
@@ -793,11 +1033,9 @@ ssize_t safe_sctp_recvfrom(struct edwork_data *data, SCTP_SOCKET_TYPE socket, vo
 
 int edwork_is_sctp(struct edwork_data *data, const void *clientaddr_ptr) {
     int is_sctp = 0;
-    thread_mutex_lock(&data->clients_lock);
-    uintptr_t data_index = (uintptr_t)avl_search(&data->tree, (void *)clientaddr_ptr);
+    unsigned int data_index = edwork_peer_lookup(data, clientaddr_ptr);
     if (data_index > 1)
-        is_sctp = data->clients[data_index - 1].is_sctp;
-    thread_mutex_unlock(&data->clients_lock);
+        is_sctp = edwork_peer(data, data_index - 1)->is_sctp;
     return is_sctp;
 }
 #endif
@@ -811,9 +1049,9 @@ ssize_t safe_sendto(struct edwork_data *data, struct client_data *peer_data, con
             socket = peer_data->socket;
             is_sctp = peer_data->is_sctp;
         } else {
-            uintptr_t data_index = (uintptr_t)avl_search(&data->tree, (void *)dest_addr);
+            unsigned int data_index = edwork_peer_lookup(data, dest_addr);
             if (data_index > 0) {
-                peer_data = &data->clients[data_index - 1];
+                peer_data = edwork_peer(data, data_index - 1);
                 if (peer_data) {
                     socket = peer_data->socket;
                     is_sctp = peer_data->is_sctp;
@@ -842,6 +1080,113 @@ ssize_t safe_recvfrom(struct edwork_data *data, void *buf, size_t len, int flags
     return err;
 }
 
+static void edwork_send_batch_init(struct edwork_send_batch *batch, const void *buf, size_t len, time_t threshold) {
+    batch->buf = buf;
+    batch->len = len;
+    batch->threshold = threshold;
+    batch->count = 0;
+}
+
+// same decision as safe_sendto: 1 if the packet would go out on the udp socket
+static int edwork_send_batch_accepts(struct edwork_data *data, struct client_data *peer_data, int try_sctp) {
+#ifdef WITH_SCTP
+    if ((data->sctp_socket) && (try_sctp)) {
+        if ((peer_data->socket) && ((peer_data->is_sctp) || (data->force_sctp)))
+            return 0;
+        if (peer_data->is_sctp)
+            return 0;
+    }
+#endif
+    return 1;
+}
+
+static void edwork_send_batch_error(struct edwork_data *data, struct edwork_send_batch *batch, unsigned int index) {
+    unsigned int i = batch->clients[index];
+#ifdef _WIN32
+    log_trace("error %i in sendto (client #%i: %s)", (int)WSAGetLastError(), i, edwork_addr_ipv4(&edwork_peer(data, i)->clientaddr));
+#else
+    log_trace("error %i in sendto (client #%i: %s)", (int)errno, i, edwork_addr_ipv4(&edwork_peer(data, i)->clientaddr));
+#endif
+#ifdef WITH_SCTP
+    if (errno != 11)
+#endif
+        edwork_peer(data, i)->last_seen = batch->threshold - EDWROK_LAST_SEEN_TIMEOUT;
+}
+
+// sends the queued packets, returns the number of peers the packet was sent to
+static unsigned int edwork_send_batch_flush(struct edwork_data *data, struct edwork_send_batch *batch) {
+    unsigned int sent = 0;
+    unsigned int i = 0;
+
+    if (!batch->count)
+        return 0;
+
+    thread_mutex_lock(&data->sock_lock);
+#ifdef EDWORK_USE_MMSG
+    batch->iov.iov_base = (void *)batch->buf;
+    batch->iov.iov_len = batch->len;
+    for (i = 0; i < batch->count; i++) {
+        struct client_data *peer_data = edwork_peer(data, batch->clients[i]);
+        memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+        batch->msgs[i].msg_hdr.msg_name = &peer_data->clientaddr;
+        batch->msgs[i].msg_hdr.msg_namelen = peer_data->clientlen;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov;
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    i = 0;
+    while (i < batch->count) {
+        int err = sendmmsg(data->socket, batch->msgs + i, batch->count - i, 0);
+        if (err > 0) {
+            sent += err;
+            i += err;
+        } else {
+            // sendmmsg stops at the first failed packet
+            edwork_send_batch_error(data, batch, i);
+            i ++;
+        }
+    }
+#else
+    for (i = 0; i < batch->count; i++) {
+        struct client_data *peer_data = edwork_peer(data, batch->clients[i]);
+        if (sendto(data->socket, (const char *)batch->buf, batch->len, 0, (struct sockaddr *)&peer_data->clientaddr, peer_data->clientlen) <= 0)
+            edwork_send_batch_error(data, batch, i);
+        else
+            sent ++;
+    }
+#endif
+    thread_mutex_unlock(&data->sock_lock);
+
+    batch->count = 0;
+    return sent;
+}
+
+#ifdef EDWORK_USE_MMSG
+static int edwork_recv_batch(struct edwork_data *data) {
+    if (!data->recv_buffers) {
+        data->recv_buffers = (unsigned char *)malloc(EDWORK_RECV_BATCH * EDWORK_RECV_BUFFER);
+        if (!data->recv_buffers)
+            return -1;
+    }
+
+    int i;
+    for (i = 0; i < EDWORK_RECV_BATCH; i++) {
+        // keep one byte for the terminator added by edwork_dispatch_data
+        data->recv_iov[i].iov_base = data->recv_buffers + i * EDWORK_RECV_BUFFER;
+        data->recv_iov[i].iov_len = EDWORK_RECV_BUFFER - 1;
+        memset(&data->recv_msgs[i], 0, sizeof(struct mmsghdr));
+        data->recv_msgs[i].msg_hdr.msg_name = &data->recv_addr[i];
+        data->recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        data->recv_msgs[i].msg_hdr.msg_iov = &data->recv_iov[i];
+        data->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    thread_mutex_lock(&data->sock_lock);
+    int err = recvmmsg(data->socket, data->recv_msgs, EDWORK_RECV_BATCH, MSG_DONTWAIT, NULL);
+    thread_mutex_unlock(&data->sock_lock);
+    return err;
+}
+#endif
+
 int edwork_random_bytes(unsigned char *destination, int len) {
 #ifdef _WIN32
     HCRYPTPROV prov;
@@ -1038,7 +1383,6 @@ struct edwork_data *edwork_create(int port, edwork_find_key_callback find_key) {
     data->i_am[0] = 0x01;
     data->i_am[1] = 0x00;
 
-    avl_initialize(&data->tree, sockaddr_compare, avl_key_destructor);
     avl_initialize(&data->spent, spent_compare, avl_spent_key_destructor);
     data->spent_count = 0;
 
@@ -1048,6 +1392,9 @@ struct edwork_data *edwork_create(int port, edwork_find_key_callback find_key) {
 
     thread_mutex_init(&data->sock_lock);
     thread_mutex_init(&data->clients_lock);
+    int i;
+    for (i = 0; i < EDWORK_PEER_SHARDS; i++)
+        thread_mutex_init(&data->peer_shards[i].lock);
     thread_mutex_init(&data->lock);
 #ifdef WITH_SCTP
     thread_mutex_init(&data->sctp_sock_lock);
@@ -1056,6 +1403,7 @@ struct edwork_data *edwork_create(int port, edwork_find_key_callback find_key) {
     thread_mutex_init(&data->thread_lock);
 #endif
     thread_mutex_init(&data->callback_lock);
+    thread_mutex_init(&data->sequence_lock);
     edwork_add_node(data, "255.255.255.255", port, 0, 0, 0, 0);
 
     return data;
@@ -1077,7 +1425,9 @@ void edwork_reset_id(struct edwork_data *data) {
 
     sha256(random, 32, data->i_am);
 
+    thread_mutex_lock(&data->sequence_lock);
     data->sequence = edwork_random();
+    thread_mutex_unlock(&data->sequence_lock);
 
     // my version (1.0)
     data->i_am[0] = 0x01;
@@ -1131,14 +1481,156 @@ int edwork_unspend(struct edwork_data *data, const unsigned char *proof_of_work,
     return 0;
 }
 
-unsigned char *make_packet(struct edwork_data *data, struct edfs_key_data *key, const char type[4], const unsigned char *data_buffer, int *len, int confirmed_acks, uint64_t force_timestamp, uint64_t ino) {
+static int edwork_rebroadcast_write_wal(struct edfs_key_data *key, uint64_t ino, uint32_t confirmed_acks, const unsigned char *packet, int len) {
+    char buf_path[4096];
+    buf_path[0] = 0;
+    snprintf(buf_path, 4096, "%s/%" PRIu64, key->cache_directory, ino);
+    FILE *f = fopen(buf_path, "wb");
+    if (!f)
+        return -1;
+
+    uint32_t acks_buffer = htonl(confirmed_acks);
+    fwrite(&acks_buffer, 1, sizeof(acks_buffer), f);
+    // second one is "original acks"
+    fwrite(&acks_buffer, 1, sizeof(acks_buffer), f);
+    if (fwrite(packet, 1, len, f) != len) {
+        fclose(f);
+        unlink(buf_path);
+        errno = EIO;
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void edwork_rebroadcast_unlink_wal(struct edwork_data *data, struct edfs_key_data *key, uint64_t ino) {
+    if (data->no_rebroadcast_wal)
+        return;
+
+    char buf_path[4096];
+    buf_path[0] = 0;
+    snprintf(buf_path, 4096, "%s/%" PRIu64, key->cache_directory, ino);
+    if ((unlink(buf_path)) && (errno != ENOENT))
+        log_warn("error deleting %s, errno: %i", buf_path, errno);
+}
+
+// loads the rebroadcast queue written before restart (once per key)
+static void edwork_rebroadcast_load(struct edwork_data *data, struct edfs_key_data *key) {
+    thread_mutex_lock(&key->rebroadcast_lock);
+    int loaded = key->rebroadcast_loaded;
+    key->rebroadcast_loaded = 1;
+    thread_mutex_unlock(&key->rebroadcast_lock);
+
+    if ((loaded) || (data->no_rebroadcast_wal))
+        return;
+
+    tinydir_dir dir;
+    if (tinydir_open(&dir, key->cache_directory))
+        return;
+
+    int count = 0;
+    uint64_t next_send = microseconds();
+    while (dir.has_next) {
+        tinydir_file file;
+        tinydir_readfile(&dir, &file);
+
+        if (!file.is_dir) {
+            char buf_path[4096];
+            buf_path[0] = 0;
+            snprintf(buf_path, 4096, "%s/%s", key->cache_directory, file.name);
+            FILE *f = fopen(buf_path, "rb");
+            if (f) {
+                unsigned char buf[MAX_EDWORK_SYNC_BLOCK_SIZE];
+                int size = fread(buf, 1, MAX_EDWORK_SYNC_BLOCK_SIZE, f);
+                fclose(f);
+                uint64_t ino = strtoull(file.name, NULL, 10);
+                if ((size >= 136) && (ino)) {
+                    if (edfs_key_data_rebroadcast_add(key, ino, ntohll(*(uint64_t *)(buf + 40)), ntohl(*(uint32_t *)buf), ntohl(*(uint32_t *)(buf + 4)), buf + 8, size - 8, next_send, 0) > 0)
+                        count ++;
+                } else {
+                    log_info("invalid edwork block %s, deleting block", file.name);
+                    if (unlink(buf_path))
+                        log_warn("error deleting %s, errno: %i", file.name, errno);
+                }
+            } else {
+                log_warn("error opening edwork block %s", file.name);
+            }
+        }
+        tinydir_next(&dir);
+    }
+    tinydir_close(&dir);
+    if (count)
+        log_info("loaded %i edwork blocks for rebroadcast", count);
+}
+
+void edwork_set_rebroadcast_wal(struct edwork_data *data, int wal) {
+    if (!data)
+        return;
+    data->no_rebroadcast_wal = !wal;
+}
+
+// chacha20-poly1305 (rfc 8439) tag of the 92 bytes header (as additional data) and the payload, stored in the first 16 bytes of the hmac field
+static void edwork_packet_tag(const unsigned char *header, const unsigned char *payload, int len, const unsigned char *key_id, unsigned char *tag) {
+    static const unsigned char zero[16];
+    struct chacha_ctx ctx;
+    struct poly1305_ctx poly;
+    unsigned char block[64];
+    unsigned char key[32];
+    unsigned char counter[4];
+    unsigned char nonce[12];
+    unsigned char lengths[16];
+    int i;
+
+    // key_id is shared by all the peers using the key; the one-time key is unique per (sender, sequence, timestamp), sequence is never reused by a sender
+    memcpy(key, key_id, 32);
+    for (i = 0; i < 4; i++)
+        key[i] ^= header[40 + i];
+    for (i = 0; i < 4; i++)
+        counter[i] = header[48 + i] ^ header[2 + i];
+    for (i = 0; i < 8; i++)
+        nonce[i] = header[32 + i] ^ header[6 + i];
+    for (i = 0; i < 4; i++)
+        nonce[8 + i] = header[44 + i] ^ header[14 + i];
+
+    memset(block, 0, sizeof(block));
+    chacha_keysetup(&ctx, key, 256);
+    chacha_ivsetup(&ctx, nonce, counter);
+    chacha_encrypt_bytes(&ctx, block, block, sizeof(block));
+
+    memset(lengths, 0, sizeof(lengths));
+    lengths[0] = 92;
+    for (i = 0; i < 4; i++)
+        lengths[8 + i] = (unsigned char)(((uint32_t)len) >> (i * 8));
+
+    poly1305_init(&poly, block);
+    poly1305_update(&poly, header, 92);
+    poly1305_update(&poly, zero, 4);
+    if ((payload) && (len > 0)) {
+        poly1305_update(&poly, payload, len);
+        if (len % 16)
+            poly1305_update(&poly, zero, 16 - len % 16);
+    }
+    poly1305_update(&poly, lengths, sizeof(lengths));
+    poly1305_finish(&poly, tag);
+    memset(block, 0, sizeof(block));
+    memset(key, 0, sizeof(key));
+}
+
+// aead packets carry this marker after the tag, in the second half of the hmac field
+static const unsigned char edwork_aead_marker[16] = "edwork:poly1305";
+
+static unsigned char *edwork_make_packet(struct edwork_data *data, struct edfs_key_data *key, const char type[4], const unsigned char *data_buffer, int *len, int confirmed_acks, uint64_t force_timestamp, uint64_t ino, int aead) {
     unsigned char *buf = (unsigned char *)malloc(128 + *len);
     static unsigned char null_hash[32];
     if (!buf)
         return NULL;
 
+    thread_mutex_lock(&data->sequence_lock);
+    uint64_t packet_sequence = data->sequence ++;
+    thread_mutex_unlock(&data->sequence_lock);
+
     memcpy(buf, data->i_am, 32);
-    uint64_t sequence = htonll(data->sequence);
+    uint64_t sequence = htonll(packet_sequence);
     uint32_t size = htonl((uint32_t)*len);
     memcpy(buf + 32, &sequence, sizeof(uint64_t));
     memcpy(buf + 40, type, 4);
@@ -1156,6 +1648,10 @@ unsigned char *make_packet(struct edwork_data *data, struct edfs_key_data *key,
     uint64_t key_hash = key ? key->key_id_xxh64_be : 0;
     memcpy(buf + 84, &key_hash, 8);
 
+    if (aead) {
+        edwork_packet_tag(buf, data_buffer, *len, key ? key->key_id : null_hash, buf + 92);
+        memcpy(buf + 108, edwork_aead_marker, 16);
+    } else
     if (key)
         hmac_sha256(key->key_id, 32, buf, 92, data_buffer, *len, buf + 92); 
     else
@@ -1168,68 +1664,45 @@ unsigned char *make_packet(struct edwork_data *data, struct edfs_key_data *key,
     *len += 128;
 
     if ((confirmed_acks > 0) && (key)) {
-        char buf_path[4096];
-        buf_path[0] = 0;
-        snprintf(buf_path, 4096, "%s/%" PRIu64, key->cache_directory, ino);
-        FILE *f = fopen(buf_path, "wb");
-        if (f) {
-            uint32_t acks_buffer = htonl(confirmed_acks);
-            fwrite(&acks_buffer, 1, sizeof(acks_buffer), f);
-            // second one is "original acks"
-            fwrite(&acks_buffer, 1, sizeof(acks_buffer), f);
-            if (fwrite(buf, 1, *len, f) != *len) {
-                fclose(f);
-                errno = EIO;
-                return NULL;
-            }
-            fclose(f);
-        } else {
+        edwork_rebroadcast_load(data, key);
+        if (edfs_key_data_rebroadcast_add(key, ino, packet_sequence, confirmed_acks, confirmed_acks, buf, *len, microseconds() + EDWORK_REBROADCAST_BACKOFF_US, 1) <= 0) {
             free(buf);
             *len = 0;
             return NULL;
         }
+        // write-ahead copy, used only after restart
+        if ((!data->no_rebroadcast_wal) && (edwork_rebroadcast_write_wal(key, ino, confirmed_acks, buf, *len)))
+            log_warn("error writing edwork block %" PRIu64 " to %s, errno: %i", ino, key->cache_directory, errno);
     }
-    data->sequence ++;
     return buf;
 }
 
-void edwork_confirm_seq(struct edwork_data *data, struct edfs_key_data *key, uint64_t sequence, int acks) {
-    if ((!acks) || (!key))
-        return;
+unsigned char *make_packet(struct edwork_data *data, struct edfs_key_data *key, const char type[4], const unsigned char *data_buffer, int *len, int confirmed_acks, uint64_t force_timestamp, uint64_t ino) {
+    return edwork_make_packet(data, key, type, data_buffer, len, confirmed_acks, force_timestamp, ino, 0);
+}
 
-    char buf_path[4096];
-    buf_path[0] = 0;
-    snprintf(buf_path, 4096, "%s/%" PRIu64, key->cache_directory, sequence);
-    if (acks < 0) {
-        log_debug("forcefully deleted edwork block %", buf_path);
-        if (unlink(buf_path))
-            log_warn("error deleting %s, errno: %i", buf_path, errno);
-        return;
-    }
+// 1 if the peer negotiated authenticated encryption
+static int edwork_peer_aead(struct edwork_data *data, const void *clientaddr) {
+    int aead = 0;
+    if ((!(EDWORK_CAPABILITIES & EDWORK_CAP_AEAD)) || (!data) || (!clientaddr))
+        return 0;
 
-    FILE *f = fopen(buf_path, "r+b");
-    if (f) {
-        uint32_t acks_buffer;
-        if (fread(&acks_buffer, 1, sizeof(uint32_t), f) != sizeof(uint32_t)) {
-            fclose(f);
-            return;
-        }
-        acks_buffer = ntohl(acks_buffer);
-        if ((acks_buffer) && (acks_buffer > acks)) {
-            acks_buffer --;
-            acks_buffer = htonl(acks_buffer);
-            fseek(f, 0, SEEK_SET);
-            if (fwrite(&acks_buffer, 1, sizeof(uint32_t), f) != sizeof(uint32_t))
-                log_error("error writing ACKs buffer");
-        } else {
-            log_debug("marked edwork block %s for delete (%i/%i)", buf_path, acks_buffer, acks);
-            acks_buffer = 0;
-        }
+    // segments are never freed, and removed slots are reused only after EDWORK_PEER_REUSE_DELAY
+    unsigned int data_index = edwork_peer_lookup(data, clientaddr);
+    if ((data_index > 1) && (thread_atomic_int_load(&edwork_peer(data, data_index - 1)->capabilities) & EDWORK_CAP_AEAD))
+        aead = 1;
+    return aead;
+}
 
-        fclose(f);
+void edwork_confirm_seq(struct edwork_data *data, struct edfs_key_data *key, uint64_t sequence, int acks) {
+    if ((!acks) || (!key))
+        return;
 
-        if (!acks_buffer)
-            unlink(buf_path);
+    edwork_rebroadcast_load(data, key);
+    // ack counters are kept in memory only, the write-ahead copy is removed when done
+    if ((edfs_key_data_rebroadcast_confirm(key, sequence, acks) > 0) || (acks < 0)) {
+        log_debug("deleted edwork block %" PRIu64, sequence);
+        edwork_rebroadcast_unlink_wal(data, key, sequence);
     }
 }
 
@@ -1270,7 +1743,7 @@ int edwork_set_info(void *clientinfo, uint64_t last_ino, uint64_t last_chunk, ui
 int edwork_send_to_sctp_socket(struct edwork_data *data, struct edfs_key_data *key, SCTP_SOCKET_TYPE socket, const char type[4], const unsigned char *buf, int len, void *clientaddr, int clientaddrlen, int ttl) {
     if (!socket)
         return -1;
-    unsigned char *packet = make_packet(data, key, type, buf, &len, 0, 0, 0);
+    unsigned char *packet = edwork_make_packet(data, key, type, buf, &len, 0, 0, 0, edwork_peer_aead(data, clientaddr));
     int sent = -1;
     if ((packet) && (len > 0)) {
         if (data)
@@ -1293,9 +1766,9 @@ void *add_node(struct edwork_data *data, struct sockaddr_in *sin, int client_len
 
     thread_mutex_lock(&data->clients_lock);
     struct client_data *peer = NULL;
-    uintptr_t data_index = (uintptr_t)avl_search(&data->tree, sin);
+    unsigned int data_index = edwork_peer_lookup(data, sin);
     if (data_index > 0)
-        peer = &data->clients[data_index - 1];
+        peer = edwork_peer(data, data_index - 1);
 
     if (peer) {
         if (update_seen) {
@@ -1331,63 +1804,73 @@ void *add_node(struct edwork_data *data, struct sockaddr_in *sin, int client_len
         return 0;
     }
 
-    // rewrite this (slow)
-    data->clients = (struct client_data *)realloc(data->clients, sizeof(struct client_data) * (data->clients_count + 1));
-    if (!data->clients) {
-        data->clients_count = 0;
-        thread_mutex_unlock(&data->clients_lock);
-        return 0;
+    // reuse the slot of a removed peer; it stays marked as removed until initialized
+    unsigned int peer_index;
+    unsigned int free_index = edwork_peer_reuse(data, now);
+    if (free_index) {
+        peer_index = free_index - 1;
+        peer = edwork_peer(data, peer_index);
+    } else {
+        peer_index = edwork_peer_count(data);
+        peer = edwork_peer_alloc(data, peer_index);
+        if (!peer) {
+            thread_mutex_unlock(&data->clients_lock);
+            return 0;
+        }
     }
-    memcpy(&data->clients[data->clients_count].clientaddr, sin, client_len);
-    memset(&data->clients[data->clients_count].clientaddr + client_len, 0, sizeof(data->clients[data->clients_count].clientaddr) - client_len);
-    data->clients[data->clients_count].clientlen = client_len;
-    data->clients[data->clients_count].last_ino = 0;
-    data->clients[data->clients_count].last_chunk = 0;
-    data->clients[data->clients_count].last_msg_timestamp = 0;
-    data->clients[data->clients_count].last_seen = timestamp ? timestamp : time(NULL);
+    memcpy(&peer->clientaddr, sin, client_len);
+    if (client_len < (int)sizeof(peer->clientaddr))
+        memset((unsigned char *)&peer->clientaddr + client_len, 0, sizeof(peer->clientaddr) - client_len);
+    peer->clientlen = client_len;
+    peer->last_ino = 0;
+    peer->last_chunk = 0;
+    peer->last_msg_timestamp = 0;
+    thread_atomic_int_store(&peer->capabilities, 0);
+    thread_atomic_int_store(&peer->helo_timestamp, 0);
+    peer->last_seen = timestamp ? timestamp : time(NULL);
     if (is_listen_socket)
-        data->clients[data->clients_count].is_listen_socket = 1;
+        peer->is_listen_socket = 1;
     else
-        data->clients[data->clients_count].is_listen_socket = 0;
+        peer->is_listen_socket = 0;
 #ifdef WITH_SCTP
     // no sctp for broadcast address
-    data->clients[data->clients_count].socket = 0;
-    data->clients[data->clients_count].sctp_reconnect_timestamp = 0;
-    if ((is_sctp & 1) && (!is_listen_socket) && (data->clients_count)) {
+    peer->socket = 0;
+    peer->sctp_reconnect_timestamp = 0;
+    if ((is_sctp & 1) && (!is_listen_socket) && (peer_index)) {
         struct sockaddr addr2;
         memcpy(&addr2, sin, client_len);
         if (addr2.sa_family == AF_INET)
             ((struct sockaddr_in *)&addr2)->sin_port = ((struct sockaddr_in *)&addr2)->sin_port;
-        data->clients[data->clients_count].socket = edwork_sctp_connect(data, (const struct sockaddr *)&addr2, client_len, encapsulation_port);
-        if (data->clients[data->clients_count].socket)
-            data->clients[data->clients_count].sctp_reconnect_timestamp = time(NULL);
+        peer->socket = edwork_sctp_connect(data, (const struct sockaddr *)&addr2, client_len, encapsulation_port);
+        if (peer->socket)
+            peer->sctp_reconnect_timestamp = time(NULL);
         else
-            data->clients[data->clients_count].sctp_reconnect_timestamp = 0;
+            peer->sctp_reconnect_timestamp = 0;
     } else
     if ((is_sctp) && (is_listen_socket) && (!encapsulation_port))
         encapsulation_port = edword_sctp_get_remote_encapsulation_port(data->sctp_socket, NULL, (struct sockaddr *)sin);
 
-    if ((data->force_sctp) && (data->clients_count))
-        data->clients[data->clients_count].is_sctp = 1;
+    if ((data->force_sctp) && (peer_index))
+        peer->is_sctp = 1;
     else
-        data->clients[data->clients_count].is_sctp = ((is_listen_socket) || (is_callback)) ? is_sctp : 0;
+        peer->is_sctp = ((is_listen_socket) || (is_callback)) ? is_sctp : 0;
     if ((is_sctp & 1) && ((is_listen_socket) || (is_callback))) {
-        data->clients[data->clients_count].sctp_timestamp = timestamp ? timestamp : time(NULL);
-        if (data->sctp_timestamp < data->clients[data->clients_count].sctp_timestamp)
-            data->sctp_timestamp = data->clients[data->clients_count].sctp_timestamp;
+        peer->sctp_timestamp = timestamp ? timestamp : time(NULL);
+        if (data->sctp_timestamp < peer->sctp_timestamp)
+            data->sctp_timestamp = peer->sctp_timestamp;
     } else
-        data->clients[data->clients_count].sctp_timestamp = 0;
-    data->clients[data->clients_count].encapsulation_port = encapsulation_port;
+        peer->sctp_timestamp = 0;
+    peer->encapsulation_port = encapsulation_port;
 #endif
 
-    data->clients[data->clients_count].sctp_socket = is_sctp;
-    data->clients_count ++;
-
-    struct sockaddr_in *addr_key = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-    if (addr_key) {
-        memcpy(addr_key, sin, sizeof(struct sockaddr_in));
-        avl_insert(&data->tree, addr_key, (void *)(uintptr_t)data->clients_count);
-    }
+    peer->sctp_socket = is_sctp;
+    if (edwork_peer_index_add(data, sin, peer_index))
+        log_error("error adding peer to index");
+    // publish the peer to lock-free readers
+    if (free_index)
+        peer->removed = 0;
+    else
+        thread_atomic_int_store(&data->clients_count, (int)(peer_index + 1));
 
     thread_mutex_unlock(&data->clients_lock);
 #ifdef WITH_SCTP
@@ -1407,7 +1890,7 @@ void *add_node(struct edwork_data *data, struct sockaddr_in *sin, int client_len
         add_node(data, (struct sockaddr_in *)&addr2, sizeof(struct sockaddr_in), 0, 0, is_sctp, 0, encapsulation_port, 0, timestamp ? timestamp : 0);
     }
 #endif
-    return &data->clients[data->clients_count - 1];
+    return peer;
 }
 
 void *edwork_ensure_node_in_list(struct edwork_data *data, void *clientaddr, int clientaddrlen, int is_sctp, int is_listen_socket) {
@@ -1455,13 +1938,13 @@ int edwork_private_broadcast(struct edwork_data *data, struct edfs_key_data *key
     if (!data)
         return -1;
 
-    if (!data->clients_count) {
+    // peers added after this point are not used by this broadcast
+    unsigned int clients_count = edwork_peer_count(data);
+    if (!clients_count) {
         log_warn("no nodes to broadcast to");
         return 0;
     }
 
-    thread_mutex_lock(&data->clients_lock);
-
     unsigned char *packet = NULL;
     const unsigned char *ptr = buf;
     if (buf_is_packet) {
@@ -1471,7 +1954,7 @@ int edwork_private_broadcast(struct edwork_data *data, struct edfs_key_data *key
         packet = make_packet(data, key, type, buf, &len, confirmed_acks, force_timestamp, ino);
         ptr = packet;
     }
-    uint64_t rand = edwork_random() % data->clients_count;
+    uint64_t rand = edwork_random() % clients_count;
     int wrapped_to_first = 0;
     if (!threshold)
         threshold = time(NULL) - 60;
@@ -1481,7 +1964,11 @@ int edwork_private_broadcast(struct edwork_data *data, struct edfs_key_data *key
     if ((ptr) && (len > 0)) {
         unsigned int i;
         if ((clientaddr) && (clientaddr_len > 0)) {
-            if (safe_sendto(data, NULL, (const char *)ptr, len, 0, (const struct sockaddr *)clientaddr, clientaddr_len, 1) <= 0) {
+            // sctp sockets are closed and reconnected under clients_lock
+            thread_mutex_lock(&data->clients_lock);
+            ssize_t sent = safe_sendto(data, NULL, (const char *)ptr, len, 0, (const struct sockaddr *)clientaddr, clientaddr_len, 1);
+            thread_mutex_unlock(&data->clients_lock);
+            if (sent <= 0) {
 #ifdef _WIN32
                 log_trace("error %i in sendto (%s)", (int)WSAGetLastError(), edwork_addr_ipv4(clientaddr));
 #else
@@ -1489,7 +1976,6 @@ int edwork_private_broadcast(struct edwork_data *data, struct edfs_key_data *key
 #endif
                 // fallback sending to other clients
             } else {
-                thread_mutex_unlock(&data->clients_lock);
                 free(packet);
                 return 0;
             }
@@ -1498,42 +1984,58 @@ int edwork_private_broadcast(struct edwork_data *data, struct edfs_key_data *key
         // exclude data and large packages from broadcast
         if ((len > EDWOR_MAX_LAN_BROADCAST_SIZE) || ((type[0] == 'd') && (type[1] == 'a') && (type[2] == 't')))
             lan_broadcast = 0;
-        i = rand % data->clients_count;
+        i = rand % clients_count;
         unsigned int start_i = i;
         unsigned int send_to = 0;
         // default to 50 nodes (eg: rebroadcast)
         if (max_nodes <= 0)
             max_nodes = 50;
-        while (send_to < max_nodes) {
-            if ((i) || (lan_broadcast)) {
+        // paced broadcasts are sent one by one
+        int use_batch = (sleep_us <= 0);
+        int peers_left = 1;
+        struct edwork_send_batch batch;
+        edwork_send_batch_init(&batch, ptr, len, threshold);
+        do {
+        while (send_to + batch.count < max_nodes) {
+            struct client_data *peer = edwork_peer(data, i);
+            if (((i) || (lan_broadcast)) && (!peer->removed)) {
                 int try_sctp = 0;
 #ifdef WITH_SCTP
-                if ((!data->force_sctp) || (!data->clients[i].is_sctp)  || (force_udp) || (data->clients[i].last_seen >= threshold) || ((data->clients[i].is_sctp) && ((data->sctp_timestamp < sctp_threshold) || (data->clients[i].sctp_timestamp >= sctp_threshold)))) {
+                if ((!data->force_sctp) || (!peer->is_sctp)  || (force_udp) || (peer->last_seen >= threshold) || ((peer->is_sctp) && ((data->sctp_timestamp < sctp_threshold) || (peer->sctp_timestamp >= sctp_threshold)))) {
 #endif
-                if ((except) && (except_len == data->clients[i].clientlen) && (!memcmp(except, &data->clients[i].clientaddr, except_len))) {
+                if ((except) && (except_len == peer->clientlen) && (!memcmp(except, &peer->clientaddr, except_len))) {
                     log_debug("not broadcasting to same client");
                 } else
-                if ((data->clients[i].last_seen >= threshold) || (i == 0) || (force_udp)) { // i == 0 => means first addres (broadcast address)
+                if ((peer->last_seen >= threshold) || (i == 0) || (force_udp)) { // i == 0 => means first addres (broadcast address)
 #ifdef WITH_SCTP
-                    try_sctp = ((force_udp) && ((!data->clients[i].is_sctp) || (data->clients[i].sctp_socket & 2))) ? 0 : 1;
+                    try_sctp = ((force_udp) && ((!peer->is_sctp) || (peer->sctp_socket & 2))) ? 0 : 1;
 #endif
-                    if (safe_sendto(data, &data->clients[i], (const char *)ptr, len, 0, (struct sockaddr *)&data->clients[i].clientaddr, data->clients[i].clientlen, try_sctp) <= 0) {
+                    if ((use_batch) && (edwork_send_batch_accepts(data, peer, try_sctp))) {
+                        batch.clients[batch.count ++] = i;
+                        if (batch.count == EDWORK_SEND_BATCH)
+                            send_to += edwork_send_batch_flush(data, &batch);
+                    } else {
+                    int sent = 0;
+#ifdef WITH_SCTP
+                    thread_mutex_lock(&data->clients_lock);
+#endif
+                    if (safe_sendto(data, peer, (const char *)ptr, len, 0, (struct sockaddr *)&peer->clientaddr, peer->clientlen, try_sctp) <= 0) {
 #ifdef _WIN32
-                        log_trace("error %i in sendto (client #%i: %s)", (int)WSAGetLastError(), i, edwork_addr_ipv4(&data->clients[i].clientaddr));
+                        log_trace("error %i in sendto (client #%i: %s)", (int)WSAGetLastError(), i, edwork_addr_ipv4(&peer->clientaddr));
 #else
-                        log_trace("error %i in sendto (client #%i: %s)", (int)errno, i, edwork_addr_ipv4(&data->clients[i].clientaddr));
+                        log_trace("error %i in sendto (client #%i: %s)", (int)errno, i, edwork_addr_ipv4(&peer->clientaddr));
 #endif
 #ifdef WITH_SCTP
-                        if (data->clients[i].is_sctp) {
+                        if (peer->is_sctp) {
                             if ((errno != 11) && (errno != 35)) {
-                                data->clients[i].is_sctp = 0;
-                                if (data->clients[i].socket) {
-                                    SCTP_close(data->clients[i].socket);
-                                    if (data->clients[i].is_listen_socket) {
-                                        data->clients[i].socket = 0;
+                                peer->is_sctp = 0;
+                                if (peer->socket) {
+                                    SCTP_close(peer->socket);
+                                    if (peer->is_listen_socket) {
+                                        peer->socket = 0;
                                     } else {
-                                        data->clients[i].socket = edwork_sctp_connect(data, (struct sockaddr *)&data->clients[i].clientaddr, data->clients[i].clientlen, data->clients[i].encapsulation_port);
-                                        if (data->clients[i].socket)
+                                        peer->socket = edwork_sctp_connect(data, (struct sockaddr *)&peer->clientaddr, peer->clientlen, peer->encapsulation_port);
+                                        if (peer->socket)
                                             log_trace("reconnecting SCTP socket");
                                     }
                                 }
@@ -1541,18 +2043,22 @@ int edwork_private_broadcast(struct edwork_data *data, struct edfs_key_data *key
                         } else
                         if (errno != 11)
 #endif
-                            data->clients[i].last_seen = threshold - EDWROK_LAST_SEEN_TIMEOUT;
+                            peer->last_seen = threshold - EDWROK_LAST_SEEN_TIMEOUT;
                     } else {
                         send_to ++;
+                        sent = 1;
 #ifdef WITH_SCTP
-                        if ((force_udp) && (data->clients[i].is_sctp) && (!data->clients[i].is_listen_socket) && (try_sctp))
-                            safe_sendto(data, &data->clients[i], (const char *)ptr, len, 0, (struct sockaddr *)&data->clients[i].clientaddr, data->clients[i].clientlen, 0);
-
-                        if ((sleep_us > 0) && (!data->clients[i].is_sctp))
-                            usleep(sleep_us);
+                        if ((force_udp) && (peer->is_sctp) && (!peer->is_listen_socket) && (try_sctp))
+                            safe_sendto(data, peer, (const char *)ptr, len, 0, (struct sockaddr *)&peer->clientaddr, peer->clientlen, 0);
+#endif
+                    }
+#ifdef WITH_SCTP
+                    thread_mutex_unlock(&data->clients_lock);
+                    if ((sent) && (sleep_us > 0) && (!peer->is_sctp))
+                        usleep(sleep_us);
 #else
-                        if (sleep_us > 0)
-                            usleep(sleep_us);
+                    if ((sent) && (sleep_us > 0))
+                        usleep(sleep_us);
 #endif
                     }
                 }
@@ -1561,17 +2067,23 @@ int edwork_private_broadcast(struct edwork_data *data, struct edfs_key_data *key
 #endif
             }
             i ++;
-            if (i >= data->clients_count) {
+            if (i >= clients_count) {
                 i = 0;
-                if (wrapped_to_first)
+                if (wrapped_to_first) {
+                    peers_left = 0;
                     break;
+                }
                 wrapped_to_first = 1;
             }
-            if (i == start_i)
+            if (i == start_i) {
+                peers_left = 0;
                 break;
+            }
         }
+        send_to += edwork_send_batch_flush(data, &batch);
+        // some batched sends failed, try next peers
+        } while ((peers_left) && (send_to < max_nodes));
     }
-    thread_mutex_unlock(&data->clients_lock);
     free(packet);
     return 0;
 }
@@ -1601,78 +2113,52 @@ unsigned int edwork_jumbo(struct edwork_data *data, struct edfs_key_data *key, u
     return jumbo_size;
 }
 
-unsigned int edwork_rebroadcast(struct edwork_data *data, struct edfs_key_data *key, unsigned int max_count, unsigned int offset) {
+unsigned int edwork_rebroadcast(struct edwork_data *data, struct edfs_key_data *key, unsigned int max_count) {
     if ((!data) || (!key))
         return 0;
 
-    tinydir_dir dir;
-    
-    if (tinydir_open(&dir, key->cache_directory)) {
-        log_error("error opening log directory %s", key->cache_directory);
-        return 0;
+    edwork_rebroadcast_load(data, key);
+
+    if (!max_count) {
+        thread_mutex_lock(&key->rebroadcast_lock);
+        max_count = key->rebroadcast_count;
+        thread_mutex_unlock(&key->rebroadcast_lock);
     }
+    if (!max_count)
+        return 0;
+
+    struct edfs_rebroadcast_entry *due = (struct edfs_rebroadcast_entry *)malloc(sizeof(struct edfs_rebroadcast_entry) * max_count);
+    if (!due)
+        return 0;
+
+    uint64_t now = microseconds();
+    int count = edfs_key_data_rebroadcast_due(key, now, EDWORK_REBROADCAST_BACKOFF_US, due, max_count);
     unsigned int rebroadcast_count = 0;
-    // unsigned char jumbo_buf[0xA000];
-    // unsigned int jumbo_size = 0;
-    while (dir.has_next) {
-        tinydir_file file;
-        tinydir_readfile(&dir, &file);
+    int i;
+    for (i = 0; i < count; i++) {
+        unsigned char *buf = due[i].packet;
+        int size = due[i].len;
+        uint64_t timestamp = ntohll(*(uint64_t *)(buf + 44));
+        if (timestamp - MAX_US_OFFSET > now) {
+            log_warn("edwork block %" PRIu64 " has timestamp in the future, dropping", due[i].ino);
+        } else
+        if (timestamp < now - (uint64_t)EDWORK_SYNC_MAX_TTL * (uint64_t)1000000) {
+            log_warn("edwork block %" PRIu64 " is too old, dropping (timestamp %i, now %i)", due[i].ino, timestamp, now);
+            edwork_confirm_seq(data, key, due[i].ino, -1);
+        } else {
+            // re-id (maybe restarted the service)
+            memcpy(buf, data->i_am, 32);
+            // re-timestamp
+            *(uint64_t *)(buf + 44) = htonll(microseconds());
 
-        if (!file.is_dir) {
-            if (offset) {
-                offset --;
-                tinydir_next(&dir);
-                continue;
-            }
-            char buf_path[4096];
-            buf_path[0] = 0;
-            snprintf(buf_path, 4096, "%s/%s", key->cache_directory, file.name);
-            FILE *f = fopen(buf_path, "rb");
-            if (f) {
-                unsigned char buf[MAX_EDWORK_SYNC_BLOCK_SIZE];
-                int size = fread(buf, 1, MAX_EDWORK_SYNC_BLOCK_SIZE, f);
-                int invalid = 1;
-                if (size >= 136) {
-                    invalid = 0;
-                    uint64_t timestamp = ntohll(*(uint64_t *)(buf + 52));
-                    uint64_t now = microseconds();
-                    if (timestamp - MAX_US_OFFSET > now) {
-                        log_warn("edwork block %s has timestamp in the future, dropping", file.name);
-                    } else
-                    if (timestamp < now - (uint64_t)EDWORK_SYNC_MAX_TTL * (uint64_t)1000000) {
-                        log_warn("edwork block %s is too old, dropping (timestamp %i, now %i)", file.name, timestamp, now);
-                        fclose(f);
-                        unlink(buf_path);
-                        tinydir_next(&dir);
-                        continue;
-                    } else {
-                        // re-id (maybe restarted the service)
-                        memcpy(buf + 8, data->i_am, 32);
-                        // re-timestamp
-                        *(uint64_t *)(buf + 52) = htonll(microseconds());
-
-                        hmac_sha256(key->key_id, 32, buf + 8, 92, buf + 136, size - 136, buf + 100);
-                        
-                        edwork_private_broadcast(data, key, NULL, buf + 8, size - 8, 0, 0, 1, NULL, 0, 0, 0, NULL, 0, 0, 0, 0);
-                        rebroadcast_count ++;
-                    }
-                } else
-                    log_warn("error reading edwork block %s, read size: %i , errno %i", size, file.name, errno);
-                fclose(f);
-                if (invalid) {
-                    log_info("invalid edwork block %s, deleting block", file.name);
-                    if (unlink(buf_path))
-                        log_warn("error deleting %s, errno: %i", file.name, errno);
-                }
-            } else {
-                log_warn("error opening edwork block %s", file.name);
-            }
-            if ((max_count) && (rebroadcast_count >= max_count))
-                break;
+            hmac_sha256(key->key_id, 32, buf, 92, buf + 128, size - 128, buf + 92);
+
+            edwork_private_broadcast(data, key, NULL, buf, size, 0, 0, 1, NULL, 0, 0, 0, NULL, 0, 0, 0, 0);
+            rebroadcast_count ++;
         }
-        tinydir_next(&dir);
+        free(buf);
     }
-    tinydir_close(&dir);
+    free(due);
     return rebroadcast_count;
 }
 
@@ -1727,11 +2213,11 @@ int edwork_send_to_peer(struct edwork_data *data, struct edfs_key_data *key, con
     if (is_sctp) {
         if (is_listen_socket)
             return edwork_send_to_sctp_socket(data, key, data->sctp_socket, type, buf, len, clientaddr, clientaddrlen, EDWORK_SCTP_TTL);
-        uintptr_t data_index = (uintptr_t)avl_search(&data->tree, clientaddr);
+        unsigned int data_index = edwork_peer_lookup(data, clientaddr);
         SCTP_SOCKET_TYPE socket = 0;
         if (data_index > 0) {
             thread_mutex_lock(&data->clients_lock);
-            struct client_data *peer_data = &data->clients[data_index - 1];
+            struct client_data *peer_data = edwork_peer(data, data_index - 1);
             if (peer_data)
                 socket = peer_data->socket;
             thread_mutex_unlock(&data->clients_lock);
@@ -1739,7 +2225,7 @@ int edwork_send_to_peer(struct edwork_data *data, struct edfs_key_data *key, con
         return edwork_send_to_sctp_socket(data, key, socket ? socket : data->sctp_socket, type, buf, len, clientaddr, clientaddrlen, EDWORK_SCTP_TTL);
     }
 #endif
-    unsigned char *packet = make_packet(data, key, type, buf, &len, 0, 0, 0);
+    unsigned char *packet = edwork_make_packet(data, key, type, buf, &len, 0, 0, 0, edwork_peer_aead(data, clientaddr));
     int sent = -1;
     if ((packet) && (len > 0)) {
         if ((data) && (clientaddr) && (clientaddrlen))
@@ -1754,36 +2240,116 @@ int edwork_send_to_peer(struct edwork_data *data, struct edfs_key_data *key, con
 
 int edwork_remove_addr(struct edwork_data *data, void *sin, int client_len) {
     thread_mutex_lock(&data->clients_lock);
-    uintptr_t index = (uintptr_t)avl_search(&data->tree, sin);
+    unsigned int index = edwork_peer_lookup(data, sin);
     if ((!index) || (index == 1)) {
         thread_mutex_unlock(&data->clients_lock);
         return 0;
     }
-    
-    if ((data->clients_count > 1) && (index <= data->clients_count)) {
+
+    // peers never move, readers may still hold the pointer
+    struct client_data *peer = edwork_peer(data, index - 1);
 #ifdef WITH_SCTP
-        if (data->clients[index - 1].socket) {
-            SCTP_close(data->clients[index - 1].socket);
-            data->clients[index - 1].socket = 0;
-        }
-#endif
-        avl_remove(&data->tree, sin);
-        memmove(&data->clients[index - 1], &data->clients[index], sizeof(struct client_data) * (data->clients_count - index));
-        int i;
-        data->clients_count --;
-
-        for (i = index - 1; i < data->clients_count; i++) {
-            struct sockaddr_in *addr_key = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-            if (addr_key) {
-                memcpy(addr_key, &data->clients[i].clientaddr, sizeof(struct sockaddr_in));
-                // avl_insert replaces the old key, no need to call avl_remove
-                avl_insert(&data->tree, addr_key, (void *)(uintptr_t)(i + 1));
-            }
+    if (peer->socket) {
+        SCTP_close(peer->socket);
+        peer->socket = 0;
+    }
+    peer->is_sctp = 0;
+    peer->sctp_timestamp = 0;
+#endif
+    peer->sctp_socket = 0;
+    peer->is_listen_socket = 0;
+    peer->last_seen = 0;
+    peer->removed = 1;
+    peer->removed_timestamp = time(NULL);
+    edwork_peer_index_remove(data, &peer->clientaddr, index - 1);
+    edwork_peer_release(data, index - 1);
+    thread_mutex_unlock(&data->clients_lock);
+    return 1;
+}
+
+static void edwork_dispatch_job_run(void *job_data, void *userdata) {
+    struct edwork_dispatch_job *job = (struct edwork_dispatch_job *)job_data;
+    job->callback(job->arg);
+    free(job);
+}
+
+// jobs with the same route are handled in order, by the same worker; runs the job on the calling thread if there are no workers
+int edwork_defer(struct edwork_data *data, uint64_t route, edwork_deferred_callback callback, void *arg) {
+    if (!callback)
+        return -1;
 
+    if ((data) && (data->workers)) {
+        struct edwork_dispatch_job *job = (struct edwork_dispatch_job *)malloc(sizeof(struct edwork_dispatch_job));
+        if (job) {
+            job->callback = callback;
+            job->arg = arg;
+            if (!writeback_submit(data->workers, route, job))
+                return 1;
+            free(job);
         }
     }
+    callback(arg);
+    return 0;
+}
+
+void edwork_set_dispatch_threads(struct edwork_data *data, int threads) {
+    if ((!data) || (data->workers))
+        return;
+    if (threads <= 0)
+        return;
+
+    data->workers = writeback_create(threads, EDWORK_DISPATCH_MAX_JOBS, edwork_dispatch_job_run, data);
+    if (data->workers)
+        log_info("using %i dispatch threads", threads);
+    else
+        log_warn("error creating dispatch threads, dispatching on the network thread");
+}
+
+// records the capabilities advertised in a helo message, and advertises ours to peers that didn't answer yet
+static void edwork_negotiate(struct edwork_data *data, struct edfs_key_data *key, void *clientaddr, int clientaddrlen, int is_sctp, int is_listen_socket, const unsigned char *helo, unsigned int helo_size) {
+    if ((!key) || (!clientaddr) || (!clientaddrlen))
+        return;
+
+    unsigned int data_index = edwork_peer_lookup(data, clientaddr);
+    // 1 is the broadcast address
+    if (data_index <= 1)
+        return;
+
+    struct client_data *peer = edwork_peer(data, data_index - 1);
+    unsigned int capabilities = (unsigned int)thread_atomic_int_load(&peer->capabilities);
+    unsigned int new_capabilities = capabilities;
+    if (helo) {
+        // older nodes send an empty helo, no capabilities
+        if (helo_size >= sizeof(uint32_t))
+            new_capabilities = ntohl(*(const uint32_t *)helo) | EDWORK_CAP_KNOWN;
+        else
+            new_capabilities = EDWORK_CAP_KNOWN;
+    }
+    unsigned int now = (unsigned int)time(NULL);
+    unsigned int helo_timestamp = (unsigned int)thread_atomic_int_load(&peer->helo_timestamp);
+    int send_helo = ((EDWORK_CAPABILITIES) && (!(capabilities & EDWORK_CAP_KNOWN)) && (now - helo_timestamp >= EDWORK_HELO_INTERVAL));
+    // known peers don't take the lock
+    if ((new_capabilities == capabilities) && (!send_helo))
+        return;
+
+    thread_mutex_lock(&data->clients_lock);
+    // the slot may have been reused since the lookup
+    if ((!peer->removed) && (!sockaddr_compare(&peer->clientaddr, clientaddr))) {
+        if (new_capabilities != capabilities)
+            thread_atomic_int_store(&peer->capabilities, (int)new_capabilities);
+        // another thread sent it meanwhile
+        if ((send_helo) && ((unsigned int)thread_atomic_int_load(&peer->helo_timestamp) != helo_timestamp))
+            send_helo = 0;
+        if (send_helo)
+            thread_atomic_int_store(&peer->helo_timestamp, (int)now);
+    } else
+        send_helo = 0;
     thread_mutex_unlock(&data->clients_lock);
-    return 1;
+
+    if (send_helo) {
+        uint32_t capabilities = htonl(EDWORK_CAPABILITIES);
+        edwork_send_to_peer(data, key, "helo", (const unsigned char *)&capabilities, sizeof(uint32_t), clientaddr, clientaddrlen, is_sctp, is_listen_socket, EDWORK_SCTP_TTL);
+    }
 }
 
 int edwork_dispatch_data(struct edwork_data *data, edwork_dispatch_callback callback, unsigned char *buffer, int n, void *clientaddr, int clientaddrlen, void *userdata, int is_sctp, int is_listen_socket) {
@@ -1840,9 +2406,17 @@ int edwork_dispatch_data(struct edwork_data *data, edwork_dispatch_callback call
     if (key_id)
         key_data = data->find_key(key_id, userdata);
     unsigned char hmac[32];
-    if (key_data)
-        hmac_sha256(key_data->key_id, 32, buffer, 92, payload, size, hmac);
-    if ((!key_data) || (memcmp(hmac, buffer + 92, 32))) {
+    int verified = 0;
+    if (key_data) {
+        if (((EDWORK_CAPABILITIES & EDWORK_CAP_AEAD)) && (!memcmp(buffer + 108, edwork_aead_marker, 16))) {
+            edwork_packet_tag(buffer, payload, size, key_data->key_id, hmac);
+            verified = poly1305_verify(hmac, buffer + 92);
+        } else {
+            hmac_sha256(key_data->key_id, 32, buffer, 92, payload, size, hmac);
+            verified = !memcmp(hmac, buffer + 92, 32);
+        }
+    }
+    if (!verified) {
         // invalid hmac
         if ((!key_id) && (!memcmp(type, "ping", 4)) && (size >= sizeof(uint64_t))) {
             int i;
@@ -1902,6 +2476,14 @@ int edwork_dispatch_data(struct edwork_data *data, edwork_dispatch_callback call
         thread_mutex_unlock(&data->callback_lock);        
     }
 
+    // after the callback, so the peer is already in the list
+    if (verified) {
+        if (!memcmp(type, "helo", 4))
+            edwork_negotiate(data, key_data, clientaddr, clientaddrlen, is_sctp, is_listen_socket, payload, size);
+        else
+            edwork_negotiate(data, key_data, clientaddr, clientaddrlen, is_sctp, is_listen_socket, NULL, 0);
+    }
+
     return 1;
 }
 
@@ -1916,13 +2498,34 @@ int edwork_dispatch(struct edwork_data *data, edwork_dispatch_callback callback,
     if (!edworks_data_pending(data, timeout_ms))
         return 0;
 
+#if !defined(EDWORK_USE_MMSG) || (defined(WITH_SCTP) && !defined(WITH_USRSCTP))
+    // mmsg receives in data->recv_buffers, only recvfrom and SCTP need these
     unsigned char buffer[0xFFFF];
     struct sockaddr_in clientaddr;
+#endif
     do {
+#if !defined(EDWORK_USE_MMSG) || (defined(WITH_SCTP) && !defined(WITH_USRSCTP))
         socklen_t clientlen = sizeof(clientaddr);
+#endif
 #if defined(WITH_SCTP) && !defined(WITH_USRSCTP)
         if ((data->ufds) && (data->ufds[0].revents)) {
 #endif
+#ifdef EDWORK_USE_MMSG
+            int count = edwork_recv_batch(data);
+            if (count <= 0) {
+                log_error("error in recvmmsg: %i", (int)errno);
+                return 0;
+            }
+            int j;
+            int dispatch_error = 0;
+            // all received packets are dispatched, even if one of them fails
+            for (j = 0; j < count; j++) {
+                if (edwork_dispatch_data(data, callback, data->recv_buffers + j * EDWORK_RECV_BUFFER, data->recv_msgs[j].msg_len, &data->recv_addr[j], data->recv_msgs[j].msg_hdr.msg_namelen, userdata, 0, 0) <= 0)
+                    dispatch_error = 1;
+            }
+            if (dispatch_error)
+                break;
+#else
             int n = safe_recvfrom(data, (char *)buffer, sizeof(buffer), 0, (struct sockaddr *) &clientaddr, &clientlen);
             if (n <= 0) {
         #ifdef _WIN32
@@ -1934,6 +2537,7 @@ int edwork_dispatch(struct edwork_data *data, edwork_dispatch_callback callback,
             }
             if (edwork_dispatch_data(data, callback, buffer, n, &clientaddr, clientlen, userdata, 0, 0) <= 0)
                 break;
+#endif
 #if defined(WITH_SCTP) && !defined(WITH_USRSCTP)
         }
         int i;
@@ -1964,24 +2568,24 @@ int edwork_get_node_list(struct edwork_data *data, unsigned char *buf, int *buf_
     int records = 0;
     unsigned int i;
     // active in last 72 hours
-    thread_mutex_lock(&data->clients_lock);
+    // peers are read without locking, removed peers have last_seen = 0
     unsigned int found = 0;
     unsigned short port;
     time_t now = time(NULL);
     int buffer_size = 0;
-    for (i = 0; i < data->clients_count; i++) {
+    for (i = 0; i < edwork_peer_count(data); i++) {
         if (*buf_size < 14)
             break;
 #if defined(WITH_SCTP) && defined(SCTP_UDP_ENCAPSULATION)
-         if (/*(!data->force_sctp) && */ (data->clients[i].is_sctp) && (data->clients[i].is_listen_socket))
+         if (/*(!data->force_sctp) && */ (edwork_peer(data, i)->is_sctp) && (edwork_peer(data, i)->is_listen_socket))
              continue;
 #endif
-        if (data->clients[i].last_seen >= threshold) {
+        if (edwork_peer(data, i)->last_seen >= threshold) {
             if (found >= offset) {
                 records ++;
 #ifdef WITH_SCTP
-                if (data->clients[i].sctp_socket) {
-                    if (data->clients[i].encapsulation_port)
+                if (edwork_peer(data, i)->sctp_socket) {
+                    if (edwork_peer(data, i)->encapsulation_port)
                         *buf = 9;
                     else
                         *buf = 7;
@@ -1994,19 +2598,19 @@ int edwork_get_node_list(struct edwork_data *data, unsigned char *buf, int *buf_
                 buffer_size += *buf + 1;
                 buf ++;
 
-                memcpy(buf, &data->clients[i].clientaddr.sin_addr, 4);
+                memcpy(buf, &edwork_peer(data, i)->clientaddr.sin_addr, 4);
                 buf += 4;
-                if (data->clients[i].is_listen_socket) {
+                if (edwork_peer(data, i)->is_listen_socket) {
                     port = htons(4848);
                     memcpy(buf, &port, 2);
                 } else
-                    memcpy(buf, &data->clients[i].clientaddr.sin_port, 2);
+                    memcpy(buf, &edwork_peer(data, i)->clientaddr.sin_port, 2);
                 buf += 2;
 #ifdef WITH_SCTP
-                if (data->clients[i].sctp_socket) {
-                    *buf ++ = data->clients[i].sctp_socket;
-                    if (data->clients[i].encapsulation_port) {
-                        port = htons(data->clients[i].encapsulation_port);
+                if (edwork_peer(data, i)->sctp_socket) {
+                    *buf ++ = edwork_peer(data, i)->sctp_socket;
+                    if (edwork_peer(data, i)->encapsulation_port) {
+                        port = htons(edwork_peer(data, i)->encapsulation_port);
                         memcpy(buf, &port, 2);
                         buf += 2;
                         *buf_size -= 10;
@@ -2016,7 +2620,7 @@ int edwork_get_node_list(struct edwork_data *data, unsigned char *buf, int *buf_
 #endif
                     *buf_size -= 7;
                 if (with_timestamp) {
-                    time_t delta_time = htonl(now - data->clients[i].last_seen);
+                    time_t delta_time = htonl(now - edwork_peer(data, i)->last_seen);
                     memcpy(buf, &delta_time, 4);
                     buf += 4;
                     *buf_size -= 4;
@@ -2025,7 +2629,6 @@ int edwork_get_node_list(struct edwork_data *data, unsigned char *buf, int *buf_
             found ++;
         }
     }
-    thread_mutex_unlock(&data->clients_lock);
     *buf_size = buffer_size;
     return records;
 }
@@ -2090,7 +2693,6 @@ int edwork_debug_node_list(struct edwork_data *data, char *buf, int buf_size, un
     int records = 0;
     unsigned int i;
     // active in last 72 hours
-    thread_mutex_lock(&data->clients_lock);
     unsigned int found = 0;
     unsigned short port;
     time_t now = time(NULL);
@@ -2100,14 +2702,14 @@ int edwork_debug_node_list(struct edwork_data *data, char *buf, int buf_size, un
     const char *prefix = text_prefix;
     if (html)
         prefix = html_prefix;
-    for (i = 0; i < data->clients_count; i++) {
+    for (i = 0; i < edwork_peer_count(data); i++) {
         if (buf_size < 14)
             break;
 
-        if (data->clients[i].last_seen >= threshold) {
+        if (edwork_peer(data, i)->last_seen >= threshold) {
             if (found >= offset) {
                 records ++;
-                time_t delta_time = now - data->clients[i].last_seen;
+                time_t delta_time = now - edwork_peer(data, i)->last_seen;
                 if (records > 1) {
                     buf[0] = ',';
                     buf[1] = ' ';
@@ -2116,14 +2718,14 @@ int edwork_debug_node_list(struct edwork_data *data, char *buf, int buf_size, un
                 }
                 int written;
 #ifdef WITH_SCTP
-                if ((data->clients[i].is_sctp) && (data->clients[i].sctp_socket & 2))
-                    written = snprintf(buf, buf_size, "%ssctp_udp://%s, %i seconds ago", prefix, edwork_addr_ipv4(&data->clients[i].clientaddr), (int)delta_time);
+                if ((edwork_peer(data, i)->is_sctp) && (edwork_peer(data, i)->sctp_socket & 2))
+                    written = snprintf(buf, buf_size, "%ssctp_udp://%s, %i seconds ago", prefix, edwork_addr_ipv4(&edwork_peer(data, i)->clientaddr), (int)delta_time);
                 else
-                if (data->clients[i].is_sctp)
-                    written = snprintf(buf, buf_size, "%ssctp://%s, %i seconds ago", prefix, edwork_addr_ipv4(&data->clients[i].clientaddr), (int)delta_time);
+                if (edwork_peer(data, i)->is_sctp)
+                    written = snprintf(buf, buf_size, "%ssctp://%s, %i seconds ago", prefix, edwork_addr_ipv4(&edwork_peer(data, i)->clientaddr), (int)delta_time);
                 else
 #endif
-                    written = snprintf(buf, buf_size, "%sudp://%s, %i seconds ago", prefix, edwork_addr_ipv4(&data->clients[i].clientaddr), (int)delta_time);
+                    written = snprintf(buf, buf_size, "%sudp://%s, %i seconds ago", prefix, edwork_addr_ipv4(&edwork_peer(data, i)->clientaddr), (int)delta_time);
                 if (written <= 0)
                     break;
 
@@ -2133,12 +2735,11 @@ int edwork_debug_node_list(struct edwork_data *data, char *buf, int buf_size, un
             found ++;
         }
     }
-    thread_mutex_unlock(&data->clients_lock);
     return records;
 }
 
 unsigned int edwork_magnitude(struct edwork_data *data) {
-    if ((!data) || (!data->clients_count))
+    if ((!data) || (!edwork_peer_count(data)))
         return 0;
 
     unsigned int magnitude = 0;
@@ -2147,9 +2748,8 @@ unsigned int edwork_magnitude(struct edwork_data *data) {
     if ((data->magnitude_stamp > threshold) && (data->magnitude > 0))
         return data->magnitude;
 
-    thread_mutex_lock(&data->clients_lock);
-    for (i = 0; i < data->clients_count; i++) {
-        if (data->clients[i].last_seen > threshold) {
+    for (i = 0; i < edwork_peer_count(data); i++) {
+        if (edwork_peer(data, i)->last_seen > threshold) {
             magnitude ++;
             if (magnitude > 1000)
                 break;
@@ -2157,7 +2757,6 @@ unsigned int edwork_magnitude(struct edwork_data *data) {
     }
     data->magnitude_stamp = time(NULL);
     data->magnitude = magnitude;
-    thread_mutex_unlock(&data->clients_lock);
 
     return magnitude;
 }
@@ -2187,6 +2786,12 @@ void edwork_close(struct edwork_data *data) {
     if (!data)
         return;
 
+    // pending packets are handled before the sockets are closed
+    if (data->workers) {
+        writeback_destroy(data->workers);
+        data->workers = NULL;
+    }
+
     if (data->socket) {
         thread_mutex_lock(&data->sock_lock);
 #ifdef _WIN32
@@ -2208,11 +2813,11 @@ void edwork_close(struct edwork_data *data) {
     }
     int i;
     thread_mutex_lock(&data->clients_lock);
-    for (i = 0; i < data->clients_count; i++) {
-        SCTP_SOCKET_TYPE socket = data->clients[i].socket;
-        data->clients[i].is_sctp = 0;
+    for (i = 0; i < edwork_peer_count(data); i++) {
+        SCTP_SOCKET_TYPE socket = edwork_peer(data, i)->socket;
+        edwork_peer(data, i)->is_sctp = 0;
         if (socket) {
-            data->clients[i].socket = 0;
+            edwork_peer(data, i)->socket = 0;
             SCTP_shutdown(socket, SHUT_RDWR);
             SCTP_close(socket);
         }
@@ -2225,9 +2830,15 @@ void edwork_destroy(struct edwork_data *data) {
     if (!data)
         return;
     avl_destroy(&data->spent, avl_spent_key_data_destructor);
-    avl_destroy(&data->tree, avl_key_data_destructor);
     thread_mutex_term(&data->sock_lock);
     thread_mutex_term(&data->clients_lock);
+    int i;
+    for (i = 0; i < EDWORK_PEER_SHARDS; i++) {
+        thread_mutex_term(&data->peer_shards[i].lock);
+        free(data->peer_shards[i].slots);
+    }
+    for (i = 0; i < EDWORK_PEER_SEGMENTS; i++)
+        free(data->client_segments[i]);
     thread_mutex_term(&data->lock);
 #ifdef WITH_SCTP
     thread_mutex_term(&data->sctp_sock_lock);
@@ -2236,7 +2847,10 @@ void edwork_destroy(struct edwork_data *data) {
     thread_mutex_term(&data->thread_lock);
 #endif
     thread_mutex_term(&data->callback_lock);
+    thread_mutex_term(&data->sequence_lock);
 
-    free(data->clients);
+#ifdef EDWORK_USE_MMSG
+    free(data->recv_buffers);
+#endif
     free(data);
 }
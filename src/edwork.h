@@ -12,11 +12,14 @@
 #define EDWORK_SCTP_UDP_TUNNELING_PORT  4884
 #define EDWORK_PEER_DISCOVERY_SERVICE
 #define EDWROK_LAST_SEEN_TIMEOUT        120
+// capability bits, advertised in helo
+#define EDWORK_CAP_AEAD                 0x01
 
 struct edwork_data;
 
 typedef void (*edwork_dispatch_callback)(struct edwork_data *edwork, uint64_t sequence, uint64_t timestamp, const char *type, const unsigned char *payload, unsigned int payload_size, struct edfs_key_data *key_data, void *clientaddr, int clientaddrlen, const unsigned char *who_am_i, const unsigned char *blockhash, void *userdata, int is_sctp, int is_listen_socket);
 typedef struct edfs_key_data *(*edwork_find_key_callback)(uint64_t key, void *userdata);
+typedef void (*edwork_deferred_callback)(void *arg);
 
 #ifdef _WIN32
     void usleep(uint64_t usec);
@@ -37,7 +40,8 @@ int edwork_send_to_peer(struct edwork_data *data, struct edfs_key_data *key, con
 int edwork_broadcast(struct edwork_data *data, struct edfs_key_data *key, const char type[4], const unsigned char *buf, int len, int confirmed_acks, int max_nodes, uint64_t ino, int force_udp, time_t threshold);
 int edwork_broadcast_client(struct edwork_data *data, struct edfs_key_data *key, const char type[4], const unsigned char *buf, int len, int confirmed_acks, int max_nodes, uint64_t ino, const void *clientaddr, int clientaddr_len);
 int edwork_broadcast_except(struct edwork_data *data, struct edfs_key_data *key, const char type[4], const unsigned char *buf, int len, int confirmed_acks, int max_nodes, const void *except, int except_len, uint64_t force_timestamp, uint64_t ino);
-unsigned int edwork_rebroadcast(struct edwork_data *data, struct edfs_key_data *key, unsigned int max_count, unsigned int offset);
+unsigned int edwork_rebroadcast(struct edwork_data *data, struct edfs_key_data *key, unsigned int max_count);
+void edwork_set_rebroadcast_wal(struct edwork_data *data, int wal);
 int edwork_get_node_list(struct edwork_data *data, unsigned char *buf, int *buf_size, unsigned int offset, time_t threshold, int with_timestamp);
 int edwork_debug_node_list(struct edwork_data *data, char *buf, int buf_size, unsigned int offset, time_t threshold, int html);
 int edwork_add_node_list(struct edwork_data *data, const unsigned char *buf, int buf_size);
@@ -58,6 +62,8 @@ const char *edwork_addr_ipv4(const void *clientaddr_ptr);
 void edwork_close(struct edwork_data *data);
 void edwork_destroy(struct edwork_data *data);
 void edwork_callback_lock(struct edwork_data *data, int lock);
+void edwork_set_dispatch_threads(struct edwork_data *data, int threads);
+int edwork_defer(struct edwork_data *data, uint64_t route, edwork_deferred_callback callback, void *arg);
 void edwork_reset_id(struct edwork_data *data);
 
 void edwork_done();
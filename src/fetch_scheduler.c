@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fetch_scheduler.h"
+#include "thread.h"
+
+struct fetch_peer {
+    unsigned char addr[FETCH_ADDR_SIZE];
+    int addr_len;
+
+    uint64_t srtt;
+    uint64_t rttvar;
+    // bytes per second
+    uint64_t throughput;
+    // per mille, moving average
+    int loss;
+    int window;
+    int outstanding;
+    int samples;
+
+    uint64_t last_seen;
+};
+
+struct fetch_request {
+    uint64_t key_id;
+    uint64_t inode;
+    uint64_t chunk;
+
+    int peer;
+    int hedge_peer;
+    uint64_t sent;
+    uint64_t hedge_sent;
+};
+
+struct fetch_scheduler {
+    struct fetch_peer peers[FETCH_MAX_PEERS];
+    int peer_count;
+
+    struct fetch_request requests[FETCH_MAX_REQUESTS];
+    int request_count;
+
+    uint64_t total_requests;
+    uint64_t completed;
+    uint64_t hedged;
+    uint64_t lost;
+
+    thread_mutex_t lock;
+};
+
+struct fetch_scheduler *fetch_scheduler_create() {
+    struct fetch_scheduler *sched = (struct fetch_scheduler *)malloc(sizeof(struct fetch_scheduler));
+    if (!sched)
+        return NULL;
+
+    memset(sched, 0, sizeof(struct fetch_scheduler));
+    thread_mutex_init(&sched->lock);
+    return sched;
+}
+
+void fetch_scheduler_destroy(struct fetch_scheduler *sched) {
+    if (!sched)
+        return;
+
+    thread_mutex_term(&sched->lock);
+    free(sched);
+}
+
+static int fetch_peer_find(struct fetch_scheduler *sched, const void *addr, int addr_len) {
+    int i;
+    for (i = 0; i < sched->peer_count; i++) {
+        if ((sched->peers[i].addr_len == addr_len) && (!memcmp(sched->peers[i].addr, addr, addr_len)))
+            return i;
+    }
+    return -1;
+}
+
+static int fetch_peer_get(struct fetch_scheduler *sched, const void *addr, int addr_len, uint64_t now) {
+    if ((addr_len <= 0) || (addr_len > FETCH_ADDR_SIZE))
+        return -1;
+
+    int index = fetch_peer_find(sched, addr, addr_len);
+    if (index >= 0)
+        return index;
+
+    if (sched->peer_count < FETCH_MAX_PEERS) {
+        index = sched->peer_count++;
+    } else {
+        // replace the idle peer not seen for the longest time
+        int i;
+        for (i = 0; i < sched->peer_count; i++) {
+            if ((!sched->peers[i].outstanding) && ((index < 0) || (sched->peers[i].last_seen < sched->peers[index].last_seen)))
+                index = i;
+        }
+        if (index < 0)
+            return -1;
+    }
+
+    struct fetch_peer *peer = &sched->peers[index];
+    memset(peer, 0, sizeof(struct fetch_peer));
+    memcpy(peer->addr, addr, addr_len);
+    peer->addr_len = addr_len;
+    peer->srtt = FETCH_DEFAULT_RTT;
+    peer->rttvar = FETCH_DEFAULT_RTT / 2;
+    peer->window = FETCH_INITIAL_WINDOW;
+    peer->last_seen = now;
+    return index;
+}
+
+static uint64_t fetch_peer_hedge_timeout(struct fetch_peer *peer) {
+    uint64_t timeout = peer->srtt + 4 * peer->rttvar;
+    if (timeout < FETCH_MIN_HEDGE)
+        timeout = FETCH_MIN_HEDGE;
+    return timeout;
+}
+
+// expected time until a new request to this peer completes, lower is better
+static uint64_t fetch_peer_cost(struct fetch_peer *peer) {
+    uint64_t cost = peer->srtt + 2 * peer->rttvar;
+    // queued requests, at the measured throughput (or rtt / window, if unknown)
+    if (peer->throughput)
+        cost += (uint64_t)peer->outstanding * FETCH_CHUNK_BYTES * 1000000 / peer->throughput;
+    else
+        cost += (uint64_t)peer->outstanding * peer->srtt / peer->window;
+
+    int loss = peer->loss;
+    if (loss > 900)
+        loss = 900;
+    return cost * 1000 / (1000 - loss);
+}
+
+static void fetch_peer_sample(struct fetch_peer *peer, uint64_t rtt, int bytes, uint64_t now) {
+    if (!peer->samples) {
+        peer->srtt = rtt;
+        peer->rttvar = rtt / 2;
+    } else {
+        uint64_t delta = (rtt > peer->srtt) ? rtt - peer->srtt : peer->srtt - rtt;
+        peer->rttvar = (3 * peer->rttvar + delta) / 4;
+        peer->srtt = (7 * peer->srtt + rtt) / 8;
+    }
+    if ((bytes > 0) && (rtt > 0)) {
+        uint64_t throughput = (uint64_t)bytes * 1000000 / rtt;
+        if (peer->throughput)
+            peer->throughput = (7 * peer->throughput + throughput) / 8;
+        else
+            peer->throughput = throughput;
+    }
+    peer->samples ++;
+    peer->loss = peer->loss * 7 / 8;
+    if (peer->window < FETCH_MAX_WINDOW)
+        peer->window ++;
+    peer->last_seen = now;
+}
+
+static void fetch_peer_lost(struct fetch_peer *peer) {
+    peer->loss = (peer->loss * 7 + 1000) / 8;
+    peer->window /= 2;
+    if (peer->window < 1)
+        peer->window = 1;
+}
+
+static void fetch_peer_release(struct fetch_scheduler *sched, int index) {
+    if ((index >= 0) && (index < sched->peer_count) && (sched->peers[index].outstanding > 0))
+        sched->peers[index].outstanding --;
+}
+
+static void fetch_request_remove(struct fetch_scheduler *sched, int index) {
+    struct fetch_request *request = &sched->requests[index];
+    fetch_peer_release(sched, request->peer);
+    fetch_peer_release(sched, request->hedge_peer);
+
+    sched->request_count --;
+    if (index != sched->request_count)
+        memcpy(request, &sched->requests[sched->request_count], sizeof(struct fetch_request));
+}
+
+static void fetch_request_expire(struct fetch_scheduler *sched, uint64_t now) {
+    int i = 0;
+    while (i < sched->request_count) {
+        struct fetch_request *request = &sched->requests[i];
+        if (now - request->sent >= FETCH_REQUEST_TIMEOUT) {
+            if (request->peer >= 0)
+                fetch_peer_lost(&sched->peers[request->peer]);
+            if (request->hedge_peer >= 0)
+                fetch_peer_lost(&sched->peers[request->hedge_peer]);
+            sched->lost ++;
+            fetch_request_remove(sched, i);
+            continue;
+        }
+        i ++;
+    }
+}
+
+static int fetch_request_find(struct fetch_scheduler *sched, uint64_t key_id, uint64_t inode, uint64_t chunk) {
+    int i;
+    for (i = 0; i < sched->request_count; i++) {
+        struct fetch_request *request = &sched->requests[i];
+        if ((request->chunk == chunk) && (request->inode == inode) && (request->key_id == key_id))
+            return i;
+    }
+    return -1;
+}
+
+static int fetch_candidate_find(struct fetch_scheduler *sched, const unsigned char *candidates, int count, int stride, int addr_len, int peer_index) {
+    if (peer_index < 0)
+        return FETCH_BROADCAST;
+
+    struct fetch_peer *peer = &sched->peers[peer_index];
+    int i;
+    for (i = 0; i < count; i++) {
+        if ((peer->addr_len == addr_len) && (!memcmp(peer->addr, candidates + i * stride, addr_len)))
+            return i;
+    }
+    return FETCH_BROADCAST;
+}
+
+static int fetch_select_peer(struct fetch_scheduler *sched, const unsigned char *candidates, int count, int stride, int addr_len, int exclude, int required, uint64_t now, int *peer_index) {
+    int best = -1;
+    int best_peer = -1;
+    uint64_t best_cost = 0;
+    int full = -1;
+    int full_peer = -1;
+    uint64_t full_cost = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        int index = fetch_peer_get(sched, candidates + i * stride, addr_len, now);
+        if ((index < 0) || (index == exclude))
+            continue;
+
+        struct fetch_peer *peer = &sched->peers[index];
+        uint64_t cost = fetch_peer_cost(peer);
+        if (peer->outstanding >= peer->window) {
+            if ((full < 0) || (cost < full_cost)) {
+                full = i;
+                full_peer = index;
+                full_cost = cost;
+            }
+            continue;
+        }
+        if ((best < 0) || (cost < best_cost)) {
+            best = i;
+            best_peer = index;
+            best_cost = cost;
+        }
+    }
+    // all windows are full, but the caller is waiting for this chunk
+    if ((best < 0) && (required)) {
+        best = full;
+        best_peer = full_peer;
+    }
+    *peer_index = best_peer;
+    return best;
+}
+
+// returns the index of the candidate to send the request to, FETCH_BROADCAST if no candidate is usable,
+// FETCH_IN_FLIGHT if the chunk was already requested and the request is not late yet
+// or FETCH_BUSY if all the windows are full and the request is not required (eg. forward chunks)
+int fetch_scheduler_select(struct fetch_scheduler *sched, uint64_t key_id, uint64_t inode, uint64_t chunk, const void *candidates, int count, int stride, int addr_len, int required, uint64_t now) {
+    if ((!sched) || (!candidates) || (count <= 0) || (addr_len <= 0) || (addr_len > FETCH_ADDR_SIZE))
+        return FETCH_BROADCAST;
+
+    int peer_index = -1;
+    int selected;
+
+    thread_mutex_lock(&sched->lock);
+    fetch_request_expire(sched, now);
+
+    int index = fetch_request_find(sched, key_id, inode, chunk);
+    if (index >= 0) {
+        struct fetch_request *request = &sched->requests[index];
+        if (request->hedge_peer < 0) {
+            if ((request->peer >= 0) && (now - request->sent < fetch_peer_hedge_timeout(&sched->peers[request->peer]))) {
+                thread_mutex_unlock(&sched->lock);
+                return FETCH_IN_FLIGHT;
+            }
+            // slow request, ask a second peer, first one to answer wins
+            selected = fetch_select_peer(sched, (const unsigned char *)candidates, count, stride, addr_len, request->peer, 1, now, &peer_index);
+            if (selected >= 0) {
+                request->hedge_peer = peer_index;
+                request->hedge_sent = now;
+                sched->peers[peer_index].outstanding ++;
+                sched->hedged ++;
+            } else {
+                // no other source, retry the same peer
+                request->sent = now;
+                selected = fetch_candidate_find(sched, (const unsigned char *)candidates, count, stride, addr_len, request->peer);
+            }
+            thread_mutex_unlock(&sched->lock);
+            return selected;
+        }
+        if (now - request->hedge_sent < fetch_peer_hedge_timeout(&sched->peers[request->hedge_peer])) {
+            thread_mutex_unlock(&sched->lock);
+            return FETCH_IN_FLIGHT;
+        }
+        // both peers are late, consider the request lost and start over
+        if (request->peer >= 0)
+            fetch_peer_lost(&sched->peers[request->peer]);
+        fetch_peer_lost(&sched->peers[request->hedge_peer]);
+        sched->lost ++;
+        fetch_request_remove(sched, index);
+    }
+
+    selected = fetch_select_peer(sched, (const unsigned char *)candidates, count, stride, addr_len, -1, required, now, &peer_index);
+    if ((selected < 0) && (!required)) {
+        thread_mutex_unlock(&sched->lock);
+        return FETCH_BUSY;
+    }
+    if (selected >= 0) {
+        if (sched->request_count >= FETCH_MAX_REQUESTS) {
+            // drop the oldest request
+            int i;
+            int oldest = 0;
+            for (i = 1; i < sched->request_count; i++) {
+                if (sched->requests[i].sent < sched->requests[oldest].sent)
+                    oldest = i;
+            }
+            fetch_request_remove(sched, oldest);
+        }
+        struct fetch_request *request = &sched->requests[sched->request_count++];
+        request->key_id = key_id;
+        request->inode = inode;
+        request->chunk = chunk;
+        request->peer = peer_index;
+        request->hedge_peer = -1;
+        request->sent = now;
+        request->hedge_sent = 0;
+        sched->peers[peer_index].outstanding ++;
+        sched->total_requests ++;
+    }
+    thread_mutex_unlock(&sched->lock);
+    return selected;
+}
+
+// drops in-flight requests for chunks in [first_chunk, last_chunk], without penalizing the peers
+void fetch_scheduler_cancel(struct fetch_scheduler *sched, uint64_t key_id, uint64_t inode, uint64_t first_chunk, uint64_t last_chunk) {
+    if ((!sched) || (first_chunk > last_chunk))
+        return;
+
+    thread_mutex_lock(&sched->lock);
+    int i = 0;
+    while (i < sched->request_count) {
+        struct fetch_request *request = &sched->requests[i];
+        if ((request->inode == inode) && (request->key_id == key_id) && (request->chunk >= first_chunk) && (request->chunk <= last_chunk)) {
+            fetch_request_remove(sched, i);
+            continue;
+        }
+        i ++;
+    }
+    thread_mutex_unlock(&sched->lock);
+}
+
+void fetch_scheduler_complete(struct fetch_scheduler *sched, uint64_t key_id, uint64_t inode, uint64_t chunk, const void *addr, int addr_len, int bytes, uint64_t now) {
+    if (!sched)
+        return;
+
+    thread_mutex_lock(&sched->lock);
+    int index = fetch_request_find(sched, key_id, inode, chunk);
+    if (index >= 0) {
+        struct fetch_request *request = &sched->requests[index];
+        int peer_index = ((addr) && (addr_len > 0)) ? fetch_peer_find(sched, addr, addr_len) : -1;
+        if ((peer_index >= 0) && (peer_index == request->peer))
+            fetch_peer_sample(&sched->peers[peer_index], now - request->sent, bytes, now);
+        else
+        if ((peer_index >= 0) && (peer_index == request->hedge_peer))
+            fetch_peer_sample(&sched->peers[peer_index], now - request->hedge_sent, bytes, now);
+        sched->completed ++;
+        fetch_request_remove(sched, index);
+    }
+    thread_mutex_unlock(&sched->lock);
+}
+
+void fetch_scheduler_stats(struct fetch_scheduler *sched, struct fetch_scheduler_stats *stats) {
+    if (!stats)
+        return;
+
+    memset(stats, 0, sizeof(struct fetch_scheduler_stats));
+    if (!sched)
+        return;
+
+    thread_mutex_lock(&sched->lock);
+    stats->requests = sched->total_requests;
+    stats->completed = sched->completed;
+    stats->hedged = sched->hedged;
+    stats->lost = sched->lost;
+    stats->peers = sched->peer_count;
+    stats->in_flight = sched->request_count;
+    thread_mutex_unlock(&sched->lock);
+}
@@ -0,0 +1,43 @@
+#ifndef __FETCH_SCHEDULER_H
+#define __FETCH_SCHEDULER_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#define FETCH_MAX_PEERS         128
+#define FETCH_MAX_REQUESTS      512
+#define FETCH_ADDR_SIZE         28
+// BLOCK_SIZE, used for estimating queueing delay
+#define FETCH_CHUNK_BYTES       57280
+
+#define FETCH_INITIAL_WINDOW    4
+#define FETCH_MAX_WINDOW        32
+// optimistic rtt for unknown peers, so they get probed
+#define FETCH_DEFAULT_RTT       30000
+#define FETCH_MIN_HEDGE         20000
+#define FETCH_REQUEST_TIMEOUT   3000000
+
+// fetch_scheduler_select return values
+#define FETCH_BROADCAST         -1
+#define FETCH_IN_FLIGHT         -2
+#define FETCH_BUSY              -3
+
+struct fetch_scheduler;
+
+struct fetch_scheduler_stats {
+    uint64_t requests;
+    uint64_t completed;
+    uint64_t hedged;
+    uint64_t lost;
+    int peers;
+    int in_flight;
+};
+
+struct fetch_scheduler *fetch_scheduler_create();
+void fetch_scheduler_destroy(struct fetch_scheduler *sched);
+int fetch_scheduler_select(struct fetch_scheduler *sched, uint64_t key_id, uint64_t inode, uint64_t chunk, const void *candidates, int count, int stride, int addr_len, int required, uint64_t now);
+void fetch_scheduler_cancel(struct fetch_scheduler *sched, uint64_t key_id, uint64_t inode, uint64_t first_chunk, uint64_t last_chunk);
+void fetch_scheduler_complete(struct fetch_scheduler *sched, uint64_t key_id, uint64_t inode, uint64_t chunk, const void *addr, int addr_len, int bytes, uint64_t now);
+void fetch_scheduler_stats(struct fetch_scheduler *sched, struct fetch_scheduler_stats *stats);
+
+#endif
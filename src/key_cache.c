@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "key_cache.h"
+#include "thread.h"
+#include "xxhash.h"
+
+#define KEY_CACHE_WAYS  4
+
+struct key_cache_entry {
+    uint64_t key_id;
+    uint64_t inode;
+    uint64_t chunk;
+    unsigned char key[32];
+    unsigned char ivector[32];
+    uint64_t stamp;
+    int used;
+};
+
+struct key_cache {
+    // set associative, a put in a full set evicts the least recently used entry
+    struct key_cache_entry *entries;
+    unsigned int size;
+    unsigned int sets;
+    int used;
+    uint64_t stamp;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    thread_mutex_t lock;
+};
+
+void key_cache_wipe(void *ptr, size_t size) {
+    // volatile, so the compiler cannot drop the stores to memory that is about to be released
+    volatile unsigned char *p = (volatile unsigned char *)ptr;
+    while (size--)
+        *p++ = 0;
+}
+
+static struct key_cache_entry *key_cache_set(struct key_cache *cache, uint64_t key_id, uint64_t inode, uint64_t chunk) {
+    uint64_t buf[3];
+    buf[0] = key_id;
+    buf[1] = inode;
+    buf[2] = chunk;
+    return &cache->entries[(XXH64(buf, sizeof(buf), 0) & (cache->sets - 1)) * KEY_CACHE_WAYS];
+}
+
+static struct key_cache_entry *key_cache_find(struct key_cache_entry *set, uint64_t key_id, uint64_t inode, uint64_t chunk) {
+    int i;
+    for (i = 0; i < KEY_CACHE_WAYS; i++) {
+        if ((set[i].used) && (set[i].key_id == key_id) && (set[i].inode == inode) && (set[i].chunk == chunk))
+            return &set[i];
+    }
+    return NULL;
+}
+
+static void key_cache_remove(struct key_cache *cache, struct key_cache_entry *entry) {
+    key_cache_wipe(entry, sizeof(struct key_cache_entry));
+    cache->used --;
+}
+
+struct key_cache *key_cache_create(int max_entries) {
+    if (max_entries <= 0)
+        return NULL;
+
+    struct key_cache *cache = (struct key_cache *)malloc(sizeof(struct key_cache));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(struct key_cache));
+    cache->sets = 1;
+    while (cache->sets * KEY_CACHE_WAYS < (unsigned int)max_entries)
+        cache->sets <<= 1;
+    cache->size = cache->sets * KEY_CACHE_WAYS;
+
+    cache->entries = (struct key_cache_entry *)calloc(cache->size, sizeof(struct key_cache_entry));
+    if (!cache->entries) {
+        free(cache);
+        return NULL;
+    }
+    thread_mutex_init(&cache->lock);
+    return cache;
+}
+
+void key_cache_destroy(struct key_cache *cache) {
+    if (!cache)
+        return;
+
+    key_cache_wipe(cache->entries, cache->size * sizeof(struct key_cache_entry));
+    free(cache->entries);
+    thread_mutex_term(&cache->lock);
+    free(cache);
+}
+
+// returns 1 and copies the key schedule if cached
+int key_cache_get(struct key_cache *cache, uint64_t key_id, uint64_t inode, int64_t chunk, unsigned char key[32], unsigned char ivector[32]) {
+    if (!cache)
+        return 0;
+
+    thread_mutex_lock(&cache->lock);
+    struct key_cache_entry *entry = key_cache_find(key_cache_set(cache, key_id, inode, (uint64_t)chunk), key_id, inode, (uint64_t)chunk);
+    if (!entry) {
+        cache->misses ++;
+        thread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    entry->stamp = ++ cache->stamp;
+    memcpy(key, entry->key, 32);
+    memcpy(ivector, entry->ivector, 32);
+    cache->hits ++;
+    thread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+void key_cache_put(struct key_cache *cache, uint64_t key_id, uint64_t inode, int64_t chunk, const unsigned char key[32], const unsigned char ivector[32]) {
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    struct key_cache_entry *set = key_cache_set(cache, key_id, inode, (uint64_t)chunk);
+    struct key_cache_entry *entry = key_cache_find(set, key_id, inode, (uint64_t)chunk);
+    if (!entry) {
+        int i;
+        entry = &set[0];
+        for (i = 0; i < KEY_CACHE_WAYS; i++) {
+            if (!set[i].used) {
+                entry = &set[i];
+                break;
+            }
+            if (set[i].stamp < entry->stamp)
+                entry = &set[i];
+        }
+        if (entry->used)
+            cache->evictions ++;
+    }
+    if (entry->used)
+        key_cache_remove(cache, entry);
+    entry->key_id = key_id;
+    entry->inode = inode;
+    entry->chunk = (uint64_t)chunk;
+    memcpy(entry->key, key, 32);
+    memcpy(entry->ivector, ivector, 32);
+    entry->stamp = ++ cache->stamp;
+    entry->used = 1;
+    cache->used ++;
+    thread_mutex_unlock(&cache->lock);
+}
+
+// wipes all the entries derived from the given key (called when the key is unloaded)
+void key_cache_invalidate(struct key_cache *cache, uint64_t key_id) {
+    if (!cache)
+        return;
+
+    unsigned int i;
+    thread_mutex_lock(&cache->lock);
+    for (i = 0; i < cache->size; i++) {
+        if ((cache->entries[i].used) && (cache->entries[i].key_id == key_id))
+            key_cache_remove(cache, &cache->entries[i]);
+    }
+    thread_mutex_unlock(&cache->lock);
+}
+
+void key_cache_clear(struct key_cache *cache) {
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    key_cache_wipe(cache->entries, cache->size * sizeof(struct key_cache_entry));
+    cache->used = 0;
+    thread_mutex_unlock(&cache->lock);
+}
+
+void key_cache_stats(struct key_cache *cache, struct key_cache_stats *stats) {
+    if (!stats)
+        return;
+
+    memset(stats, 0, sizeof(struct key_cache_stats));
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->used;
+    thread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,25 @@
+#ifndef __KEY_CACHE_H
+#define __KEY_CACHE_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+struct key_cache;
+
+struct key_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    int entries;
+};
+
+struct key_cache *key_cache_create(int max_entries);
+void key_cache_destroy(struct key_cache *cache);
+int key_cache_get(struct key_cache *cache, uint64_t key_id, uint64_t inode, int64_t chunk, unsigned char key[32], unsigned char ivector[32]);
+void key_cache_put(struct key_cache *cache, uint64_t key_id, uint64_t inode, int64_t chunk, const unsigned char key[32], const unsigned char ivector[32]);
+void key_cache_invalidate(struct key_cache *cache, uint64_t key_id);
+void key_cache_clear(struct key_cache *cache);
+void key_cache_stats(struct key_cache *cache, struct key_cache_stats *stats);
+void key_cache_wipe(void *ptr, size_t size);
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <arpa/inet.h>
+    #include <unistd.h>
+#endif
+
+#include "miner.h"
+#include "sha3.h"
+#include "thread.h"
+#include "log.h"
+
+// check cancellation every 4096 hashes
+#define MINER_CHECK_MASK    0xFFF
+
+uint64_t switchorder(uint64_t input);
+uint64_t microseconds();
+
+#ifndef htonll
+#define htonll(x) ((1==htonl(1)) ? (x) : switchorder(x))
+#endif
+
+struct miner_job {
+    sha3_context base;
+    const unsigned char *suffix;
+    int suffix_len;
+    int bytes;
+    int mbits;
+    int step;
+    int *loop_condition;
+
+    thread_atomic_int_t done;
+    thread_mutex_t lock;
+    int found;
+    uint64_t nonce;
+    unsigned char hash[32];
+};
+
+struct miner_worker {
+    struct miner_job *job;
+    uint64_t start;
+    uint64_t hashes;
+    thread_ptr_t thread;
+};
+
+static int miner_thread_count;
+
+int miner_threads() {
+    if (miner_thread_count > 0)
+        return miner_thread_count;
+
+    int threads = 1;
+#ifdef _WIN32
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    threads = (int)sysinfo.dwNumberOfProcessors;
+#else
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads < 1)
+        threads = 1;
+    if (threads > MINER_MAX_THREADS)
+        threads = MINER_MAX_THREADS;
+
+    miner_thread_count = threads;
+    return threads;
+}
+
+void miner_set_threads(int threads) {
+    if (threads > MINER_MAX_THREADS)
+        threads = MINER_MAX_THREADS;
+    // 0 = number of cores
+    miner_thread_count = threads;
+}
+
+static int miner_worker_run(void *userdata) {
+    struct miner_worker *worker = (struct miner_worker *)userdata;
+    struct miner_job *job = worker->job;
+    sha3_context ctx;
+    const unsigned char *hash;
+    uint64_t counter = worker->start;
+    uint64_t step = (uint64_t)job->step;
+
+    while (1) {
+        if ((!(worker->hashes & MINER_CHECK_MASK)) && ((thread_atomic_int_load(&job->done)) || ((job->loop_condition) && (!*(volatile int *)job->loop_condition))))
+            break;
+
+        // prefix is absorbed once, in job->base
+        memcpy(&ctx, &job->base, sizeof(sha3_context));
+        uint64_t counter_be = htonll(counter);
+        sha3_Update(&ctx, (unsigned char *)&counter_be, 8);
+        if (job->suffix_len)
+            sha3_Update(&ctx, job->suffix, job->suffix_len);
+
+        hash = (const unsigned char *)sha3_Finalize(&ctx);
+        worker->hashes ++;
+
+        int i;
+        int valid = 1;
+        for (i = 0; i < job->bytes; i++) {
+            if (hash[i]) {
+                valid = 0;
+                break;
+            }
+        }
+        if ((valid) && ((!job->mbits) || (!(hash[job->bytes] >> job->mbits)))) {
+            thread_mutex_lock(&job->lock);
+            if (!job->found) {
+                job->found = 1;
+                job->nonce = counter;
+                memcpy(job->hash, hash, 32);
+            }
+            thread_mutex_unlock(&job->lock);
+            thread_atomic_int_store(&job->done, 1);
+            break;
+        }
+
+        // not found
+        if (counter > (uint64_t)-1 - step)
+            break;
+        counter += step;
+    }
+    return 0;
+}
+
+// searches nonce, so that sha3_256(prefix | nonce_be | suffix) starts with zero_bits zero bits
+int miner_search(const unsigned char *prefix, int prefix_len, const unsigned char *suffix, int suffix_len, int zero_bits, int *loop_condition, uint64_t *nonce, unsigned char *hash, struct miner_stats *stats) {
+    if ((zero_bits < 0) || (zero_bits > 64))
+        return 0;
+
+    struct miner_job *job = (struct miner_job *)malloc(sizeof(struct miner_job));
+    if (!job)
+        return 0;
+    memset(job, 0, sizeof(struct miner_job));
+
+    sha3_Init256(&job->base);
+    if (prefix_len)
+        sha3_Update(&job->base, prefix, prefix_len);
+    job->suffix = suffix;
+    job->suffix_len = suffix ? suffix_len : 0;
+    job->bytes = zero_bits / 8;
+    job->mbits = zero_bits % 8;
+    if (job->mbits)
+        job->mbits = 8 - job->mbits;
+    job->loop_condition = loop_condition;
+    thread_atomic_int_store(&job->done, 0);
+    thread_mutex_init(&job->lock);
+
+    int threads = 1;
+    if (zero_bits >= MINER_PARALLEL_BITS)
+        threads = miner_threads();
+    job->step = threads;
+
+    struct miner_worker workers[MINER_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+
+    uint64_t start = microseconds();
+    int i;
+    for (i = 0; i < threads; i++) {
+        workers[i].job = job;
+        workers[i].start = (uint64_t)i;
+    }
+    // worker 0 runs on the calling thread
+    int created = 1;
+    for (i = 1; i < threads; i++) {
+        workers[i].thread = thread_create(miner_worker_run, &workers[i], "edfs miner", 8192 * 1024);
+        if (!workers[i].thread) {
+            log_warn("error creating miner thread %i, mining on a single thread", i);
+            created = 0;
+            break;
+        }
+    }
+    if (!created) {
+        // nonce space was split for all threads, stop the running ones and start over
+        thread_atomic_int_store(&job->done, 1);
+    } else
+        miner_worker_run(&workers[0]);
+
+    uint64_t hashes = workers[0].hashes;
+    for (i = 1; i < threads; i++) {
+        if (workers[i].thread) {
+            // thread_destroy also joins the thread
+            thread_destroy(workers[i].thread);
+            hashes += workers[i].hashes;
+        }
+    }
+
+    if ((!created) && (!job->found)) {
+        threads = 1;
+        job->step = 1;
+        thread_atomic_int_store(&job->done, 0);
+        workers[0].hashes = 0;
+        miner_worker_run(&workers[0]);
+        hashes += workers[0].hashes;
+    }
+
+    int found = job->found;
+    if (found) {
+        if (nonce)
+            *nonce = job->nonce;
+        if (hash)
+            memcpy(hash, job->hash, 32);
+    }
+    if (stats) {
+        stats->hashes = hashes;
+        stats->elapsed_us = microseconds() - start;
+        stats->threads = threads;
+    }
+
+    thread_mutex_term(&job->lock);
+    free(job);
+    return found;
+}
+
+double miner_hash_rate(const struct miner_stats *stats) {
+    if ((!stats) || (!stats->elapsed_us))
+        return 0;
+    return (double)stats->hashes * 1000000.0 / (double)stats->elapsed_us;
+}
@@ -0,0 +1,21 @@
+#ifndef __MINER_H
+#define __MINER_H
+
+#include <inttypes.h>
+
+#define MINER_MAX_THREADS       32
+// below this difficulty, the thread start-up cost is higher than the search itself
+#define MINER_PARALLEL_BITS     16
+
+struct miner_stats {
+    uint64_t hashes;
+    uint64_t elapsed_us;
+    int threads;
+};
+
+int miner_threads();
+void miner_set_threads(int threads);
+int miner_search(const unsigned char *prefix, int prefix_len, const unsigned char *suffix, int suffix_len, int zero_bits, int *loop_condition, uint64_t *nonce, unsigned char *hash, struct miner_stats *stats);
+double miner_hash_rate(const struct miner_stats *stats);
+
+#endif
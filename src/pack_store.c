@@ -0,0 +1,808 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include "pack_store.h"
+#include "avl.h"
+#include "thread.h"
+#include "xxhash.h"
+#include "tinydir.h"
+#include "log.h"
+
+#define PACK_STORE_MAGIC            0x4544504B
+#define PACK_STORE_HEADER_SIZE      44
+#define PACK_STORE_DELETED          1
+#define PACK_STORE_DELETED_INODE    2
+#define PACK_STORE_COMPACT_RECORDS  64
+
+struct pack_store_segment {
+    uint32_t id;
+    FILE *f;
+    uint64_t size;
+    uint64_t live;
+};
+
+struct pack_store_entry {
+    uint64_t sequence;
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t timestamp;
+};
+
+struct pack_store_inode {
+    avl_tree_t chunks;
+};
+
+struct pack_store_record {
+    uint64_t sequence;
+    uint32_t flags;
+    uint64_t inode;
+    uint64_t chunk;
+    uint32_t size;
+    uint32_t timestamp;
+    uint32_t checksum;
+};
+
+struct pack_store {
+    char *path;
+    avl_tree_t index;
+
+    struct pack_store_segment *segments;
+    int segments_count;
+    int open_count;
+
+    uint64_t sequence;
+
+    // segment being compacted
+    uint32_t compact_id;
+    uint64_t compact_offset;
+
+    thread_mutex_t lock;
+};
+
+static int pack_store_compare(void *a1, void *a2) {
+    if (a1 < a2)
+        return -1;
+
+    if (a1 > a2)
+        return 1;
+
+    return 0;
+}
+
+static void pack_store_dummy_key_destructor(void *key) {
+    // nothing
+}
+
+static void pack_store_free_entry(void *key, void *data) {
+    free(data);
+}
+
+static void pack_store_free_inode(void *key, void *data) {
+    struct pack_store_inode *inode_data = (struct pack_store_inode *)data;
+    if (inode_data) {
+        avl_destroy(&inode_data->chunks, pack_store_free_entry);
+        free(inode_data);
+    }
+}
+
+static void pack_store_put32(unsigned char *buf, uint32_t val) {
+    buf[0] = (unsigned char)(val >> 24);
+    buf[1] = (unsigned char)(val >> 16);
+    buf[2] = (unsigned char)(val >> 8);
+    buf[3] = (unsigned char)val;
+}
+
+static uint32_t pack_store_get32(const unsigned char *buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+static void pack_store_put64(unsigned char *buf, uint64_t val) {
+    pack_store_put32(buf, (uint32_t)(val >> 32));
+    pack_store_put32(buf + 4, (uint32_t)val);
+}
+
+static uint64_t pack_store_get64(const unsigned char *buf) {
+    return ((uint64_t)pack_store_get32(buf) << 32) | pack_store_get32(buf + 4);
+}
+
+static uint32_t pack_store_checksum(const unsigned char *header, const void *data, int size) {
+    return XXH32(data, size, XXH32(header, PACK_STORE_HEADER_SIZE - 4, 0));
+}
+
+static void pack_store_encode_header(unsigned char *header, struct pack_store_record *record, const void *data) {
+    pack_store_put32(header, PACK_STORE_MAGIC);
+    pack_store_put32(header + 4, record->flags);
+    pack_store_put64(header + 8, record->sequence);
+    pack_store_put64(header + 16, record->inode);
+    pack_store_put64(header + 24, record->chunk);
+    pack_store_put32(header + 32, record->size);
+    pack_store_put32(header + 36, record->timestamp);
+    record->checksum = pack_store_checksum(header, data, record->size);
+    pack_store_put32(header + 40, record->checksum);
+}
+
+static int pack_store_decode_header(const unsigned char *header, struct pack_store_record *record) {
+    if (pack_store_get32(header) != PACK_STORE_MAGIC)
+        return -1;
+
+    record->flags = pack_store_get32(header + 4);
+    record->sequence = pack_store_get64(header + 8);
+    record->inode = pack_store_get64(header + 16);
+    record->chunk = pack_store_get64(header + 24);
+    record->size = pack_store_get32(header + 32);
+    record->timestamp = pack_store_get32(header + 36);
+    record->checksum = pack_store_get32(header + 40);
+
+    if (record->size > PACK_STORE_MAX_RECORD_SIZE)
+        return -1;
+
+    return 0;
+}
+
+static int pack_store_truncate(FILE *f, uint64_t size) {
+    fflush(f);
+#ifdef _WIN32
+    return _chsize_s(_fileno(f), (__int64)size);
+#else
+    return ftruncate(fileno(f), (off_t)size);
+#endif
+}
+
+static int pack_store_sync_file(FILE *f) {
+    if (fflush(f))
+        return -1;
+#ifdef _WIN32
+    return _commit(_fileno(f));
+#else
+    return fsync(fileno(f));
+#endif
+}
+
+static char *pack_store_segment_path(struct pack_store *store, uint32_t id, char *path, int len) {
+    snprintf(path, len, "%s/%08x.pack", store->path, (unsigned int)id);
+    return path;
+}
+
+static struct pack_store_segment *pack_store_segment(struct pack_store *store, uint32_t id) {
+    int start = 0;
+    int end = store->segments_count - 1;
+    while (start <= end) {
+        int mid = (start + end) / 2;
+        struct pack_store_segment *segment = &store->segments[mid];
+        if (segment->id == id)
+            return segment;
+        if (segment->id < id)
+            start = mid + 1;
+        else
+            end = mid - 1;
+    }
+    return NULL;
+}
+
+static struct pack_store_segment *pack_store_active_segment(struct pack_store *store) {
+    if (store->segments_count <= 0)
+        return NULL;
+
+    return &store->segments[store->segments_count - 1];
+}
+
+static FILE *pack_store_segment_file(struct pack_store *store, struct pack_store_segment *segment) {
+    if (segment->f)
+        return segment->f;
+
+    if (store->open_count >= PACK_STORE_MAX_OPEN) {
+        struct pack_store_segment *active = pack_store_active_segment(store);
+        int i;
+        for (i = 0; i < store->segments_count; i ++) {
+            struct pack_store_segment *victim = &store->segments[i];
+            if ((victim->f) && (victim != active) && (victim->id != store->compact_id)) {
+                fclose(victim->f);
+                victim->f = NULL;
+                store->open_count --;
+                break;
+            }
+        }
+    }
+
+    char path[4096];
+    segment->f = fopen(pack_store_segment_path(store, segment->id, path, sizeof(path)), "r+b");
+    if (!segment->f) {
+        log_error("error opening pack segment %s (errno: %i)", path, errno);
+        return NULL;
+    }
+    store->open_count ++;
+    return segment->f;
+}
+
+static struct pack_store_segment *pack_store_add_segment(struct pack_store *store, uint32_t id, int create) {
+    char path[4096];
+    FILE *f = NULL;
+    if (create) {
+        f = fopen(pack_store_segment_path(store, id, path, sizeof(path)), "w+b");
+        if (!f) {
+            log_error("error creating pack segment %s (errno: %i)", path, errno);
+            return NULL;
+        }
+    }
+
+    struct pack_store_segment *segments = (struct pack_store_segment *)realloc(store->segments, sizeof(struct pack_store_segment) * (store->segments_count + 1));
+    if (!segments) {
+        if (f)
+            fclose(f);
+        log_error("error allocating memory");
+        return NULL;
+    }
+    store->segments = segments;
+
+    // keep segments sorted by id
+    int i = store->segments_count;
+    while ((i > 0) && (segments[i - 1].id > id)) {
+        segments[i] = segments[i - 1];
+        i --;
+    }
+    memset(&segments[i], 0, sizeof(struct pack_store_segment));
+    segments[i].id = id;
+    segments[i].f = f;
+    if (f)
+        store->open_count ++;
+    store->segments_count ++;
+
+    return &segments[i];
+}
+
+static void pack_store_remove_segment(struct pack_store *store, uint32_t id) {
+    struct pack_store_segment *segment = pack_store_segment(store, id);
+    if (!segment)
+        return;
+
+    if (segment->f) {
+        fclose(segment->f);
+        store->open_count --;
+    }
+
+    char path[4096];
+    unlink(pack_store_segment_path(store, id, path, sizeof(path)));
+
+    int index = (int)(segment - store->segments);
+    store->segments_count --;
+    if (index < store->segments_count)
+        memmove(segment, segment + 1, (store->segments_count - index) * sizeof(struct pack_store_segment));
+}
+
+static struct pack_store_entry *pack_store_find(struct pack_store *store, uint64_t inode, uint64_t chunk) {
+    struct pack_store_inode *inode_data = (struct pack_store_inode *)avl_search(&store->index, (void *)(uintptr_t)inode);
+    if (!inode_data)
+        return NULL;
+
+    return (struct pack_store_entry *)avl_search(&inode_data->chunks, (void *)(uintptr_t)chunk);
+}
+
+static void pack_store_release(struct pack_store *store, struct pack_store_entry *entry) {
+    struct pack_store_segment *segment = pack_store_segment(store, entry->segment);
+    if (segment)
+        segment->live -= PACK_STORE_HEADER_SIZE + entry->size;
+}
+
+static int pack_store_set(struct pack_store *store, struct pack_store_record *record, uint32_t segment_id, uint32_t offset) {
+    struct pack_store_inode *inode_data = (struct pack_store_inode *)avl_search(&store->index, (void *)(uintptr_t)record->inode);
+    if (!inode_data) {
+        inode_data = (struct pack_store_inode *)malloc(sizeof(struct pack_store_inode));
+        if (!inode_data)
+            return -1;
+        avl_initialize(&inode_data->chunks, pack_store_compare, pack_store_dummy_key_destructor);
+        avl_insert(&store->index, (void *)(uintptr_t)record->inode, inode_data);
+    }
+
+    struct pack_store_entry *entry = (struct pack_store_entry *)avl_search(&inode_data->chunks, (void *)(uintptr_t)record->chunk);
+    if (entry) {
+        // an older copy moved forward by compaction
+        if (entry->sequence > record->sequence)
+            return 0;
+        pack_store_release(store, entry);
+    } else {
+        entry = (struct pack_store_entry *)malloc(sizeof(struct pack_store_entry));
+        if (!entry)
+            return -1;
+        avl_insert(&inode_data->chunks, (void *)(uintptr_t)record->chunk, entry);
+    }
+
+    entry->sequence = record->sequence;
+    entry->segment = segment_id;
+    entry->offset = offset;
+    entry->size = record->size;
+    entry->timestamp = record->timestamp;
+
+    struct pack_store_segment *segment = pack_store_segment(store, segment_id);
+    if (segment)
+        segment->live += PACK_STORE_HEADER_SIZE + record->size;
+    return 1;
+}
+
+static int pack_store_remove(struct pack_store *store, uint64_t inode, uint64_t chunk, uint64_t sequence) {
+    struct pack_store_inode *inode_data = (struct pack_store_inode *)avl_search(&store->index, (void *)(uintptr_t)inode);
+    if (!inode_data)
+        return 0;
+
+    struct pack_store_entry *entry = (struct pack_store_entry *)avl_search(&inode_data->chunks, (void *)(uintptr_t)chunk);
+    if ((!entry) || (entry->sequence > sequence))
+        return 0;
+
+    avl_remove(&inode_data->chunks, (void *)(uintptr_t)chunk);
+    pack_store_release(store, entry);
+    free(entry);
+
+    if (!inode_data->chunks.root) {
+        avl_remove(&store->index, (void *)(uintptr_t)inode);
+        pack_store_free_inode(NULL, inode_data);
+    }
+    return 1;
+}
+
+static void pack_store_collect_tree(avl_tree_node_t *node, uint64_t sequence, uint64_t **chunks, int *len) {
+    if (!node)
+        return;
+
+    struct pack_store_entry *entry = (struct pack_store_entry *)node->data;
+    if (entry->sequence < sequence) {
+        uint64_t *new_chunks = (uint64_t *)realloc(*chunks, sizeof(uint64_t) * (*len + 1));
+        if (new_chunks) {
+            *chunks = new_chunks;
+            new_chunks[(*len) ++] = (uint64_t)(uintptr_t)node->key;
+        }
+    }
+    pack_store_collect_tree(node->left, sequence, chunks, len);
+    pack_store_collect_tree(node->right, sequence, chunks, len);
+}
+
+static int pack_store_remove_inode(struct pack_store *store, uint64_t inode, uint64_t sequence) {
+    struct pack_store_inode *inode_data = (struct pack_store_inode *)avl_search(&store->index, (void *)(uintptr_t)inode);
+    if (!inode_data)
+        return 0;
+
+    uint64_t *chunks = NULL;
+    int len = 0;
+    pack_store_collect_tree(inode_data->chunks.root, sequence, &chunks, &len);
+
+    int i;
+    for (i = 0; i < len; i ++)
+        pack_store_remove(store, inode, chunks[i], sequence);
+    free(chunks);
+    return len;
+}
+
+static int pack_store_apply(struct pack_store *store, struct pack_store_record *record, uint32_t segment_id, uint32_t offset) {
+    if (record->sequence > store->sequence)
+        store->sequence = record->sequence;
+
+    if (record->flags & PACK_STORE_DELETED_INODE)
+        return pack_store_remove_inode(store, record->inode, record->sequence);
+
+    if (record->flags & PACK_STORE_DELETED)
+        return pack_store_remove(store, record->inode, record->chunk, record->sequence);
+
+    return pack_store_set(store, record, segment_id, offset);
+}
+
+static int pack_store_append(struct pack_store *store, struct pack_store_record *record, const void *data) {
+    struct pack_store_segment *segment = pack_store_active_segment(store);
+    if ((!segment) || ((segment->size) && (segment->size + PACK_STORE_HEADER_SIZE + record->size > PACK_STORE_SEGMENT_SIZE))) {
+        // a full segment is never written again, make it durable once
+        if ((segment) && (segment->f) && (pack_store_sync_file(segment->f)))
+            log_warn("error syncing pack segment %08x (errno: %i)", (unsigned int)segment->id, errno);
+        uint32_t id = segment ? segment->id + 1 : 0;
+        segment = pack_store_add_segment(store, id, 1);
+        if (!segment)
+            return -1;
+    }
+
+    FILE *f = pack_store_segment_file(store, segment);
+    if (!f)
+        return -1;
+
+    // records moved by compaction keep their sequence
+    if (!record->sequence)
+        record->sequence = ++ store->sequence;
+
+    unsigned char header[PACK_STORE_HEADER_SIZE];
+    pack_store_encode_header(header, record, data);
+
+    uint32_t offset = (uint32_t)segment->size;
+    fseek(f, (long)offset, SEEK_SET);
+    if ((fwrite(header, 1, PACK_STORE_HEADER_SIZE, f) != PACK_STORE_HEADER_SIZE) || ((record->size) && (fwrite(data, 1, record->size, f) != record->size)) || (fflush(f))) {
+        log_error("error writing to pack segment %08x (errno: %i)", (unsigned int)segment->id, errno);
+        // drop the partial record
+        pack_store_truncate(f, segment->size);
+        errno = EIO;
+        return -1;
+    }
+    segment->size += PACK_STORE_HEADER_SIZE + record->size;
+
+    pack_store_apply(store, record, segment->id, offset);
+
+    return (int)record->size;
+}
+
+static int pack_store_append_new(struct pack_store *store, uint32_t flags, uint64_t inode, uint64_t chunk, const void *data, int size, uint32_t timestamp) {
+    struct pack_store_record record;
+    memset(&record, 0, sizeof(record));
+    record.flags = flags;
+    record.inode = inode;
+    record.chunk = chunk;
+    record.size = (uint32_t)size;
+    record.timestamp = timestamp;
+    return pack_store_append(store, &record, data);
+}
+
+static int pack_store_scan(struct pack_store *store, struct pack_store_segment *segment, int is_last) {
+    FILE *f = pack_store_segment_file(store, segment);
+    if (!f)
+        return -1;
+
+    unsigned char *buffer = (unsigned char *)malloc(PACK_STORE_MAX_RECORD_SIZE);
+    if (!buffer)
+        return -1;
+
+    fseek(f, 0, SEEK_END);
+    uint64_t file_size = (uint64_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint64_t offset = 0;
+    int records = 0;
+    while (offset < file_size) {
+        unsigned char header[PACK_STORE_HEADER_SIZE];
+        struct pack_store_record record;
+        if (fread(header, 1, PACK_STORE_HEADER_SIZE, f) != PACK_STORE_HEADER_SIZE)
+            break;
+        if (pack_store_decode_header(header, &record))
+            break;
+        if ((record.size) && (fread(buffer, 1, record.size, f) != record.size))
+            break;
+        if (pack_store_checksum(header, buffer, record.size) != record.checksum)
+            break;
+
+        pack_store_apply(store, &record, segment->id, (uint32_t)offset);
+        offset += PACK_STORE_HEADER_SIZE + record.size;
+        records ++;
+    }
+    free(buffer);
+
+    if (offset < file_size) {
+        if (is_last) {
+            // torn write, drop the incomplete tail
+            log_warn("pack segment %08x: dropping %" PRIu64 " bytes after last valid record", (unsigned int)segment->id, file_size - offset);
+            pack_store_truncate(f, offset);
+            file_size = offset;
+        } else
+            log_error("pack segment %08x is corrupted at offset %" PRIu64, (unsigned int)segment->id, offset);
+    }
+    segment->size = file_size;
+    return records;
+}
+
+static int pack_store_id_compare(const void *a1, const void *a2) {
+    uint32_t id1 = *(const uint32_t *)a1;
+    uint32_t id2 = *(const uint32_t *)a2;
+    if (id1 < id2)
+        return -1;
+    if (id1 > id2)
+        return 1;
+    return 0;
+}
+
+struct pack_store *pack_store_open(const char *path) {
+    if (!path)
+        return NULL;
+
+    struct pack_store *store = (struct pack_store *)malloc(sizeof(struct pack_store));
+    if (!store)
+        return NULL;
+
+    memset(store, 0, sizeof(struct pack_store));
+    store->path = strdup(path);
+    store->compact_id = (uint32_t)-1;
+    avl_initialize(&store->index, pack_store_compare, pack_store_dummy_key_destructor);
+    thread_mutex_init(&store->lock);
+
+    uint32_t *ids = NULL;
+    int ids_count = 0;
+    tinydir_dir dir;
+    if (!tinydir_open(&dir, path)) {
+        while (dir.has_next) {
+            tinydir_file file;
+            tinydir_readfile(&dir, &file);
+            unsigned int id;
+            char ext[8];
+            if ((!file.is_dir) && (sscanf(file.name, "%8x.%4s", &id, ext) == 2) && (!strcmp(ext, "pack"))) {
+                uint32_t *new_ids = (uint32_t *)realloc(ids, sizeof(uint32_t) * (ids_count + 1));
+                if (new_ids) {
+                    ids = new_ids;
+                    ids[ids_count ++] = id;
+                }
+            }
+            tinydir_next(&dir);
+        }
+        tinydir_close(&dir);
+    }
+
+    if (ids_count)
+        qsort(ids, ids_count, sizeof(uint32_t), pack_store_id_compare);
+
+    int i;
+    int records = 0;
+    for (i = 0; i < ids_count; i ++) {
+        struct pack_store_segment *segment = pack_store_add_segment(store, ids[i], 0);
+        if (segment) {
+            int segment_records = pack_store_scan(store, segment, i == ids_count - 1);
+            if (segment_records > 0)
+                records += segment_records;
+        }
+    }
+    free(ids);
+
+    log_info("pack store %s: %i segments, %i records", path, store->segments_count, records);
+    return store;
+}
+
+void pack_store_close(struct pack_store *store) {
+    if (!store)
+        return;
+
+    int i;
+    for (i = 0; i < store->segments_count; i ++) {
+        if (store->segments[i].f)
+            fclose(store->segments[i].f);
+    }
+    free(store->segments);
+
+    avl_destroy(&store->index, pack_store_free_inode);
+    thread_mutex_term(&store->lock);
+    free(store->path);
+    free(store);
+}
+
+int pack_store_write(struct pack_store *store, uint64_t inode, uint64_t chunk, const void *data, int size, uint32_t timestamp) {
+    if ((!store) || (size < 0) || (size > PACK_STORE_MAX_RECORD_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    thread_mutex_lock(&store->lock);
+    int written = pack_store_append_new(store, 0, inode, chunk, data, size, timestamp ? timestamp : (uint32_t)time(NULL));
+    thread_mutex_unlock(&store->lock);
+
+    return written;
+}
+
+int pack_store_read(struct pack_store *store, uint64_t inode, uint64_t chunk, void *data, int size) {
+    if ((!store) || (size < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    thread_mutex_lock(&store->lock);
+    struct pack_store_entry *entry = pack_store_find(store, inode, chunk);
+    if (!entry) {
+        thread_mutex_unlock(&store->lock);
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct pack_store_segment *segment = pack_store_segment(store, entry->segment);
+    FILE *f = segment ? pack_store_segment_file(store, segment) : NULL;
+    if (!f) {
+        thread_mutex_unlock(&store->lock);
+        errno = EIO;
+        return -1;
+    }
+
+    if (size > entry->size)
+        size = entry->size;
+
+    fseek(f, (long)entry->offset + PACK_STORE_HEADER_SIZE, SEEK_SET);
+    int bytes_read = (int)fread(data, 1, size, f);
+    thread_mutex_unlock(&store->lock);
+
+    if (bytes_read != size) {
+        errno = EIO;
+        return -1;
+    }
+    return bytes_read;
+}
+
+int pack_store_exists(struct pack_store *store, uint64_t inode, uint64_t chunk) {
+    if (!store)
+        return 0;
+
+    int timestamp = 0;
+    thread_mutex_lock(&store->lock);
+    struct pack_store_entry *entry = pack_store_find(store, inode, chunk);
+    if (entry) {
+        timestamp = (int)entry->timestamp;
+        if (!timestamp)
+            timestamp = 1;
+    }
+    thread_mutex_unlock(&store->lock);
+    return timestamp;
+}
+
+int pack_store_stat(struct pack_store *store, uint64_t inode, uint64_t chunk, struct stat *attrib) {
+    if ((!store) || (!attrib))
+        return -1;
+
+    thread_mutex_lock(&store->lock);
+    struct pack_store_entry *entry = pack_store_find(store, inode, chunk);
+    if (entry) {
+        memset(attrib, 0, sizeof(struct stat));
+        attrib->st_size = entry->size;
+        attrib->st_mtime = entry->timestamp;
+        attrib->st_ctime = entry->timestamp;
+    }
+    thread_mutex_unlock(&store->lock);
+
+    if (!entry) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+int pack_store_unlink(struct pack_store *store, uint64_t inode, uint64_t chunk) {
+    if (!store)
+        return -1;
+
+    int err = 0;
+    thread_mutex_lock(&store->lock);
+    if (pack_store_find(store, inode, chunk))
+        err = pack_store_append_new(store, PACK_STORE_DELETED, inode, chunk, NULL, 0, (uint32_t)time(NULL));
+    else
+        err = -1;
+    thread_mutex_unlock(&store->lock);
+
+    return (err < 0) ? -1 : 0;
+}
+
+int pack_store_unlink_inode(struct pack_store *store, uint64_t inode) {
+    if (!store)
+        return -1;
+
+    int err = 0;
+    thread_mutex_lock(&store->lock);
+    if (avl_search(&store->index, (void *)(uintptr_t)inode))
+        err = pack_store_append_new(store, PACK_STORE_DELETED_INODE, inode, 0, NULL, 0, (uint32_t)time(NULL));
+    thread_mutex_unlock(&store->lock);
+
+    return (err < 0) ? -1 : 0;
+}
+
+int pack_store_sync(struct pack_store *store) {
+    if (!store)
+        return -1;
+
+    int err = 0;
+    thread_mutex_lock(&store->lock);
+    struct pack_store_segment *active = pack_store_active_segment(store);
+    if ((active) && (active->f))
+        err = pack_store_sync_file(active->f);
+    thread_mutex_unlock(&store->lock);
+    return err;
+}
+
+static int pack_store_compact_step(struct pack_store *store, struct pack_store_segment *segment) {
+    FILE *f = pack_store_segment_file(store, segment);
+    if (!f)
+        return -1;
+
+    unsigned char *buffer = (unsigned char *)malloc(PACK_STORE_MAX_RECORD_SIZE);
+    if (!buffer)
+        return -1;
+
+    // tombstones are needed only while an older segment may still hold the deleted record
+    int keep_tombstones = (store->segments[0].id < segment->id);
+    uint32_t segment_id = segment->id;
+    int i;
+    for (i = 0; i < PACK_STORE_COMPACT_RECORDS; i ++) {
+        segment = pack_store_segment(store, segment_id);
+        if ((!segment) || (store->compact_offset >= segment->size)) {
+            free(buffer);
+            return 1;
+        }
+
+        unsigned char header[PACK_STORE_HEADER_SIZE];
+        struct pack_store_record record;
+        uint32_t offset = (uint32_t)store->compact_offset;
+        fseek(f, (long)offset, SEEK_SET);
+        if ((fread(header, 1, PACK_STORE_HEADER_SIZE, f) != PACK_STORE_HEADER_SIZE) || (pack_store_decode_header(header, &record)) ||
+            ((record.size) && (fread(buffer, 1, record.size, f) != record.size)) || (pack_store_checksum(header, buffer, record.size) != record.checksum)) {
+            log_error("pack segment %08x: invalid record at offset %u, compaction stopped", (unsigned int)segment_id, (unsigned int)offset);
+            free(buffer);
+            return 1;
+        }
+        store->compact_offset += PACK_STORE_HEADER_SIZE + record.size;
+
+        if (record.flags & (PACK_STORE_DELETED | PACK_STORE_DELETED_INODE)) {
+            if ((keep_tombstones) && (pack_store_append(store, &record, NULL) < 0)) {
+                free(buffer);
+                return -1;
+            }
+            continue;
+        }
+
+        struct pack_store_entry *entry = pack_store_find(store, record.inode, record.chunk);
+        if ((entry) && (entry->segment == segment_id) && (entry->offset == offset)) {
+            if (pack_store_append(store, &record, buffer) < 0) {
+                free(buffer);
+                return -1;
+            }
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+int pack_store_compact(struct pack_store *store, int min_garbage_percent) {
+    if (!store)
+        return -1;
+
+    thread_mutex_lock(&store->lock);
+    struct pack_store_segment *active = pack_store_active_segment(store);
+    struct pack_store_segment *segment = NULL;
+    if (store->compact_id != (uint32_t)-1) {
+        segment = pack_store_segment(store, store->compact_id);
+    } else {
+        int i;
+        uint64_t max_garbage = 0;
+        for (i = 0; i < store->segments_count; i ++) {
+            struct pack_store_segment *candidate = &store->segments[i];
+            if ((candidate == active) || (!candidate->size))
+                continue;
+            uint64_t garbage = candidate->size - candidate->live;
+            if ((garbage * 100 >= candidate->size * min_garbage_percent) && (garbage >= max_garbage)) {
+                max_garbage = garbage;
+                segment = candidate;
+            }
+        }
+        if (segment) {
+            store->compact_id = segment->id;
+            store->compact_offset = 0;
+            log_info("compacting pack segment %08x (%" PRIu64 " of %" PRIu64 " bytes are garbage)", (unsigned int)segment->id, max_garbage, segment->size);
+        }
+    }
+    if (!segment) {
+        store->compact_id = (uint32_t)-1;
+        thread_mutex_unlock(&store->lock);
+        return 0;
+    }
+
+    int done = pack_store_compact_step(store, segment);
+    if (done > 0) {
+        // the moved records must be on disk before their only other copy is removed
+        // (full segments are synced when the active segment changes)
+        active = pack_store_active_segment(store);
+        if ((active) && (active->f) && (pack_store_sync_file(active->f))) {
+            log_error("error syncing pack segment %08x (errno: %i), compaction postponed", (unsigned int)active->id, errno);
+            done = -1;
+        }
+    }
+    if (done > 0) {
+        pack_store_remove_segment(store, store->compact_id);
+        store->compact_id = (uint32_t)-1;
+        store->compact_offset = 0;
+    } else
+    if (done < 0) {
+        // retry from the start of the segment later
+        store->compact_id = (uint32_t)-1;
+        store->compact_offset = 0;
+    }
+    thread_mutex_unlock(&store->lock);
+    return 1;
+}
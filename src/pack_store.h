@@ -0,0 +1,24 @@
+#ifndef __PACK_STORE_H
+#define __PACK_STORE_H
+
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#define PACK_STORE_SEGMENT_SIZE     0x8000000
+#define PACK_STORE_MAX_RECORD_SIZE  0x20000
+#define PACK_STORE_MAX_OPEN         64
+
+struct pack_store;
+
+struct pack_store *pack_store_open(const char *path);
+void pack_store_close(struct pack_store *store);
+int pack_store_write(struct pack_store *store, uint64_t inode, uint64_t chunk, const void *data, int size, uint32_t timestamp);
+int pack_store_read(struct pack_store *store, uint64_t inode, uint64_t chunk, void *data, int size);
+int pack_store_exists(struct pack_store *store, uint64_t inode, uint64_t chunk);
+int pack_store_stat(struct pack_store *store, uint64_t inode, uint64_t chunk, struct stat *attrib);
+int pack_store_unlink(struct pack_store *store, uint64_t inode, uint64_t chunk);
+int pack_store_unlink_inode(struct pack_store *store, uint64_t inode);
+int pack_store_sync(struct pack_store *store);
+int pack_store_compact(struct pack_store *store, int min_garbage_percent);
+
+#endif
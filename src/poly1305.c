@@ -0,0 +1,212 @@
+// poly1305 (32 bit, 26 bit limbs), based on poly1305-donna by Andrew Moon (public domain)
+#include <string.h>
+
+#include "poly1305.h"
+
+static uint32_t poly1305_u8to32(const unsigned char *p) {
+    return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void poly1305_u32to8(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+void poly1305_init(struct poly1305_ctx *ctx, const unsigned char key[32]) {
+    // r &= 0xffffffc0ffffffc0ffffffc0fffffff
+    ctx->r[0] = (poly1305_u8to32(&key[0])) & 0x3ffffff;
+    ctx->r[1] = (poly1305_u8to32(&key[3]) >> 2) & 0x3ffff03;
+    ctx->r[2] = (poly1305_u8to32(&key[6]) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (poly1305_u8to32(&key[9]) >> 6) & 0x3f03fff;
+    ctx->r[4] = (poly1305_u8to32(&key[12]) >> 8) & 0x00fffff;
+
+    memset(ctx->h, 0, sizeof(ctx->h));
+
+    ctx->pad[0] = poly1305_u8to32(&key[16]);
+    ctx->pad[1] = poly1305_u8to32(&key[20]);
+    ctx->pad[2] = poly1305_u8to32(&key[24]);
+    ctx->pad[3] = poly1305_u8to32(&key[28]);
+
+    ctx->leftover = 0;
+    ctx->final = 0;
+}
+
+static void poly1305_blocks(struct poly1305_ctx *ctx, const unsigned char *m, size_t bytes) {
+    const uint32_t hibit = (ctx->final) ? 0 : (1UL << 24);
+    uint32_t r0 = ctx->r[0];
+    uint32_t r1 = ctx->r[1];
+    uint32_t r2 = ctx->r[2];
+    uint32_t r3 = ctx->r[3];
+    uint32_t r4 = ctx->r[4];
+    uint32_t s1 = r1 * 5;
+    uint32_t s2 = r2 * 5;
+    uint32_t s3 = r3 * 5;
+    uint32_t s4 = r4 * 5;
+    uint32_t h0 = ctx->h[0];
+    uint32_t h1 = ctx->h[1];
+    uint32_t h2 = ctx->h[2];
+    uint32_t h3 = ctx->h[3];
+    uint32_t h4 = ctx->h[4];
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    while (bytes >= 16) {
+        // h += m[i]
+        h0 += (poly1305_u8to32(m + 0)) & 0x3ffffff;
+        h1 += (poly1305_u8to32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (poly1305_u8to32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (poly1305_u8to32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (poly1305_u8to32(m + 12) >> 8) | hibit;
+
+        // h *= r
+        d0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) + ((uint64_t)h2 * s3) + ((uint64_t)h3 * s2) + ((uint64_t)h4 * s1);
+        d1 = ((uint64_t)h0 * r1) + ((uint64_t)h1 * r0) + ((uint64_t)h2 * s4) + ((uint64_t)h3 * s3) + ((uint64_t)h4 * s2);
+        d2 = ((uint64_t)h0 * r2) + ((uint64_t)h1 * r1) + ((uint64_t)h2 * r0) + ((uint64_t)h3 * s4) + ((uint64_t)h4 * s3);
+        d3 = ((uint64_t)h0 * r3) + ((uint64_t)h1 * r2) + ((uint64_t)h2 * r1) + ((uint64_t)h3 * r0) + ((uint64_t)h4 * s4);
+        d4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) + ((uint64_t)h2 * r2) + ((uint64_t)h3 * r1) + ((uint64_t)h4 * r0);
+
+        // (partial) h %= p
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = (h0 >> 26); h0 = h0 & 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        bytes -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+}
+
+void poly1305_update(struct poly1305_ctx *ctx, const unsigned char *m, size_t bytes) {
+    size_t i;
+
+    // handle leftover
+    if (ctx->leftover) {
+        size_t want = (16 - ctx->leftover);
+        if (want > bytes)
+            want = bytes;
+        for (i = 0; i < want; i++)
+            ctx->buffer[ctx->leftover + i] = m[i];
+        bytes -= want;
+        m += want;
+        ctx->leftover += want;
+        if (ctx->leftover < 16)
+            return;
+        poly1305_blocks(ctx, ctx->buffer, 16);
+        ctx->leftover = 0;
+    }
+
+    // process full blocks
+    if (bytes >= 16) {
+        size_t want = (bytes & ~(size_t)15);
+        poly1305_blocks(ctx, m, want);
+        m += want;
+        bytes -= want;
+    }
+
+    // store leftover
+    if (bytes) {
+        for (i = 0; i < bytes; i++)
+            ctx->buffer[ctx->leftover + i] = m[i];
+        ctx->leftover += bytes;
+    }
+}
+
+void poly1305_finish(struct poly1305_ctx *ctx, unsigned char mac[16]) {
+    uint32_t h0, h1, h2, h3, h4, c;
+    uint32_t g0, g1, g2, g3, g4;
+    uint64_t f;
+    uint32_t mask;
+
+    // process the remaining block
+    if (ctx->leftover) {
+        size_t i = ctx->leftover;
+        ctx->buffer[i++] = 1;
+        for (; i < 16; i++)
+            ctx->buffer[i] = 0;
+        ctx->final = 1;
+        poly1305_blocks(ctx, ctx->buffer, 16);
+    }
+
+    // fully carry h
+    h0 = ctx->h[0];
+    h1 = ctx->h[1];
+    h2 = ctx->h[2];
+    h3 = ctx->h[3];
+    h4 = ctx->h[4];
+
+    c = h1 >> 26; h1 = h1 & 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 = h2 & 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 = h3 & 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 = h4 & 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 = h0 & 0x3ffffff;
+    h1 += c;
+
+    // compute h + -p
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1UL << 26);
+
+    // select h if h < p, or h + -p if h >= p (constant time)
+    mask = (g4 >> 31) - 1;
+    g0 &= mask;
+    g1 &= mask;
+    g2 &= mask;
+    g3 &= mask;
+    g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    // h = h % (2^128)
+    h0 = ((h0) | (h1 << 26)) & 0xffffffff;
+    h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+    h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+    h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+    // mac = (h + pad) % (2^128)
+    f = (uint64_t)h0 + ctx->pad[0]; h0 = (uint32_t)f;
+    f = (uint64_t)h1 + ctx->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + ctx->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + ctx->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    poly1305_u32to8(mac + 0, h0);
+    poly1305_u32to8(mac + 4, h1);
+    poly1305_u32to8(mac + 8, h2);
+    poly1305_u32to8(mac + 12, h3);
+
+    // zero out the state
+    memset(ctx, 0, sizeof(struct poly1305_ctx));
+}
+
+void poly1305_auth(unsigned char mac[16], const unsigned char *m, size_t bytes, const unsigned char key[32]) {
+    struct poly1305_ctx ctx;
+    poly1305_init(&ctx, key);
+    poly1305_update(&ctx, m, bytes);
+    poly1305_finish(&ctx, mac);
+}
+
+// constant time, returns 1 if the tags are equal
+int poly1305_verify(const unsigned char mac1[16], const unsigned char mac2[16]) {
+    unsigned int dif = 0;
+    int i;
+    for (i = 0; i < 16; i++)
+        dif |= (mac1[i] ^ mac2[i]);
+    dif = (dif - 1) >> ((sizeof(unsigned int) * 8) - 1);
+    return (int)(dif & 1);
+}
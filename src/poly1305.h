@@ -0,0 +1,25 @@
+#ifndef __POLY1305_H
+#define __POLY1305_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define POLY1305_KEYLEN     32
+#define POLY1305_TAGLEN     16
+
+struct poly1305_ctx {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    size_t leftover;
+    unsigned char buffer[16];
+    unsigned char final;
+};
+
+void poly1305_init(struct poly1305_ctx *ctx, const unsigned char key[32]);
+void poly1305_update(struct poly1305_ctx *ctx, const unsigned char *m, size_t bytes);
+void poly1305_finish(struct poly1305_ctx *ctx, unsigned char mac[16]);
+void poly1305_auth(unsigned char mac[16], const unsigned char *m, size_t bytes, const unsigned char key[32]);
+int poly1305_verify(const unsigned char mac1[16], const unsigned char mac2[16]);
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "session_cache.h"
+#include "key_cache.h"
+#include "thread.h"
+#include "xxhash.h"
+
+#define SESSION_CACHE_WAYS  4
+
+struct session_cache_entry {
+    // the local secret is kept instead of its public key, so a secret rotated while being read cannot poison the cache
+    unsigned char local_secret[32];
+    unsigned char peer_pk[32];
+    unsigned char shared_secret[32];
+    time_t created;
+    uint64_t stamp;
+    int used;
+};
+
+struct session_cache {
+    // set associative, a put in a full set evicts the least recently used entry
+    struct session_cache_entry *entries;
+    unsigned int size;
+    unsigned int sets;
+    int used;
+    uint64_t stamp;
+    time_t ttl;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired;
+    uint64_t evictions;
+
+    thread_mutex_t lock;
+};
+
+static struct session_cache_entry *session_cache_set(struct session_cache *cache, const unsigned char *local_secret, const unsigned char *peer_pk) {
+    // seeded with the local secret, so peers cannot choose public keys colliding in the same set
+    uint64_t seed;
+    memcpy(&seed, local_secret + 8, sizeof(uint64_t));
+    return &cache->entries[(XXH64(peer_pk, 32, seed) & (cache->sets - 1)) * SESSION_CACHE_WAYS];
+}
+
+static struct session_cache_entry *session_cache_find(struct session_cache_entry *set, const unsigned char *local_secret, const unsigned char *peer_pk) {
+    int i;
+    for (i = 0; i < SESSION_CACHE_WAYS; i++) {
+        if ((set[i].used) && (!memcmp(set[i].peer_pk, peer_pk, 32)) && (!memcmp(set[i].local_secret, local_secret, 32)))
+            return &set[i];
+    }
+    return NULL;
+}
+
+static void session_cache_remove(struct session_cache *cache, struct session_cache_entry *entry) {
+    key_cache_wipe(entry, sizeof(struct session_cache_entry));
+    cache->used --;
+}
+
+struct session_cache *session_cache_create(int max_entries, time_t ttl) {
+    if (max_entries <= 0)
+        return NULL;
+
+    struct session_cache *cache = (struct session_cache *)malloc(sizeof(struct session_cache));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(struct session_cache));
+    cache->sets = 1;
+    while (cache->sets * SESSION_CACHE_WAYS < (unsigned int)max_entries)
+        cache->sets <<= 1;
+    cache->size = cache->sets * SESSION_CACHE_WAYS;
+    cache->ttl = ttl;
+
+    cache->entries = (struct session_cache_entry *)calloc(cache->size, sizeof(struct session_cache_entry));
+    if (!cache->entries) {
+        free(cache);
+        return NULL;
+    }
+    thread_mutex_init(&cache->lock);
+    return cache;
+}
+
+void session_cache_destroy(struct session_cache *cache) {
+    if (!cache)
+        return;
+
+    key_cache_wipe(cache->entries, cache->size * sizeof(struct session_cache_entry));
+    free(cache->entries);
+    thread_mutex_term(&cache->lock);
+    free(cache);
+}
+
+// returns 1 and copies the shared secret if a session for (local secret, peer public key) exists and is not expired
+int session_cache_get(struct session_cache *cache, const unsigned char local_secret[32], const unsigned char peer_pk[32], unsigned char shared_secret[32]) {
+    if (!cache)
+        return 0;
+
+    thread_mutex_lock(&cache->lock);
+    struct session_cache_entry *entry = session_cache_find(session_cache_set(cache, local_secret, peer_pk), local_secret, peer_pk);
+    if ((entry) && (cache->ttl > 0) && (time(NULL) - entry->created >= cache->ttl)) {
+        session_cache_remove(cache, entry);
+        cache->expired ++;
+        entry = NULL;
+    }
+    if (!entry) {
+        cache->misses ++;
+        thread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    entry->stamp = ++ cache->stamp;
+    memcpy(shared_secret, entry->shared_secret, 32);
+    cache->hits ++;
+    thread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+void session_cache_put(struct session_cache *cache, const unsigned char local_secret[32], const unsigned char peer_pk[32], const unsigned char shared_secret[32]) {
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    struct session_cache_entry *set = session_cache_set(cache, local_secret, peer_pk);
+    struct session_cache_entry *entry = session_cache_find(set, local_secret, peer_pk);
+    if (!entry) {
+        int i;
+        entry = &set[0];
+        for (i = 0; i < SESSION_CACHE_WAYS; i++) {
+            if (!set[i].used) {
+                entry = &set[i];
+                break;
+            }
+            if (set[i].stamp < entry->stamp)
+                entry = &set[i];
+        }
+        if (entry->used)
+            cache->evictions ++;
+    }
+    if (entry->used)
+        session_cache_remove(cache, entry);
+    memcpy(entry->local_secret, local_secret, 32);
+    memcpy(entry->peer_pk, peer_pk, 32);
+    memcpy(entry->shared_secret, shared_secret, 32);
+    entry->created = time(NULL);
+    entry->stamp = ++ cache->stamp;
+    entry->used = 1;
+    cache->used ++;
+    thread_mutex_unlock(&cache->lock);
+}
+
+// wipes all the sessions negotiated with the given local key (called when the key is rotated out)
+void session_cache_invalidate(struct session_cache *cache, const unsigned char local_secret[32]) {
+    if (!cache)
+        return;
+
+    unsigned int i;
+    thread_mutex_lock(&cache->lock);
+    for (i = 0; i < cache->size; i++) {
+        if ((cache->entries[i].used) && (!memcmp(cache->entries[i].local_secret, local_secret, 32)))
+            session_cache_remove(cache, &cache->entries[i]);
+    }
+    thread_mutex_unlock(&cache->lock);
+}
+
+void session_cache_clear(struct session_cache *cache) {
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    key_cache_wipe(cache->entries, cache->size * sizeof(struct session_cache_entry));
+    cache->used = 0;
+    thread_mutex_unlock(&cache->lock);
+}
+
+void session_cache_stats(struct session_cache *cache, struct session_cache_stats *stats) {
+    if (!stats)
+        return;
+
+    memset(stats, 0, sizeof(struct session_cache_stats));
+    if (!cache)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->expired = cache->expired;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->used;
+    thread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,25 @@
+#ifndef __SESSION_CACHE_H
+#define __SESSION_CACHE_H
+
+#include <inttypes.h>
+#include <time.h>
+
+struct session_cache;
+
+struct session_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired;
+    uint64_t evictions;
+    int entries;
+};
+
+struct session_cache *session_cache_create(int max_entries, time_t ttl);
+void session_cache_destroy(struct session_cache *cache);
+int session_cache_get(struct session_cache *cache, const unsigned char local_secret[32], const unsigned char peer_pk[32], unsigned char shared_secret[32]);
+void session_cache_put(struct session_cache *cache, const unsigned char local_secret[32], const unsigned char peer_pk[32], const unsigned char shared_secret[32]);
+void session_cache_invalidate(struct session_cache *cache, const unsigned char local_secret[32]);
+void session_cache_clear(struct session_cache *cache);
+void session_cache_stats(struct session_cache *cache, struct session_cache_stats *stats);
+
+#endif
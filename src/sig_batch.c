@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sig_batch.h"
+#include "edd25519.h"
+#include "thread.h"
+
+#define SIG_BATCH_QUEUED    0
+#define SIG_BATCH_DONE      1
+#define SIG_BATCH_LEADER    2
+
+struct sig_batch_request {
+    const unsigned char *signature;
+    const unsigned char *message;
+    size_t message_len;
+    const unsigned char *public_key;
+    int valid;
+    int state;
+    thread_signal_t signal;
+
+    struct sig_batch_request *next;
+};
+
+// verifications are combined: the first caller verifies everything queued while it runs,
+// so an idle node verifies one signature at a time and a busy one in batches
+struct sig_batch {
+    struct sig_batch_request *head;
+    struct sig_batch_request *tail;
+    int busy;
+    int max_batch;
+
+    uint64_t verified;
+    uint64_t batches;
+    uint64_t batched;
+    int largest_batch;
+
+    thread_mutex_t lock;
+};
+
+struct sig_batch *sig_batch_create(int max_batch) {
+    struct sig_batch *batch = (struct sig_batch *)malloc(sizeof(struct sig_batch));
+    if (!batch)
+        return NULL;
+
+    memset(batch, 0, sizeof(struct sig_batch));
+    if ((max_batch <= 0) || (max_batch > SIG_BATCH_MAX))
+        max_batch = SIG_BATCH_MAX;
+    batch->max_batch = max_batch;
+    thread_mutex_init(&batch->lock);
+    return batch;
+}
+
+void sig_batch_destroy(struct sig_batch *batch) {
+    if (!batch)
+        return;
+
+    thread_mutex_term(&batch->lock);
+    free(batch);
+}
+
+static void sig_batch_run(struct sig_batch *batch, struct sig_batch_request **requests, int count) {
+    const unsigned char *signatures[SIG_BATCH_MAX];
+    const unsigned char *messages[SIG_BATCH_MAX];
+    const unsigned char *public_keys[SIG_BATCH_MAX];
+    size_t message_lens[SIG_BATCH_MAX];
+    int valid[SIG_BATCH_MAX];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        signatures[i] = requests[i]->signature;
+        messages[i] = requests[i]->message;
+        message_lens[i] = requests[i]->message_len;
+        public_keys[i] = requests[i]->public_key;
+    }
+    ed25519_verify_batch(signatures, messages, message_lens, public_keys, count, valid);
+
+    thread_mutex_lock(&batch->lock);
+    for (i = 0; i < count; i++) {
+        requests[i]->valid = valid[i];
+        // the first request belongs to the caller
+        if (i) {
+            requests[i]->state = SIG_BATCH_DONE;
+            thread_signal_raise(&requests[i]->signal);
+        }
+    }
+    batch->verified += count;
+    if (count > 1) {
+        batch->batches ++;
+        batch->batched += count;
+    }
+    if (count > batch->largest_batch)
+        batch->largest_batch = count;
+
+    // hand over to the next queued request, if any
+    if (batch->head) {
+        struct sig_batch_request *next = batch->head;
+        batch->head = next->next;
+        if (!batch->head)
+            batch->tail = NULL;
+        next->state = SIG_BATCH_LEADER;
+        thread_signal_raise(&next->signal);
+    } else
+        batch->busy = 0;
+    thread_mutex_unlock(&batch->lock);
+}
+
+int sig_batch_verify(struct sig_batch *batch, const unsigned char *signature, const unsigned char *message, size_t message_len, const unsigned char *public_key) {
+    struct sig_batch_request *requests[SIG_BATCH_MAX];
+    struct sig_batch_request request;
+    int count = 1;
+
+    if (!batch)
+        return ed25519_verify(signature, message, message_len, public_key);
+
+    memset(&request, 0, sizeof(struct sig_batch_request));
+    request.signature = signature;
+    request.message = message;
+    request.message_len = message_len;
+    request.public_key = public_key;
+
+    thread_mutex_lock(&batch->lock);
+    if (batch->busy) {
+        thread_signal_init(&request.signal);
+        request.state = SIG_BATCH_QUEUED;
+        if (batch->tail)
+            batch->tail->next = &request;
+        else
+            batch->head = &request;
+        batch->tail = &request;
+        while (request.state == SIG_BATCH_QUEUED) {
+            thread_mutex_unlock(&batch->lock);
+            thread_signal_wait(&request.signal, 100);
+            thread_mutex_lock(&batch->lock);
+        }
+        thread_mutex_unlock(&batch->lock);
+        thread_signal_term(&request.signal);
+        if (request.state == SIG_BATCH_DONE)
+            return request.valid;
+        thread_mutex_lock(&batch->lock);
+    } else
+        batch->busy = 1;
+
+    // leader: take whatever is queued
+    requests[0] = &request;
+    while ((batch->head) && (count < batch->max_batch)) {
+        requests[count++] = batch->head;
+        batch->head = batch->head->next;
+    }
+    if (!batch->head)
+        batch->tail = NULL;
+    thread_mutex_unlock(&batch->lock);
+
+    sig_batch_run(batch, requests, count);
+    return request.valid;
+}
+
+void sig_batch_stats(struct sig_batch *batch, struct sig_batch_stats *stats) {
+    if (!stats)
+        return;
+
+    memset(stats, 0, sizeof(struct sig_batch_stats));
+    if (!batch)
+        return;
+
+    thread_mutex_lock(&batch->lock);
+    stats->verified = batch->verified;
+    stats->batches = batch->batches;
+    stats->batched = batch->batched;
+    stats->max_batch = batch->largest_batch;
+    thread_mutex_unlock(&batch->lock);
+}
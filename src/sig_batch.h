@@ -0,0 +1,24 @@
+#ifndef __SIG_BATCH_H
+#define __SIG_BATCH_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+// larger batches stop paying off once the point tables leave the L1 cache
+#define SIG_BATCH_MAX   32
+
+struct sig_batch;
+
+struct sig_batch_stats {
+    uint64_t verified;
+    uint64_t batches;
+    uint64_t batched;
+    int max_batch;
+};
+
+struct sig_batch *sig_batch_create(int max_batch);
+void sig_batch_destroy(struct sig_batch *batch);
+int sig_batch_verify(struct sig_batch *batch, const unsigned char *signature, const unsigned char *message, size_t message_len, const unsigned char *public_key);
+void sig_batch_stats(struct sig_batch *batch, struct sig_batch_stats *stats);
+
+#endif
@@ -1019,8 +1019,7 @@ void thread_atomic_int_store( thread_atomic_int_t* atomic, int desired )
 
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined(__NOT_WIN32__)
 
-        __sync_lock_test_and_set( &atomic->i, desired );
-        __sync_lock_release( &atomic->i );
+        __atomic_store_n( &atomic->i, desired, __ATOMIC_SEQ_CST );
     
     #else 
         #error Unknown platform.
@@ -1100,8 +1099,7 @@ int thread_atomic_int_swap( thread_atomic_int_t* atomic, int desired )
     
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined(__NOT_WIN32__)
 
-        int old = (int)__sync_lock_test_and_set( &atomic->i, desired );
-        __sync_lock_release( &atomic->i );
+        int old = (int)__atomic_exchange_n( &atomic->i, desired, __ATOMIC_SEQ_CST );
         return old;
     
     #else 
@@ -1156,8 +1154,7 @@ void thread_atomic_ptr_store( thread_atomic_ptr_t* atomic, void* desired )
     
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined(__NOT_WIN32__)
 
-        __sync_lock_test_and_set( &atomic->ptr, desired );
-        __sync_lock_release( &atomic->ptr );
+        __atomic_store_n( &atomic->ptr, desired, __ATOMIC_SEQ_CST );
     
     #else 
         #error Unknown platform.
@@ -1178,8 +1175,7 @@ void* thread_atomic_ptr_swap( thread_atomic_ptr_t* atomic, void* desired )
     
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined(__NOT_WIN32__)
 
-        void* old = __sync_lock_test_and_set( &atomic->ptr, desired );
-        __sync_lock_release( &atomic->ptr );
+        void* old = __atomic_exchange_n( &atomic->ptr, desired, __ATOMIC_SEQ_CST );
         return old;
     
     #else 
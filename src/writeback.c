@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include "writeback.h"
+#include "thread.h"
+#include "log.h"
+
+struct writeback_job {
+    void *job;
+    struct writeback_job *next;
+};
+
+struct writeback_worker {
+    struct writeback *wb;
+    struct writeback_job *head;
+    struct writeback_job *tail;
+    thread_mutex_t lock;
+    thread_signal_t ready;
+    thread_ptr_t thread;
+};
+
+struct writeback {
+    struct writeback_worker workers[WRITEBACK_MAX_THREADS];
+    int threads;
+    int max_jobs;
+
+    writeback_proc proc;
+    void *userdata;
+
+    thread_atomic_int_t pending;
+    thread_atomic_int_t done;
+    thread_signal_t space;
+};
+
+int writeback_threads() {
+    int threads = 1;
+#ifdef _WIN32
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    threads = (int)sysinfo.dwNumberOfProcessors;
+#else
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads < 1)
+        threads = 1;
+    if (threads > WRITEBACK_MAX_THREADS)
+        threads = WRITEBACK_MAX_THREADS;
+    return threads;
+}
+
+static int writeback_worker_run(void *userdata) {
+    struct writeback_worker *worker = (struct writeback_worker *)userdata;
+    struct writeback *wb = worker->wb;
+
+    while (1) {
+        thread_mutex_lock(&worker->lock);
+        struct writeback_job *job = worker->head;
+        if (job) {
+            worker->head = job->next;
+            if (!worker->head)
+                worker->tail = NULL;
+        }
+        thread_mutex_unlock(&worker->lock);
+
+        if (!job) {
+            // queue is drained before exiting
+            if (thread_atomic_int_load(&wb->done))
+                break;
+            thread_signal_wait(&worker->ready, 100);
+            continue;
+        }
+
+        wb->proc(job->job, wb->userdata);
+        free(job);
+
+        thread_atomic_int_dec(&wb->pending);
+        thread_signal_raise(&wb->space);
+    }
+    return 0;
+}
+
+struct writeback *writeback_create(int threads, int max_jobs, writeback_proc proc, void *userdata) {
+    if (!proc)
+        return NULL;
+
+    if (threads <= 0)
+        threads = writeback_threads();
+    if (threads > WRITEBACK_MAX_THREADS)
+        threads = WRITEBACK_MAX_THREADS;
+    if (max_jobs <= 0)
+        max_jobs = WRITEBACK_MAX_JOBS;
+
+    struct writeback *wb = (struct writeback *)malloc(sizeof(struct writeback));
+    if (!wb)
+        return NULL;
+
+    memset(wb, 0, sizeof(struct writeback));
+    wb->max_jobs = max_jobs;
+    wb->proc = proc;
+    wb->userdata = userdata;
+    thread_atomic_int_store(&wb->pending, 0);
+    thread_atomic_int_store(&wb->done, 0);
+    thread_signal_init(&wb->space);
+
+    int i;
+    for (i = 0; i < threads; i++) {
+        struct writeback_worker *worker = &wb->workers[i];
+        worker->wb = wb;
+        thread_mutex_init(&worker->lock);
+        thread_signal_init(&worker->ready);
+        worker->thread = thread_create(writeback_worker_run, worker, "edfs writeback", 8192 * 1024);
+        if (!worker->thread) {
+            log_warn("error creating writeback thread %i", i);
+            thread_signal_term(&worker->ready);
+            thread_mutex_term(&worker->lock);
+            break;
+        }
+        wb->threads ++;
+    }
+    if (!wb->threads) {
+        thread_signal_term(&wb->space);
+        free(wb);
+        return NULL;
+    }
+    return wb;
+}
+
+// jobs for the same inode are run in order, on the same worker; blocks while max_jobs are pending
+int writeback_submit(struct writeback *wb, uint64_t inode, void *job) {
+    if ((!wb) || (thread_atomic_int_load(&wb->done)))
+        return -1;
+
+    struct writeback_job *entry = (struct writeback_job *)malloc(sizeof(struct writeback_job));
+    if (!entry)
+        return -1;
+    entry->job = job;
+    entry->next = NULL;
+
+    // back-pressure
+    while (thread_atomic_int_load(&wb->pending) >= wb->max_jobs)
+        thread_signal_wait(&wb->space, 10);
+    thread_atomic_int_inc(&wb->pending);
+
+    struct writeback_worker *worker = &wb->workers[(inode ^ (inode >> 32)) % wb->threads];
+    thread_mutex_lock(&worker->lock);
+    if (worker->tail)
+        worker->tail->next = entry;
+    else
+        worker->head = entry;
+    worker->tail = entry;
+    thread_mutex_unlock(&worker->lock);
+    thread_signal_raise(&worker->ready);
+    return 0;
+}
+
+int writeback_pending(struct writeback *wb) {
+    if (!wb)
+        return 0;
+    return thread_atomic_int_load(&wb->pending);
+}
+
+void writeback_destroy(struct writeback *wb) {
+    if (!wb)
+        return;
+
+    thread_atomic_int_store(&wb->done, 1);
+    int i;
+    for (i = 0; i < wb->threads; i++) {
+        struct writeback_worker *worker = &wb->workers[i];
+        thread_signal_raise(&worker->ready);
+        // thread_destroy joins the thread
+        thread_destroy(worker->thread);
+        thread_signal_term(&worker->ready);
+        thread_mutex_term(&worker->lock);
+    }
+    thread_signal_term(&wb->space);
+    free(wb);
+}
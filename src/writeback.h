@@ -0,0 +1,19 @@
+#ifndef __WRITEBACK_H
+#define __WRITEBACK_H
+
+#include <inttypes.h>
+
+#define WRITEBACK_MAX_THREADS   16
+#define WRITEBACK_MAX_JOBS      64
+
+struct writeback;
+
+typedef void (*writeback_proc)(void *job, void *userdata);
+
+int writeback_threads();
+struct writeback *writeback_create(int threads, int max_jobs, writeback_proc proc, void *userdata);
+int writeback_submit(struct writeback *wb, uint64_t inode, void *job);
+int writeback_pending(struct writeback *wb);
+void writeback_destroy(struct writeback *wb);
+
+#endif
@@ -0,0 +1,150 @@
+// ed25519_verify_batch must give the same per-item results as ed25519_verify,
+// including for points with a small order component and non-canonical encodings
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/edd25519.h"
+
+#define TEST_BATCH_SIZE 16
+#define TEST_ROUNDS     64
+
+// point of order 8
+static const unsigned char torsion_point[32] = {
+    0xc7, 0x17, 0x6a, 0x70, 0x3d, 0x4d, 0xd8, 0x4f, 0xba, 0x3c, 0x0b, 0x76, 0x0d, 0x10, 0x67, 0x0f,
+    0x2a, 0x20, 0x53, 0xfa, 0x2c, 0x39, 0xcc, 0xc6, 0x4e, 0xc7, 0xfd, 0x77, 0x92, 0xac, 0x03, 0x7a
+};
+
+static unsigned int test_seed = 1;
+
+static unsigned char test_random() {
+    test_seed = test_seed * 1103515245 + 12345;
+    return (unsigned char)(test_seed >> 16);
+}
+
+static void test_random_bytes(unsigned char *buf, int len) {
+    int i;
+    for (i = 0; i < len; i++)
+        buf[i] = test_random();
+}
+
+// encodes a * B + T, or a * B when torsion is 0
+static void test_point(unsigned char *out, const unsigned char *a, int torsion) {
+    ge_p3 P;
+    ge_p3 T;
+    ge_p1p1 t;
+    ge_cached c;
+
+    ge_scalarmult_base(&P, a);
+    if (torsion) {
+        ge_frombytes_negate_vartime(&T, torsion_point);
+        ge_p3_to_cached(&c, &T);
+        ge_add(&t, &P, &c);
+        ge_p1p1_to_p3(&P, &t);
+    }
+    ge_p3_tobytes(out, &P);
+}
+
+// signs with the secret scalar of private_key, using public_key as is (may be torsioned); torsion_r adds a small order component to R
+static void test_sign(unsigned char *signature, const unsigned char *message, size_t message_len, const unsigned char *public_key, const unsigned char *private_key, int torsion_r) {
+    unsigned char r[64];
+    unsigned char h[64];
+    sha512_context hash;
+
+    test_random_bytes(r, 64);
+    sc_reduce(r);
+    test_point(signature, r, torsion_r);
+
+    sha512_init(&hash);
+    sha512_update(&hash, signature, 32);
+    sha512_update(&hash, public_key, 32);
+    sha512_update(&hash, message, message_len);
+    sha512_final(&hash, h);
+    sc_reduce(h);
+    sc_muladd(signature + 32, h, private_key, r);
+}
+
+int main() {
+    unsigned char seed[32];
+    unsigned char public_key[2][32];
+    unsigned char torsioned_key[32];
+    unsigned char private_key[2][64];
+    unsigned char signatures[TEST_BATCH_SIZE][64];
+    unsigned char messages[TEST_BATCH_SIZE][64];
+    const unsigned char *signature_ptr[TEST_BATCH_SIZE];
+    const unsigned char *message_ptr[TEST_BATCH_SIZE];
+    const unsigned char *public_key_ptr[TEST_BATCH_SIZE];
+    size_t message_lens[TEST_BATCH_SIZE];
+    int valid[TEST_BATCH_SIZE];
+    int expected[TEST_BATCH_SIZE];
+    int round;
+    int i;
+    int errors = 0;
+    int expected_valid = 0;
+
+    for (i = 0; i < 2; i++) {
+        test_random_bytes(seed, 32);
+        ed25519_create_keypair(public_key[i], private_key[i], seed);
+    }
+    test_point(torsioned_key, private_key[0], 1);
+
+    for (round = 0; round < TEST_ROUNDS; round++) {
+        for (i = 0; i < TEST_BATCH_SIZE; i++) {
+            int k = i & 1;
+            message_lens[i] = 1 + test_random() % 64;
+            test_random_bytes(messages[i], message_lens[i]);
+            public_key_ptr[i] = public_key[k];
+            switch (i) {
+                case 0:
+                case 1:
+                    // small order component in R, may cancel out in an unchecked batch
+                    test_sign(signatures[i], messages[i], message_lens[i], public_key[0], private_key[0], 1);
+                    public_key_ptr[i] = public_key[0];
+                    break;
+                case 2:
+                case 3:
+                    // small order component in A
+                    test_sign(signatures[i], messages[i], message_lens[i], torsioned_key, private_key[0], 0);
+                    public_key_ptr[i] = torsioned_key;
+                    break;
+                case 4:
+                    // non-canonical R (y >= p)
+                    ed25519_sign(signatures[i], messages[i], message_lens[i], public_key[k], private_key[k]);
+                    memset(signatures[i], 0xff, 32);
+                    signatures[i][0] = 0xed + test_random() % 0x12;
+                    signatures[i][31] = 0x7f;
+                    break;
+                case 5:
+                    // non-canonical zero x sign bit in R
+                    ed25519_sign(signatures[i], messages[i], message_lens[i], public_key[k], private_key[k]);
+                    memset(signatures[i], 0, 32);
+                    signatures[i][0] = 1;
+                    signatures[i][31] = 0x80;
+                    break;
+                default:
+                    ed25519_sign(signatures[i], messages[i], message_lens[i], public_key[k], private_key[k]);
+                    break;
+            }
+            signature_ptr[i] = signatures[i];
+            message_ptr[i] = messages[i];
+            expected[i] = ed25519_verify(signature_ptr[i], message_ptr[i], message_lens[i], public_key_ptr[i]);
+            expected_valid += expected[i];
+        }
+
+        ed25519_verify_batch(signature_ptr, message_ptr, message_lens, public_key_ptr, TEST_BATCH_SIZE, valid);
+        for (i = 0; i < TEST_BATCH_SIZE; i++) {
+            if (valid[i] != expected[i]) {
+                fprintf(stderr, "round %i, item %i: batch %i, ed25519_verify %i\n", round, i, valid[i], expected[i]);
+                errors++;
+            }
+        }
+
+        // only the untouched items
+        if (!ed25519_verify_batch(signature_ptr + 6, message_ptr + 6, message_lens + 6, public_key_ptr + 6, TEST_BATCH_SIZE - 6, valid)) {
+            fprintf(stderr, "round %i: valid batch rejected\n", round);
+            errors++;
+        }
+    }
+
+    printf("ed25519 batch: %i rounds, %i valid signatures, %i errors\n", TEST_ROUNDS, expected_valid, errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+// times the storage key derivation of derive_storage_key, with and without the key cache,
+// followed by the chacha pass of a chunk (as edfs_crypt_with_key does)
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#define THREAD_IMPLEMENTATION
+#include "../src/thread.h"
+#include "../src/sha256.h"
+#include "../src/chacha.h"
+#include "../src/key_cache.h"
+
+#define BENCH_CHUNKS        1024
+#define BENCH_CACHE_SIZE    4096
+#define BENCH_KEY_ID        1
+#define BENCH_INODE         7
+
+static unsigned char storekey[32];
+static unsigned char pubkey[32];
+static unsigned char in_buf[57280];
+static unsigned char out_buf[57280];
+
+static double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t bench_be64(uint64_t val) {
+    unsigned char buf[8];
+    int i;
+    for (i = 0; i < 8; i++)
+        buf[i] = (unsigned char)(val >> (56 - i * 8));
+    memcpy(&val, buf, 8);
+    return val;
+}
+
+// same as derive_storage_key for inode != 0
+static void bench_derive(uint64_t inode, int64_t chunk, unsigned char key[32], unsigned char ivector[32]) {
+    unsigned char hash[32];
+    uint64_t inode_be = bench_be64(inode);
+    uint64_t chunk_be = bench_be64((uint64_t)chunk);
+
+    hmac_sha256((const BYTE *)storekey, 32, (const BYTE *)&chunk_be, sizeof(chunk_be), (const BYTE *)&inode_be, sizeof(inode_be), (BYTE *)hash);
+    hmac_sha256((const BYTE *)pubkey, sizeof(pubkey), (const BYTE *)"EDFS STORAGEKEY:", 16, (const BYTE *)hash, 32, (BYTE *)key);
+    hmac_sha256((const BYTE *)pubkey, sizeof(pubkey), (const BYTE *)"EDFS STORAGE VECTOR:", 20, (const BYTE *)hash, 32, (BYTE *)ivector);
+}
+
+static void bench_crypt(struct key_cache *cache, uint64_t inode, int64_t chunk, int size) {
+    unsigned char key[32];
+    unsigned char ivector[32];
+    struct chacha_ctx ctx;
+
+    if ((!cache) || (!key_cache_get(cache, BENCH_KEY_ID, inode, chunk, key, ivector))) {
+        bench_derive(inode, chunk, key, ivector);
+        if (cache)
+            key_cache_put(cache, BENCH_KEY_ID, inode, chunk, key, ivector);
+    }
+    chacha_keysetup(&ctx, key, 256);
+    chacha_ivsetup(&ctx, ivector, NULL);
+    chacha_encrypt_bytes(&ctx, in_buf, out_buf, size);
+}
+
+int main() {
+    // signature only, small block, full compressed chunk
+    int sizes[] = { 64, 4096, sizeof(in_buf) };
+    int s;
+    int i;
+
+    memset(storekey, 1, sizeof(storekey));
+    memset(pubkey, 2, sizeof(pubkey));
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(int)); s++) {
+        int rounds = (sizes[s] > 4096) ? 20000 : 200000;
+        struct key_cache *cache = key_cache_create(BENCH_CACHE_SIZE);
+        if (!cache) {
+            fprintf(stderr, "error creating key cache\n");
+            return 1;
+        }
+
+        double start = bench_seconds();
+        for (i = 0; i < rounds; i++)
+            bench_crypt(NULL, BENCH_INODE, i % BENCH_CHUNKS, sizes[s]);
+        double uncached = (bench_seconds() - start) / rounds * 1e9;
+
+        // warm up, the working set fits in the cache
+        for (i = 0; i < BENCH_CHUNKS; i++)
+            bench_crypt(cache, BENCH_INODE, i, sizes[s]);
+
+        start = bench_seconds();
+        for (i = 0; i < rounds; i++)
+            bench_crypt(cache, BENCH_INODE, i % BENCH_CHUNKS, sizes[s]);
+        double cached = (bench_seconds() - start) / rounds * 1e9;
+
+        struct key_cache_stats stats;
+        key_cache_stats(cache, &stats);
+        printf("%6i bytes: %8.0f ns/chunk uncached, %8.0f ns/chunk cached (%" PRIu64 " hits, %" PRIu64 " misses)\n", sizes[s], uncached, cached, stats.hits, stats.misses);
+        key_cache_destroy(cache);
+    }
+    return 0;
+}